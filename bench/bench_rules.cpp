@@ -0,0 +1,91 @@
+#include <chrono>
+#include <cstdio>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "rules.hpp"
+
+using std::string;
+using std::vector;
+using std::regex;
+
+namespace re_consts = std::regex_constants;
+using Clock = std::chrono::steady_clock;
+
+
+/**
+ * Check the rules the way the file handler used to, with std::regex
+ */
+bool regex_matches(const vector<regex> &rules, const string &path) {
+    for (const regex &pattern : rules) {
+        if (!std::regex_search(path, pattern, re_consts::match_not_null | re_consts::match_any)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Generate request paths like a capsule would see them
+ */
+vector<string> make_paths(size_t count) {
+    const vector<string> dirs = {"/srv/gemini/", "/srv/gemini/gemlog/", "/srv/gemini/cgi/", "/srv/gemini/.git/", "/srv/gemini/docs/reference/"};
+    const vector<string> exts = {".gmi", ".txt", ".py", ".md", "", ".gmi~"};
+    vector<string> paths;
+    paths.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        paths.push_back(dirs[i % dirs.size()] + "page-" + std::to_string(i) + exts[i % exts.size()]);
+    }
+    return paths;
+}
+
+template<typename F>
+double time_ns(const vector<string> &paths, size_t rounds, F check) {
+    size_t matched = 0;
+    auto start = Clock::now();
+    for (size_t r = 0; r < rounds; ++r) {
+        for (const string &path : paths) {
+            matched += check(path);
+        }
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    // Keep the checks from being optimized away
+    if (matched == size_t(-1)) {
+        std::puts("");
+    }
+    return elapsed / (rounds * paths.size());
+}
+
+void bench(const char *name, const vector<string> &patterns, const vector<string> &paths, size_t rounds) {
+    vector<regex> rules;
+    for (const string &pattern : patterns) {
+        rules.emplace_back(pattern, re_consts::ECMAScript | re_consts::icase | re_consts::optimize);
+    }
+    double std_ns = time_ns(paths, rounds, [&](const string &path) { return regex_matches(rules, path); });
+
+    // Every path is unique, so the first round only hits the DFA
+    RuleSet compiled(patterns);
+    double cold_ns = time_ns(paths, 1, [&](const string &path) { return compiled.matches(path); });
+    double warm_ns = time_ns(paths, rounds, [&](const string &path) { return compiled.matches(path); });
+
+    std::printf("%-12s %3zu rules %10.1f ns/path std::regex %10.1f ns/path compiled %10.1f ns/path memoized (%zu fallback)\n",
+        name, patterns.size(), std_ns, cold_ns, warm_ns, compiled.getFallbackCount());
+}
+
+int main(int argc, char **argv) {
+    size_t rounds = argc > 1 ? std::stoul(argv[1]) : 20;
+    vector<string> paths = make_paths(2000);
+
+    bench("default", {"^[^.]*$|\\.gmi$|\\.txt$"}, paths, rounds);
+    bench("hidden", {"^(?:(?!/\\.).)*$"}, paths, rounds);
+    bench("typical", {"^/srv/gemini/", "^(/[a-z0-9_.-]+)*$", "\\.(gmi|txt|py)$", "[^~]$"}, paths, rounds);
+
+    vector<string> many;
+    for (int i = 0; i < 16; ++i) {
+        many.push_back("[^x]|page-" + std::to_string(i));
+    }
+    bench("many", many, paths, rounds);
+
+    return 0;
+}
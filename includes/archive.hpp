@@ -0,0 +1,157 @@
+#ifndef __GEMCAPS_ARCHIVE__
+#define __GEMCAPS_ARCHIVE__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * Options for packing a folder into an archive
+ *
+ * @property base path that the archive will be served under, used for the
+ *     links in directory listings
+ * @property listings whether to render listings for directories without an
+ *     index file
+ * @property hidden whether to pack hidden files
+ */
+struct PackOptions {
+    std::string base = "/";
+    bool listings = true;
+    bool hidden = false;
+};
+
+/**
+ * A read-only capsule packed into a single file.
+ *
+ * The archive is made up of a header, a perfect hash index of every path, and
+ * the complete response (header and body) of every path stored back to back,
+ * so that a request can be answered with a single lookup and send straight
+ * from the mapped file.
+ *
+ * Paths are relative to the packed folder, without leading or trailing
+ * slashes. The packed folder itself is the empty path.
+ *
+ * @note the archive uses the byte order of the machine that packed it
+ *
+ * @note an archive that is being served must be replaced by renaming a new
+ *     one over it (as pack() does), never by writing to it.
+ */
+class Archive {
+public:
+    enum Kind : uint32_t {
+        FILE = 0,
+        DIRECTORY = 1,
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t count;
+        uint32_t buckets;
+        uint32_t reserved;
+        uint64_t seeds_offset;
+        uint64_t entries_offset;
+        uint64_t size;
+    };
+
+    /**
+     * An entry in the index
+     *
+     * @property path_offset offset of the path in the archive
+     * @property path_length length of the path
+     * @property kind whether the entry is a file or a directory
+     * @property header_length length of the response header
+     * @property response_offset offset of the response in the archive
+     * @property response_length length of the response with its body, 0 if
+     *     a directory has nothing to show
+     */
+    struct Entry {
+        uint64_t path_offset;
+        uint32_t path_length;
+        uint32_t kind;
+        uint32_t header_length;
+        uint32_t reserved;
+        uint64_t response_offset;
+        uint64_t response_length;
+    };
+
+    inline static const char MAGIC[8] = {'G', 'E', 'M', 'C', 'A', 'P', 'S', 'A'};
+    inline static const uint32_t VERSION = 1;
+private:
+    std::string path;
+    const char *data = nullptr;
+    size_t size = 0;
+    const Header *header = nullptr;
+    const uint32_t *seeds = nullptr;
+    const Entry *entries = nullptr;
+
+    Archive(std::string path)
+        : path(path) {}
+
+    void validate();
+public:
+    ~Archive();
+
+    Archive(const Archive &) = delete;
+    Archive &operator=(const Archive &) = delete;
+
+    /**
+     * Map an archive into memory
+     *
+     * @param path path of the archive
+     *
+     * @throw std::runtime_error if the archive can't be read or is invalid
+     *
+     * @return the archive
+     */
+    static std::shared_ptr<Archive> open(const std::string &path);
+    /**
+     * Pack a folder into an archive
+     *
+     * The archive is written next to the output and renamed into place, so
+     * handlers serving the old archive can swap to the new one atomically.
+     *
+     * @param folder folder to pack
+     * @param output path of the archive
+     * @param options what to pack
+     *
+     * @throw std::runtime_error if the folder can't be packed
+     *
+     * @return the number of entries in the archive
+     */
+    static size_t pack(const std::string &folder, const std::string &output, const PackOptions &options = PackOptions());
+    /**
+     * Hash a path for the index
+     *
+     * @param data path
+     * @param length length of the path
+     * @param seed seed of the hash
+     *
+     * @return the hash
+     */
+    static uint64_t hash(const char *data, size_t length, uint64_t seed) noexcept;
+
+    /**
+     * Find an entry in the archive
+     *
+     * @param path path relative to the packed folder
+     *
+     * @return the entry, or nullptr if the path isn't in the archive
+     */
+    const Entry *find(const std::string &path) const noexcept;
+
+    /**
+     * Get the response for an entry
+     *
+     * @param entry entry
+     *
+     * @return the response, with a length of entry.response_length
+     */
+    const char *getResponse(const Entry &entry) const noexcept { return data + entry.response_offset; }
+    std::string getPath(const Entry &entry) const noexcept { return std::string(data + entry.path_offset, entry.path_length); }
+    size_t getCount() const noexcept { return header->count; }
+    size_t getSize() const noexcept { return size; }
+    const std::string &getFile() const noexcept { return path; }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef __GEMCAPS_ARCHIVEHANDLER__
+#define __GEMCAPS_ARCHIVEHANDLER__
+
+#include <memory>
+#include <string>
+
+#include <uv.h>
+
+#include "gemcaps/settings.hpp"
+#include "gemcaps/handler.hpp"
+#include "gemcaps/metrics.hpp"
+#include "archive.hpp"
+
+/**
+ * A handler that serves a capsule packed with gemcaps-pack.
+ *
+ * Requests are answered straight from the mapped archive, a block at a time
+ * as the client keeps up. When a new archive is renamed over the old one, it
+ * is mapped in the threadpool and swapped in once it has been validated.
+ */
+class ArchiveHandler : public Handler {
+private:
+    struct Reload {
+        uv_work_t work;
+        ArchiveHandler *handler;
+        std::string file;
+        std::shared_ptr<Archive> archive;
+        std::string error;
+    };
+
+    const std::string host;
+    const std::string base;
+    const std::string file;
+    const size_t block_size;
+    std::shared_ptr<Archive> archive;
+
+    uv_fs_event_t *event = nullptr;
+    Reload *reloading = nullptr;
+    bool reload_again = false;
+
+    metrics::Counter *reloads;
+    metrics::Counter *reload_errors;
+
+    static void __on_event(uv_fs_event_t *handle, const char *filename, int events, int status) noexcept;
+    static void __reload(uv_work_t *work) noexcept;
+    static void __on_reloaded(uv_work_t *work, int status) noexcept;
+public:
+    /**
+     * Create an archive handler
+     *
+     * @param host host to serve, empty for any host
+     * @param base path the archive is served under
+     * @param file path of the archive
+     * @param archive the loaded archive
+     * @param loop loop to watch the archive with, nullptr to never reload it
+     * @param block_size most bytes of a response that are sent at a time
+     */
+    ArchiveHandler(std::string host, std::string base, std::string file, std::shared_ptr<Archive> archive, uv_loop_t *loop, size_t block_size = 64 * 1024);
+    ~ArchiveHandler();
+
+    /**
+     * Map the archive again in the background and swap it in
+     */
+    void reload() noexcept;
+
+    const std::shared_ptr<Archive> &getArchive() const noexcept { return archive; }
+
+    // Override Handler
+    bool shouldHandle(std::string host, std::string path) noexcept;
+    void handle(ClientConnection *client) noexcept;
+};
+
+
+class ArchiveHandlerFactory : public HandlerFactory {
+public:
+    inline static const std::string HOST = "host";
+    inline static const std::string BASE = "base";
+    inline static const std::string ARCHIVE = "archive";
+    inline static const std::string WATCH = "watch";
+    inline static const std::string READ_BLOCK_SIZE = "readBlockSize";
+
+    // Override HandlerFactory
+    std::shared_ptr<Handler> createHandler(YAML::Node settings, std::string dir);
+};
+
+#endif
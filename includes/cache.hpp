@@ -213,6 +213,14 @@ public:
      * @param key key
      */
     void invalidate(const CacheKey &key);
+    /**
+     * Invalidate every cache whose name is the path or is inside of it
+     * 
+     * This is meant to be called by a FileWatcher listener when a file changes
+     * 
+     * @param path file or directory that changed
+     */
+    void invalidateTree(const std::string &path);
 
     /**
      * Get a notification when the cache is ready
@@ -0,0 +1,57 @@
+#ifndef __GEMCAPS_CERTSTORE__
+#define __GEMCAPS_CERTSTORE__
+
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <wolfssl/options.h>
+#include <wolfssl/ssl.h>
+
+#include <parallel_hashmap/phmap.h>
+
+/**
+ * Called on a new context before it is shared
+ * 
+ * @param ctx context
+ */
+typedef void (*setupContext)(WOLFSSL_CTX *ctx);
+
+/**
+ * Contexts shared by every server that uses the same certificate.
+ *
+ * A context is kept by the paths of its certificate and key, and the times
+ * that they were last modified, so that servers with the same certificate
+ * share one context and a reload only reads the certificates that changed.
+ * The store only holds weak references, so a context is freed once no server
+ * uses it.
+ *
+ * @note the store may be used from the threadpool, and certificates are read
+ *     without holding its lock
+ */
+class CertificateStore {
+private:
+    inline static std::mutex lock;
+    inline static phmap::flat_hash_map<std::string, std::weak_ptr<WOLFSSL_CTX>> contexts;
+public:
+    /**
+     * Get the context for a certificate, loading it if it isn't loaded or
+     * has changed since
+     *
+     * @param cert certificate file
+     * @param key key file
+     * @param setup called on the context if it is loaded now
+     *
+     * @return the context, or nullptr if the files could not be loaded
+     */
+    static std::shared_ptr<WOLFSSL_CTX> get(const std::string &cert, const std::string &key, setupContext setup = nullptr) noexcept;
+
+    /**
+     * Get the number of contexts that are in use
+     *
+     * @return number of contexts
+     */
+    static size_t size() noexcept;
+};
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __GEMCAPS_CLIENTHELLO__
+#define __GEMCAPS_CLIENTHELLO__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * The parts of a TLS ClientHello that are needed before the handshake starts
+ * 
+ * @property ciphers cipher suites the client offered
+ */
+struct ClientHello {
+    std::vector<uint16_t> ciphers;
+
+    /**
+     * Parse the ClientHello at the start of a connection
+     * 
+     * @param data first bytes that the client sent
+     * @param length number of bytes
+     * @param result parsed hello
+     * 
+     * @return whether the data starts with a ClientHello, up to the end of
+     *     its cipher suites
+     */
+    static bool parse(const char *data, size_t length, ClientHello &result) noexcept;
+
+    /**
+     * Check if the client offered a cipher suite that uses an ECDSA certificate
+     * 
+     * @return whether the client accepts an ECDSA certificate
+     */
+    bool offersECDSA() const noexcept;
+};
+
+#endif
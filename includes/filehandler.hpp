@@ -1,14 +1,34 @@
 #ifndef __GEMCAPS_FILEHANDLER__
 #define __GEMCAPS_FILEHANDLER__
 
+#include <atomic>
 #include <memory>
 #include <vector>
-#include <regex>
 
 #include <parallel_hashmap/phmap.h>
 
 #include "gemcaps/settings.hpp"
 #include "gemcaps/handler.hpp"
+#include "gemcaps/limiter.hpp"
+#include "gemcaps/executor.hpp"
+#include "gemcaps/dircache.hpp"
+#include "rules.hpp"
+
+/**
+ * Limits on how long and how much a cgi script may run
+ * 
+ * @property timeout maximum wall-clock time in ms the script may run (0 means no limit)
+ * @property first_byte_timeout maximum time in ms before the script must write something (0 means no limit)
+ * @property kill_timeout time in ms between asking a timed out script to
+ *     terminate and killing it
+ * @property resources resource limits applied to the script
+ */
+struct CGITimeouts {
+    uint64_t timeout = 0;
+    uint64_t first_byte_timeout = 0;
+    uint64_t kill_timeout = 5000;
+    ResourceLimits resources;
+};
 
 class FileHandler : public Handler {
 private:
@@ -16,20 +36,49 @@ private:
     const std::string folder;
     const std::string base;
     const bool read_dirs;
-    const std::vector<std::regex> rules;
+    const RuleSet rules;
     const std::vector<std::string> cgi_types;
     const std::string cgi_lang;
     const phmap::flat_hash_map<std::string, std::string> cgi_vars;
+    const std::shared_ptr<Limiter> cgi_limiter;
+    const ScriptRunners cgi_runners;
+    const CGITimeouts cgi_timeouts;
+    const size_t max_upload_size;
+    const ListingOptions listing_options;
+    const size_t read_block_size;
+    const std::string lang;
+    const std::string charset;
+    // Unlike the address, this is never reused by a later handler
+    const uint64_t id;
+
+    Environment cgi_env;
+    // Loop whose watcher the folder is watched with, if it is
+    uv_loop_t *watch_loop = nullptr;
+
+    inline static std::atomic<uint64_t> next_id{0};
+
+    /**
+     * Build the environment variables that are the same for every cgi script
+     */
+    void buildEnvironment() noexcept;
 public:
     FileHandler(
             std::string host,
             std::string folder,
             std::string base,
             bool read_dirs,
-            std::vector<std::regex> rules,
+            RuleSet rules,
             std::vector<std::string> cgi_types,
             std::string cgi_lang,
-            phmap::flat_hash_map<std::string, std::string> cgi_vars)
+            phmap::flat_hash_map<std::string, std::string> cgi_vars,
+            std::shared_ptr<Limiter> cgi_limiter,
+            ScriptRunners cgi_runners,
+            CGITimeouts cgi_timeouts,
+            size_t max_upload_size,
+            ListingOptions listing_options,
+            size_t read_block_size,
+            std::string lang,
+            std::string charset)
         : host(host),
           folder(folder),
           base(base),
@@ -37,7 +86,26 @@ public:
           rules(rules),
           cgi_types(cgi_types),
           cgi_lang(cgi_lang),
-          cgi_vars(cgi_vars) {}
+          cgi_vars(cgi_vars),
+          cgi_limiter(cgi_limiter),
+          cgi_runners(cgi_runners),
+          cgi_timeouts(cgi_timeouts),
+          max_upload_size(max_upload_size),
+          listing_options(listing_options),
+          read_block_size(read_block_size),
+          lang(lang),
+          charset(charset),
+          id(++next_id) {
+        buildEnvironment();
+    }
+    ~FileHandler();
+
+    /**
+     * Watch the folder for changes for as long as the handler exists
+     * 
+     * @param loop loop of the watcher
+     */
+    void watch(uv_loop_t *loop) noexcept;
 
     /**
      * Check if this handler is allowed to display directory contents
@@ -54,7 +122,7 @@ public:
      * 
      * @return whether the file is allowed to be sent to clients
      */
-    bool validateFile(std::string file) const noexcept;
+    bool validateFile(const std::string &file) const noexcept;
     /**
      * Check if the file is allowed to be executed
      * 
@@ -65,16 +133,74 @@ public:
      * @return whether the file is allowed to be executed
      */
     bool isExecutable(std::string file) const noexcept;
+    /**
+     * Get the limiter for cgi scripts run by this handler
+     * 
+     * @return the handler's cgi limiter
+     */
+    Limiter *getCgiLimiter() const noexcept { return cgi_limiter.get(); }
+    /**
+     * Get the programs that run cgi scripts for this handler
+     * 
+     * @return the handler's script runners
+     */
+    const ScriptRunners &getScriptRunners() const noexcept { return cgi_runners; }
+    /**
+     * Get the time and resource limits for cgi scripts
+     * 
+     * @return the handler's cgi limits
+     */
+    const CGITimeouts &getCgiTimeouts() const noexcept { return cgi_timeouts; }
+    /**
+     * Get the largest titan upload that scripts may receive
+     * 
+     * @return the maximum upload size in bytes, 0 if uploads are not allowed
+     */
+    size_t getMaxUploadSize() const noexcept { return max_upload_size; }
+    /**
+     * Get how directory listings are rendered
+     * 
+     * @return the handler's listing options
+     */
+    const ListingOptions &getListingOptions() const noexcept { return listing_options; }
+    /**
+     * Get how much of a file is read at a time when it is sent
+     * 
+     * @return the size of each read in bytes
+     */
+    size_t getReadBlockSize() const noexcept { return read_block_size; }
+    /**
+     * Get the id of the handler, which no other handler has had
+     * 
+     * @return the id
+     */
+    uint64_t getId() const noexcept { return id; }
+    /**
+     * Build the success header for a file
+     * 
+     * The mimetype comes from the file's extension, with the handler's charset
+     * added to text types and its lang added to gemini documents.
+     * 
+     * @param file file
+     * 
+     * @return the response header
+     */
+    std::string buildHeader(const std::string &file) const noexcept;
 
     /**
-     * Generate the environment variables for a cgi script
+     * Get the environment variables shared by all cgi scripts of this handler
+     * 
+     * @return the shared environment
+     */
+    const Environment &getEnvironment() const noexcept { return cgi_env; }
+    /**
+     * Generate the request specific environment variables for a cgi script
      * 
      * @param file script file
      * @param client client connection
-     * 
-     * @return the generated environment variables
+     * @param env environment to add the variables to
      */
-    phmap::flat_hash_map<std::string, std::string> generateEnvironment(const std::string &file, const ClientConnection *client) const noexcept;
+    void generateEnvironment(const std::string &file, const ClientConnection *client, Environment &env) const noexcept;
 
     // Override Handler
     bool shouldHandle(std::string host, std::string path) noexcept;
@@ -92,6 +218,26 @@ public:
     inline static const std::string CGI_TYPES = "cgiFiletypes";
     inline static const std::string CGI_LANG = "cgiLang";
     inline static const std::string CGI_VARS = "cgiVars";
+    inline static const std::string MAX_CONCURRENT_CGI = "maxConcurrentCgi";
+    inline static const std::string CGI_QUEUE_SIZE = "cgiQueueSize";
+    inline static const std::string CGI_QUEUE_TIMEOUT = "cgiQueueTimeout";
+    inline static const std::string SCRIPT_RUNNERS = "scriptRunners";
+    inline static const std::string CGI_TIMEOUT = "cgiTimeout";
+    inline static const std::string CGI_FIRST_BYTE_TIMEOUT = "cgiFirstByteTimeout";
+    inline static const std::string CGI_KILL_TIMEOUT = "cgiKillTimeout";
+    inline static const std::string CGI_LIMITS = "cgiLimits";
+    inline static const std::string LIMIT_CPU = "cpu";
+    inline static const std::string LIMIT_MEMORY = "memory";
+    inline static const std::string LIMIT_FILES = "files";
+    inline static const std::string MAX_UPLOAD_SIZE = "maxUploadSize";
+    inline static const std::string WATCH = "watch";
+    inline static const std::string LISTING = "listing";
+    inline static const std::string LISTING_SORT = "sort";
+    inline static const std::string LISTING_SIZE = "size";
+    inline static const std::string LISTING_MTIME = "mtime";
+    inline static const std::string READ_BLOCK_SIZE = "readBlockSize";
+    inline static const std::string LANG = "lang";
+    inline static const std::string CHARSET = "charset";
 
     // Override HandlerFactory
     std::shared_ptr<Handler> createHandler(YAML::Node settings, std::string dir);
@@ -15,17 +15,40 @@ inline const std::string HOST = "host";
 inline const std::string PORT = "port";
 inline const std::string CERT = "cert";
 inline const std::string KEY = "key";
+inline const std::string ECDSA_CERT = "ecdsaCert";
+inline const std::string ECDSA_KEY = "ecdsaKey";
+inline const std::string BACKLOG = "backlog";
+inline const std::string LISTEN = "listen";
+inline const std::string REUSE_PORT = "reusePort";
 
 inline const std::string HANDLER = "handler";
 
 /**
- * Load a server from a YAML File
+ * The settings of a server
+ */
+struct ServerSettings {
+    std::vector<ListenAddress> addresses;
+    std::string cert;
+    std::string key;
+    // An ECDSA certificate for clients that offer it, or empty for none
+    std::string ecdsa_cert;
+    std::string ecdsa_key;
+    int backlog;
+    size_t max_connections;
+    bool reuse_port;
+};
+
+/**
+ * Load the settings of a server from a YAML File
+ * 
+ * This doesn't touch the loop, so it may be called from the threadpool.
  * 
  * @param settings settings to use
+ * @param dir the directory where relative files should begin
  * 
- * @return the loaded server
+ * @return the server's settings
  */
-std::shared_ptr<SSLServer> loadServer(YAML::Node settings, std::string dir, uv_loop_t *loop = nullptr);
+ServerSettings loadServerSettings(YAML::Node settings, std::string dir);
 
 class HandlerLoader {
 private:
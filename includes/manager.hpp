@@ -18,6 +18,8 @@
 #include "cache.hpp"
 #include "gemcaps/settings.hpp"
 #include "server.hpp"
+#include "loader.hpp"
+#include "gemcaps/metrics.hpp"
 #include "gemcaps/handler.hpp"
 
 
@@ -30,18 +32,46 @@ class Manager;
  * An object that sends messages to the client from a handler
  */
 class GeminiConnection : public ClientConnection, public ClientContext {
+public:
+    enum Phase {
+        /** waiting for the TLS handshake */
+        HANDSHAKE,
+        /** waiting for the request header */
+        HEADER,
+        /** the request was given to a handler */
+        HANDLING
+    };
 private:
 	Manager *manager;
+    Phase phase = HANDSHAKE;
+    uint64_t phase_start;
 	Request request;
 	SSLClient *client;
-	BufferPipe buffer;
     bool sentHeader = false;
 
     onClientClose cb = nullptr;
     void *ctx = nullptr;
+
+    onClientData data_cb = nullptr;
+    void *data_ctx = nullptr;
+
+    onClientDrain drain_cb = nullptr;
+    void *drain_ctx = nullptr;
+    std::string pending_data;
+    size_t remaining = 0;
+    // Whether the end of the body was passed to the data callback
+    bool ended = false;
+    bool dispatched = false;
+    bool paused = true;
+
+    /**
+     * Deliver as much of the body to the data callback as is available
+     */
+    void pump() noexcept;
 public:
 	GeminiConnection(Manager *manager, SSLClient *client)
 		: manager(manager),
+		  phase_start(uv_now(client->getLoop())),
 		  client(client) {}
 
 	Request &getRequest() noexcept { return request; }
@@ -51,42 +81,312 @@ public:
 	void send(const void *data, size_t length) noexcept;
 	void close() noexcept;
     void setClientCloseCallback(onClientClose cb, void *ctx = nullptr) { this->cb = cb; this->ctx = ctx; }
+    void setClientDataCallback(onClientData cb, void *ctx = nullptr) { data_cb = cb; data_ctx = ctx; }
+    void pauseData() noexcept;
+    void resumeData() noexcept;
+    size_t getPending() const noexcept { return client->getPending(); }
+    void setClientDrainCallback(onClientDrain cb, void *ctx = nullptr) { drain_cb = cb; drain_ctx = ctx; }
+
+    /**
+     * Mark the request as being passed to a handler
+     * 
+     * @param body data received after the request header
+     */
+    void dispatch(std::string body) noexcept;
+    /**
+     * Check if the request has been passed to a handler
+     * 
+     * @return whether the request was dispatched
+     */
+    bool isDispatched() const noexcept { return dispatched; }
+    Phase getPhase() const noexcept { return phase; }
+    /**
+     * Move on to the next phase of the request
+     * 
+     * @param phase new phase
+     * 
+     * @return time in ms that was spent in the last phase
+     */
+    uint64_t setPhase(Phase phase) noexcept;
 
 	// Override ClientContext
 	void on_close(SSLClient *client) noexcept;
-	void on_read(SSLClient *client) noexcept {}
+	void on_read(SSLClient *client) noexcept;
 	void on_write(SSLClient *client) noexcept;
 };
 
 
+/**
+ * Routes requests from the servers to their handlers.
+ * 
+ * The servers and handlers that are loaded together make up a generation.
+ * Reloading the config builds a new generation next to the current one, which
+ * takes over the listening sockets of unchanged addresses and handles every
+ * new connection. Connections of the old generation finish on the servers and
+ * handlers they were accepted by, and the old generation is freed once the
+ * last of them closes.
+ */
 class Manager : public ServerContext, public ClientContext {
 private:
     struct ClientData {
         Request request;
         BufferPipe body;
     };
-    phmap::flat_hash_map<std::string, std::shared_ptr<SSLServer>> servers;
-    phmap::flat_hash_map<SSLServer *, std::vector<std::shared_ptr<Handler>>> handlers;
+    struct Generation {
+        unsigned long id;
+        phmap::flat_hash_map<std::string, std::shared_ptr<SSLServer>> servers;
+        phmap::flat_hash_map<SSLServer *, std::vector<std::shared_ptr<Handler>>> handlers;
+
+        /**
+         * Check if every connection to the generation has closed
+         */
+        bool drained() const noexcept;
+    };
+    /**
+     * Config files that were read from disk, ready to be applied on the loop
+     */
+    struct Reload {
+        struct ServerFile {
+            std::string filename;
+            std::string name;
+            ServerSettings settings;
+            ServerCertificates certificates;
+        };
+        struct HandlerFile {
+            std::string filename;
+            YAML::Node node;
+        };
+
+        uv_work_t work;
+        Manager *manager;
+        // Only used to scan the directories, which is done synchronously
+        uv_loop_t *loop;
+        std::string servers_dir;
+        std::string handlers_dir;
+        std::vector<ServerFile> servers;
+        std::vector<HandlerFile> handlers;
+        std::vector<std::string> errors;
+    };
+
+    uv_loop_t *loop;
+    std::string config_dir;
+    std::shared_ptr<Generation> current;
+    // Old generations that still have open connections
+    std::vector<std::shared_ptr<Generation>> draining;
+    unsigned long generations = 0;
+    bool started = false;
+
+    Reload *reloading = nullptr;
+    bool reload_again = false;
+    uv_signal_t *reload_signal = nullptr;
+    uv_timer_t *sweep_timer;
+
+    bool shutting_down = false;
+    uint64_t shutdown_deadline = 0;
+    // Whether the scripts left over once every connection closed were asked to exit
+    bool scripts_terminated = false;
+    uv_signal_t *shutdown_signals[2] = {nullptr, nullptr};
+    uv_timer_t *drain_timer;
+
+    /**
+     * A new process that is starting up to take over the listening sockets
+     */
+    struct Upgrade {
+        Manager *manager;
+        uv_process_t process;
+        // Read end of the pipe that the new process reports it is ready on
+        uv_pipe_t ready;
+        uv_timer_t timer;
+        bool exited = false;
+        // Handles that have yet to finish closing
+        int handles = 3;
+
+        static void __on_close(uv_handle_t *handle) noexcept;
+    };
+
+    std::vector<std::string> upgrade_args;
+    uv_signal_t *upgrade_signal = nullptr;
+    Upgrade *upgrading = nullptr;
+    // Pipe to the process that started this one in an upgrade, or -1
+    int upgraded_from = -1;
+
+    metrics::Counter *reloads;
+    metrics::Counter *reload_errors;
+    metrics::Gauge *generation_gauge;
+    metrics::Gauge *draining_gauge;
 
     phmap::flat_hash_map<SSLClient *, std::unique_ptr<GeminiConnection>> requests;
+
+    /**
+     * Read the config files of a reload
+     * 
+     * This doesn't touch the loop, so it may be called from the threadpool.
+     */
+    static void scan(Reload *reload) noexcept;
+    /**
+     * Build a generation from the files of a reload, and switch to it
+     * 
+     * @param strict whether to give up if any file has an error, rather than skipping it
+     * 
+     * @return whether the generation was switched
+     */
+    bool apply(Reload *reload, bool strict) noexcept;
+    /**
+     * Find the handlers of a server in any generation
+     */
+    const std::vector<std::shared_ptr<Handler>> *findHandlers(SSLServer *server) const noexcept;
+    /**
+     * Free the old generations that have no connections left
+     */
+    void sweep() noexcept;
+    /**
+     * Check on the connections left during a shutdown, dropping them if the
+     * deadline has passed, and stop the loop once there are none
+     */
+    void drain() noexcept;
+    /**
+     * Stop waiting on the new process of an upgrade
+     * 
+     * @param ready whether the new process is ready, in which case this one
+     *     shuts down, otherwise the new process is killed if it is running
+     */
+    void endUpgrade(bool ready) noexcept;
+
+    static void __reload(uv_work_t *work) noexcept;
+    static void __on_reloaded(uv_work_t *work, int status) noexcept;
+    static void __on_signal(uv_signal_t *handle, int signum) noexcept;
+    static void __on_sweep(uv_timer_t *handle) noexcept;
+    static void __on_shutdown_signal(uv_signal_t *handle, int signum) noexcept;
+    static void __on_drain(uv_timer_t *handle) noexcept;
+    static void __on_upgrade_signal(uv_signal_t *handle, int signum) noexcept;
+    static void __on_upgrade_exit(uv_process_t *process, int64_t exit_status, int term_signal) noexcept;
+    static void __on_upgrade_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) noexcept;
+    static void __on_upgrade_timeout(uv_timer_t *handle) noexcept;
+
+    inline static uint64_t handshake_timeout = 1000;
+    inline static uint64_t header_timeout = 1000;
+    inline static uint64_t idle_timeout = 30000;
+    inline static uint64_t request_deadline = 10000;
+    inline static uint64_t shutdown_timeout = 30000;
 public:
+    inline static const std::string TIMEOUTS = "timeouts";
+    inline static const std::string HANDSHAKE_TIMEOUT = "handshake";
+    inline static const std::string HEADER_TIMEOUT = "header";
+    inline static const std::string IDLE_TIMEOUT = "idle";
+    inline static const std::string REQUEST_DEADLINE = "request";
+    inline static const std::string SHUTDOWN_TIMEOUT = "shutdown";
+    /** Environment variable with the pipe that a new process reports it is ready on */
+    inline static const char *READY_ENV = "GEMCAPS_READY_FD";
+    /** Time in ms that the new process of an upgrade has to start its servers */
+    inline static const uint64_t UPGRADE_TIMEOUT = 30000;
 
     /**
-     * Load the servers into memory
+     * Load the connection timeouts from the root config
+     * 
+     * @param settings root config
+     */
+    static void loadTimeouts(YAML::Node settings);
+    /**
+     * Change the connection timeouts
+     * 
+     * Each timeout is restarted whenever data is sent or received, and 0 means
+     * no timeout.
      * 
-     * @param config_dir directory of server configs
+     * @param handshake time in ms a new connection has to finish the TLS handshake
+     * @param header time in ms to send the request header after the handshake
+     * @param idle time in ms a handler's connection may go without sending or receiving
+     * @param request time in ms a new connection has to send its whole request
+     *     header, which is never restarted
+     * @param shutdown time in ms that responses have to finish when shutting down
      */
-    void loadServers(std::string config_dir) noexcept;
+    static void configureTimeouts(uint64_t handshake, uint64_t header, uint64_t idle, uint64_t request, uint64_t shutdown) noexcept;
+
+    Manager(uv_loop_t *loop = nullptr);
+    ~Manager();
+
+    Manager(const Manager &) = delete;
+    Manager &operator=(const Manager &) = delete;
+
     /**
-     * Load the handlers into memory
+     * Load the servers and handlers into memory
      * 
-     * @param config_dir directory of handler configs
+     * Files that can't be loaded are skipped.
+     * 
+     * @param config_dir directory with the `servers` and `handlers` directories
      */
-    void loadHandlers(std::string config_dir) noexcept;
+    void load(std::string config_dir) noexcept;
     /**
      * Start the servers
      */
     void startServers() noexcept;
+    /**
+     * Get the listening sockets of the current servers
+     * 
+     * @param sockets list to add each address and its socket to
+     */
+    void getSockets(std::vector<std::pair<ListenAddress, uv_os_fd_t>> &sockets) const noexcept;
+    /**
+     * Load the servers and handlers again in the background, and switch to
+     * them if every file loads
+     */
+    void reload() noexcept;
+    /**
+     * Reload whenever the process gets SIGHUP
+     */
+    void reloadOnSignal() noexcept;
+    /**
+     * Stop accepting connections, and stop the loop once the open ones close
+     * 
+     * Connections that haven't sent their request yet are closed right away,
+     * unless another process is taking over. Responses that are still going
+     * once the shutdown timeout passes are dropped. Scripts that are still
+     * running after their connection closes get SIGTERM, and SIGKILL once the
+     * shutdown timeout passes, and the loop only stops once they have exited.
+     * 
+     * @param close_idle whether to close the connections that haven't sent
+     *     their request yet, rather than letting them finish
+     */
+    void shutdown(bool close_idle = true) noexcept;
+    /**
+     * Shut down when the process gets SIGTERM or SIGINT, or right away if it
+     * gets one while already shutting down
+     */
+    void shutdownOnSignal() noexcept;
+    bool isShuttingDown() const noexcept { return shutting_down; }
+    /**
+     * Start a new gemcaps process that takes over the listening sockets, then
+     * shut down once it is ready
+     * 
+     * The new process may be a newer binary, and nothing is refused while it
+     * starts, since the sockets never close. This process keeps serving until
+     * the new one reports that its servers are listening. If it can't be
+     * started, exits first, or takes longer than UPGRADE_TIMEOUT, this process
+     * carries on.
+     * 
+     * @param args arguments to start the new process with, including the program
+     */
+    void upgrade(const std::vector<std::string> &args) noexcept;
+    /**
+     * Check if this process was started by an upgrade
+     * 
+     * If it was, load() only switches to the config if every file loads, and
+     * READY_ENV is removed so that scripts don't see it.
+     */
+    void loadUpgrade() noexcept;
+    /**
+     * Tell the process that started this one in an upgrade whether the servers
+     * are listening, so that it can shut down or carry on
+     * 
+     * @return false if this process was started by an upgrade and isn't ready
+     *     to take over, in which case it should exit
+     */
+    bool finishUpgrade() noexcept;
+    /**
+     * Upgrade when the process gets SIGUSR2
+     * 
+     * @param args arguments to start the new process with, including the program
+     */
+    void upgradeOnSignal(std::vector<std::string> args) noexcept;
 
     // Overrides ServerContext
     void on_accept(SSLServer *server, SSLClient *client) noexcept;
@@ -95,6 +395,7 @@ public:
     void on_close(SSLClient *client) noexcept;
     void on_read(SSLClient *client) noexcept;
 	void on_write(SSLClient *client) noexcept {}
+    void on_timeout(SSLClient *client, bool deadline) noexcept;
 };
 
 #endif
\ No newline at end of file
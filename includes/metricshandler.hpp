@@ -0,0 +1,37 @@
+#ifndef __GEMCAPS_METRICSHANDLER__
+#define __GEMCAPS_METRICSHANDLER__
+
+#include <memory>
+#include <string>
+
+#include "gemcaps/settings.hpp"
+#include "gemcaps/handler.hpp"
+
+/**
+ * A handler that exposes the server's metrics as text/plain
+ */
+class MetricsHandler : public Handler {
+private:
+    const std::string host;
+    const std::string path;
+public:
+    MetricsHandler(std::string host, std::string path)
+        : host(host),
+          path(path) {}
+
+    // Override Handler
+    bool shouldHandle(std::string host, std::string path) noexcept;
+    void handle(ClientConnection *client) noexcept;
+};
+
+
+class MetricsHandlerFactory : public HandlerFactory {
+public:
+    inline static const std::string HOST = "host";
+    inline static const std::string PATH = "path";
+
+    // Override HandlerFactory
+    std::shared_ptr<Handler> createHandler(YAML::Node settings, std::string dir);
+};
+
+#endif
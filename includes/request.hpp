@@ -0,0 +1,19 @@
+#ifndef __GEMCAPS_REQUEST__
+#define __GEMCAPS_REQUEST__
+
+#include "gemcaps/handler.hpp"
+
+/**
+ * Parse the header of a request
+ * 
+ * The header should contain the request line including the line ending.
+ * Titan parameters (`;size=...;mime=...;token=...`) are removed from the
+ * path and put in the request's upload.
+ * 
+ * @param request request with its header set
+ * 
+ * @return whether the header is valid
+ */
+bool parseRequest(Request *request);
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef __GEMCAPS_RULES__
+#define __GEMCAPS_RULES__
+
+#include <bitset>
+#include <cstdint>
+#include <regex>
+#include <string>
+#include <vector>
+
+#include <parallel_hashmap/phmap.h>
+
+/**
+ * A set of regex rules that a path must all match (as with std::regex_search).
+ *
+ * The rules are compiled together into a single automaton which is turned
+ * into a DFA lazily as paths are checked, so each path is only scanned once
+ * no matter how many rules there are. Verdicts are memoized in a bounded
+ * cache.
+ *
+ * Patterns are ECMAScript regexes. Patterns using features that can't be
+ * expressed as an automaton (backreferences, lookaheads, word boundaries)
+ * are checked with std::regex instead.
+ *
+ * @note not thread safe
+ */
+class RuleSet {
+public:
+    /** A parsed rule */
+    struct Node;
+private:
+    struct NState {
+        enum Type {CHAR, SPLIT, BOL, EOL, MATCH};
+        Type type;
+        std::bitset<256> chars;
+        int out = -1;
+        int out1 = -1;
+        int rule = -1;
+    };
+
+    struct Frag {
+        int start;
+        std::vector<std::pair<int, bool>> outs;
+    };
+
+    struct DState {
+        // NFA states (id * 2 + whether a character has been consumed)
+        std::vector<int> states;
+        uint64_t matched;
+        std::vector<int> next;
+    };
+
+    std::vector<std::string> patterns;
+    std::vector<NState> nfa;
+    // Start state of each compiled rule
+    std::vector<int> starts;
+    uint64_t all_rules = 0;
+    std::vector<std::regex> fallback;
+
+    mutable std::vector<DState> dfa;
+    mutable phmap::flat_hash_map<std::string, int> dfa_index;
+    mutable phmap::flat_hash_map<std::string, bool> verdicts;
+
+    int newState(NState::Type type, int rule);
+    Frag compile(const Node &node, int rule);
+    void patch(const Frag &frag, int target);
+
+    int addState(std::vector<int> &states, uint64_t matched) const;
+    void reset() const;
+    void closure(std::vector<int> &states, std::vector<char> &seen, int state, bool consumed, bool at_start, bool at_end = false) const;
+    int step(int dstate, unsigned char c) const;
+    bool finish(int dstate) const;
+    bool search(const std::string &path) const;
+public:
+    /** Maximum number of memoized verdicts */
+    inline static const size_t MAX_VERDICTS = 4096;
+    /** Maximum number of DFA states before the DFA is rebuilt */
+    inline static const size_t MAX_DFA_STATES = 2048;
+
+    RuleSet() {}
+    /**
+     * Compile a set of rules
+     *
+     * @param patterns ECMAScript regex patterns
+     * @param icase whether the rules ignore case
+     *
+     * @throw std::regex_error if a pattern is invalid
+     */
+    RuleSet(const std::vector<std::string> &patterns, bool icase = true);
+
+    /**
+     * Check if a path matches every rule
+     *
+     * @param path path to check
+     *
+     * @return whether the path matches
+     */
+    bool matches(const std::string &path) const noexcept;
+
+    const std::vector<std::string> &getPatterns() const noexcept { return patterns; }
+    /**
+     * Get the number of rules that couldn't be compiled and are checked with std::regex
+     *
+     * @return number of std::regex rules
+     */
+    size_t getFallbackCount() const noexcept { return fallback.size(); }
+};
+
+#endif
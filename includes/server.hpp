@@ -2,6 +2,8 @@
 #define __GEMCAPS_SHARED_SERVER__
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <wolfssl/options.h>
 #include <wolfssl/ssl.h>
@@ -9,8 +11,11 @@
 #include <uv.h>
 
 #include <parallel_hashmap/phmap.h>
+#include <yaml-cpp/yaml.h>
 
 #include "gemcaps/util.hpp"
+#include "gemcaps/metrics.hpp"
+#include "gemcaps/timerwheel.hpp"
 
 
 class SSLServer;
@@ -23,34 +28,87 @@ public:
     virtual void on_close(SSLClient *client) = 0;
     virtual void on_read(SSLClient *client) = 0;
     virtual void on_write(SSLClient *client) = 0;
+    /**
+     * Called right before a client is dropped for timing out
+     * 
+     * @param client client
+     * @param deadline whether the deadline passed, rather than the idle timeout
+     */
+    virtual void on_timeout(SSLClient *client, bool deadline) {}
 };
 
 
+/**
+ * A connection to a client.
+ * 
+ * If the threadpool's handshake lane has threads, the TLS handshake runs there,
+ * so that its public key operations don't hold up the loop. While it runs, the
+ * threadpool has the WOLFSSL to itself: data that arrives waits on the loop,
+ * and the records that the handshake writes are sent once it is back.
+ */
 class SSLClient {
 private:
+    /**
+     * A step of the handshake on the threadpool
+     */
+    struct Handshake {
+        uv_work_t work;
+        SSLClient *client;
+        int result = 0;
+        int error = 0;
+        std::string output;
+        // Whether the client closed while the handshake was running
+        bool orphaned = false;
+    };
+
     uv_tcp_t *client;
-    uv_timer_t *timeout;
+    TimerWheel *wheel;
+    WheelTimer timeout;
+    WheelTimer deadline;
     WOLFSSL *ssl;
+    sockaddr_storage address = {};
 
     BufferPipe buffer;
     
     size_t queued_writes = 0;
+    size_t pending_bytes = 0;
     bool queued_close = false;
+    bool sent_close_notify = false;
+    // Whether the server has seen the ClientHello to pick a certificate
+    bool hello_checked = false;
     bool closing = false;
+    bool reading = false;
     bool destroying = false;
 
     SSLServer *server;
     
     ClientContext *context = nullptr;
 
-    unsigned long timeout_time;
+    unsigned long timeout_time = 0;
 
     static void __on_recv(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) noexcept;
     static void __on_send(uv_write_t *req, int status) noexcept;
     static void __on_close(uv_handle_t *handle) noexcept;
-    static void __on_timeout(uv_timer_t *timeout) noexcept;
+    static void __on_timeout(void *ctx) noexcept;
+    static void __on_deadline(void *ctx) noexcept;
 
     phmap::flat_hash_map<uv_write_t *, std::vector<uv_buf_t>> write_requests;
+
+    Handshake *handshake = nullptr;
+    // Data received while the handshake was on the threadpool
+    std::string deferred;
+
+    /**
+     * Let the context read whatever has been received
+     */
+    void notifyRead() noexcept;
+    /**
+     * Run the next step of the handshake on the threadpool
+     */
+    void offloadHandshake() noexcept;
+
+    static void __handshake(uv_work_t *work) noexcept;
+    static void __on_handshake(uv_work_t *work, int status) noexcept;
 protected:
     int _send(const char *buf, int size) noexcept;
     int _recv(int size, char *buf) noexcept;
@@ -62,22 +120,63 @@ public:
     ~SSLClient() noexcept;
 
     uv_loop_t *getLoop() const noexcept;
+    /**
+     * Get the address of the peer
+     * 
+     * @return the peer's address, whose family is AF_UNSPEC if it is unknown
+     */
+    const sockaddr *getAddress() const noexcept { return reinterpret_cast<const sockaddr *>(&address); }
 
     bool hasData() const noexcept { return buffer.ready() > 0; }
 
     void listen() noexcept;
     void stop_listening() noexcept;
 
+    /**
+     * Crash the client once it has gone a while without sending or receiving
+     * 
+     * @param time time in ms, 0 for no timeout
+     */
     void setTimeout(unsigned long time) noexcept;
+    /**
+     * Restart the timeout, as though data was just sent or received
+     */
     void resetTimeout() noexcept;
+    /**
+     * Crash the client after a fixed time, no matter how much it sends
+     * 
+     * @param time time in ms, 0 to clear the deadline
+     */
+    void setDeadline(unsigned long time) noexcept;
+    /**
+     * Check if the TLS handshake has finished
+     * 
+     * @return whether the handshake is done
+     */
+    bool isHandshakeDone() const noexcept;
 
     int read(size_t size, void *buffer) noexcept;
     int write(const void *data, size_t size) noexcept;
+    /**
+     * Get the number of encrypted bytes waiting to be written to the socket
+     * 
+     * @return number of bytes waiting
+     */
+    size_t getPending() const noexcept { return pending_bytes; }
 
     bool wants_read() const noexcept;
     bool is_open() const noexcept;
 
+    /**
+     * Close the connection once everything has been written
+     * 
+     * After the handshake, the client is told that nothing was cut off with a
+     * TLS close_notify.
+     */
     void close() noexcept;
+    /**
+     * Reset the connection right away
+     */
     void crash() noexcept;
 
     int getSSLErrorNumber(int result) const noexcept;
@@ -94,15 +193,132 @@ public:
     virtual void on_accept(SSLServer *server, SSLClient *client) = 0;
 };
 
+/**
+ * An address for a server to listen on
+ * 
+ * @property host IPv4 or IPv6 address
+ * @property port port
+ */
+struct ListenAddress {
+    std::string host;
+    int port;
+
+    /**
+     * Parse an address of the form `host`, `host:port`, or `[host]:port`
+     * 
+     * @param address address to parse
+     * @param default_port port to use if the address doesn't have one
+     * @param result parsed address
+     * 
+     * @return whether the address is valid
+     */
+    static bool parse(const std::string &address, int default_port, ListenAddress &result) noexcept;
+
+    bool isIPv6() const noexcept { return host.find(':') != std::string::npos; }
+    bool operator==(const ListenAddress &other) const noexcept { return port == other.port && host == other.host; }
+    /**
+     * Format the address like parse() accepts
+     * 
+     * @return the address
+     */
+    std::string toString() const noexcept;
+};
+
+/**
+ * The certificates of a server, which may have an ECDSA certificate besides
+ * its main one
+ * 
+ * The contexts come from the CertificateStore, so servers with the same
+ * certificates share them.
+ */
+struct ServerCertificates {
+    std::shared_ptr<WOLFSSL_CTX> primary;
+    // Used instead of the primary context for clients that offer ECDSA
+    std::shared_ptr<WOLFSSL_CTX> ecdsa;
+};
+
+/**
+ * A TLS server.
+ * 
+ * A server may listen on several addresses, which share its certificate and
+ * handlers.
+ * 
+ * Connections are only accepted while the server and the process are under
+ * their connection limits. Over a limit, new connections wait in the listen
+ * backlog until a client closes.
+ * 
+ * A server that replaces another takes over its listeners on the same
+ * addresses, so nothing is dropped from the backlog, while the old server
+ * keeps its open connections until they finish.
+ */
 class SSLServer {
 private:
-    WOLFSSL_CTX *wolfssl = nullptr;
-    uv_tcp_t *server = nullptr;
+    struct Listener {
+        uv_tcp_t *handle;
+        ListenAddress address;
+        bool ipv6_only;
+    };
+
+    ServerCertificates certificates;
+    std::vector<Listener> listeners;
+    // Addresses left for adopt()
+    std::vector<std::pair<ListenAddress, bool>> adoptable;
     
     ServerContext *context;
 
     phmap::flat_hash_set<SSLClient *> clients;
 
+    int backlog = DEFAULT_BACKLOG;
+    size_t max_connections = 0;
+    // Listeners with a connection waiting to be accepted
+    std::vector<uv_stream_t *> waiting;
+
+    metrics::Gauge *connections_gauge = nullptr;
+
+    inline static size_t max_total = 0;
+    inline static size_t total = 0;
+    inline static phmap::flat_hash_set<SSLServer *> waiting_servers;
+    // Listening sockets passed on by the process that started this one, by address
+    inline static phmap::flat_hash_map<std::string, uv_os_sock_t> inherited;
+
+    /**
+     * Check if a new connection would go over a limit
+     */
+    bool atCapacity() const noexcept;
+    /**
+     * Bind a listener to an address
+     * 
+     * @return whether the listener was bound
+     */
+    bool bind(uv_loop_t *loop, const ListenAddress &address, bool ipv6_only, bool reuse_port) noexcept;
+    /**
+     * Find a listener bound to an address
+     * 
+     * @return index of the listener, or -1 if there is none
+     */
+    int findListener(const ListenAddress &address, bool ipv6_only) const noexcept;
+    /**
+     * Close a listener, and forget any connection waiting on it
+     */
+    void closeListener(size_t index) noexcept;
+    /**
+     * Accept the connection that is waiting on a listener
+     */
+    void accept(uv_stream_t *listener) noexcept;
+    /**
+     * Switch a client over to the ECDSA certificate if it offers ECDSA
+     * 
+     * @param client client that hasn't started its handshake
+     * @param data first data received from the client
+     * @param size size of the data
+     */
+    void chooseCertificate(SSLClient *client, const char *data, size_t size) noexcept;
+    /**
+     * Accept waiting connections of any server that is under its limits again
+     */
+    static void resumeWaiting() noexcept;
+    static void updateMetrics() noexcept;
+
     static void __on_accept(uv_stream_t *stream, int status) noexcept;
 
     static int __send(WOLFSSL *ssl, char *buf, int size, void *ctx) noexcept;
@@ -112,15 +328,116 @@ protected:
 
     friend SSLClient;
 public:
+    inline static const std::string MAX_CONNECTIONS = "maxConnections";
+    inline static const int DEFAULT_BACKLOG = 128;
+    /** Environment variable with the listening sockets that a process passes on */
+    inline static const char *INHERITED_ENV = "GEMCAPS_LISTEN_FDS";
+
     ~SSLServer() noexcept;
 
-    void load(uv_loop_t *loop, const std::string &host, int port, const std::string &cert, const std::string &key) noexcept;
+    /**
+     * Load the connection limit shared by every server from the root config
+     * 
+     * @param settings root config
+     */
+    static void loadLimits(YAML::Node settings);
+    /**
+     * Limit the connections of every server together
+     * 
+     * @param max_connections most connections open at once (0 means no limit)
+     */
+    static void configureLimits(size_t max_connections) noexcept;
+
+    /**
+     * Take the listening sockets passed on by the process that started this
+     * one, which are used instead of binding to the same address
+     * 
+     * The sockets are listed in INHERITED_ENV as `address=fd` pairs separated
+     * by `;`, and the variable is removed so that scripts don't see it.
+     */
+    static void loadInherited() noexcept;
+    /**
+     * Parse a list of inherited sockets, as found in INHERITED_ENV
+     * 
+     * Pairs that aren't valid are skipped.
+     * 
+     * @param value `address=fd` pairs separated by `;`
+     * @param sockets map to add the socket of each address to
+     * 
+     * @return number of pairs that were skipped
+     */
+    static size_t parseInherited(const std::string &value, phmap::flat_hash_map<std::string, uv_os_sock_t> &sockets) noexcept;
+    /**
+     * Close the inherited sockets that no server used
+     */
+    static void closeInherited() noexcept;
+
+    /**
+     * Load a certificate and its key, and the ECDSA pair if there is one
+     * 
+     * Certificates that are already loaded and haven't changed since are
+     * shared rather than read again. This doesn't touch any loop, so it may be
+     * called from the threadpool.
+     * 
+     * @param cert certificate file
+     * @param key key file
+     * @param ecdsa_cert ECDSA certificate file, or empty for none
+     * @param ecdsa_key ECDSA key file, or empty for none
+     * 
+     * @return the certificates for new servers, whose primary context is
+     *     nullptr if any of the files could not be loaded
+     */
+    static ServerCertificates loadCertificate(const std::string &cert, const std::string &key,
+        const std::string &ecdsa_cert = "", const std::string &ecdsa_key = "") noexcept;
+
+    /**
+     * Bind the server
+     * 
+     * IPv6 addresses also accept IPv4 connections, unless an IPv4 address of
+     * this server or of the ones loaded with it shares their port.
+     * 
+     * Addresses that one of the previous servers is listening on are left for
+     * adopt(), so that replacing a server never closes its sockets.
+     * 
+     * @param loop loop
+     * @param addresses addresses to listen on
+     * @param certificates certificates from loadCertificate()
+     * @param backlog number of connections the kernel queues before they are accepted
+     * @param max_connections most connections this server has open at once (0 means no limit)
+     * @param reuse_port whether other sockets may bind the same addresses, so
+     *     the kernel spreads connections between them
+     * @param previous servers that this one may take listeners from
+     * @param others addresses of the other servers loaded along with this one
+     */
+    void load(uv_loop_t *loop, const std::vector<ListenAddress> &addresses, const ServerCertificates &certificates,
+        int backlog = DEFAULT_BACKLOG, size_t max_connections = 0, bool reuse_port = false,
+        const std::vector<SSLServer *> &previous = {}, const std::vector<ListenAddress> &others = {}) noexcept;
+    /**
+     * Take over the listeners that load() left to the previous servers
+     * 
+     * Connections waiting on them are accepted by this server from now on.
+     * 
+     * @param previous servers that were passed to load()
+     */
+    void adopt(const std::vector<SSLServer *> &previous) noexcept;
 
     void listen() noexcept;
+    /**
+     * Close the listeners, while letting open connections finish
+     */
+    void stopListening() noexcept;
+    /**
+     * Get the sockets of the listeners, to pass them on to another process
+     * 
+     * @param sockets list to add each address and its socket to
+     */
+    void getSockets(std::vector<std::pair<ListenAddress, uv_os_fd_t>> &sockets) const noexcept;
 
     void setContext(ServerContext *context) { this->context = context; }
 
-    bool isLoaded() const noexcept { return wolfssl != nullptr; }
+    bool isLoaded() const noexcept { return certificates.primary != nullptr; }
+    size_t getConnections() const noexcept { return clients.size(); }
+    bool isWaiting() const noexcept { return !waiting.empty(); }
 };
 
 #endif
\ No newline at end of file
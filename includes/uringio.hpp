@@ -0,0 +1,123 @@
+#ifndef __GEMCAPS_URINGIO__
+#define __GEMCAPS_URINGIO__
+
+#include "gemcaps/fileio.hpp"
+
+#ifdef GEMCAPS_IO_URING
+
+#include <deque>
+#include <string>
+
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+
+/**
+ * File operations submitted to the kernel with io_uring.
+ *
+ * Operations started during a loop iteration are submitted together right
+ * before the loop polls, and their completions are signalled through an
+ * eventfd that the loop polls like any other handle. When the rings are full,
+ * operations wait in a backlog until earlier ones complete. When the kernel
+ * can't take the submissions yet, they are retried from a short timer.
+ */
+class UringFileIO : public FileIO {
+private:
+    enum OpType {
+        STAT,
+        STAT_OPEN,
+        OPEN,
+        READ,
+        CLOSE,
+    };
+
+    struct Op {
+        OpType type;
+        std::string path;
+        struct statx statxbuf;
+        char *buf = nullptr;
+        size_t length = 0;
+        uint64_t offset = 0;
+        uv_file fd = -1;
+        onFileResult result_cb = nullptr;
+        onFileStat stat_cb = nullptr;
+        onFileOpened opened_cb = nullptr;
+        void *ctx = nullptr;
+        // Results of a linked stat and open
+        int stat_result = 0;
+        int open_result = 0;
+        int remaining = 1;
+    };
+
+    int ring_fd = -1;
+    int event_fd = -1;
+
+    void *sq_ring = nullptr;
+    size_t sq_ring_size = 0;
+    void *cq_ring = nullptr;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    io_uring_cqe *cqes;
+    unsigned cq_mask;
+    unsigned cq_entries;
+
+    // Number of entries that have been queued but not submitted
+    unsigned unsubmitted = 0;
+    // Number of completions that are still expected from the kernel
+    unsigned expected = 0;
+    std::deque<Op *> backlog;
+
+    uv_poll_t *poll = nullptr;
+    uv_prepare_t *prepare = nullptr;
+    uv_timer_t *retry = nullptr;
+    bool referenced = false;
+
+    UringFileIO(uv_loop_t *loop)
+        : FileIO(loop) {}
+
+    bool setup(unsigned entries) noexcept;
+    void start(Op *op) noexcept;
+    bool push(Op *op) noexcept;
+    io_uring_sqe *nextSqe() noexcept;
+    void submit() noexcept;
+    void reap() noexcept;
+    void complete(Op *op, unsigned part, int result) noexcept;
+    void updateRef() noexcept;
+
+    static void __on_prepare(uv_prepare_t *handle) noexcept;
+    static void __on_poll(uv_poll_t *handle, int status, int events) noexcept;
+    static void __on_retry(uv_timer_t *handle) noexcept;
+public:
+    /**
+     * Set up io_uring for a loop
+     *
+     * @param loop loop
+     * @param entries size of the submission queue
+     *
+     * @return the file operations, or nullptr if io_uring or one of the
+     *     needed operations isn't supported
+     */
+    static UringFileIO *create(uv_loop_t *loop, unsigned entries) noexcept;
+    ~UringFileIO();
+
+    const char *getName() const noexcept { return "io_uring"; }
+
+    void stat(const std::string &path, onFileStat cb, void *ctx) noexcept;
+    void statOpen(const std::string &path, onFileOpened cb, void *ctx) noexcept;
+    void open(const std::string &path, onFileResult cb, void *ctx) noexcept;
+    void read(uv_file fd, char *buf, size_t length, uint64_t offset, onFileResult cb, void *ctx) noexcept;
+    void close(uv_file fd, onFileResult cb = nullptr, void *ctx = nullptr) noexcept;
+};
+
+#endif
+
+#endif
@@ -1,4 +1,4 @@
-// This code has been taken from https://github.com/lasselukkari/MimeTypes
+// The table of types was originally taken from https://github.com/lasselukkari/MimeTypes
 //
 // I may improve on it someday to dynamically retrieve mimetypes regardless of os, but for now
 // hardcoding them in is fine
@@ -6,20 +6,81 @@
 #define MIMETYPES_H_
 #include <string.h>
 
+#include <string>
+
+#include <yaml-cpp/yaml.h>
+
+/**
+ * Lookup of mimetypes by file extension.
+ *
+ * The built in types are indexed with a perfect hash that is generated at
+ * compile time, along with the full success header of each type, so a lookup
+ * is a hash and a single compare. Extensions are matched ignoring case.
+ *
+ * Types can be overridden or added from the config, which are checked first.
+ */
 class MimeTypes {
   public:
+    /**
+     * A known type
+     *
+     * @property mime the mimetype
+     * @property header the success header for the type, "20 <mime>\r\n"
+     * @property header_length length of the header
+     */
+    struct Type {
+      const char *mime;
+      const char *header;
+      size_t header_length;
+    };
+
+    inline static const std::string MIME_TYPES = "mimeTypes";
+
+    /**
+     * Find the type of a file
+     *
+     * @param path file name or extension
+     *
+     * @return the type, or nullptr if the extension is unknown
+     */
+    static const Type *find(const char *path) noexcept;
+    /**
+     * Get the mimetype of a file
+     *
+     * @param path file name or extension
+     *
+     * @return the mimetype, or NULL if the extension is unknown
+     */
     static const char* getType(const char * path);
+    /**
+     * Get an extension of a built in mimetype
+     *
+     * @param type mimetype
+     * @param skip number of extensions of the type to skip
+     *
+     * @return the extension, or NULL if there are no more extensions for the type
+     */
     static const char* getExtension(const char * type, int skip = 0);
 
-  private:
-    struct entry {
-      const char* fileExtension;
-      const char* mimeType;
-    };
-    static MimeTypes::entry types[349];
-    static int strcmpi(const char *s1, const char *s2);
+    /**
+     * Load the overridden types from the root config
+     *
+     * @param settings root config
+     */
+    static void load(YAML::Node settings);
+    /**
+     * Override or add the type of an extension
+     *
+     * @param extension extension without the dot
+     * @param mime mimetype, which may include parameters
+     */
+    static void set(const std::string &extension, const std::string &mime);
+    /**
+     * Remove every overridden type
+     */
+    static void clearOverrides() noexcept;
 };
 
 inline MimeTypes mimeTypes;
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,229 @@
+#ifndef __GEMCAPS_SHARED_DIRCACHE__
+#define __GEMCAPS_SHARED_DIRCACHE__
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <uv.h>
+#include <yaml-cpp/yaml.h>
+#include <parallel_hashmap/phmap.h>
+
+#include "gemcaps/metrics.hpp"
+
+class DirListing;
+
+/**
+ * Called once a directory has been listed
+ *
+ * @note the listing is only valid during the callback
+ *
+ * @param listing the directory listing
+ * @param ctx context
+ */
+typedef void (*onListingReady)(DirListing *listing, void *ctx);
+
+/**
+ * How the entries of a listing are ordered
+ *
+ * Directories are always listed before files.
+ */
+enum class ListingSort {
+    /** In the order the file system returns them */
+    NONE,
+    /** By name */
+    NAME,
+    /** Largest first */
+    SIZE,
+    /** Most recently modified first */
+    MTIME,
+};
+
+/**
+ * How a directory listing is rendered
+ *
+ * @property sort order of the entries
+ * @property size whether to show the size of files
+ * @property mtime whether to show when entries were last modified
+ */
+struct ListingOptions {
+    ListingSort sort = ListingSort::NAME;
+    bool size = false;
+    bool mtime = false;
+};
+
+/**
+ * An entry in a directory
+ *
+ * @property name name of the entry
+ * @property is_dir whether the entry is a directory
+ * @property size size in bytes
+ * @property mtime last modification time in seconds since the epoch
+ */
+struct DirItem {
+    std::string name;
+    bool is_dir;
+    uint64_t size;
+    int64_t mtime;
+};
+
+/**
+ * The cached contents of a directory, along with its rendered listings
+ */
+class DirListing {
+private:
+    struct Waiter {
+        onListingReady cb;
+        void *ctx;
+    };
+
+    std::string path;
+    std::vector<Waiter> waiters;
+    std::list<DirListing *>::iterator lru;
+    // Rendered listings by url path and options
+    phmap::flat_hash_map<std::string, std::string> rendered;
+    bool ready = false;
+    bool pending = false;
+    bool cached = true;
+
+    friend class DirCache;
+public:
+    /** Maximum number of rendered listings kept for a directory */
+    inline static const size_t MAX_RENDERED = 8;
+
+    /** 0 if the directory was read, otherwise the uv error */
+    int status = 0;
+    /** modification time of the directory when it was read */
+    uv_timespec_t mtime = {0, 0};
+    /** entries of the directory, in the order they were read */
+    std::vector<DirItem> items;
+    /** names of the index.* files in the directory, sorted by name */
+    std::vector<std::string> indexes;
+
+    DirListing(std::string path)
+        : path(path) {}
+
+    const std::string &getPath() const noexcept { return path; }
+
+    /**
+     * Render the listing as a gemtext response, including the response header
+     *
+     * The result is cached until the directory changes.
+     *
+     * @param url_path path of the directory in the request
+     * @param options how to render the listing
+     *
+     * @return the response
+     */
+    const std::string &render(const std::string &url_path, const ListingOptions &options) noexcept;
+};
+
+/**
+ * A bounded cache of directory listings.
+ *
+ * A directory is read along with the stat of each of its entries in a single
+ * threadpool job. Listings are kept until the directory's modification time
+ * changes, or the FileWatcher reports a change in the directory.
+ *
+ * @note Without a watcher, sizes and modification times shown in a listing are
+ *     only refreshed when an entry is added or removed from the directory.
+ *
+ * @note there is one cache per loop which is shared by all handlers
+ */
+class DirCache {
+private:
+    struct Scan {
+        uv_work_t work;
+        DirCache *cache;
+        DirListing *listing;
+        std::string path;
+        int status;
+        uv_timespec_t mtime;
+        std::vector<DirItem> items;
+    };
+
+    uv_loop_t *loop;
+    phmap::flat_hash_map<std::string, DirListing *> listings;
+    // Most recently used listings are at the front
+    std::list<DirListing *> lru;
+
+    metrics::Counter *hits;
+    metrics::Counter *misses;
+    metrics::Gauge *size;
+
+    inline static size_t max_listings = 256;
+
+    void evict(DirListing *listing) noexcept;
+
+    static void __scan(uv_work_t *work) noexcept;
+    static void __on_scanned(uv_work_t *work, int status) noexcept;
+    static void __on_changed(const std::string &path, void *ctx) noexcept;
+public:
+    inline static const std::string MAX_LISTINGS = "maxListings";
+
+    DirCache(uv_loop_t *loop);
+    ~DirCache();
+
+    DirCache(const DirCache &) = delete;
+    DirCache &operator=(const DirCache &) = delete;
+
+    /**
+     * Get the cache for a loop
+     *
+     * The cache is invalidated by the loop's FileWatcher.
+     *
+     * @param loop loop
+     *
+     * @return the loop's cache
+     */
+    static DirCache &get(uv_loop_t *loop) noexcept;
+    /**
+     * Load the cache settings from the root config
+     *
+     * The settings are read from the file cache's section.
+     *
+     * @param settings root config
+     */
+    static void load(YAML::Node settings);
+    /**
+     * Change the cache settings
+     *
+     * @param max_listings maximum number of directories in each cache
+     */
+    static void configure(size_t max_listings) noexcept;
+
+    /**
+     * List a directory
+     *
+     * The callback may be called before this function returns.
+     *
+     * @param path path of the directory
+     * @param mtime current modification time of the directory, a cached
+     *     listing with a different time is read again
+     * @param cb callback with the listing
+     * @param ctx context for the callback
+     */
+    void list(const std::string &path, const uv_timespec_t &mtime, onListingReady cb, void *ctx) noexcept;
+
+    /**
+     * Forget a directory so that the next listing goes to the disk
+     *
+     * @param path path of the directory
+     */
+    void invalidate(const std::string &path) noexcept;
+    /**
+     * Forget a directory and every directory in it
+     *
+     * @param path path of the directory
+     */
+    void invalidateTree(const std::string &path) noexcept;
+    /**
+     * Forget every directory
+     */
+    void clear() noexcept;
+
+    size_t getSize() const noexcept { return listings.size(); }
+};
+
+#endif
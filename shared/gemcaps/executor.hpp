@@ -3,12 +3,21 @@
 
 #include <string>
 #include <vector>
+#include <memory>
 
 #include <yaml-cpp/yaml.h>
 #include <parallel_hashmap/phmap.h>
 #include <uv.h>
 
 #include "gemcaps/util.hpp"
+#include "gemcaps/limiter.hpp"
+
+#ifndef WIN32
+// Processes are launched with posix_spawn so that the cost of launching a
+// script doesn't grow with the size of the server's heap
+#define GEMCAPS_POSIX_SPAWN
+#include <sys/types.h>
+#endif
 
 class Executor;
 
@@ -17,22 +26,153 @@ public:
     virtual void onExit(Executor *executor, int64_t exit_status, int term_signal) = 0;
 };
 
+/**
+ * A packed block of environment variables.
+ * 
+ * Each variable is stored as `NAME=value\0` in a single buffer so that a
+ * block can be built once and reused for every process without copying.
+ */
+class Environment {
+private:
+    std::vector<char> block;
+    size_t count = 0;
+public:
+    /**
+     * Add a variable to the environment
+     * 
+     * @note this does not check if the variable has already been set
+     * 
+     * @param name name of the variable
+     * @param value value of the variable
+     */
+    void set(const char *name, const char *value, size_t value_len) noexcept;
+    void set(const char *name, const std::string &value) noexcept { set(name, value.c_str(), value.length()); }
+    void set(const std::string &name, const std::string &value) noexcept { set(name.c_str(), value); }
+
+    /**
+     * Remove all variables while keeping the allocated memory
+     */
+    void clear() noexcept { block.clear(); count = 0; }
+
+    /**
+     * Get the number of variables
+     * 
+     * @return number of variables
+     */
+    size_t size() const noexcept { return count; }
+
+    /**
+     * Append a pointer to each variable to a list
+     * 
+     * @note the pointers are only valid until the environment is modified
+     * 
+     * @param pointers list to append to
+     */
+    void pointers(std::vector<char *> &pointers) const noexcept;
+};
+
+/**
+ * Resource limits to apply to a spawned process. A limit of 0 is unlimited.
+ * 
+ * @property cpu cpu time in seconds
+ * @property memory address space in bytes
+ * @property files number of open file descriptors
+ */
+struct ResourceLimits {
+    uint64_t cpu = 0;
+    uint64_t memory = 0;
+    uint64_t files = 0;
+};
+
+/**
+ * A map of file extensions to the program (and its arguments) that runs them
+ */
+typedef phmap::flat_hash_map<std::string, std::vector<std::string>> ScriptRunners;
+
+/**
+ * Resolves program names to executables on the system path.
+ * 
+ * Each directory on the path is probed directly for the program instead of
+ * being scanned. Results, including programs that could not be found, are
+ * cached and revalidated with a stat of the resolved file (or of the path
+ * directories for missing programs), so a program that gets installed or
+ * removed is picked up on the next lookup.
+ * 
+ * @warning resolving is synchronous, and should be done while loading
+ *     settings rather than while handling requests.
+ */
+class ExecutableResolver {
+private:
+    struct Stamp {
+        int64_t mtime_sec = 0;
+        int64_t mtime_nsec = 0;
+        uint64_t ino = 0;
+        bool exists = false;
+    };
+    struct Entry {
+        std::string path;
+        // The stamp of the resolved file, or of each path directory if the program was not found
+        std::vector<Stamp> stamps;
+    };
+
+    std::vector<std::string> paths;
+    phmap::flat_hash_map<std::string, Entry> cache;
+
+    static Stamp stamp(const std::string &file) noexcept;
+    static bool isExecutable(const std::string &file) noexcept;
+
+    bool valid(const Entry &entry) const noexcept;
+    Entry probe(const std::string &filename) const noexcept;
+public:
+    /**
+     * Create a resolver
+     * 
+     * @param path list of directories separated by the system's path separator
+     */
+    ExecutableResolver(const std::string &path);
+
+    /**
+     * Find the full path of a program
+     * 
+     * @param filename name of the program
+     * 
+     * @return the full path to the program, or filename if it could not be found
+     */
+    std::string resolve(const std::string &filename) noexcept;
+
+    /**
+     * Forget all resolved programs
+     */
+    void clear() noexcept { cache.clear(); }
+};
+
 class Executor {
 private:
+#ifdef GEMCAPS_POSIX_SPAWN
+    pid_t pid = 0;
+#else
     uv_process_t *process = nullptr;
+#endif
     ExecutorContext *context = nullptr;
 
-    std::string path;
     std::string cwd;
-    char *env_buf = nullptr;
-    char *args_buf = nullptr;
+    std::vector<std::string> args;
+    const Environment *base_env;
+    Environment *request_env;
 
-    char **env = nullptr;
-    char **args = nullptr;
+    std::vector<char *> argv;
+    std::vector<char *> envp;
+
+    ResourceLimits limits;
 
     bool alive = false;
 
+#ifdef GEMCAPS_POSIX_SPAWN
+    static void __on_sigchld(uv_signal_t *handle, int signum) noexcept;
+#else
     static void __on_exit(uv_process_t *process, int64_t exit_status, int term_signal) noexcept;
+#endif
+    void exited(int64_t exit_status, int term_signal) noexcept;
 public:
     /**
      * Create an executor for the given file.
@@ -40,14 +180,41 @@ public:
      * This will be able to execute a file either directly or using a secondary program specified by a configuration file.
      * 
      * @param path file to execute
-     * @param env environment variables to give the process
+     * @param env environment variables shared by all processes of the
+     *     caller. It must outlive the executor.
      * @param args arguments to give the process
+     * @param runners programs that run the file by extension. These are
+     *     checked before the global script runners.
      */
-    Executor(std::string path, const phmap::flat_hash_map<std::string, std::string> &env, std::vector<std::string> args);
+    Executor(std::string path, const Environment &env, std::vector<std::string> args, const ScriptRunners *runners = nullptr);
     ~Executor();
 
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    /**
+     * Get the environment for variables specific to this process.
+     * 
+     * These are given to the process along with the shared environment.
+     * 
+     * @return the process's environment
+     */
+    Environment &environment() noexcept { return *request_env; }
+
     void setContext(ExecutorContext *context) noexcept { this->context = context; }
 
+    /**
+     * Set the resource limits that are applied to the process when it is spawned
+     * 
+     * The limits are set in the child before it runs the script. Limits above
+     * the server's own hard limits are lowered to them.
+     * 
+     * @note limits are not supported on windows
+     * 
+     * @param limits limits
+     */
+    void setLimits(const ResourceLimits &limits) noexcept { this->limits = limits; }
+
     /**
      * Create the process
      * 
@@ -74,6 +241,21 @@ public:
      */
     bool is_alive() const noexcept { return alive; }
 
+    /**
+     * Send a signal to every process that is alive
+     * 
+     * @param signal signal to send
+     * 
+     * @return number of processes that were signaled
+     */
+    static size_t signalAll(int signal) noexcept;
+    /**
+     * Get the number of processes that are alive
+     * 
+     * @return number of processes
+     */
+    static size_t getRunning() noexcept;
+
     /**
      * Load the global settings for executors.
      * 
@@ -83,6 +265,42 @@ public:
      */
     static void load(YAML::Node settings);
 
+    /**
+     * Parse a map of script runners, resolving each program's path
+     * 
+     * @param settings settings node
+     * 
+     * @return the script runners
+     * 
+     * @throws InvalidSettingsException if the settings are invalid
+     */
+    static ScriptRunners loadRunners(YAML::Node settings);
+
+    inline static const std::string MAX_CONCURRENT = "maxConcurrentCgi";
+    inline static const std::string QUEUE_SIZE = "cgiQueueSize";
+    inline static const std::string QUEUE_TIMEOUT = "cgiQueueTimeout";
+
+    /**
+     * Load the global cgi concurrency limits.
+     * 
+     * @param settings the main config node
+     */
+    static void loadLimits(YAML::Node settings);
+
+    /**
+     * Get the limiter that is shared by all cgi scripts
+     * 
+     * @return the global limiter
+     */
+    static Limiter &limiter() noexcept;
+
+    /**
+     * Get the resolver for programs on the system path
+     * 
+     * @return the resolver
+     */
+    static ExecutableResolver &resolver() noexcept;
+
     /**
      * Find the path of an filename
      * 
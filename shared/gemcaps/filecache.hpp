@@ -0,0 +1,199 @@
+#ifndef __GEMCAPS_SHARED_FILECACHE__
+#define __GEMCAPS_SHARED_FILECACHE__
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <uv.h>
+#include <yaml-cpp/yaml.h>
+#include <parallel_hashmap/phmap.h>
+
+#include "gemcaps/metrics.hpp"
+
+class FileEntry;
+
+/**
+ * Called once a file has been looked up
+ *
+ * The entry is acquired for the callback, and must be given back with
+ * FileCache::release() once it is no longer needed.
+ *
+ * @param entry the file
+ * @param ctx context
+ */
+typedef void (*onFileReady)(FileEntry *entry, void *ctx);
+
+/**
+ * The cached stat result and open file descriptor of a file
+ */
+class FileEntry {
+private:
+    struct Waiter {
+        onFileReady cb;
+        void *ctx;
+        bool open;
+    };
+
+    std::string path;
+    std::vector<Waiter> waiters;
+    std::list<FileEntry *>::iterator lru;
+    uint64_t expires = 0;
+    size_t refs = 0;
+    bool ready = false;
+    bool pending = false;
+    bool cached = true;
+
+    friend class FileCache;
+public:
+    /** 0 if the stat succeeded, otherwise the uv error */
+    int status = 0;
+    /** stat of the file, only valid if status is 0 */
+    uv_stat_t stat;
+    /** open file descriptor, -1 if the file hasn't been or couldn't be opened */
+    uv_file fd = -1;
+    /** 0 if the file was opened, otherwise the uv error */
+    int open_status = 0;
+    /** success response header of the file, empty until a handler sends it */
+    std::string header;
+    /** id of the handler that built the header, since handlers may add different params */
+    uint64_t header_owner = 0;
+
+    FileEntry(std::string path)
+        : path(path) {}
+
+    const std::string &getPath() const noexcept { return path; }
+    bool isFile() const noexcept { return status == 0 && (stat.st_mode & S_IFMT) == S_IFREG; }
+    bool isDir() const noexcept { return status == 0 && (stat.st_mode & S_IFMT) == S_IFDIR; }
+};
+
+/**
+ * A bounded cache of stat results and open file descriptors.
+ *
+ * Concurrent lookups of the same file share a single request, and results
+ * (including missing files) are kept for a short time so that hot files don't
+ * need to go to the disk on every request. File descriptors are
+ * shared between readers, so they should only be used with positional reads.
+ *
+ * @note there is one cache per loop which is shared by all handlers
+ */
+class FileCache {
+private:
+    struct Request {
+        FileCache *cache;
+        FileEntry *entry;
+    };
+
+    uv_loop_t *loop;
+    phmap::flat_hash_map<std::string, FileEntry *> entries;
+    // Most recently used entries are at the front
+    std::list<FileEntry *> lru;
+
+    metrics::Counter *hits;
+    metrics::Counter *misses;
+    metrics::Gauge *size;
+    metrics::Gauge *open_files;
+
+    inline static uint64_t ttl = 1000;
+    inline static uint64_t watched_ttl = 60000;
+    inline static size_t max_entries = 1024;
+
+    FileEntry *lookup(const std::string &path, bool open = false) noexcept;
+    void evict(FileEntry *entry) noexcept;
+    void destroy(FileEntry *entry) noexcept;
+    void sweep() noexcept;
+    void startOpen(FileEntry *entry) noexcept;
+    void notify(FileEntry *entry, bool open) noexcept;
+    void stated(FileEntry *entry, int status, const uv_stat_t *stat) noexcept;
+    void opened(FileEntry *entry, uv_file fd) noexcept;
+
+    static void __on_stat(int status, const uv_stat_t *stat, void *ctx) noexcept;
+    static void __on_stat_open(int status, const uv_stat_t *stat, uv_file fd, void *ctx) noexcept;
+    static void __on_open(ssize_t result, void *ctx) noexcept;
+    static void __on_changed(const std::string &path, void *ctx) noexcept;
+public:
+    inline static const std::string FILE_CACHE = "fileCache";
+    inline static const std::string TTL = "ttl";
+    inline static const std::string WATCHED_TTL = "watchedTtl";
+    inline static const std::string MAX_ENTRIES = "maxEntries";
+
+    FileCache(uv_loop_t *loop);
+    ~FileCache();
+
+    FileCache(const FileCache &) = delete;
+    FileCache &operator=(const FileCache &) = delete;
+
+    /**
+     * Get the cache for a loop
+     *
+     * The cache is invalidated by the loop's FileWatcher.
+     *
+     * @param loop loop
+     *
+     * @return the loop's cache
+     */
+    static FileCache &get(uv_loop_t *loop) noexcept;
+    /**
+     * Load the cache settings from the root config
+     *
+     * @param settings root config
+     */
+    static void load(YAML::Node settings);
+    /**
+     * Change the cache settings
+     *
+     * @param ttl time in ms that entries are kept (0 only shares concurrent lookups)
+     * @param watched_ttl time in ms that entries in watched directories are kept
+     * @param max_entries maximum number of entries in each cache
+     */
+    static void configure(uint64_t ttl, uint64_t watched_ttl, size_t max_entries) noexcept;
+
+    /**
+     * Stat a file
+     *
+     * The callback may be called before this function returns.
+     *
+     * @param path path of the file
+     * @param cb callback with the entry
+     * @param ctx context for the callback
+     */
+    void stat(const std::string &path, onFileReady cb, void *ctx) noexcept;
+    /**
+     * Stat a file and open it if it is a regular file
+     *
+     * The callback may be called before this function returns.
+     *
+     * @param path path of the file
+     * @param cb callback with the entry
+     * @param ctx context for the callback
+     */
+    void open(const std::string &path, onFileReady cb, void *ctx) noexcept;
+    /**
+     * Give back an entry given to a callback
+     *
+     * @param entry entry
+     */
+    void release(FileEntry *entry) noexcept;
+
+    /**
+     * Forget a file so that the next lookup goes to the disk
+     *
+     * @param path path of the file
+     */
+    void invalidate(const std::string &path) noexcept;
+    /**
+     * Forget a file or directory and everything in it
+     *
+     * @param path path of the file or directory
+     */
+    void invalidateTree(const std::string &path) noexcept;
+    /**
+     * Forget every file
+     */
+    void clear() noexcept;
+
+    size_t getSize() const noexcept { return entries.size(); }
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef __GEMCAPS_SHARED_FILEIO__
+#define __GEMCAPS_SHARED_FILEIO__
+
+#include <cstdint>
+#include <string>
+
+#include <uv.h>
+#include <yaml-cpp/yaml.h>
+
+#include "gemcaps/metrics.hpp"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+// File operations can be submitted to the kernel with io_uring instead of
+// waiting for a thread in libuv's threadpool
+#define GEMCAPS_IO_URING
+#endif
+#endif
+
+/**
+ * Called once a file operation finishes
+ *
+ * @param result the descriptor or number of bytes, or a negative uv error
+ * @param ctx context
+ */
+typedef void (*onFileResult)(ssize_t result, void *ctx);
+/**
+ * Called once a file has been stat'd
+ *
+ * @param status 0 on success, otherwise a negative uv error
+ * @param stat stat of the file, only valid during the call if status is 0
+ * @param ctx context
+ */
+typedef void (*onFileStat)(int status, const uv_stat_t *stat, void *ctx);
+/**
+ * Called once a file has been stat'd and opened
+ *
+ * @param status 0 if the stat succeeded, otherwise a negative uv error
+ * @param stat stat of the file, only valid during the call if status is 0
+ * @param fd the open file, or a negative uv error if it wasn't opened.
+ *     Only regular files are opened.
+ * @param ctx context
+ */
+typedef void (*onFileOpened)(int status, const uv_stat_t *stat, uv_file fd, void *ctx);
+
+/**
+ * Asynchronous file operations for a loop.
+ *
+ * Every operation is read only. Callbacks are always called from the loop,
+ * never before the function returns.
+ *
+ * The default backend runs the operations in libuv's threadpool. On Linux,
+ * io_uring is used instead when the kernel supports it, which batches every
+ * operation started in a loop iteration into a single system call.
+ */
+class FileIO {
+public:
+    enum Backend {
+        AUTO,
+        THREADPOOL,
+        URING,
+    };
+private:
+    inline static Backend backend = AUTO;
+    inline static unsigned entries = 256;
+protected:
+    uv_loop_t *loop;
+    metrics::Gauge *inflight;
+
+    FileIO(uv_loop_t *loop);
+public:
+    inline static const std::string FILE_IO = "fileIO";
+    inline static const std::string BACKEND = "backend";
+    inline static const std::string ENTRIES = "entries";
+
+    virtual ~FileIO() {}
+
+    FileIO(const FileIO &) = delete;
+    FileIO &operator=(const FileIO &) = delete;
+
+    /**
+     * Get the file operations for a loop
+     *
+     * The backend is chosen the first time a loop asks for it.
+     *
+     * @param loop loop
+     *
+     * @return the loop's file operations
+     */
+    static FileIO &get(uv_loop_t *loop);
+    /**
+     * Load the file io settings from the root config
+     *
+     * @param settings root config
+     */
+    static void load(YAML::Node settings);
+    /**
+     * Change which backend new loops use
+     *
+     * @param backend backend to use, AUTO for io_uring if it is available
+     * @param entries size of each io_uring submission queue
+     */
+    static void configure(Backend backend, unsigned entries = 256) noexcept;
+
+    /**
+     * Get the name of the backend
+     *
+     * @return "io_uring" or "threadpool"
+     */
+    virtual const char *getName() const noexcept = 0;
+
+    /**
+     * Stat a file
+     *
+     * @param path path of the file
+     * @param cb callback
+     * @param ctx context for the callback
+     */
+    virtual void stat(const std::string &path, onFileStat cb, void *ctx) noexcept = 0;
+    /**
+     * Stat a file and open it for reading if it is a regular file
+     *
+     * With io_uring, the stat and open are linked and submitted together.
+     *
+     * @param path path of the file
+     * @param cb callback
+     * @param ctx context for the callback
+     */
+    virtual void statOpen(const std::string &path, onFileOpened cb, void *ctx) noexcept = 0;
+    /**
+     * Open a file for reading
+     *
+     * @param path path of the file
+     * @param cb callback with the descriptor
+     * @param ctx context for the callback
+     */
+    virtual void open(const std::string &path, onFileResult cb, void *ctx) noexcept = 0;
+    /**
+     * Read from a file at an offset
+     *
+     * @param fd file
+     * @param buf buffer to read into, which must stay valid until the callback
+     * @param length number of bytes to read
+     * @param offset where to start reading
+     * @param cb callback with the number of bytes read
+     * @param ctx context for the callback
+     */
+    virtual void read(uv_file fd, char *buf, size_t length, uint64_t offset, onFileResult cb, void *ctx) noexcept = 0;
+    /**
+     * Close a file
+     *
+     * @param fd file
+     * @param cb callback, or nullptr
+     * @param ctx context for the callback
+     */
+    virtual void close(uv_file fd, onFileResult cb = nullptr, void *ctx = nullptr) noexcept = 0;
+};
+
+#endif
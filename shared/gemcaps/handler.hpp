@@ -49,25 +49,62 @@ constexpr const StringLiteral<Size> responseHeader(int response, const char *met
     return builder;
 }
 
+/**
+ * The parameters of a titan upload
+ * 
+ * @property size the number of bytes that will be uploaded
+ * @property mime the mimetype of the uploaded content
+ * @property token the token given by the client, may be empty
+ */
+struct Upload {
+    size_t size = 0;
+    std::string mime;
+    std::string token;
+};
+
 /**
  * A gemini request.
  * 
  * @property header the full header of the request
+ * @property scheme
  * @property host
  * @property port
  * @property path 
  * @property query
+ * @property is_upload whether this is a titan upload
+ * @property upload upload parameters if this is a titan upload
  */
 struct Request {
     std::string header;
+    std::string scheme;
     std::string host;
     uint16_t port;
     std::string path;
     std::string query;
+    bool is_upload = false;
+    Upload upload;
 };
 
 class ClientConnection;
 typedef void (*onClientClose)(ClientConnection *connection, void *ctx);
+/**
+ * Called with data that the client sends after its request (the body of a titan upload)
+ * 
+ * @param connection connection
+ * @param data received data, only valid during the call
+ * @param length length of the data. A length of 0 means that the whole body has been received.
+ * @param ctx context
+ */
+typedef void (*onClientData)(ClientConnection *connection, const char *data, size_t length, void *ctx);
+/**
+ * Called whenever data sent to the client has been written
+ * 
+ * Use ClientConnection::getPending() to check how much is still waiting.
+ * 
+ * @param connection connection
+ * @param ctx context
+ */
+typedef void (*onClientDrain)(ClientConnection *connection, void *ctx);
 
 /**
  * A connection to a client.
@@ -113,6 +150,41 @@ public:
      * @param ctx context
      */
     virtual void setClientCloseCallback(onClientClose cb, void *ctx = nullptr) = 0;
+
+    /**
+     * Set the callback for the body of the request.
+     * 
+     * The body is not read until resumeData() is called.
+     * 
+     * @param cb callback
+     * @param ctx context
+     */
+    virtual void setClientDataCallback(onClientData cb, void *ctx = nullptr) = 0;
+    /**
+     * Stop reading the body from the client until resumeData() is called
+     */
+    virtual void pauseData() = 0;
+    /**
+     * Start or continue reading the body from the client
+     */
+    virtual void resumeData() = 0;
+
+    /**
+     * Get the number of bytes that have been sent but not yet written to the client
+     * 
+     * Handlers that send large responses should wait for the drain callback
+     * when this grows too large, rather than buffering the whole response.
+     * 
+     * @return number of bytes waiting to be written
+     */
+    virtual size_t getPending() const = 0;
+    /**
+     * Set the callback for when data sent to the client has been written
+     * 
+     * @param cb callback
+     * @param ctx context
+     */
+    virtual void setClientDrainCallback(onClientDrain cb, void *ctx = nullptr) = 0;
 };
 
 /**
@@ -0,0 +1,134 @@
+#ifndef __GEMCAPS_SHARED_LIMITER__
+#define __GEMCAPS_SHARED_LIMITER__
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include <uv.h>
+
+#include "gemcaps/metrics.hpp"
+
+/**
+ * Called when a queued request either acquires its slot or times out
+ *
+ * @param acquired whether the slot was acquired. If false, the deadline has
+ *     passed and the request should be rejected.
+ * @param ctx context
+ */
+typedef void (*onLimiterAcquire)(bool acquired, void *ctx);
+
+/**
+ * Limits the number of concurrent jobs.
+ *
+ * Jobs that can't be started right away wait in a bounded FIFO queue until a
+ * slot is released or their deadline passes. The timer for the deadlines only
+ * exists while jobs are waiting, so a limiter with an empty queue holds
+ * nothing on any loop.
+ */
+class Limiter {
+public:
+    enum Result {
+        /** The slot was acquired immediately */
+        ACQUIRED,
+        /** The request is waiting in the queue and the callback will be called later */
+        QUEUED,
+        /** The queue is full */
+        FULL
+    };
+private:
+    struct Waiter {
+        uint64_t ticket;
+        uint64_t queued;
+        uint64_t deadline;
+        onLimiterAcquire cb;
+        void *ctx;
+    };
+
+    size_t max_active;
+    size_t max_queue;
+    uint64_t timeout;
+
+    size_t active = 0;
+    uint64_t next_ticket = 1;
+    std::deque<Waiter> queue;
+
+    uv_loop_t *loop = nullptr;
+    uv_timer_t *timer = nullptr;
+
+    metrics::Gauge *active_gauge;
+    metrics::Gauge *depth_gauge;
+    metrics::Histogram *wait_hist;
+    metrics::Counter *rejected;
+    metrics::Counter *timeouts;
+
+    void arm() noexcept;
+    void closeTimer() noexcept;
+
+    static void __on_timer(uv_timer_t *timer) noexcept;
+public:
+    /**
+     * Create a limiter
+     *
+     * @param name name of the limiter used to label its metrics
+     * @param max_active maximum number of concurrent jobs (0 means no limit)
+     * @param max_queue maximum number of waiting jobs
+     * @param timeout maximum time in ms to wait in the queue (0 means no limit)
+     */
+    Limiter(std::string name, size_t max_active = 0, size_t max_queue = 0, uint64_t timeout = 0);
+    ~Limiter();
+
+    /**
+     * Change the limits
+     *
+     * @param max_active maximum number of concurrent jobs (0 means no limit)
+     * @param max_queue maximum number of waiting jobs
+     * @param timeout maximum time in ms to wait in the queue (0 means no limit)
+     */
+    void configure(size_t max_active, size_t max_queue, uint64_t timeout) noexcept;
+
+    /**
+     * Try to acquire a slot
+     *
+     * @param loop loop that is used to time out waiting requests
+     * @param cb callback for when a queued request acquires its slot or times out
+     * @param ctx context for the callback
+     * @param ticket set to the ticket of a queued request which can be passed to cancel()
+     * @param deadline absolute time (as uv_now()) the request may wait until.
+     *     0 uses the limiter's timeout.
+     *
+     * @return the result of the request
+     */
+    Result acquire(uv_loop_t *loop, onLimiterAcquire cb, void *ctx, uint64_t *ticket, uint64_t deadline = 0) noexcept;
+    /**
+     * Remove a request from the queue
+     *
+     * @param ticket ticket given by acquire()
+     */
+    void cancel(uint64_t ticket) noexcept;
+    /**
+     * Release a previously acquired slot
+     *
+     * If there are requests waiting, the first one will be given the slot.
+     */
+    void release() noexcept;
+
+    /**
+     * Time out all waiting requests whose deadline has passed
+     *
+     * @param now current time
+     */
+    void expire(uint64_t now) noexcept;
+
+    /**
+     * Check whether the limiter limits anything
+     *
+     * @return whether the limiter is enabled
+     */
+    bool enabled() const noexcept { return max_active > 0; }
+    size_t getActive() const noexcept { return active; }
+    size_t getQueued() const noexcept { return queue.size(); }
+    uint64_t getTimeout() const noexcept { return timeout; }
+};
+
+#endif
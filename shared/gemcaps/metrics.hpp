@@ -0,0 +1,120 @@
+#ifndef __GEMCAPS_SHARED_METRICS__
+#define __GEMCAPS_SHARED_METRICS__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Process wide metrics.
+ *
+ * Metrics are registered by name and live for the rest of the program, so
+ * references returned by the registry functions may be kept and updated
+ * directly. Labels are written as part of the name i.e.
+ * `gemcaps_cgi_queue_depth{limiter="global"}`.
+ *
+ * @note metrics are not thread safe, and should only be updated from the loop
+ */
+namespace metrics {
+
+/**
+ * A value that only increases
+ */
+class Counter {
+private:
+    uint64_t value = 0;
+public:
+    void inc(uint64_t n = 1) noexcept { value += n; }
+    uint64_t get() const noexcept { return value; }
+};
+
+/**
+ * A value that may go up and down
+ */
+class Gauge {
+private:
+    int64_t value = 0;
+public:
+    void set(int64_t v) noexcept { value = v; }
+    void inc(int64_t n = 1) noexcept { value += n; }
+    void dec(int64_t n = 1) noexcept { value -= n; }
+    int64_t get() const noexcept { return value; }
+};
+
+/**
+ * A distribution of observed values sorted into buckets
+ */
+class Histogram {
+private:
+    std::vector<double> bounds;
+    std::vector<uint64_t> buckets;
+    double sum = 0;
+    uint64_t count = 0;
+public:
+    /**
+     * Create a histogram
+     *
+     * @param bounds the upper bound of each bucket in ascending order. An
+     *     implicit +Inf bucket is always added.
+     */
+    Histogram(std::vector<double> bounds)
+        : bounds(bounds),
+          buckets(bounds.size() + 1, 0) {}
+
+    /**
+     * Record a value
+     *
+     * @param value value to record
+     */
+    void observe(double value) noexcept;
+
+    const std::vector<double> &getBounds() const noexcept { return bounds; }
+    const std::vector<uint64_t> &getBuckets() const noexcept { return buckets; }
+    double getSum() const noexcept { return sum; }
+    uint64_t getCount() const noexcept { return count; }
+};
+
+/**
+ * Bucket bounds suitable for latencies in milliseconds
+ */
+inline const std::vector<double> LATENCY_MS = {1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000};
+
+/**
+ * Get or create a counter
+ *
+ * @param name name of the metric including any labels
+ * @param help description of the metric
+ *
+ * @return the counter
+ */
+Counter &counter(const std::string &name, const std::string &help = "");
+/**
+ * Get or create a gauge
+ *
+ * @param name name of the metric including any labels
+ * @param help description of the metric
+ *
+ * @return the gauge
+ */
+Gauge &gauge(const std::string &name, const std::string &help = "");
+/**
+ * Get or create a histogram
+ *
+ * @param name name of the metric including any labels
+ * @param help description of the metric
+ * @param bounds bucket bounds if the histogram is created
+ *
+ * @return the histogram
+ */
+Histogram &histogram(const std::string &name, const std::string &help = "", const std::vector<double> &bounds = LATENCY_MS);
+
+/**
+ * Render all metrics in the prometheus text exposition format
+ *
+ * @return the rendered metrics
+ */
+std::string render();
+
+}
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef __GEMCAPS_SHARED_RATELIMITER__
+#define __GEMCAPS_SHARED_RATELIMITER__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <uv.h>
+#include <yaml-cpp/yaml.h>
+
+#include "gemcaps/metrics.hpp"
+
+/**
+ * Limits how often each client address may make requests.
+ *
+ * Every address has a token bucket which refills at a steady rate up to a
+ * burst, and each request takes a token. IPv6 addresses are grouped by their
+ * prefix, since a single client usually has a whole /64.
+ *
+ * The buckets are kept in a count-min sketch instead of a table of addresses,
+ * so memory stays fixed no matter how many addresses connect. An address uses
+ * one bucket in each row of the sketch and has as many tokens as the fullest
+ * of them, so addresses that share buckets can only be limited early, never
+ * late.
+ *
+ * @note there is one limiter per loop
+ */
+class RateLimiter {
+public:
+    /** Number of rows in the sketch */
+    inline static const size_t ROWS = 4;
+private:
+    struct Bucket {
+        double tokens;
+        uint64_t updated;
+    };
+
+    inline static double rate = 0;
+    inline static double burst = 10;
+    inline static unsigned ipv6_prefix = 64;
+    inline static size_t width = 4096;
+    // Bumped by every configure, so limiters know to start over
+    inline static unsigned long settings_version = 0;
+
+    uv_loop_t *loop;
+    std::vector<Bucket> buckets;
+    // Settings version the buckets were filled with
+    unsigned long buckets_version = 0;
+
+    metrics::Counter *limited_accepts;
+    metrics::Counter *limited_requests;
+
+    /**
+     * Find the bucket of an address in each row
+     *
+     * @param addr address
+     * @param rows the index of the bucket in each row
+     *
+     * @return whether the address could be keyed
+     */
+    bool find(const sockaddr *addr, size_t (&rows)[ROWS]) noexcept;
+    /**
+     * Refill a bucket up to now
+     */
+    void refill(Bucket &bucket, uint64_t now) const noexcept;
+public:
+    inline static const std::string RATE_LIMIT = "rateLimit";
+    inline static const std::string RATE = "rate";
+    inline static const std::string BURST = "burst";
+    inline static const std::string IPV6_PREFIX = "ipv6Prefix";
+    inline static const std::string SIZE = "size";
+
+    RateLimiter(uv_loop_t *loop);
+
+    RateLimiter(const RateLimiter &) = delete;
+    RateLimiter &operator=(const RateLimiter &) = delete;
+
+    /**
+     * Get the limiter for a loop
+     *
+     * @param loop loop
+     *
+     * @return the loop's limiter
+     */
+    static RateLimiter &get(uv_loop_t *loop) noexcept;
+    /**
+     * Load the limiter settings from the root config
+     *
+     * @param settings root config
+     */
+    static void load(YAML::Node settings);
+    /**
+     * Change the limiter settings
+     *
+     * Limiters forget every address the next time they are used.
+     *
+     * @param rate tokens added to each bucket per second (0 means no limit)
+     * @param burst most tokens a bucket can hold
+     * @param ipv6_prefix number of bits of IPv6 addresses that identify a client
+     * @param width number of buckets in each row of the sketch
+     */
+    static void configure(double rate, double burst = 10, unsigned ipv6_prefix = 64, size_t width = 4096) noexcept;
+    /**
+     * Check if limiting is enabled
+     *
+     * @return whether there is a rate limit
+     */
+    static bool enabled() noexcept { return rate > 0; }
+
+    /**
+     * Check if an address is out of tokens, without taking one
+     *
+     * This is meant for new connections, so that limited clients can be turned
+     * away before the TLS handshake.
+     *
+     * @param addr address of the client
+     *
+     * @return whether the address is limited
+     */
+    bool limited(const sockaddr *addr) noexcept;
+    /**
+     * Take a token for a request
+     *
+     * @param addr address of the client
+     * @param retry_after set to the number of seconds until a token is available
+     *     if the request is limited
+     *
+     * @return whether the request is allowed
+     */
+    bool take(const sockaddr *addr, unsigned *retry_after = nullptr) noexcept;
+};
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef __GEMCAPS_SHARED_THREADPOOL__
+#define __GEMCAPS_SHARED_THREADPOOL__
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include <uv.h>
+#include <yaml-cpp/yaml.h>
+
+#include "gemcaps/metrics.hpp"
+
+/**
+ * Work for libuv's threadpool, split into lanes.
+ *
+ * Each lane may only use some of the pool's threads at once, and queues the
+ * rest of its work in order. As long as the lanes' shares don't add up to more
+ * than the size of the pool, a burst in one lane (like a slow directory scan)
+ * can't hold up work in another (like small file reads).
+ *
+ * @note there is one pool per loop, but every loop shares libuv's threads
+ */
+class ThreadPool {
+public:
+    enum Lane {
+        /** stat, open, and close */
+        METADATA,
+        /** reading files */
+        READ,
+        /** scanning directories and other slow work */
+        SCAN,
+        /** TLS handshakes, which only use the pool if the lane is given threads */
+        HANDSHAKE,
+        LANE_COUNT
+    };
+private:
+    struct Job {
+        uv_work_t work;
+        ThreadPool *pool;
+        Lane lane;
+        uint64_t queued;
+        uv_work_t *req;
+        uv_work_cb work_cb;
+        uv_after_work_cb after_cb;
+    };
+
+    struct LaneState {
+        size_t active = 0;
+        std::deque<Job *> queue;
+
+        metrics::Gauge *active_gauge;
+        metrics::Gauge *depth_gauge;
+        metrics::Histogram *wait_hist;
+    };
+
+    inline static unsigned size = 0;
+    inline static unsigned shares[LANE_COUNT] = {0, 0, 0, 0};
+
+    uv_loop_t *loop;
+    LaneState lanes[LANE_COUNT];
+
+    void start(Job *job) noexcept;
+
+    static void __work(uv_work_t *work) noexcept;
+    static void __after_work(uv_work_t *work, int status) noexcept;
+public:
+    inline static const std::string THREADPOOL = "threadpool";
+    inline static const std::string SIZE = "size";
+    inline static const std::string LANES = "lanes";
+    inline static const std::string LANE_METADATA = "metadata";
+    inline static const std::string LANE_READ = "read";
+    inline static const std::string LANE_SCAN = "scan";
+    inline static const std::string LANE_HANDSHAKE = "handshake";
+
+    /** libuv's limit on the size of its threadpool */
+    inline static const unsigned MAX_SIZE = 1024;
+
+    ThreadPool(uv_loop_t *loop);
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * Get the pool for a loop
+     *
+     * @param loop loop
+     *
+     * @return the loop's pool
+     */
+    static ThreadPool &get(uv_loop_t *loop) noexcept;
+    /**
+     * Load the pool settings from the root config
+     *
+     * The size only reaches libuv through exportSize().
+     *
+     * @param settings root config
+     */
+    static void load(YAML::Node settings);
+    /**
+     * Pass the size of the pool on to libuv through UV_THREADPOOL_SIZE
+     *
+     * This must be called before anything is queued, since libuv starts its
+     * threads the first time work is queued, and can't be resized after.
+     */
+    static void exportSize() noexcept;
+    /**
+     * Size the pool and its lanes
+     *
+     * @param size number of threads, 0 for UV_THREADPOOL_SIZE if it is set,
+     *     or the number of cpus (but at least 4)
+     * @param metadata threads the metadata lane may use, 0 for a quarter of the pool
+     * @param read threads the read lane may use, 0 for half of the pool
+     * @param scan threads the scan lane may use, 0 for a quarter of the pool
+     * @param handshake threads the handshake lane may use, 0 to do handshakes
+     *     on the loop instead
+     */
+    static void configure(unsigned size = 0, unsigned metadata = 0, unsigned read = 0, unsigned scan = 0, unsigned handshake = 0) noexcept;
+    /**
+     * Get the number of threads in libuv's pool
+     *
+     * @return the size of the pool
+     */
+    static unsigned getSize() noexcept;
+    /**
+     * Get the number of threads a lane may use at once
+     *
+     * @param lane lane
+     *
+     * @return the lane's share of the pool, which is only 0 for a handshake
+     *     lane that isn't used
+     */
+    static unsigned getShare(Lane lane) noexcept;
+
+    /**
+     * Queue work in a lane
+     *
+     * This works like uv_queue_work(). The work may wait in the lane before it
+     * is given to libuv.
+     *
+     * @param lane lane
+     * @param req request, whose data is left alone
+     * @param work_cb work to run in the pool
+     * @param after_cb callback on the loop once the work is done
+     */
+    void queue(Lane lane, uv_work_t *req, uv_work_cb work_cb, uv_after_work_cb after_cb) noexcept;
+
+    size_t getActive(Lane lane) const noexcept { return lanes[lane].active; }
+    size_t getQueued(Lane lane) const noexcept { return lanes[lane].queue.size(); }
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef __GEMCAPS_SHARED_TIMERWHEEL__
+#define __GEMCAPS_SHARED_TIMERWHEEL__
+
+#include <cstdint>
+#include <vector>
+
+#include <uv.h>
+
+class TimerWheel;
+
+/**
+ * Called when a timer expires
+ *
+ * @param ctx context
+ */
+typedef void (*onWheelTimeout)(void *ctx);
+
+/**
+ * A timer on a TimerWheel.
+ *
+ * The timer is meant to be embedded in whatever it times out, so arming it
+ * never allocates. It is stopped when it is destroyed.
+ */
+class WheelTimer {
+private:
+    WheelTimer *prev = this;
+    WheelTimer *next = this;
+    // Tick that the timer expires on
+    uint64_t deadline = 0;
+    TimerWheel *wheel = nullptr;
+
+    onWheelTimeout cb;
+    void *ctx;
+
+    friend class TimerWheel;
+public:
+    WheelTimer(onWheelTimeout cb = nullptr, void *ctx = nullptr)
+        : cb(cb), ctx(ctx) {}
+    ~WheelTimer() noexcept { stop(); }
+
+    WheelTimer(const WheelTimer &) = delete;
+    WheelTimer &operator=(const WheelTimer &) = delete;
+
+    /**
+     * Change what the timer calls when it expires
+     *
+     * @param cb callback
+     * @param ctx context for the callback
+     */
+    void setCallback(onWheelTimeout cb, void *ctx = nullptr) noexcept { this->cb = cb; this->ctx = ctx; }
+    /**
+     * Stop the timer if it is running
+     */
+    void stop() noexcept;
+    /**
+     * Check if the timer is running
+     *
+     * @return whether the timer is waiting to expire
+     */
+    bool isActive() const noexcept { return wheel != nullptr; }
+};
+
+/**
+ * A hashed timer wheel, for lots of timeouts that are reset often.
+ *
+ * Timers are kept in a ring of slots by the tick that they expire on, so
+ * starting, resetting, and stopping a timer only links or unlinks it from a
+ * slot. A single libuv timer advances the wheel one tick at a time, and only
+ * runs while there are timers on the wheel. Timers that are further out than
+ * one turn of the wheel stay in their slot until their turn comes.
+ *
+ * Timers expire up to one tick late, so the wheel is only suited to coarse
+ * timeouts like those of connections.
+ *
+ * @note there is one wheel per loop
+ */
+class TimerWheel {
+private:
+    uv_loop_t *loop;
+    uv_timer_t *timer;
+    uint64_t tick;
+    // The heads of each slot's circular list
+    std::vector<WheelTimer> slots;
+    // The last tick that was processed
+    uint64_t current;
+    size_t active = 0;
+    bool running = false;
+
+    /**
+     * Expire the timers due by the current time
+     */
+    void advance() noexcept;
+
+    static void unlink(WheelTimer *timer) noexcept;
+    static void link(WheelTimer *head, WheelTimer *timer) noexcept;
+
+    static void __on_tick(uv_timer_t *timer) noexcept;
+
+    friend class WheelTimer;
+public:
+    /** Default resolution of a wheel in ms */
+    inline static const uint64_t DEFAULT_TICK = 100;
+    /** Default number of slots in a wheel */
+    inline static const size_t DEFAULT_SLOTS = 512;
+
+    /**
+     * Create a wheel
+     *
+     * @param loop loop
+     * @param tick resolution of the timers in ms
+     * @param slots number of slots, the ticks in one turn of the wheel
+     */
+    TimerWheel(uv_loop_t *loop, uint64_t tick = DEFAULT_TICK, size_t slots = DEFAULT_SLOTS);
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    /**
+     * Get the wheel for a loop
+     *
+     * @param loop loop
+     *
+     * @return the loop's wheel
+     */
+    static TimerWheel &get(uv_loop_t *loop) noexcept;
+
+    /**
+     * Start a timer, or restart it if it is already running
+     *
+     * @param timer timer
+     * @param timeout time in ms until the timer expires
+     */
+    void start(WheelTimer &timer, uint64_t timeout) noexcept;
+
+    size_t getActive() const noexcept { return active; }
+};
+
+#endif
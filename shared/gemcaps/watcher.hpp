@@ -0,0 +1,143 @@
+#ifndef __GEMCAPS_SHARED_WATCHER__
+#define __GEMCAPS_SHARED_WATCHER__
+
+#include <string>
+#include <vector>
+
+#include <uv.h>
+#include <parallel_hashmap/phmap.h>
+
+#include "gemcaps/metrics.hpp"
+
+/**
+ * Called when something in a watched directory changes
+ *
+ * The directory containing the path has changed as well.
+ *
+ * @param path the file or directory that changed, along with anything in it
+ * @param ctx context
+ */
+typedef void (*onFileChanged)(const std::string &path, void *ctx);
+
+/**
+ * Watches folders for changes so that caches can be invalidated as soon as a
+ * file changes.
+ *
+ * Every directory below a watched folder is watched, and new directories are
+ * watched as they are created. Folders are scanned for their directories in
+ * the threadpool, and are only fully watched once the scan is done.
+ *
+ * @note there is one watcher per loop
+ */
+class FileWatcher {
+private:
+    struct Watch {
+        uv_fs_event_t handle;
+        std::string dir;
+        FileWatcher *watcher;
+    };
+
+    struct Check {
+        uv_fs_t req;
+        std::string path;
+        FileWatcher *watcher;
+    };
+
+    struct Scan {
+        uv_work_t work;
+        std::string dir;
+        // Every directory below dir
+        std::vector<std::string> dirs;
+        FileWatcher *watcher;
+    };
+
+    uv_loop_t *loop;
+    phmap::flat_hash_map<std::string, Watch *> watches;
+    // Watched folders, by the number of times they were watched
+    phmap::flat_hash_map<std::string, size_t> roots;
+    phmap::flat_hash_set<Scan *> scans;
+    phmap::flat_hash_set<Check *> checks;
+    std::vector<std::pair<onFileChanged, void *>> listeners;
+
+    metrics::Gauge *watched;
+    metrics::Counter *events;
+
+    /**
+     * Check whether a directory is in one of the watched folders
+     */
+    bool isCovered(const std::string &dir) const noexcept;
+    /**
+     * Watch a single directory
+     */
+    void watchDir(const std::string &dir) noexcept;
+    void watchTree(const std::string &dir) noexcept;
+    void unwatchTree(const std::string &dir) noexcept;
+    void notify(const std::string &path) noexcept;
+
+    static void __on_event(uv_fs_event_t *handle, const char *filename, int events, int status) noexcept;
+    static void __on_check(uv_fs_t *req) noexcept;
+    static void __on_close(uv_handle_t *handle) noexcept;
+    static void __scan(uv_work_t *work) noexcept;
+    static void __on_scanned(uv_work_t *work, int status) noexcept;
+public:
+    FileWatcher(uv_loop_t *loop);
+    ~FileWatcher();
+
+    FileWatcher(const FileWatcher &) = delete;
+    FileWatcher &operator=(const FileWatcher &) = delete;
+
+    /**
+     * Get the watcher for a loop
+     *
+     * @param loop loop
+     *
+     * @return the loop's watcher
+     */
+    static FileWatcher &get(uv_loop_t *loop) noexcept;
+
+    /**
+     * Watch a folder and everything in it
+     *
+     * A folder may be watched more than once, and is watched until unwatch()
+     * has been called as many times.
+     *
+     * @param folder folder to watch
+     */
+    void watch(const std::string &folder) noexcept;
+    /**
+     * Stop watching a folder, unless it was watched again since
+     *
+     * Directories that are in another watched folder stay watched.
+     *
+     * @param folder folder given to watch()
+     */
+    void unwatch(const std::string &folder) noexcept;
+    /**
+     * Check whether changes to a path will be noticed
+     *
+     * @param path file or directory
+     *
+     * @return whether the path is being watched
+     */
+    bool isWatched(const std::string &path) const noexcept;
+
+    /**
+     * Get notified when a watched file changes
+     *
+     * @param cb callback
+     * @param ctx context for the callback
+     */
+    void addListener(onFileChanged cb, void *ctx = nullptr) noexcept;
+    /**
+     * Stop getting notified of changes
+     *
+     * @param cb callback
+     * @param ctx context given to addListener()
+     */
+    void removeListener(onFileChanged cb, void *ctx = nullptr) noexcept;
+
+    size_t getWatched() const noexcept { return watches.size(); }
+    bool isScanning() const noexcept { return !scans.empty(); }
+};
+
+#endif
@@ -1,79 +1,26 @@
 #include "gemcaps/MimeTypes.h"
 
-const char* MimeTypes::getType(const char * extension)  {
-  const char *dot = strrchr(extension, '.');
-  if (dot) {
-    if ( dot != extension) {
-      extension = dot;
-    }
-
-    extension++;
-  }
-
-  int min = 0;
-  int max = (sizeof(types) / sizeof(*types) - 1);
-
-  while (min <= max) {
-    int i = (int)(((max + min) / 2) + 0.5);
-    int order = strcmpi(extension, types[i].fileExtension);
-
-    if (order == 0) {
-      return types[i].mimeType;
-    } else if (order > 0) {
-      min = i + 1;
-    } else {
-      max = i - 1;
-    }
-  }
-
-  return NULL;
-}
-
-const char* MimeTypes::getExtension(const char * type, int skip)  {
-  int length = (sizeof(types) / sizeof(*types));
-
-  for (int i = 0; i < length; i++) {
-    if (strcmpi(type, types[i].mimeType) == 0) {
-      if (skip-- <= 0) {
-        return types[i].fileExtension;
-      }
-    }
-  }
+#include <cstdint>
+#include <memory>
 
-  return NULL;
-}
+#include <parallel_hashmap/phmap.h>
 
-// https://www.geeksforgeeks.org/write-your-own-strcmp-which-ignores-cases/
-int MimeTypes::strcmpi(const char *s1, const char *s2) {
-  int i;
+#include "gemcaps/handler.hpp"
+#include "gemcaps/settings.hpp"
 
-  for (i = 0; s1[i] && s2[i]; ++i) {
-    if (s1[i] == s2[i] || (s1[i] ^ 32) == s2[i]) {
-      continue;
-    } else {
-      break;
-    }
-  }
+using std::string;
+using std::unique_ptr;
 
-  if (s1[i] == s2[i]) {
-    return 0;
-  }
 
-  if ((s1[i] | 32) < (s2[i] | 32)) {
-    return -1;
-  }
+namespace {
 
-  return 1;
-}
+struct Entry {
+  const char *fileExtension;
+  const char *mimeType;
+};
 
 // Source: https://raw.githubusercontent.com/broofa/node-mime/master/types/standard.json
-MimeTypes::entry MimeTypes::types[] =  {
-  {"*3gpp", "audio/3gpp"},
-  {"*jpm", "video/jpm"},
-  {"*mp3", "audio/mp3"},
-  {"*rtf", "text/rtf"},
-  {"*wav", "audio/wave"},
-  {"*xml", "text/xml"},
+constexpr Entry types[] = {
   {"3g2", "video/3gpp2"},
   {"3gp", "video/3gpp"},
   {"3gpp", "video/3gpp"},
@@ -417,4 +364,306 @@ MimeTypes::entry MimeTypes::types[] =  {
   {"yin", "application/yin+xml"},
   {"yml", "text/yaml"},
   {"zip", "application/zip"},
-};
\ No newline at end of file
+};
+
+constexpr size_t TYPE_COUNT = sizeof(types) / sizeof(*types);
+// Longest built in extension that can be looked up
+constexpr size_t MAX_EXTENSION = 32;
+
+constexpr char lower(char c) {
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/**
+ * Seeded FNV-1a over the lowercase string, with a murmur finalizer
+ */
+constexpr uint32_t hash(const char *key, size_t length, uint32_t seed) {
+  uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+  for (size_t i = 0; i < length; ++i) {
+    h ^= (unsigned char)lower(key[i]);
+    h *= 16777619u;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+constexpr size_t length(const char *text) {
+  size_t l = 0;
+  while (text[l] != '\0') ++l;
+  return l;
+}
+
+constexpr bool equals(const char *a, const char *b) {
+  size_t i = 0;
+  while (a[i] != '\0' && a[i] == b[i]) ++i;
+  return a[i] == b[i];
+}
+
+/**
+ * A perfect hash of a set of keys, made with hash and displace.
+ *
+ * Keys are split into buckets by their unseeded hash, then each bucket (from
+ * largest to smallest) gets the first seed that puts all of its keys into
+ * free slots.
+ */
+template<size_t Buckets, size_t Slots>
+struct PerfectHash {
+  static constexpr size_t MAX_BUCKET = 16;
+
+  uint16_t seeds[Buckets] = {};
+  int16_t slots[Slots] = {};
+  bool complete = false;
+
+  /**
+   * Find the slot a key would be in
+   *
+   * @return the index of the key that is in the slot, or -1 if it is empty
+   */
+  constexpr int16_t find(const char *key, size_t length) const {
+    uint32_t bucket = hash(key, length, 0) % Buckets;
+    return slots[hash(key, length, seeds[bucket] + 1) % Slots];
+  }
+};
+
+/**
+ * Build a perfect hash of the keys, skipping null keys
+ */
+template<size_t Buckets, size_t Slots, size_t N>
+constexpr PerfectHash<Buckets, Slots> build(const char *const (&keys)[N]) {
+  using Hash = PerfectHash<Buckets, Slots>;
+  Hash index;
+  for (size_t i = 0; i < Slots; ++i) {
+    index.slots[i] = -1;
+  }
+
+  int16_t members[Buckets][Hash::MAX_BUCKET] = {};
+  size_t sizes[Buckets] = {};
+  for (size_t i = 0; i < N; ++i) {
+    if (keys[i] == nullptr) {
+      continue;
+    }
+    uint32_t bucket = hash(keys[i], length(keys[i]), 0) % Buckets;
+    if (sizes[bucket] == Hash::MAX_BUCKET) {
+      return index;
+    }
+    members[bucket][sizes[bucket]++] = i;
+  }
+
+  for (size_t size = Hash::MAX_BUCKET; size > 0; --size) {
+    for (size_t bucket = 0; bucket < Buckets; ++bucket) {
+      if (sizes[bucket] != size) {
+        continue;
+      }
+      bool placed = false;
+      for (uint32_t seed = 0; seed < UINT16_MAX && !placed; ++seed) {
+        uint32_t taken[Hash::MAX_BUCKET] = {};
+        placed = true;
+        for (size_t m = 0; m < size && placed; ++m) {
+          const char *key = keys[members[bucket][m]];
+          uint32_t slot = hash(key, length(key), seed + 1) % Slots;
+          placed = index.slots[slot] == -1;
+          for (size_t t = 0; t < m && placed; ++t) {
+            placed = taken[t] != slot;
+          }
+          taken[m] = slot;
+        }
+        if (placed) {
+          index.seeds[bucket] = seed;
+          for (size_t m = 0; m < size; ++m) {
+            index.slots[taken[m]] = members[bucket][m];
+          }
+        }
+      }
+      if (!placed) {
+        return index;
+      }
+    }
+  }
+  index.complete = true;
+  return index;
+}
+
+struct Keys {
+  const char *extensions[TYPE_COUNT] = {};
+  // Only the first extension of each mimetype, so that every key is unique
+  const char *mimes[TYPE_COUNT] = {};
+  // The next extension with the same mimetype, or -1
+  int16_t next[TYPE_COUNT] = {};
+};
+
+constexpr Keys makeKeys() {
+  Keys keys;
+  for (size_t i = 0; i < TYPE_COUNT; ++i) {
+    keys.extensions[i] = types[i].fileExtension;
+    keys.next[i] = -1;
+    bool first = true;
+    for (size_t j = 0; j < i && first; ++j) {
+      first = !equals(types[j].mimeType, types[i].mimeType);
+    }
+    keys.mimes[i] = first ? types[i].mimeType : nullptr;
+    for (size_t j = i + 1; j < TYPE_COUNT; ++j) {
+      if (equals(types[j].mimeType, types[i].mimeType)) {
+        keys.next[i] = j;
+        break;
+      }
+    }
+  }
+  return keys;
+}
+
+constexpr Keys KEYS = makeKeys();
+constexpr auto EXTENSIONS = build<TYPE_COUNT / 2, 512>(KEYS.extensions);
+constexpr auto MIMES = build<TYPE_COUNT / 2, 512>(KEYS.mimes);
+static_assert(EXTENSIONS.complete, "Could not build a perfect hash of the extensions");
+static_assert(MIMES.complete, "Could not build a perfect hash of the mimetypes");
+
+// Longest built in header, "20 " + mimetype + "\r\n"
+constexpr size_t HEADER_SIZE = 64;
+
+struct Headers {
+  StringLiteral<HEADER_SIZE> headers[TYPE_COUNT];
+};
+
+constexpr Headers makeHeaders() {
+  Headers headers;
+  for (size_t i = 0; i < TYPE_COUNT; ++i) {
+    headers.headers[i] = responseHeader<HEADER_SIZE>(RES_SUCCESS, types[i].mimeType);
+  }
+  return headers;
+}
+
+constexpr Headers HEADERS = makeHeaders();
+
+struct Types {
+  MimeTypes::Type types[TYPE_COUNT] = {};
+};
+
+constexpr Types makeTypes() {
+  Types built;
+  for (size_t i = 0; i < TYPE_COUNT; ++i) {
+    built.types[i] = {types[i].mimeType, HEADERS.headers[i].buf, HEADERS.headers[i].length()};
+  }
+  return built;
+}
+
+constexpr Types TYPES = makeTypes();
+
+/**
+ * A type from the config
+ */
+struct Override {
+  string mime;
+  string header;
+  MimeTypes::Type type;
+};
+
+phmap::flat_hash_map<string, unique_ptr<Override>> overrides;
+
+/**
+ * Get the extension of a file
+ */
+const char *extensionOf(const char *path) {
+  const char *dot = strrchr(path, '.');
+  if (dot) {
+    if (dot != path) {
+      path = dot;
+    }
+    path++;
+  }
+  return path;
+}
+
+}
+
+const MimeTypes::Type *MimeTypes::find(const char *path) noexcept {
+  const char *extension = extensionOf(path);
+  size_t len = strlen(extension);
+
+  if (!overrides.empty()) {
+    char key[MAX_EXTENSION];
+    if (len < MAX_EXTENSION) {
+      for (size_t i = 0; i < len; ++i) {
+        key[i] = lower(extension[i]);
+      }
+      auto found = overrides.find(string(key, len));
+      if (found != overrides.end()) {
+        return &found->second->type;
+      }
+    }
+  }
+
+  int16_t index = EXTENSIONS.find(extension, len);
+  if (index < 0) {
+    return nullptr;
+  }
+  const char *key = types[index].fileExtension;
+  for (size_t i = 0; i < len; ++i) {
+    if (key[i] != lower(extension[i])) {
+      return nullptr;
+    }
+  }
+  if (key[len] != '\0') {
+    return nullptr;
+  }
+  return &TYPES.types[index];
+}
+
+const char* MimeTypes::getType(const char * path) {
+  const Type *type = find(path);
+  return type != nullptr ? type->mime : NULL;
+}
+
+const char* MimeTypes::getExtension(const char * type, int skip) {
+  int16_t index = MIMES.find(type, strlen(type));
+  if (index < 0 || strcasecmp(types[index].mimeType, type) != 0) {
+    return NULL;
+  }
+  while (skip-- > 0 && index >= 0) {
+    index = KEYS.next[index];
+  }
+  return index >= 0 ? types[index].fileExtension : NULL;
+}
+
+void MimeTypes::load(YAML::Node settings) {
+  if (!settings[MIME_TYPES].IsDefined()) {
+    return;
+  }
+  YAML::Node types = settings[MIME_TYPES];
+  if (!types.IsMap()) {
+    throw InvalidSettingsException(types.Mark(), "'" + MIME_TYPES + "' must be a map of extensions to mimetypes");
+  }
+  for (auto type : types) {
+    string extension = type.first.as<string>();
+    if (!extension.empty() && extension.front() == '.') {
+      extension.erase(0, 1);
+    }
+    if (extension.empty() || extension.length() >= MAX_EXTENSION) {
+      throw InvalidSettingsException(type.first.Mark(), "Extensions must be between 1 and " + std::to_string(MAX_EXTENSION - 1) + " characters");
+    }
+    string mime = type.second.as<string>();
+    if (mime.empty() || mime.find_first_of("\r\n") != string::npos) {
+      throw InvalidSettingsException(type.second.Mark(), "Invalid mimetype for '" + extension + "'");
+    }
+    set(extension, mime);
+  }
+}
+
+void MimeTypes::set(const string &extension, const string &mime) {
+  string key = extension;
+  for (char &c : key) {
+    c = lower(c);
+  }
+  unique_ptr<Override> type = std::make_unique<Override>();
+  type->mime = mime;
+  type->header = "20 " + mime + "\r\n";
+  type->type = {type->mime.c_str(), type->header.c_str(), type->header.length()};
+  overrides[key] = std::move(type);
+}
+
+void MimeTypes::clearOverrides() noexcept {
+  overrides.clear();
+}
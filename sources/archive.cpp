@@ -0,0 +1,511 @@
+#include "archive.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <uv.h>
+
+#include "gemcaps/handler.hpp"
+#include "gemcaps/pathutils.hpp"
+#include "gemcaps/MimeTypes.h"
+#include "gemcaps/dircache.hpp"
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::runtime_error;
+
+// Give up on building the index if a bucket can't be placed after this many seeds
+const uint32_t MAX_SEED = 1 << 26;
+// Number of paths per bucket of the index
+const size_t BUCKET_SIZE = 4;
+
+
+uint64_t Archive::hash(const char *data, size_t length, uint64_t seed) noexcept {
+    // FNV-1a with the seed mixed into the offset basis, followed by a
+    // finalizer so that every seed gives an independent hash
+    uint64_t h = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < length; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Reading
+//
+////////////////////////////////////////////////////////////////////////////////
+
+Archive::~Archive() {
+    if (data != nullptr) {
+        munmap(const_cast<char *>(data), size);
+    }
+}
+
+shared_ptr<Archive> Archive::open(const string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw runtime_error("Could not open '" + path + "': " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int error = errno;
+        ::close(fd);
+        throw runtime_error("Could not stat '" + path + "': " + strerror(error));
+    }
+    if (st.st_size < static_cast<off_t>(sizeof(Header))) {
+        ::close(fd);
+        throw runtime_error("'" + path + "' is not an archive");
+    }
+
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int error = errno;
+    // The mapping keeps the file alive
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        throw runtime_error("Could not map '" + path + "': " + strerror(error));
+    }
+#ifdef MADV_WILLNEED
+    madvise(mapped, st.st_size, MADV_WILLNEED);
+#endif
+
+    shared_ptr<Archive> archive(new Archive(path));
+    archive->data = static_cast<const char *>(mapped);
+    archive->size = st.st_size;
+    archive->validate();
+    return archive;
+}
+
+/**
+ * Check that a range lies within the archive
+ */
+static bool in_bounds(uint64_t offset, uint64_t length, uint64_t size) {
+    return offset <= size && length <= size - offset;
+}
+
+void Archive::validate() {
+    header = reinterpret_cast<const Header *>(data);
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw runtime_error("'" + path + "' is not an archive");
+    }
+    if (header->version != VERSION) {
+        throw runtime_error("'" + path + "' has an unsupported version " + std::to_string(header->version));
+    }
+    if (header->size != size) {
+        throw runtime_error("'" + path + "' is truncated");
+    }
+    if (header->count == 0 || header->buckets == 0
+            || header->seeds_offset % alignof(uint32_t) != 0
+            || header->entries_offset % alignof(Entry) != 0
+            || !in_bounds(header->seeds_offset, uint64_t(header->buckets) * sizeof(uint32_t), size)
+            || !in_bounds(header->entries_offset, uint64_t(header->count) * sizeof(Entry), size)) {
+        throw runtime_error("'" + path + "' has an invalid index");
+    }
+    seeds = reinterpret_cast<const uint32_t *>(data + header->seeds_offset);
+    entries = reinterpret_cast<const Entry *>(data + header->entries_offset);
+
+    for (uint32_t i = 0; i < header->count; ++i) {
+        const Entry &entry = entries[i];
+        if (!in_bounds(entry.path_offset, entry.path_length, size)
+                || !in_bounds(entry.response_offset, entry.response_length, size)
+                || entry.header_length > entry.response_length
+                || entry.kind > DIRECTORY) {
+            throw runtime_error("'" + path + "' has an invalid entry");
+        }
+    }
+}
+
+const Archive::Entry *Archive::find(const string &path) const noexcept {
+    uint32_t bucket = hash(path.c_str(), path.length(), 0) % header->buckets;
+    const Entry &entry = entries[hash(path.c_str(), path.length(), seeds[bucket]) % header->count];
+    // Paths that aren't in the archive land on some other entry
+    if (entry.path_length != path.length() || memcmp(data + entry.path_offset, path.c_str(), path.length()) != 0) {
+        return nullptr;
+    }
+    return &entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Packing
+//
+////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+struct PackItem {
+    string path;
+    Archive::Kind kind;
+    // File to read the body from
+    string file;
+    uint64_t size = 0;
+    // Response header, and the body if it isn't read from a file
+    string header;
+    string body;
+    // Item whose response a directory shares (its index file)
+    int alias = -1;
+    Archive::Entry entry = {};
+};
+
+class Packer {
+private:
+    const string output;
+    const PackOptions &options;
+    std::set<std::pair<uint64_t, uint64_t>> visited;
+public:
+    vector<PackItem> items;
+
+    Packer(string output, const PackOptions &options)
+        : output(output),
+          options(options) {}
+
+    void walk(const string &dir, const string &rel) {
+        uv_fs_t req;
+        int result = uv_fs_stat(nullptr, &req, dir.c_str(), nullptr);
+        uv_stat_t dir_stat = req.statbuf;
+        uv_fs_req_cleanup(&req);
+        if (result < 0) {
+            throw runtime_error("Could not stat '" + dir + "': " + uv_strerror(result));
+        }
+        // Links back up the tree would never finish
+        if (!visited.insert({dir_stat.st_dev, dir_stat.st_ino}).second) {
+            return;
+        }
+
+        result = uv_fs_scandir(nullptr, &req, dir.c_str(), 0, nullptr);
+        if (result < 0) {
+            uv_fs_req_cleanup(&req);
+            throw runtime_error("Could not read '" + dir + "': " + uv_strerror(result));
+        }
+        size_t dir_item = items.size();
+        items.push_back(PackItem{rel, Archive::DIRECTORY});
+
+        vector<DirItem> listing;
+        vector<string> subdirs;
+        string index;
+        int index_item = -1;
+        uv_dirent_t dirent;
+        while (uv_fs_scandir_next(&req, &dirent) != UV_EOF) {
+            string name = dirent.name;
+            if (!options.hidden && name.front() == '.') {
+                continue;
+            }
+            string file = path::join(dir, name);
+            if (file == output || file == output + ".tmp") {
+                // Don't pack the archive into itself
+                continue;
+            }
+            uv_fs_t stat_req;
+            int status = uv_fs_stat(nullptr, &stat_req, file.c_str(), nullptr);
+            uv_stat_t stat = stat_req.statbuf;
+            uv_fs_req_cleanup(&stat_req);
+            if (status < 0) {
+                continue;
+            }
+
+            if ((stat.st_mode & S_IFMT) == S_IFDIR) {
+                listing.push_back({name, true, 0, stat.st_mtim.tv_sec});
+                subdirs.push_back(name);
+            } else if ((stat.st_mode & S_IFMT) == S_IFREG) {
+                listing.push_back({name, false, stat.st_size, stat.st_mtim.tv_sec});
+                PackItem item{rel.empty() ? name : rel + "/" + name, Archive::FILE, file, stat.st_size};
+                const MimeTypes::Type *type = MimeTypes::find(file.c_str());
+                item.header = type != nullptr ? type->header : responseHeader<48>(RES_SUCCESS, "application/octet-stream").buf;
+                if (name.rfind("index.", 0) == 0 && (index.empty() || name < index)) {
+                    index = name;
+                    index_item = items.size();
+                }
+                items.push_back(item);
+            }
+        }
+        uv_fs_req_cleanup(&req);
+
+        if (index_item >= 0) {
+            items[dir_item].alias = index_item;
+        } else if (options.listings) {
+            string url = options.base;
+            if (url.empty() || url.back() != '/') {
+                url += '/';
+            }
+            if (!rel.empty()) {
+                url += rel + "/";
+            }
+            DirListing rendered(dir);
+            rendered.items = listing;
+            string response = rendered.render(url, ListingOptions());
+            size_t header_end = response.find("\r\n") + 2;
+            items[dir_item].header = response.substr(0, header_end);
+            items[dir_item].body = response.substr(header_end);
+        }
+
+        std::sort(subdirs.begin(), subdirs.end());
+        for (const string &name : subdirs) {
+            walk(path::join(dir, name), rel.empty() ? name : rel + "/" + name);
+        }
+    }
+};
+
+/**
+ * Build a perfect hash of the items' paths
+ *
+ * @param items items
+ * @param seeds set to the seed of each bucket
+ *
+ * @return the slot of each item
+ */
+vector<uint32_t> build_index(const vector<PackItem> &items, vector<uint32_t> &seeds) {
+    size_t count = items.size();
+    size_t num_buckets = (count + BUCKET_SIZE - 1) / BUCKET_SIZE;
+    vector<vector<uint32_t>> buckets(num_buckets);
+    for (uint32_t i = 0; i < count; ++i) {
+        buckets[Archive::hash(items[i].path.c_str(), items[i].path.length(), 0) % num_buckets].push_back(i);
+    }
+
+    // Place the largest buckets first while most slots are still free
+    vector<uint32_t> order(num_buckets);
+    for (uint32_t i = 0; i < num_buckets; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&buckets](uint32_t a, uint32_t b) {
+        return buckets[a].size() > buckets[b].size();
+    });
+
+    seeds.assign(num_buckets, 0);
+    vector<uint32_t> slots(count);
+    vector<bool> used(count, false);
+    vector<uint32_t> placed;
+    for (uint32_t bucket : order) {
+        if (buckets[bucket].empty()) {
+            break;
+        }
+        uint32_t seed = 1;
+        for (; seed < MAX_SEED; ++seed) {
+            placed.clear();
+            for (uint32_t item : buckets[bucket]) {
+                uint32_t slot = Archive::hash(items[item].path.c_str(), items[item].path.length(), seed) % count;
+                if (used[slot] || std::find(placed.begin(), placed.end(), slot) != placed.end()) {
+                    break;
+                }
+                placed.push_back(slot);
+            }
+            if (placed.size() == buckets[bucket].size()) {
+                break;
+            }
+        }
+        if (seed == MAX_SEED) {
+            throw runtime_error("Could not build the archive index");
+        }
+        seeds[bucket] = seed;
+        for (size_t i = 0; i < placed.size(); ++i) {
+            used[placed[i]] = true;
+            slots[buckets[bucket][i]] = placed[i];
+        }
+    }
+    return slots;
+}
+
+class Output {
+private:
+    uv_file fd;
+    string path;
+public:
+    uint64_t written = 0;
+
+    Output(const string &path)
+            : path(path) {
+        uv_fs_t req;
+        fd = uv_fs_open(nullptr, &req, path.c_str(), UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0644, nullptr);
+        uv_fs_req_cleanup(&req);
+        if (fd < 0) {
+            throw runtime_error("Could not create '" + path + "': " + uv_strerror(fd));
+        }
+    }
+    ~Output() {
+        close();
+    }
+
+    void write(const void *data, size_t length) {
+        const char *pos = static_cast<const char *>(data);
+        while (length > 0) {
+            uv_buf_t buf = uv_buf_init(const_cast<char *>(pos), length);
+            uv_fs_t req;
+            int result = uv_fs_write(nullptr, &req, fd, &buf, 1, -1, nullptr);
+            uv_fs_req_cleanup(&req);
+            if (result < 0) {
+                throw runtime_error("Could not write '" + path + "': " + uv_strerror(result));
+            }
+            pos += result;
+            length -= result;
+            written += result;
+        }
+    }
+
+    /**
+     * Flush the file to disk, so it is complete before it is renamed into place
+     */
+    void sync() {
+        uv_fs_t req;
+        int result = uv_fs_fsync(nullptr, &req, fd, nullptr);
+        uv_fs_req_cleanup(&req);
+        if (result < 0) {
+            throw runtime_error("Could not write '" + path + "': " + uv_strerror(result));
+        }
+    }
+
+    void close() {
+        if (fd >= 0) {
+            uv_fs_t req;
+            uv_fs_close(nullptr, &req, fd, nullptr);
+            uv_fs_req_cleanup(&req);
+            fd = -1;
+        }
+    }
+};
+
+/**
+ * Copy the contents of a file into the archive
+ */
+void copy_file(Output &out, const PackItem &item) {
+    uv_fs_t req;
+    uv_file fd = uv_fs_open(nullptr, &req, item.file.c_str(), UV_FS_O_RDONLY, 0, nullptr);
+    uv_fs_req_cleanup(&req);
+    if (fd < 0) {
+        throw runtime_error("Could not open '" + item.file + "': " + uv_strerror(fd));
+    }
+
+    vector<char> buffer(64 * 1024);
+    uint64_t remaining = item.size;
+    int result = 0;
+    while (remaining > 0) {
+        uv_buf_t buf = uv_buf_init(buffer.data(), remaining < buffer.size() ? remaining : buffer.size());
+        result = uv_fs_read(nullptr, &req, fd, &buf, 1, -1, nullptr);
+        uv_fs_req_cleanup(&req);
+        if (result <= 0) {
+            break;
+        }
+        out.write(buffer.data(), result);
+        remaining -= result;
+    }
+    uv_fs_close(nullptr, &req, fd, nullptr);
+    uv_fs_req_cleanup(&req);
+
+    if (result < 0) {
+        throw runtime_error("Could not read '" + item.file + "': " + uv_strerror(result));
+    }
+    if (remaining > 0) {
+        throw runtime_error("'" + item.file + "' changed while it was being packed");
+    }
+}
+
+uint64_t align(uint64_t offset, uint64_t alignment) {
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+}
+
+size_t Archive::pack(const string &folder, const string &output, const PackOptions &options) {
+    Packer packer(output, options);
+    packer.walk(folder, "");
+    vector<PackItem> &items = packer.items;
+
+    vector<uint32_t> seeds;
+    vector<uint32_t> slots = build_index(items, seeds);
+
+    Header header = {};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.count = items.size();
+    header.buckets = seeds.size();
+    header.seeds_offset = sizeof(Header);
+    header.entries_offset = align(header.seeds_offset + seeds.size() * sizeof(uint32_t), alignof(Entry));
+
+    // Paths come right after the index, followed by the responses
+    uint64_t offset = header.entries_offset + items.size() * sizeof(Entry);
+    for (PackItem &item : items) {
+        item.entry.path_offset = offset;
+        item.entry.path_length = item.path.length();
+        item.entry.kind = item.kind;
+        offset += item.path.length();
+    }
+    for (PackItem &item : items) {
+        if (item.alias >= 0) {
+            continue;
+        }
+        uint64_t body = item.kind == FILE ? item.size : item.body.length();
+        item.entry.header_length = item.header.length();
+        item.entry.response_offset = offset;
+        item.entry.response_length = item.header.length() + body;
+        offset += item.entry.response_length;
+    }
+    for (PackItem &item : items) {
+        if (item.alias >= 0) {
+            const Entry &index = items[item.alias].entry;
+            item.entry.header_length = index.header_length;
+            item.entry.response_offset = index.response_offset;
+            item.entry.response_length = index.response_length;
+        }
+    }
+    header.size = offset;
+
+    vector<Entry> entries(items.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        entries[slots[i]] = items[i].entry;
+    }
+
+    string temp = output + ".tmp";
+    try {
+        Output out(temp);
+        out.write(&header, sizeof(header));
+        out.write(seeds.data(), seeds.size() * sizeof(uint32_t));
+        const char padding[alignof(Entry)] = {};
+        out.write(padding, header.entries_offset - out.written);
+        out.write(entries.data(), entries.size() * sizeof(Entry));
+        for (const PackItem &item : items) {
+            out.write(item.path.c_str(), item.path.length());
+        }
+        for (const PackItem &item : items) {
+            if (item.alias >= 0) {
+                continue;
+            }
+            out.write(item.header.c_str(), item.header.length());
+            if (item.kind == FILE) {
+                copy_file(out, item);
+            } else {
+                out.write(item.body.c_str(), item.body.length());
+            }
+        }
+        out.sync();
+        out.close();
+    } catch (runtime_error &e) {
+        uv_fs_t req;
+        uv_fs_unlink(nullptr, &req, temp.c_str(), nullptr);
+        uv_fs_req_cleanup(&req);
+        throw;
+    }
+
+    // Replace the old archive atomically, handlers still serving it keep their mapping
+    uv_fs_t req;
+    int result = uv_fs_rename(nullptr, &req, temp.c_str(), output.c_str(), nullptr);
+    uv_fs_req_cleanup(&req);
+    if (result < 0) {
+        uv_fs_unlink(nullptr, &req, temp.c_str(), nullptr);
+        uv_fs_req_cleanup(&req);
+        throw runtime_error("Could not replace '" + output + "': " + uv_strerror(result));
+    }
+    return items.size();
+}
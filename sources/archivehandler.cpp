@@ -0,0 +1,293 @@
+#include "archivehandler.hpp"
+
+#include <stdexcept>
+
+#include "gemcaps/log.hpp"
+#include "gemcaps/pathutils.hpp"
+#include "gemcaps/threadpool.hpp"
+
+using std::shared_ptr;
+using std::make_shared;
+using std::string;
+
+
+constexpr const auto DOES_NOT_EXIST = responseHeader<32>(RES_NOT_FOUND, "File does not exist");
+constexpr const auto UPLOAD_NOT_ALLOWED = responseHeader<64>(RES_BAD_REQUEST, "Uploads are not allowed here");
+
+#define HEADER(x) x.buf, x.length()
+
+static void on_event_close(uv_handle_t *handle) {
+    delete (uv_fs_event_t *)handle;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Streaming
+//
+// Large responses are sent a block at a time, whenever the client has
+// written the last one
+//
+////////////////////////////////////////////////////////////////////////////////
+
+struct ResponseStream {
+    ClientConnection *client;
+    // Keeps the mapping alive if a new archive is swapped in
+    shared_ptr<Archive> archive;
+    const char *data;
+    size_t remaining;
+    size_t block_size;
+    bool sending = false;
+    bool closed = false;
+};
+
+static void stream_pump(ResponseStream *stream);
+
+static void stream_on_drain(ClientConnection *client, void *arg) {
+    ResponseStream *stream = static_cast<ResponseStream *>(arg);
+    if (!stream->sending) {
+        stream_pump(stream);
+    }
+}
+
+static void stream_on_close(ClientConnection *client, void *arg) {
+    ResponseStream *stream = static_cast<ResponseStream *>(arg);
+    stream->closed = true;
+    if (!stream->sending) {
+        delete stream;
+    }
+}
+
+static void stream_pump(ResponseStream *stream) {
+    stream->sending = true;
+    while (!stream->closed && stream->remaining > 0 && stream->client->getPending() < stream->block_size) {
+        size_t length = stream->remaining < stream->block_size ? stream->remaining : stream->block_size;
+        stream->client->send(stream->data, length);
+        stream->data += length;
+        stream->remaining -= length;
+    }
+    stream->sending = false;
+
+    if (stream->closed) {
+        delete stream;
+        return;
+    }
+    if (stream->remaining == 0) {
+        ClientConnection *client = stream->client;
+        client->setClientDrainCallback(nullptr);
+        client->setClientCloseCallback(nullptr);
+        delete stream;
+        client->close();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ArchiveHandler
+//
+////////////////////////////////////////////////////////////////////////////////
+
+ArchiveHandler::ArchiveHandler(string host, string base, string file, shared_ptr<Archive> archive, uv_loop_t *loop, size_t block_size)
+        : host(host),
+          base(base),
+          file(file),
+          block_size(block_size),
+          archive(archive) {
+    reloads = &metrics::counter("gemcaps_archive_reloads_total", "Number of times an archive was swapped for a new one");
+    reload_errors = &metrics::counter("gemcaps_archive_reload_errors_total", "Number of new archives that could not be loaded");
+
+    if (loop == nullptr) {
+        return;
+    }
+    // The archive is replaced by a rename, so its directory is watched rather
+    // than the file itself
+    event = new uv_fs_event_t;
+    uv_fs_event_init(loop, event);
+    event->data = this;
+    int res = uv_fs_event_start(event, __on_event, path::dirname(file).c_str(), 0);
+    if (res < 0) {
+        LOG_WARN("Could not watch '" << file << "' for changes: " << uv_strerror(res));
+        uv_close((uv_handle_t *)event, on_event_close);
+        event = nullptr;
+    }
+}
+
+ArchiveHandler::~ArchiveHandler() {
+    if (event != nullptr) {
+        event->data = nullptr;
+        uv_fs_event_stop(event);
+        uv_close((uv_handle_t *)event, on_event_close);
+    }
+    if (reloading != nullptr) {
+        reloading->handler = nullptr;
+    }
+}
+
+void ArchiveHandler::reload() noexcept {
+    if (reloading != nullptr) {
+        // Pick up any change made while the archive was being mapped
+        reload_again = true;
+        return;
+    }
+    reloading = new Reload;
+    reloading->work.data = reloading;
+    reloading->handler = this;
+    reloading->file = file;
+    ThreadPool::get(event != nullptr ? event->loop : uv_default_loop()).queue(ThreadPool::SCAN, &reloading->work, __reload, __on_reloaded);
+}
+
+void ArchiveHandler::__on_event(uv_fs_event_t *handle, const char *filename, int events, int status) noexcept {
+    ArchiveHandler *handler = static_cast<ArchiveHandler *>(handle->data);
+    if (handler == nullptr || status < 0 || filename == nullptr) {
+        return;
+    }
+    if (path::basename(handler->file) != filename) {
+        return;
+    }
+    handler->reload();
+}
+
+void ArchiveHandler::__reload(uv_work_t *work) noexcept {
+    Reload *reload = static_cast<Reload *>(work->data);
+    try {
+        reload->archive = Archive::open(reload->file);
+    } catch (std::exception &e) {
+        reload->error = e.what();
+    }
+}
+
+void ArchiveHandler::__on_reloaded(uv_work_t *work, int status) noexcept {
+    Reload *reload = static_cast<Reload *>(work->data);
+    ArchiveHandler *handler = reload->handler;
+    if (handler == nullptr) {
+        delete reload;
+        return;
+    }
+    handler->reloading = nullptr;
+
+    if (reload->archive) {
+        // Responses are copied as they are sent, so the old mapping can go as
+        // soon as nothing else holds it
+        handler->archive = reload->archive;
+        handler->reloads->inc();
+        LOG_INFO("Loaded " << handler->archive->getCount() << " entries from '" << handler->file << "'");
+    } else if (!reload->error.empty()) {
+        // A half written archive is expected if it wasn't renamed into place
+        handler->reload_errors->inc();
+        LOG_WARN("Could not reload archive, still serving the old one: " << reload->error);
+    }
+    delete reload;
+
+    if (handler->reload_again) {
+        handler->reload_again = false;
+        handler->reload();
+    }
+}
+
+bool ArchiveHandler::shouldHandle(string host, string path) noexcept {
+    if (!this->host.empty() && this->host != host) {
+        return false;
+    }
+    if (!this->base.empty() && !path::isSubpath(base, path)) {
+        return false;
+    }
+    return true;
+}
+
+void ArchiveHandler::handle(ClientConnection *client) noexcept {
+    const Request &request = client->getRequest();
+    bool is_dir = !request.path.empty() && request.path.back() == '/';
+    string file = path::delUps(request.path);
+    if (is_dir) {
+        file += '/';
+    }
+    if (file != request.path) {
+        // Check if the path contains up dirs
+        const auto header = responseHeader(RES_REDIRECT_PERM, file.c_str());
+        client->send(HEADER(header));
+        client->close();
+        return;
+    }
+    if (request.is_upload) {
+        client->send(HEADER(UPLOAD_NOT_ALLOWED));
+        client->close();
+        return;
+    }
+
+    string key = this->base.empty() ? file : path::relpath(file, this->base);
+    size_t start = key.find_first_not_of('/');
+    size_t end = key.find_last_not_of('/');
+    key = start == string::npos ? "" : key.substr(start, end - start + 1);
+
+    const Archive::Entry *entry = archive->find(key);
+    if (entry == nullptr) {
+        client->send(HEADER(DOES_NOT_EXIST));
+        client->close();
+        return;
+    }
+    if (entry->kind == Archive::DIRECTORY && !is_dir) {
+        // Make sure that the path ends with a forward slash for directories
+        const auto header = responseHeader(RES_REDIRECT_PERM, (request.path + '/').c_str());
+        client->send(HEADER(header));
+        client->close();
+        return;
+    }
+    if (entry->kind == Archive::FILE && is_dir) {
+        const auto header = responseHeader(RES_REDIRECT_PERM, request.path.substr(0, request.path.length() - 1).c_str());
+        client->send(HEADER(header));
+        client->close();
+        return;
+    }
+    if (entry->response_length == 0) {
+        // A directory without an index or listing
+        client->send(HEADER(DOES_NOT_EXIST));
+        client->close();
+        return;
+    }
+
+    if (entry->response_length <= block_size) {
+        client->send(archive->getResponse(*entry), entry->response_length);
+        client->close();
+        return;
+    }
+    ResponseStream *stream = new ResponseStream;
+    stream->client = client;
+    stream->archive = archive;
+    stream->data = archive->getResponse(*entry);
+    stream->remaining = entry->response_length;
+    stream->block_size = block_size;
+    client->setClientDrainCallback(stream_on_drain, stream);
+    client->setClientCloseCallback(stream_on_close, stream);
+    stream_pump(stream);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ArchiveHandlerFactory
+//
+////////////////////////////////////////////////////////////////////////////////
+
+shared_ptr<Handler> ArchiveHandlerFactory::createHandler(YAML::Node settings, string dir) {
+    string host = getProperty<string>(settings, HOST, "");
+    string base = getProperty<string>(settings, BASE, "");
+    string file = getProperty<string>(settings, ARCHIVE);
+    bool watch = getProperty<bool>(settings, WATCH, true);
+    size_t block_size = getProperty<size_t>(settings, READ_BLOCK_SIZE, 64 * 1024);
+    if (block_size == 0) {
+        throw InvalidSettingsException(settings[READ_BLOCK_SIZE].Mark(), "'" + READ_BLOCK_SIZE + "' must be greater than 0");
+    }
+
+    if (path::isrel(file)) {
+        file = path::join(dir, file);
+    }
+    file = path::delUps(file);
+
+    shared_ptr<Archive> archive;
+    try {
+        archive = Archive::open(file);
+    } catch (std::runtime_error &e) {
+        throw InvalidSettingsException(settings[ARCHIVE].Mark(), e.what());
+    }
+    LOG_INFO("Loaded " << archive->getCount() << " entries from '" << file << "'");
+
+    return make_shared<ArchiveHandler>(host, base, file, archive, watch ? uv_default_loop() : nullptr, block_size);
+}
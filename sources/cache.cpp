@@ -182,6 +182,22 @@ void Cache::invalidate(const CacheKey &key) {
     }
 }
 
+void Cache::invalidateTree(const string &path) {
+    string prefix = path;
+    if (prefix.empty() || prefix.back() != '/') {
+        prefix += '/';
+    }
+    vector<CacheKey> removed;
+    for (auto &pair : cache) {
+        if (pair.first.name == path || pair.first.name.rfind(prefix, 0) == 0) {
+            removed.push_back(pair.first);
+        }
+    }
+    for (const CacheKey &key : removed) {
+        invalidate(key);
+    }
+}
+
 bool Cache::getNotified(const CacheKey &key, CacheReadyCB callback, void *ctx) {
     if (!cache.count(key)) {
         return false;
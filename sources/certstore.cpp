@@ -0,0 +1,97 @@
+#include "certstore.hpp"
+
+#include <uv.h>
+
+#include "gemcaps/log.hpp"
+
+using std::string;
+using std::shared_ptr;
+
+
+/**
+ * Add a file's modification time to the key of a context
+ */
+static void append_stamp(string &key, const string &file) noexcept {
+    uv_fs_t req;
+    if (uv_fs_stat(nullptr, &req, file.c_str(), nullptr) == 0) {
+        key += std::to_string(req.statbuf.st_mtim.tv_sec) + '.' + std::to_string(req.statbuf.st_mtim.tv_nsec);
+    }
+    key += '\0';
+    uv_fs_req_cleanup(&req);
+}
+
+/**
+ * Read a certificate and its key into a new context
+ */
+static WOLFSSL_CTX *load_context(const string &cert, const string &key, setupContext setup) noexcept {
+    WOLFSSL_CTX *loaded = wolfSSL_CTX_new(wolfTLSv1_2_server_method());
+    if (loaded == nullptr) {
+        return nullptr;
+    }
+    if (wolfSSL_CTX_use_certificate_file(loaded, cert.c_str(), SSL_FILETYPE_PEM) != SSL_SUCCESS) {
+        LOG_ERROR("[CertificateStore::get] Could not load certificate file '" << cert << "'");
+        wolfSSL_CTX_free(loaded);
+        return nullptr;
+    }
+    if (wolfSSL_CTX_use_PrivateKey_file(loaded, key.c_str(), SSL_FILETYPE_PEM) != SSL_SUCCESS) {
+        LOG_ERROR("[CertificateStore::get] Could not load key file '" << key << "'");
+        wolfSSL_CTX_free(loaded);
+        return nullptr;
+    }
+    if (setup != nullptr) {
+        setup(loaded);
+    }
+    return loaded;
+}
+
+shared_ptr<WOLFSSL_CTX> CertificateStore::get(const string &cert, const string &key, setupContext setup) noexcept {
+    string id = cert + '\0' + key + '\0';
+    append_stamp(id, cert);
+    append_stamp(id, key);
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto it = contexts.begin(); it != contexts.end();) {
+            if (it->second.expired()) {
+                contexts.erase(it++);
+                continue;
+            }
+            ++it;
+        }
+        auto found = contexts.find(id);
+        if (found != contexts.end()) {
+            shared_ptr<WOLFSSL_CTX> ctx = found->second.lock();
+            if (ctx) {
+                LOG_DEBUG("Reusing the certificate '" << cert << "'");
+                return ctx;
+            }
+        }
+    }
+
+    // Parsing is slow, so other certificates may be looked up meanwhile
+    WOLFSSL_CTX *loaded = load_context(cert, key, setup);
+    if (loaded == nullptr) {
+        return nullptr;
+    }
+    shared_ptr<WOLFSSL_CTX> ctx(loaded, wolfSSL_CTX_free);
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::weak_ptr<WOLFSSL_CTX> &stored = contexts[id];
+    shared_ptr<WOLFSSL_CTX> raced = stored.lock();
+    if (raced) {
+        // Another thread loaded the same certificate first
+        return raced;
+    }
+    stored = ctx;
+    LOG_DEBUG("Loaded the certificate '" << cert << "'");
+    return ctx;
+}
+
+size_t CertificateStore::size() noexcept {
+    std::lock_guard<std::mutex> guard(lock);
+    size_t count = 0;
+    for (auto &context : contexts) {
+        count += !context.second.expired();
+    }
+    return count;
+}
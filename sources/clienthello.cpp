@@ -0,0 +1,60 @@
+#include "clienthello.hpp"
+
+constexpr unsigned char RECORD_HANDSHAKE = 0x16;
+constexpr unsigned char HANDSHAKE_CLIENT_HELLO = 0x01;
+
+static size_t read_u16(const unsigned char *data) noexcept {
+    return (data[0] << 8) | data[1];
+}
+
+bool ClientHello::parse(const char *data, size_t length, ClientHello &result) noexcept {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+    // Record header: type, version, and length
+    if (length < 5 || bytes[0] != RECORD_HANDSHAKE) {
+        return false;
+    }
+    size_t end = 5 + read_u16(bytes + 3);
+    if (end < length) {
+        length = end;
+    }
+    // Handshake header: type and 24 bit length
+    size_t pos = 5;
+    if (length < pos + 4 || bytes[pos] != HANDSHAKE_CLIENT_HELLO) {
+        return false;
+    }
+    pos += 4;
+    // The version and random, then the session id
+    pos += 2 + 32;
+    if (length < pos + 1) {
+        return false;
+    }
+    pos += 1 + bytes[pos];
+    if (length < pos + 2) {
+        return false;
+    }
+    size_t ciphers = read_u16(bytes + pos);
+    pos += 2;
+    if (ciphers % 2 != 0 || length < pos + ciphers) {
+        return false;
+    }
+
+    result.ciphers.clear();
+    for (size_t i = 0; i < ciphers; i += 2) {
+        result.ciphers.push_back(read_u16(bytes + pos + i));
+    }
+    return true;
+}
+
+bool ClientHello::offersECDSA() const noexcept {
+    for (uint16_t cipher : ciphers) {
+        // The ECDHE_ECDSA suites
+        if ((cipher >= 0xC006 && cipher <= 0xC00A)
+                || cipher == 0xC023 || cipher == 0xC024
+                || cipher == 0xC02B || cipher == 0xC02C
+                || (cipher >= 0xC0AC && cipher <= 0xC0AF)
+                || cipher == 0xCCA9) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,355 @@
+#include "gemcaps/dircache.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <ctime>
+
+#include "gemcaps/settings.hpp"
+#include "gemcaps/handler.hpp"
+#include "gemcaps/log.hpp"
+#include "gemcaps/pathutils.hpp"
+#include "gemcaps/filecache.hpp"
+#include "gemcaps/threadpool.hpp"
+#include "gemcaps/watcher.hpp"
+
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::make_unique;
+using std::ostringstream;
+
+
+/**
+ * Remove any trailing slashes from a path
+ */
+static string trim_slashes(string path) {
+    while (path.length() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+    return path;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// DirListing
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static void format_size(ostringstream &oss, uint64_t size) {
+    const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    if (size < 1024) {
+        oss << size << " " << units[0];
+        return;
+    }
+    double value = size;
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        ++unit;
+    }
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%.1f", value);
+    oss << buf << " " << units[unit];
+}
+
+static void format_mtime(ostringstream &oss, int64_t mtime) {
+    time_t time = mtime;
+    struct tm tm;
+    char buf[32];
+    if (gmtime_r(&time, &tm) == nullptr || strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm) == 0) {
+        return;
+    }
+    oss << buf;
+}
+
+static void format_item(ostringstream &oss, const string &url_path, const DirItem &item, const ListingOptions &options) {
+    const char *slash = item.is_dir ? "/" : "";
+    oss << "=> " << path::join(url_path, item.name) << slash << " " << item.name << slash;
+
+    bool size = options.size && !item.is_dir;
+    if (size || options.mtime) {
+        oss << " (";
+        if (size) {
+            format_size(oss, item.size);
+        }
+        if (options.mtime) {
+            if (size) {
+                oss << ", ";
+            }
+            format_mtime(oss, item.mtime);
+        }
+        oss << ")";
+    }
+    oss << "\n";
+}
+
+const string &DirListing::render(const string &url_path, const ListingOptions &options) noexcept {
+    string key = url_path;
+    key += '\0';
+    key += static_cast<char>('0' + static_cast<int>(options.sort));
+    key += options.size ? 's' : '-';
+    key += options.mtime ? 'm' : '-';
+    auto found = rendered.find(key);
+    if (found != rendered.end()) {
+        return found->second;
+    }
+    if (rendered.size() >= MAX_RENDERED) {
+        rendered.clear();
+    }
+
+    vector<const DirItem *> sorted;
+    sorted.reserve(items.size());
+    for (const DirItem &item : items) {
+        sorted.push_back(&item);
+    }
+    ListingSort sort = options.sort;
+    std::stable_sort(sorted.begin(), sorted.end(), [sort](const DirItem *a, const DirItem *b) {
+        if (a->is_dir != b->is_dir) {
+            return a->is_dir;
+        }
+        switch (sort) {
+        case ListingSort::NAME:
+            return a->name < b->name;
+        case ListingSort::SIZE:
+            return a->size != b->size ? a->size > b->size : a->name < b->name;
+        case ListingSort::MTIME:
+            return a->mtime != b->mtime ? a->mtime > b->mtime : a->name < b->name;
+        default:
+            return false;
+        }
+    });
+
+    constexpr const auto header = responseHeader(RES_SUCCESS, "text/gemini");
+    ostringstream oss;
+    oss << header.buf;
+    oss << "# DirectoryContents\n\n## " << url_path << "\n\n";
+    oss << "=> " << path::dirname(url_path) << " back\n\n";
+
+    auto item = sorted.begin();
+    for (; item != sorted.end() && (*item)->is_dir; ++item) {
+        format_item(oss, url_path, **item, options);
+    }
+    oss << "\n";
+    for (; item != sorted.end(); ++item) {
+        format_item(oss, url_path, **item, options);
+    }
+
+    return rendered.insert({key, oss.str()}).first->second;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// DirCache
+//
+////////////////////////////////////////////////////////////////////////////////
+
+DirCache::DirCache(uv_loop_t *loop)
+        : loop(loop) {
+    hits = &metrics::counter("gemcaps_dir_cache_hits_total", "Number of directory listings answered from the directory cache");
+    misses = &metrics::counter("gemcaps_dir_cache_misses_total", "Number of directory listings that were read from the disk");
+    size = &metrics::gauge("gemcaps_dir_cache_entries", "Number of directories in the directory cache");
+}
+
+DirCache::~DirCache() {
+    for (DirListing *listing : lru) {
+        if (listing->pending) {
+            // The scan deletes the listing once it finishes
+            listing->cached = false;
+            continue;
+        }
+        delete listing;
+    }
+}
+
+DirCache &DirCache::get(uv_loop_t *loop) noexcept {
+    static phmap::flat_hash_map<uv_loop_t *, unique_ptr<DirCache>> caches;
+    auto &cache = caches[loop];
+    if (!cache) {
+        cache = make_unique<DirCache>(loop);
+        FileWatcher::get(loop).addListener(__on_changed, cache.get());
+    }
+    return *cache;
+}
+
+void DirCache::load(YAML::Node settings) {
+    if (!settings[FileCache::FILE_CACHE].IsDefined()) {
+        return;
+    }
+    YAML::Node cache = settings[FileCache::FILE_CACHE];
+    if (!cache.IsMap()) {
+        throw InvalidSettingsException(cache.Mark(), "'" + FileCache::FILE_CACHE + "' must be a map");
+    }
+    configure(getProperty<size_t>(cache, MAX_LISTINGS, max_listings));
+}
+
+void DirCache::configure(size_t max_listings) noexcept {
+    DirCache::max_listings = max_listings > 0 ? max_listings : 1;
+}
+
+void DirCache::evict(DirListing *listing) noexcept {
+    if (!listing->cached) {
+        return;
+    }
+    listings.erase(listing->path);
+    lru.erase(listing->lru);
+    listing->cached = false;
+    size->set(listings.size());
+    if (!listing->pending) {
+        delete listing;
+    }
+}
+
+void DirCache::list(const string &dir, const uv_timespec_t &mtime, onListingReady cb, void *ctx) noexcept {
+    string path = trim_slashes(dir);
+
+    auto found = listings.find(path);
+    if (found != listings.end()) {
+        DirListing *listing = found->second;
+        if (listing->pending) {
+            lru.splice(lru.begin(), lru, listing->lru);
+            listing->waiters.push_back({cb, ctx});
+            return;
+        }
+        if (listing->mtime.tv_sec == mtime.tv_sec && listing->mtime.tv_nsec == mtime.tv_nsec) {
+            hits->inc();
+            lru.splice(lru.begin(), lru, listing->lru);
+            cb(listing, ctx);
+            return;
+        }
+        LOG_DEBUG("Directory '" << path << "' was modified");
+        evict(listing);
+    }
+
+    misses->inc();
+    DirListing *listing = new DirListing(path);
+    lru.push_front(listing);
+    listing->lru = lru.begin();
+    listings.insert({path, listing});
+    listing->waiters.push_back({cb, ctx});
+    listing->pending = true;
+
+    while (listings.size() > max_listings) {
+        evict(lru.back());
+    }
+    size->set(listings.size());
+
+    Scan *scan = new Scan;
+    scan->work.data = scan;
+    scan->cache = this;
+    scan->listing = listing;
+    scan->path = path;
+    ThreadPool::get(loop).queue(ThreadPool::SCAN, &scan->work, __scan, __on_scanned);
+}
+
+void DirCache::invalidate(const string &dir) noexcept {
+    auto found = listings.find(trim_slashes(dir));
+    if (found != listings.end()) {
+        LOG_DEBUG("Invalidating cached directory '" << found->first << "'");
+        evict(found->second);
+    }
+}
+
+void DirCache::invalidateTree(const string &dir) noexcept {
+    string root = trim_slashes(dir);
+    string prefix = root == "/" ? root : root + "/";
+    vector<DirListing *> removed;
+    for (auto &pair : listings) {
+        if (pair.first == root || pair.first.rfind(prefix, 0) == 0) {
+            removed.push_back(pair.second);
+        }
+    }
+    for (DirListing *listing : removed) {
+        LOG_DEBUG("Invalidating cached directory '" << listing->path << "'");
+        evict(listing);
+    }
+}
+
+void DirCache::clear() noexcept {
+    while (!lru.empty()) {
+        evict(lru.back());
+    }
+}
+
+void DirCache::__scan(uv_work_t *work) noexcept {
+    // Runs in the threadpool, so only synchronous requests may be used
+    Scan *scan = static_cast<Scan *>(work->data);
+    uv_fs_t req;
+
+    // Stat the directory first, so that a change during the scan is noticed
+    // by the next request
+    scan->status = uv_fs_stat(nullptr, &req, scan->path.c_str(), nullptr);
+    if (scan->status == 0) {
+        scan->mtime = req.statbuf.st_mtim;
+    }
+    uv_fs_req_cleanup(&req);
+    if (scan->status < 0) {
+        return;
+    }
+
+    int result = uv_fs_scandir(nullptr, &req, scan->path.c_str(), 0, nullptr);
+    if (result < 0) {
+        scan->status = result;
+        uv_fs_req_cleanup(&req);
+        return;
+    }
+    uv_dirent_t entry;
+    while (uv_fs_scandir_next(&req, &entry) != UV_EOF) {
+        DirItem item = {entry.name, entry.type == UV_DIRENT_DIR, 0, 0};
+        string file = path::join(scan->path, item.name);
+        uv_fs_t stat_req;
+        if (uv_fs_stat(nullptr, &stat_req, file.c_str(), nullptr) == 0) {
+            // Links are shown as whatever they point to
+            item.is_dir = (stat_req.statbuf.st_mode & S_IFMT) == S_IFDIR;
+            item.size = stat_req.statbuf.st_size;
+            item.mtime = stat_req.statbuf.st_mtim.tv_sec;
+        }
+        uv_fs_req_cleanup(&stat_req);
+        scan->items.push_back(std::move(item));
+    }
+    uv_fs_req_cleanup(&req);
+}
+
+void DirCache::__on_scanned(uv_work_t *work, int status) noexcept {
+    Scan *scan = static_cast<Scan *>(work->data);
+    DirCache *cache = scan->cache;
+    DirListing *listing = scan->listing;
+
+    listing->status = status < 0 ? status : scan->status;
+    if (listing->status == 0) {
+        listing->mtime = scan->mtime;
+        listing->items = std::move(scan->items);
+        for (const DirItem &item : listing->items) {
+            if (!item.is_dir && item.name.rfind("index.", 0) == 0) {
+                listing->indexes.push_back(item.name);
+            }
+        }
+        std::sort(listing->indexes.begin(), listing->indexes.end());
+    } else {
+        LOG_DEBUG("Could not read directory '" << scan->path << "': " << uv_strerror(listing->status));
+    }
+    listing->ready = true;
+    delete scan;
+
+    // The listing stays pending while the waiters are notified so that it
+    // can't be deleted from under them
+    vector<DirListing::Waiter> waiters;
+    waiters.swap(listing->waiters);
+    for (const DirListing::Waiter &waiter : waiters) {
+        waiter.cb(listing, waiter.ctx);
+    }
+    if (listing->status < 0) {
+        // Errors aren't remembered, the next request tries again
+        cache->evict(listing);
+    }
+    listing->pending = false;
+    if (!listing->cached) {
+        delete listing;
+    }
+}
+
+void DirCache::__on_changed(const string &path, void *ctx) noexcept {
+    DirCache *cache = static_cast<DirCache *>(ctx);
+    cache->invalidateTree(path);
+    cache->invalidate(path::dirname(path));
+}
@@ -4,27 +4,283 @@
 #include "gemcaps/pathutils.hpp"
 #include "gemcaps/settings.hpp"
 
-#include <sstream>
+#include <cstring>
+#include <cerrno>
+
+#ifdef GEMCAPS_POSIX_SPAWN
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
 
 
 using std::string;
 using std::vector;
-using std::ostringstream;
-
-ReusableAllocator<uv_process_t> process_allocator;
 
 // This is a map of extensions -> program executables that will launch the process
-phmap::flat_hash_map<string, vector<string>> programs;
+ScriptRunners programs;
+
+// Environments for process specific variables are reused between executors
+// so that their buffers only need to grow once
+vector<Environment *> environment_pool;
+
+Environment *environment_acquire() noexcept {
+    if (environment_pool.empty()) {
+        return new Environment;
+    }
+    Environment *env = environment_pool.back();
+    environment_pool.pop_back();
+    return env;
+}
+
+void environment_release(Environment *env) noexcept {
+    env->clear();
+    environment_pool.push_back(env);
+}
+
+// Executors whose process is alive
+static phmap::flat_hash_set<Executor *> running;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Environment
+//
+////////////////////////////////////////////////////////////////////////////////
 
-size_t strfind(const char *text, char find) noexcept {
-    for (size_t i = 0; text[i] != '\0'; ++i) {
-        if (text[i] == find) {
-            return i;
+void Environment::set(const char *name, const char *value, size_t value_len) noexcept {
+    size_t name_len = strlen(name);
+    size_t pos = block.size();
+    block.resize(pos + name_len + value_len + 2);
+    memcpy(block.data() + pos, name, name_len);
+    block[pos + name_len] = '=';
+    memcpy(block.data() + pos + name_len + 1, value, value_len);
+    block[pos + name_len + value_len + 1] = '\0';
+    ++count;
+}
+
+void Environment::pointers(vector<char *> &pointers) const noexcept {
+    char *var = const_cast<char *>(block.data());
+    char *end = var + block.size();
+    while (var < end) {
+        pointers.push_back(var);
+        var += strlen(var) + 1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Executor
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef GEMCAPS_POSIX_SPAWN
+
+// posix_spawn can only change the directory of the child with glibc 2.29 and
+// later, scripts are started with fork_exec() everywhere else
+#if defined(__GLIBC__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 29)
+#define GEMCAPS_SPAWN_CHDIR
+#endif
+#endif
+
+#ifdef GEMCAPS_SPAWN_CHDIR
+/**
+ * Start a process with posix_spawn
+ * 
+ * @return 0, or the errno of what failed
+ */
+static int posix_spawn_exec(pid_t &pid, char *const argv[], char *const envp[], const char *cwd, int input_fd, int output_fd) noexcept {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (input_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, input_fd, 0);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    }
+    if (output_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, output_fd, 1);
+    }
+    posix_spawn_file_actions_addchdir_np(&actions, cwd);
+
+    // The server ignores SIGPIPE, which would otherwise be inherited
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigset_t defaults;
+    sigfillset(&defaults);
+    sigdelset(&defaults, SIGKILL);
+    sigdelset(&defaults, SIGSTOP);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+    flags |= POSIX_SPAWN_USEVFORK;
+#endif
+    posix_spawnattr_setflags(&attr, flags);
+
+    int error = posix_spawnp(&pid, argv[0], &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    return error;
+}
+#endif
+
+/**
+ * Tell the parent why the child could not exec, and exit
+ */
+[[noreturn]] static void child_fail(int report, int error) noexcept {
+    ssize_t written;
+    do {
+        written = write(report, &error, sizeof(error));
+    } while (written < 0 && errno == EINTR);
+    _exit(127);
+}
+
+/**
+ * Start a process with fork, so that the child can set what posix_spawn can't
+ * before it execs, like resource limits
+ * 
+ * This copies the page tables of the server, so it is slower than
+ * posix_spawn_exec() and only used when it is needed.
+ * 
+ * @return 0, or the errno of what failed
+ */
+static int fork_exec(pid_t &pid, char *const argv[], char *const envp[], const char *cwd, int input_fd, int output_fd, const ResourceLimits &limits) noexcept {
+    // execve doesn't search the path like posix_spawnp
+    string file = argv[0];
+    if (file.find('/') == string::npos) {
+        file = Executor::findPath(file);
+    }
+#ifdef RLIMIT_AS
+    const int MEMORY = RLIMIT_AS;
+#else
+    const int MEMORY = RLIMIT_DATA;
+#endif
+    const std::pair<int, uint64_t> resources[] = {
+        {RLIMIT_CPU, limits.cpu},
+        {MEMORY, limits.memory},
+        {RLIMIT_NOFILE, limits.files},
+    };
+
+    // The child learns of a failed exec through a pipe that exec closes
+    int report[2];
+    if (pipe(report) != 0) {
+        return errno;
+    }
+    fcntl(report[0], F_SETFD, FD_CLOEXEC);
+    fcntl(report[1], F_SETFD, FD_CLOEXEC);
+
+    // Signals stay blocked until the child has reset the server's handlers
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    pid = fork();
+    if (pid == 0) {
+        // Only async-signal-safe calls may be made in the child
+        ::close(report[0]);
+        if (input_fd < 0) {
+            input_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        if (input_fd < 0 || dup2(input_fd, 0) < 0) {
+            child_fail(report[1], errno);
         }
+        if (output_fd >= 0 && dup2(output_fd, 1) < 0) {
+            child_fail(report[1], errno);
+        }
+        if (chdir(cwd) != 0) {
+            child_fail(report[1], errno);
+        }
+        for (auto &resource : resources) {
+            if (resource.second == 0) {
+                continue;
+            }
+            struct rlimit limit;
+            getrlimit(resource.first, &limit);
+            // Only privileged processes may raise the hard limit
+            rlim_t value = resource.second;
+            if (limit.rlim_max != RLIM_INFINITY && value > limit.rlim_max) {
+                value = limit.rlim_max;
+            }
+            limit.rlim_cur = value;
+            limit.rlim_max = value;
+            if (setrlimit(resource.first, &limit) != 0) {
+                child_fail(report[1], errno);
+            }
+        }
+
+        struct sigaction action = {};
+        action.sa_handler = SIG_DFL;
+        for (int signum = 1; signum < NSIG; ++signum) {
+            sigaction(signum, &action, nullptr);
+        }
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+
+        execve(file.c_str(), argv, envp);
+        child_fail(report[1], errno);
+    }
+    int error = pid < 0 ? errno : 0;
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    ::close(report[1]);
+    if (error != 0) {
+        ::close(report[0]);
+        return error;
     }
-    return string::npos;
+
+    ssize_t got;
+    do {
+        got = read(report[0], &error, sizeof(error));
+    } while (got < 0 && errno == EINTR);
+    ::close(report[0]);
+    if (got == sizeof(error)) {
+        // The child has already exited
+        waitpid(pid, nullptr, 0);
+        return error;
+    }
+    return 0;
 }
 
+// Children spawned by executors. An executor is set to nullptr when it no
+// longer cares about the child, but the child still needs to be reaped.
+phmap::flat_hash_map<pid_t, Executor *> children;
+uv_signal_t *sigchld = nullptr;
+
+void Executor::__on_sigchld(uv_signal_t *handle, int signum) noexcept {
+    // Only reap the children spawned here, libuv reaps its own processes
+    vector<std::pair<Executor *, int>> reaped;
+    for (auto it = children.begin(); it != children.end();) {
+        int status = 0;
+        pid_t result = waitpid(it->first, &status, WNOHANG);
+        if (result == 0 || (result < 0 && errno == EINTR)) {
+            ++it;
+            continue;
+        }
+        if (it->second != nullptr) {
+            reaped.push_back({it->second, status});
+        }
+        it = children.erase(it);
+    }
+    if (children.empty()) {
+        uv_signal_stop(sigchld);
+    }
+
+    for (auto &pair : reaped) {
+        int status = pair.second;
+        int64_t exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 0;
+        int term_signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        pair.first->exited(exit_status, term_signal);
+    }
+}
+
+#else
+
+ReusableAllocator<uv_process_t> process_allocator;
 
 void Executor::__on_exit(uv_process_t *process, int64_t exit_status, int term_signal) noexcept {
     if (process->data == nullptr) {
@@ -32,112 +288,132 @@ void Executor::__on_exit(uv_process_t *process, int64_t exit_status, int term_si
         return;
     }
     Executor *exc = static_cast<Executor *>(process->data);
-    if (exc == nullptr) {
-        LOG_ERROR("data is not executor as expected");
-        return;
-    }
+    exc->exited(exit_status, term_signal);
+}
+
+#endif
 
-    exc->alive = false;
+void Executor::exited(int64_t exit_status, int term_signal) noexcept {
+    alive = false;
+    running.erase(this);
 
-    if (exc->context != nullptr) {
-        exc->context->onExit(exc, exit_status, term_signal);
+    if (context != nullptr) {
+        context->onExit(this, exit_status, term_signal);
     }
 }
 
-Executor::Executor(string path, const phmap::flat_hash_map<string, string> &env, vector<string> args)
-        : path(path) {
+Executor::Executor(string path, const Environment &env, vector<string> args, const ScriptRunners *runners)
+        : base_env(&env),
+          request_env(environment_acquire()) {
 
     cwd = path::dirname(path);
 
-    // Create the environment array
-    ostringstream env_oss;
-    for (auto var : env) {
-        env_oss << var.first << '=' << var.second << '\r';
-    }
-    string env_str = env_oss.str();
-    env_buf = new char[env_str.length()];
-    strcpy(env_buf, env_str.c_str());
-    this->env = new char*[env.size() + 1];
-
-    size_t pos = 0;
-    char *buf = env_buf;
-    int i;
-    for (i = 0; i < env.size(); ++i) {
-        this->env[i] = buf;
-        pos = strfind(buf, '\r');
-        if (pos == string::npos) {
-            break;
-        }
-        buf[pos++] = '\0';
-        buf = buf + pos;
-    }
-    this->env[i] = nullptr;
-
-    // Create the args array
-
     // find the executor program
     args.insert(args.begin(), path);
-    pos = path.rfind('.');
+    size_t pos = path.rfind('.');
     if (pos != string::npos) {
         string ext = path.substr(pos + 1);
-        auto found = programs.find(ext);
-        if (found != programs.end()) {
+        const vector<string> *program = nullptr;
+        if (runners != nullptr) {
+            auto found = runners->find(ext);
+            if (found != runners->end()) {
+                program = &found->second;
+            }
+        }
+        if (program == nullptr) {
+            auto found = programs.find(ext);
+            if (found != programs.end()) {
+                program = &found->second;
+            }
+        }
+        if (program != nullptr) {
             // Insert the executor program to the front of the args
-            args.insert(args.begin(), found->second.begin(), found->second.end());
+            args.insert(args.begin(), program->begin(), program->end());
         }
     }
 
-    ostringstream args_oss;
-    for (auto arg : args) {
-        args_oss << arg << '\r';
-    }
-    string args_str = args_oss.str();
-    args_buf = new char[args_str.length()];
-    strcpy(args_buf, args_str.c_str());
-    this->args = new char*[args.size() + 1];
-
-    pos = 0;
-    buf = args_buf;
-    for (i = 0; i < args.size(); ++i) {
-        this->args[i] = buf;
-        pos = strfind(buf, '\r');
-        if (pos == string::npos) {
-            break;
-        }
-        buf[pos++] = '\0';
-        buf = buf + pos;
+    this->args = std::move(args);
+    argv.reserve(this->args.size() + 1);
+    for (string &arg : this->args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
     }
-    this->args[i] = nullptr;
+    argv.push_back(nullptr);
 }
 
 Executor::~Executor() {
-    if (env_buf != nullptr) {
-        delete[] env_buf;
-    }
-    if (args_buf != nullptr) {
-        delete[] args_buf;
-    }
-    if (env != nullptr) {
-        delete[] env;
-    }
-    if (args != nullptr) {
-        delete[] args;
-    }
+    environment_release(request_env);
+    running.erase(this);
 
+#ifdef GEMCAPS_POSIX_SPAWN
+    if (alive) {
+        signal(SIGKILL);
+        children[pid] = nullptr;
+    }
+#else
     if (alive) {
         process->data = nullptr;
         signal(SIGKILL);
     } else if (process != nullptr) {
         process_allocator.deallocate(process);
     }
+#endif
 }
 
 int Executor::spawn(uv_loop_t *loop, int input_fd, int output_fd) noexcept {
-    if (process == nullptr) {
-        process = process_allocator.allocate();
-    } else if (alive) {
+    if (alive) {
         signal(SIGKILL);
         alive = false;
+        running.erase(this);
+#ifdef GEMCAPS_POSIX_SPAWN
+        children[pid] = nullptr;
+#else
+        process->data = nullptr;
+        process = nullptr;
+#endif
+    }
+
+    envp.clear();
+    envp.reserve(base_env->size() + request_env->size() + 1);
+    base_env->pointers(envp);
+    request_env->pointers(envp);
+    envp.push_back(nullptr);
+
+#ifdef GEMCAPS_POSIX_SPAWN
+    // The watcher has to be started before the child exists, or a child that
+    // exits right away is never reaped
+    if (sigchld == nullptr) {
+        sigchld = new uv_signal_t;
+        uv_signal_init(loop, sigchld);
+    }
+    if (children.empty()) {
+        uv_signal_start(sigchld, __on_sigchld, SIGCHLD);
+    }
+
+    int error;
+#ifdef GEMCAPS_SPAWN_CHDIR
+    // posix_spawn can't set limits in the child, and setting them on it once
+    // it has started leaves the script unlimited until then
+    if (limits.cpu > 0 || limits.memory > 0 || limits.files > 0) {
+        error = fork_exec(pid, argv.data(), envp.data(), cwd.c_str(), input_fd, output_fd, limits);
+    } else {
+        error = posix_spawn_exec(pid, argv.data(), envp.data(), cwd.c_str(), input_fd, output_fd);
+    }
+#else
+    error = fork_exec(pid, argv.data(), envp.data(), cwd.c_str(), input_fd, output_fd, limits);
+#endif
+    if (error != 0) {
+        if (children.empty()) {
+            uv_signal_stop(sigchld);
+        }
+        return uv_translate_sys_error(error);
+    }
+    children.insert({pid, this});
+    alive = true;
+    running.insert(this);
+    return 0;
+#else
+    if (process == nullptr) {
+        process = process_allocator.allocate();
     }
 
     uv_stdio_container_t stdio[3];
@@ -158,9 +434,9 @@ int Executor::spawn(uv_loop_t *loop, int input_fd, int output_fd) noexcept {
     stdio[2].data.fd = 2;
 
     uv_process_options_t options;
-    options.file = args[0];
-    options.args = args;
-    options.env = env;
+    options.file = argv[0];
+    options.args = argv.data();
+    options.env = envp.data();
     options.cwd = cwd.c_str();
     options.flags = UV_PROCESS_WINDOWS_HIDE_CONSOLE | UV_PROCESS_WINDOWS_HIDE_GUI;
     options.exit_cb = __on_exit;
@@ -171,18 +447,143 @@ int Executor::spawn(uv_loop_t *loop, int input_fd, int output_fd) noexcept {
     int success = uv_spawn(loop, process, &options);
     if (success == 0) {
         alive = true;
+        running.insert(this);
     }
     return success;
+#endif
 }
 
 void Executor::signal(int signal) noexcept {
     if (alive) {
+#ifdef GEMCAPS_POSIX_SPAWN
+        uv_kill(pid, signal);
+#else
         uv_process_kill(process, signal);
+#endif
+    }
+}
+
+size_t Executor::signalAll(int signal) noexcept {
+    for (Executor *executor : running) {
+        executor->signal(signal);
     }
+    return running.size();
+}
+
+size_t Executor::getRunning() noexcept {
+    return running.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ExecutableResolver
+//
+////////////////////////////////////////////////////////////////////////////////
+
+ExecutableResolver::ExecutableResolver(const string &path) {
+#ifdef WIN32
+    constexpr const char SEP = ';';
+#else
+    constexpr const char SEP = ':';
+#endif
+    size_t start = 0;
+    while (true) {
+        size_t pos = path.find(SEP, start);
+        string dir = path.substr(start, pos == string::npos ? string::npos : pos - start);
+        if (!dir.empty()) {
+            paths.push_back(dir);
+        }
+        if (pos == string::npos) {
+            break;
+        }
+        start = pos + 1;
+    }
+}
+
+ExecutableResolver::Stamp ExecutableResolver::stamp(const string &file) noexcept {
+    Stamp result;
+    uv_fs_t req;
+    if (uv_fs_stat(nullptr, &req, file.c_str(), nullptr) == 0) {
+        result.exists = true;
+        result.mtime_sec = req.statbuf.st_mtim.tv_sec;
+        result.mtime_nsec = req.statbuf.st_mtim.tv_nsec;
+        result.ino = req.statbuf.st_ino;
+    }
+    uv_fs_req_cleanup(&req);
+    return result;
+}
+
+bool ExecutableResolver::isExecutable(const string &file) noexcept {
+    uv_fs_t req;
+    int result = uv_fs_stat(nullptr, &req, file.c_str(), nullptr);
+    bool regular = result == 0 && (req.statbuf.st_mode & S_IFMT) == S_IFREG;
+    uv_fs_req_cleanup(&req);
+    if (!regular) {
+        return false;
+    }
+    result = uv_fs_access(nullptr, &req, file.c_str(), X_OK, nullptr);
+    uv_fs_req_cleanup(&req);
+    return result == 0;
+}
+
+bool ExecutableResolver::valid(const Entry &entry) const noexcept {
+    if (entry.path.empty()) {
+        // The program was missing, it is still missing if none of the path directories changed
+        for (size_t i = 0; i < paths.size(); ++i) {
+            Stamp s = stamp(paths[i]);
+            const Stamp &old = entry.stamps[i];
+            if (s.exists != old.exists || s.mtime_sec != old.mtime_sec || s.mtime_nsec != old.mtime_nsec || s.ino != old.ino) {
+                return false;
+            }
+        }
+        return true;
+    }
+    Stamp s = stamp(entry.path);
+    const Stamp &old = entry.stamps.front();
+    return s.exists && s.mtime_sec == old.mtime_sec && s.mtime_nsec == old.mtime_nsec && s.ino == old.ino;
+}
+
+ExecutableResolver::Entry ExecutableResolver::probe(const string &filename) const noexcept {
+    Entry entry;
+    for (const string &dir : paths) {
+        string candidate = path::join(dir, filename);
+        if (isExecutable(candidate)) {
+            entry.path = candidate;
+        }
+#ifdef WIN32
+        else if (isExecutable(candidate + ".exe")) {
+            entry.path = candidate + ".exe";
+        }
+#endif
+        if (!entry.path.empty()) {
+            entry.stamps.push_back(stamp(entry.path));
+            return entry;
+        }
+    }
+    for (const string &dir : paths) {
+        entry.stamps.push_back(stamp(dir));
+    }
+    return entry;
+}
+
+string ExecutableResolver::resolve(const string &filename) noexcept {
+    auto found = cache.find(filename);
+    if (found == cache.end() || !valid(found->second)) {
+        Entry entry = probe(filename);
+        found = cache.insert_or_assign(filename, entry).first;
+    }
+    if (found->second.path.empty()) {
+        return filename;
+    }
+    return found->second.path;
 }
 
 void Executor::load(YAML::Node settings) {
-    programs.clear();
+    programs = loadRunners(settings);
+}
+
+ScriptRunners Executor::loadRunners(YAML::Node settings) {
+    ScriptRunners runners;
     if (!settings.IsMap()) {
         throw InvalidSettingsException(settings.Mark(), "Must be a map");
     }
@@ -203,53 +604,36 @@ void Executor::load(YAML::Node settings) {
                 program[0] = findPath(exe);
             }
             LOG_DEBUG("Adding program for '" << ext << "' files: '" << program.front() << "'");
-            programs.insert({it.first.as<string>(), program});
+            runners.insert({ext, program});
         } 
     } catch (YAML::RepresentationException e) {
         throw InvalidSettingsException(e.mark, e.msg);
     }
+    return runners;
 }
 
-string Executor::findPath(string filename) noexcept {
-    static vector<string> paths;
-    if (paths.empty()) {
-        string path = getPath();
-#ifdef WIN32
-        constexpr const char SEP = ';';
-#else
-        constexpr const char SEP = ':';
-#endif
-        while (true) {
-            size_t pos = path.find(SEP);
-            if (pos == string::npos) {
-                paths.push_back(path);
-                break;
-            }
-            paths.push_back(path.substr(0, pos));
-            path = path.substr(pos + 1);
-        }
+void Executor::loadLimits(YAML::Node settings) {
+    size_t max_active = getProperty<size_t>(settings, MAX_CONCURRENT, 0);
+    size_t queue_size = getProperty<size_t>(settings, QUEUE_SIZE, 0);
+    uint64_t queue_timeout = getProperty<uint64_t>(settings, QUEUE_TIMEOUT, 0);
+    limiter().configure(max_active, queue_size, queue_timeout);
+    if (max_active > 0) {
+        LOG_DEBUG("Limiting cgi scripts to " << max_active << " at a time with " << queue_size << " waiting");
     }
-    uv_fs_t req;
-    for (string p : paths) {
-        int result = uv_fs_scandir(uv_default_loop(), &req, p.c_str(), 0, nullptr);
-        if (result < 0) {
-            continue;
-        }
-        uv_dirent_t entry;
-        while (uv_fs_scandir_next(&req, &entry) != UV_EOF) {
-            if (entry.type != UV_DIRENT_FILE) {
-                continue;
-            }
-            if (filename == entry.name
-                    #ifdef WIN32
-                    || filename + ".exe" == entry.name
-                    #endif
-            ) {
-                return path::join(p, entry.name);
-            }
-        }
-    }
-    return filename;
+}
+
+Limiter &Executor::limiter() noexcept {
+    static Limiter global("global");
+    return global;
+}
+
+ExecutableResolver &Executor::resolver() noexcept {
+    static ExecutableResolver resolver(getPath());
+    return resolver;
+}
+
+string Executor::findPath(string filename) noexcept {
+    return resolver().resolve(filename);
 }
 
 const string &Executor::getPath() noexcept {
@@ -0,0 +1,330 @@
+#include "gemcaps/filecache.hpp"
+
+#include <memory>
+
+#include <fcntl.h>
+
+#include "gemcaps/settings.hpp"
+#include "gemcaps/log.hpp"
+#include "gemcaps/pathutils.hpp"
+#include "gemcaps/watcher.hpp"
+#include "gemcaps/fileio.hpp"
+
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::make_unique;
+
+
+FileCache::FileCache(uv_loop_t *loop)
+        : loop(loop) {
+    hits = &metrics::counter("gemcaps_file_cache_hits_total", "Number of file lookups answered from the file cache");
+    misses = &metrics::counter("gemcaps_file_cache_misses_total", "Number of file lookups that went to the disk");
+    size = &metrics::gauge("gemcaps_file_cache_entries", "Number of files in the file cache");
+    open_files = &metrics::gauge("gemcaps_file_cache_open_files", "Number of file descriptors held by the file cache");
+}
+
+FileCache::~FileCache() {
+    for (FileEntry *entry : lru) {
+        if (entry->fd >= 0) {
+            uv_fs_t req;
+            uv_fs_close(loop, &req, entry->fd, nullptr);
+            uv_fs_req_cleanup(&req);
+        }
+        delete entry;
+    }
+}
+
+FileCache &FileCache::get(uv_loop_t *loop) noexcept {
+    static phmap::flat_hash_map<uv_loop_t *, unique_ptr<FileCache>> caches;
+    auto &cache = caches[loop];
+    if (!cache) {
+        cache = make_unique<FileCache>(loop);
+        FileWatcher::get(loop).addListener(__on_changed, cache.get());
+    }
+    return *cache;
+}
+
+void FileCache::load(YAML::Node settings) {
+    if (!settings[FILE_CACHE].IsDefined()) {
+        return;
+    }
+    YAML::Node cache = settings[FILE_CACHE];
+    if (!cache.IsMap()) {
+        throw InvalidSettingsException(cache.Mark(), "'" + FILE_CACHE + "' must be a map");
+    }
+    configure(
+        getProperty<uint64_t>(cache, TTL, ttl),
+        getProperty<uint64_t>(cache, WATCHED_TTL, watched_ttl),
+        getProperty<size_t>(cache, MAX_ENTRIES, max_entries)
+    );
+}
+
+void FileCache::configure(uint64_t ttl, uint64_t watched_ttl, size_t max_entries) noexcept {
+    FileCache::ttl = ttl;
+    FileCache::watched_ttl = watched_ttl;
+    FileCache::max_entries = max_entries > 0 ? max_entries : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Entries
+//
+////////////////////////////////////////////////////////////////////////////////
+
+FileEntry *FileCache::lookup(const string &path, bool open) noexcept {
+    sweep();
+
+    auto found = entries.find(path);
+    if (found != entries.end()) {
+        FileEntry *entry = found->second;
+        if (!entry->ready || entry->pending || uv_now(loop) < entry->expires) {
+            lru.splice(lru.begin(), lru, entry->lru);
+            return entry;
+        }
+        evict(entry);
+    }
+
+    misses->inc();
+    FileEntry *entry = new FileEntry(path);
+    lru.push_front(entry);
+    entry->lru = lru.begin();
+    entries.insert({path, entry});
+
+    while (entries.size() > max_entries) {
+        evict(lru.back());
+    }
+    size->set(entries.size());
+
+    Request *req = new Request;
+    req->cache = this;
+    req->entry = entry;
+    entry->pending = true;
+    if (open) {
+        // Files that are about to be read are stat'd and opened together
+        FileIO::get(loop).statOpen(path, __on_stat_open, req);
+    } else {
+        FileIO::get(loop).stat(path, __on_stat, req);
+    }
+    return entry;
+}
+
+void FileCache::evict(FileEntry *entry) noexcept {
+    if (!entry->cached) {
+        return;
+    }
+    entries.erase(entry->path);
+    lru.erase(entry->lru);
+    entry->cached = false;
+    size->set(entries.size());
+    if (entry->refs == 0 && !entry->pending) {
+        destroy(entry);
+    }
+}
+
+void FileCache::destroy(FileEntry *entry) noexcept {
+    if (entry->fd >= 0) {
+        FileIO::get(loop).close(entry->fd);
+        open_files->dec();
+    }
+    delete entry;
+}
+
+void FileCache::sweep() noexcept {
+    uint64_t now = uv_now(loop);
+    while (!lru.empty()) {
+        FileEntry *entry = lru.back();
+        if (!entry->ready || entry->pending || now < entry->expires) {
+            return;
+        }
+        evict(entry);
+    }
+}
+
+void FileCache::startOpen(FileEntry *entry) noexcept {
+    Request *req = new Request;
+    req->cache = this;
+    req->entry = entry;
+    entry->pending = true;
+    FileIO::get(loop).open(entry->path, __on_open, req);
+}
+
+void FileCache::notify(FileEntry *entry, bool open) noexcept {
+    vector<FileEntry::Waiter> ready;
+    vector<FileEntry::Waiter> waiting;
+    for (const FileEntry::Waiter &waiter : entry->waiters) {
+        if (open || !waiter.open) {
+            ready.push_back(waiter);
+        } else {
+            waiting.push_back(waiter);
+        }
+    }
+    entry->waiters.swap(waiting);
+
+    if (ready.empty()) {
+        if (entry->refs == 0 && !entry->cached && !entry->pending) {
+            destroy(entry);
+        }
+        return;
+    }
+
+    // Acquire the entry for every waiter first, so that releasing it in a
+    // callback can't destroy it before everyone has been notified
+    entry->refs += ready.size();
+    for (const FileEntry::Waiter &waiter : ready) {
+        waiter.cb(entry, waiter.ctx);
+    }
+}
+
+void FileCache::release(FileEntry *entry) noexcept {
+    if (entry == nullptr || entry->refs == 0) {
+        return;
+    }
+    --entry->refs;
+    if (entry->refs == 0 && !entry->cached && !entry->pending) {
+        destroy(entry);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Lookups
+//
+////////////////////////////////////////////////////////////////////////////////
+
+void FileCache::stat(const string &path, onFileReady cb, void *ctx) noexcept {
+    FileEntry *entry = lookup(path);
+    if (entry->ready && !entry->pending) {
+        hits->inc();
+        ++entry->refs;
+        cb(entry, ctx);
+        return;
+    }
+    entry->waiters.push_back({cb, ctx, false});
+}
+
+void FileCache::open(const string &path, onFileReady cb, void *ctx) noexcept {
+    FileEntry *entry = lookup(path, true);
+    if (entry->ready && !entry->pending) {
+        if (!entry->isFile() || entry->fd >= 0 || entry->open_status < 0) {
+            hits->inc();
+            ++entry->refs;
+            cb(entry, ctx);
+            return;
+        }
+        startOpen(entry);
+    }
+    entry->waiters.push_back({cb, ctx, true});
+}
+
+void FileCache::invalidate(const string &path) noexcept {
+    auto found = entries.find(path);
+    if (found != entries.end()) {
+        LOG_DEBUG("Invalidating cached file '" << path << "'");
+        evict(found->second);
+    }
+}
+
+void FileCache::invalidateTree(const string &path) noexcept {
+    string root = path;
+    while (root.length() > 1 && root.back() == '/') {
+        root.pop_back();
+    }
+    string prefix = root + "/";
+    vector<FileEntry *> removed;
+    for (auto &pair : entries) {
+        if (pair.first == root || pair.first.rfind(prefix, 0) == 0) {
+            removed.push_back(pair.second);
+        }
+    }
+    for (FileEntry *entry : removed) {
+        LOG_DEBUG("Invalidating cached file '" << entry->path << "'");
+        evict(entry);
+    }
+}
+
+void FileCache::clear() noexcept {
+    while (!lru.empty()) {
+        evict(lru.back());
+    }
+}
+
+void FileCache::stated(FileEntry *entry, int status, const uv_stat_t *stat) noexcept {
+    entry->status = status;
+    if (status == 0) {
+        entry->stat = *stat;
+    }
+    entry->ready = true;
+    entry->pending = false;
+    // Changes in watched directories invalidate the entry, so it can be kept for longer
+    bool watched = FileWatcher::get(loop).isWatched(entry->path);
+    entry->expires = uv_now(loop) + (watched ? watched_ttl : ttl);
+}
+
+void FileCache::opened(FileEntry *entry, uv_file fd) noexcept {
+    if (fd >= 0) {
+        entry->fd = fd;
+        entry->open_status = 0;
+#ifdef POSIX_FADV_SEQUENTIAL
+        // Files are always sent from start to end, so let the kernel read further ahead
+        posix_fadvise(entry->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        open_files->inc();
+    } else {
+        entry->open_status = fd;
+    }
+    entry->pending = false;
+}
+
+void FileCache::__on_stat(int status, const uv_stat_t *stat, void *ctx) noexcept {
+    Request *request = static_cast<Request *>(ctx);
+    FileCache *cache = request->cache;
+    FileEntry *entry = request->entry;
+    delete request;
+    cache->stated(entry, status, stat);
+
+    bool open = false;
+    for (const FileEntry::Waiter &waiter : entry->waiters) {
+        open |= waiter.open;
+    }
+    if (open && entry->isFile()) {
+        cache->startOpen(entry);
+        cache->notify(entry, false);
+        return;
+    }
+    cache->notify(entry, true);
+}
+
+void FileCache::__on_stat_open(int status, const uv_stat_t *stat, uv_file fd, void *ctx) noexcept {
+    Request *request = static_cast<Request *>(ctx);
+    FileCache *cache = request->cache;
+    FileEntry *entry = request->entry;
+    delete request;
+    cache->stated(entry, status, stat);
+    if (entry->isFile()) {
+        cache->opened(entry, fd);
+    }
+    cache->notify(entry, true);
+}
+
+void FileCache::__on_open(ssize_t result, void *ctx) noexcept {
+    Request *request = static_cast<Request *>(ctx);
+    FileCache *cache = request->cache;
+    FileEntry *entry = request->entry;
+    delete request;
+    cache->opened(entry, result);
+    cache->notify(entry, true);
+}
+
+void FileCache::__on_changed(const string &path, void *ctx) noexcept {
+    FileCache *cache = static_cast<FileCache *>(ctx);
+    cache->invalidateTree(path);
+
+    // The directory's listing and modification time changed too
+    string dir = path::dirname(path);
+    cache->invalidate(dir);
+    if (dir.length() > 1 && dir.back() == '/') {
+        dir.pop_back();
+        cache->invalidate(dir);
+    }
+}
@@ -1,6 +1,7 @@
 #include "filehandler.hpp"
 
-#include <sstream>
+#include <cstring>
+#include <algorithm>
 
 #include <uv.h>
 
@@ -12,24 +13,43 @@
 #include "gemcaps/MimeTypes.h"
 #include "gemcaps/log.hpp"
 #include "gemcaps/executor.hpp"
+#include "gemcaps/metrics.hpp"
+#include "gemcaps/filecache.hpp"
+#include "gemcaps/fileio.hpp"
+#include "gemcaps/dircache.hpp"
+#include "gemcaps/watcher.hpp"
 
 
 using std::shared_ptr;
 using std::make_shared;
 using std::string;
 using std::vector;
-using std::regex;
-using std::ostringstream;
 
-namespace re_consts = std::regex_constants;
 
 constexpr const auto CGI_ERROR = responseHeader<32>(RES_ERROR_CGI, "Could not run script");
 constexpr const auto ILLEGAL_FILE = responseHeader<32>(RES_NOT_FOUND, "Illegal File");
 constexpr const auto DOES_NOT_EXIST = responseHeader<32>(RES_NOT_FOUND, "File does not exist");
 constexpr const auto FILE_NOT_OPEN = responseHeader<32>(RES_GONE, "File could not be opened");
+constexpr const auto CGI_TIMED_OUT = responseHeader<32>(RES_ERROR_CGI, "Script timed out");
+constexpr const auto CGI_BUSY = responseHeader<64>(RES_SERVER_UNAVAIL, "Too many scripts are running, try again later");
+constexpr const auto UPLOAD_NOT_ALLOWED = responseHeader<64>(RES_BAD_REQUEST, "Uploads are not allowed here");
+constexpr const auto UPLOAD_TOO_LARGE = responseHeader<32>(RES_BAD_REQUEST, "Upload is too large");
+
+// Pause reading an upload once this many bytes are waiting to be written to the script
+const size_t UPLOAD_HIGH_WATER = 64 * 1024;
+// Resume reading the upload once the script has caught up
+const size_t UPLOAD_LOW_WATER = 16 * 1024;
+// Number of blocks of a file that are read ahead of the client
+const size_t READ_AHEAD = 2;
+// Number of unused read blocks of each size that are kept for later requests
+const size_t MAX_FREE_BLOCKS = 32;
 
 ReusableAllocator<uv_pipe_t> pipe_allocator;
 
+void on_timer_close(uv_handle_t *handle) {
+    timer_allocator.deallocate((uv_timer_t *)handle);
+}
+
 #define HEADER(x) x.buf, x.length()
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -38,13 +58,41 @@ ReusableAllocator<uv_pipe_t> pipe_allocator;
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-bool FileHandler::validateFile(string file) const noexcept {
-    for (regex pattern : rules) {
-        if (!std::regex_search(file, pattern, re_consts::match_not_null | re_consts::match_any)) {
-            return false;
-        }
+FileHandler::~FileHandler() {
+    if (watch_loop != nullptr) {
+        // The next generation has already watched the folder if it kept it
+        FileWatcher::get(watch_loop).unwatch(folder);
     }
-    return true;
+}
+
+void FileHandler::watch(uv_loop_t *loop) noexcept {
+    if (watch_loop != nullptr) {
+        return;
+    }
+    watch_loop = loop;
+    FileWatcher::get(loop).watch(folder);
+}
+
+bool FileHandler::validateFile(const string &file) const noexcept {
+    return rules.matches(file);
+}
+
+string FileHandler::buildHeader(const string &file) const noexcept {
+    const MimeTypes::Type *type = MimeTypes::find(file.c_str());
+    string mime = type != nullptr ? type->mime : "application/octet-stream";
+    bool add_charset = !charset.empty() && mime.rfind("text/", 0) == 0 && mime.find("charset=") == string::npos;
+    bool add_lang = !lang.empty() && mime.rfind("text/gemini", 0) == 0 && mime.find("lang=") == string::npos;
+    if (type != nullptr && !add_charset && !add_lang) {
+        return string(type->header, type->header_length);
+    }
+
+    if (add_charset) {
+        mime += "; charset=" + charset;
+    }
+    if (add_lang) {
+        mime += "; lang=" + lang;
+    }
+    return "20 " + mime + "\r\n";
 }
 
 bool FileHandler::isExecutable(string file) const noexcept {
@@ -56,34 +104,74 @@ bool FileHandler::isExecutable(string file) const noexcept {
     return false;
 }
 
-phmap::flat_hash_map<string, string> FileHandler::generateEnvironment(const string &file, const ClientConnection *client) const noexcept {
+// Variables that are set by the server, and may not be overridden by cgiVars
+const phmap::flat_hash_set<string> SERVER_VARS = {
+    "CONTENT_LENGTH",
+    "CONTENT_TYPE",
+    "GATEWAY_INTERFACE",
+    "GEMINI_DOCUMENT_ROOT",
+    "GEMINI_SCRIPT_FILENAME",
+    "GEMINI_URL",
+    "GEMINI_URL_PATH",
+    "LANG",
+    "LC_COLLATE",
+    "PATH",
+    "QUERY_STRING",
+    "REMOTE_ADDR",
+    "REMOTE_HOST",
+    "REQUEST_METHOD",
+    "SCRIPT_NAME",
+    "SERVER_NAME",
+    "SERVER_PORT",
+    "SERVER_PROTOCOL",
+    "SERVER_SOFTWARE",
+    "TITAN_TOKEN",
+};
+
+void FileHandler::buildEnvironment() noexcept {
+    for (auto var : cgi_vars) {
+        if (!SERVER_VARS.count(var.first)) {
+            cgi_env.set(var.first, var.second);
+        }
+    }
+
+    cgi_env.set("GATEWAY_INTERFACE", "CGI/1.1");
+    cgi_env.set("GEMINI_DOCUMENT_ROOT", folder);
+    cgi_env.set("LANG", cgi_lang);
+    cgi_env.set("LC_COLLATE", "C");
+    cgi_env.set("PATH", Executor::getPath());
+    cgi_env.set("REQUEST_METHOD", "");
+    cgi_env.set("SERVER_PROTOCOL", "GEMINI");
+    cgi_env.set("SERVER_SOFTWARE", SOFTWARE);
+}
+
+void FileHandler::generateEnvironment(const string &file, const ClientConnection *client, Environment &env) const noexcept {
     const Request &request = client->getRequest();
-    phmap::flat_hash_map<string, string> env = cgi_vars;
 
     size_t pos = request.header.find('\r');
-    string url = request.header.substr(0, pos);
-
-    env["GATEWAY_INTERFACE"] = "CGI/1.1";
-    env["GEMINI_DOCUMENT_ROOT"] = folder;
-    env["GEMINI_SCRIPT_FILENAME"] = file;
-    env["GEMINI_URL"] = url;
-    env["GEMINI_URL_PATH"] = request.path;
-    env["LANG"] = cgi_lang;
-    env["LC_COLLATE"] = "C";
-    env["PATH"] = Executor::getPath();
-    env["QUERY_STRING"] = request.query;
-    env["REMOTE_ADDR"] = ""; // TODO
-    env["REMOTE_HOST"] = ""; // TODO
-    env["REQUEST_METHOD"] = "";
-    env["SCRIPT_NAME"] = "/" + path::relpath(file, folder);
-    env["SERVER_NAME"] = request.host;
-    char port[6];
-    sprintf(port, "%d", request.port);
-    env["SERVER_PORT"] = port;
-    env["SERVER_PROTOCOL"] = "GEMINI";
-    env["SERVER_SOFTWARE"] = SOFTWARE;
+    if (pos == string::npos) {
+        pos = request.header.find('\n');
+    }
 
-    return env;
+    env.set("GEMINI_SCRIPT_FILENAME", file);
+    env.set("GEMINI_URL", request.header.c_str(), pos == string::npos ? request.header.length() : pos);
+    env.set("GEMINI_URL_PATH", request.path);
+    env.set("QUERY_STRING", request.query);
+    env.set("REMOTE_ADDR", ""); // TODO
+    env.set("REMOTE_HOST", ""); // TODO
+    env.set("SCRIPT_NAME", "/" + path::relpath(file, folder));
+    env.set("SERVER_NAME", request.host);
+    char port[6];
+    int port_len = snprintf(port, sizeof(port), "%d", request.port);
+    env.set("SERVER_PORT", port, port_len);
+
+    if (request.is_upload) {
+        char length[21];
+        int length_len = snprintf(length, sizeof(length), "%zu", request.upload.size);
+        env.set("CONTENT_LENGTH", length, length_len);
+        env.set("CONTENT_TYPE", request.upload.mime);
+        env.set("TITAN_TOKEN", request.upload.token);
+    }
 }
 
 
@@ -102,21 +190,131 @@ bool FileHandler::shouldHandle(string host, string path) noexcept {
     return true;
 }
 
+struct RequestContext;
+
+/**
+ * A block of a file that is being read or is waiting to be sent
+ */
+struct ReadBlock {
+    RequestContext *ctx;
+    uv_buf_t buf;
+    // Bytes at the start of buf that are sent before the data, for the header
+    size_t prefix;
+    uint64_t offset;
+    size_t length;
+    ssize_t result;
+    bool reading;
+    bool ready;
+};
+
+/**
+ * The state of a file being streamed to a client
+ * 
+ * Up to READ_AHEAD blocks are read at once, and are sent in order as they
+ * finish. New reads are only started while the client is keeping up, so a slow
+ * client holds at most a few blocks in memory.
+ */
+struct FileStream {
+    ReadBlock blocks[READ_AHEAD];
+    size_t block_size;
+    uint64_t size;
+    // Offset of the next block to read
+    uint64_t next_read = 0;
+    // Offset of the next block to send
+    uint64_t next_send = 0;
+    // Number of reads in flight
+    size_t reading = 0;
+    // Whether the whole file has been sent, or the stream failed
+    bool done = false;
+};
+
+// Read blocks that are kept for reuse, by size
+phmap::flat_hash_map<size_t, vector<std::unique_ptr<char[]>>> free_blocks;
+
+uv_buf_t block_allocate(size_t size) {
+    auto &blocks = free_blocks[size];
+    if (blocks.empty()) {
+        return uv_buf_init(new char[size], size);
+    }
+    char *base = blocks.back().release();
+    blocks.pop_back();
+    return uv_buf_init(base, size);
+}
+
+void block_deallocate(uv_buf_t buf) {
+    auto &blocks = free_blocks[buf.len];
+    if (blocks.size() >= MAX_FREE_BLOCKS) {
+        delete[] buf.base;
+        return;
+    }
+    blocks.emplace_back(buf.base);
+}
+
+void stream_free(FileStream *stream) {
+    for (ReadBlock &block : stream->blocks) {
+        if (block.buf.base != nullptr) {
+            block_deallocate(block.buf);
+        }
+    }
+    delete stream;
+}
+
 struct RequestContext {
     uv_fs_t req;
-    uv_file fd;
-    uv_buf_t buf;
-    size_t offset;
+    FileStream *stream;
     string file;
 	ClientConnection *client;
     const FileHandler *handler;
+    FileEntry *entry;
+    // Whether an asynchronous operation is using the context
+    bool busy;
+    // Whether the client closed while the context was busy
+    bool closed;
 };
 ReusableAllocator<RequestContext> request_allocator;
 
+void release_entry(RequestContext *ctx) {
+    if (ctx->entry != nullptr) {
+        FileCache::get(ctx->req.loop).release(ctx->entry);
+        ctx->entry = nullptr;
+    }
+}
+
+void request_free(RequestContext *ctx) {
+    release_entry(ctx);
+    if (ctx->stream != nullptr) {
+        stream_free(ctx->stream);
+        ctx->stream = nullptr;
+    }
+    request_allocator.deallocate(ctx);
+}
+
+/**
+ * Mark an asynchronous operation as finished
+ * 
+ * @param ctx request context
+ * 
+ * @return true if the client closed during the operation, in which case the
+ *     context has been freed
+ */
+bool request_done(RequestContext *ctx) {
+    ctx->busy = false;
+    if (ctx->closed) {
+        request_free(ctx);
+        return true;
+    }
+    return false;
+}
+
 void on_client_closed(ClientConnection *client, void *ctx) {
     RequestContext *request = static_cast<RequestContext *>(ctx);
-    request_allocator.deallocate(request);
     LOG_DEBUG("Connection Closed");
+    if (request->busy) {
+        // The context is freed once the pending operation finishes
+        request->closed = true;
+        return;
+    }
+    request_free(request);
 }
 
 
@@ -129,10 +327,10 @@ void on_client_closed(ClientConnection *client, void *ctx) {
 ////////////////////////////////////////////////////////////////////////////////
 
 void read_file(RequestContext *ctx);
-void read_dir(RequestContext *ctx);
+void read_dir(RequestContext *ctx, const uv_timespec_t &mtime);
 void run_cgi(RequestContext *ctx);
 
-void handle_on_stat(uv_fs_t *req);
+void handle_on_stat(FileEntry *entry, void *arg);
 void FileHandler::handle(ClientConnection *client) noexcept {
     // Get the absolute path of the requested file
 	const Request &request = client->getRequest();
@@ -159,6 +357,19 @@ void FileHandler::handle(ClientConnection *client) noexcept {
         return;
     }
 
+    if (request.is_upload) {
+        if (max_upload_size == 0) {
+            client->send(HEADER(UPLOAD_NOT_ALLOWED));
+            client->close();
+            return;
+        }
+        if (request.upload.size > max_upload_size) {
+            client->send(HEADER(UPLOAD_TOO_LARGE));
+            client->close();
+            return;
+        }
+    }
+
     // Check if the path exists, and if it is a file or not
     RequestContext *ctx = request_allocator.allocate();
     ctx->file = file;
@@ -166,24 +377,34 @@ void FileHandler::handle(ClientConnection *client) noexcept {
     ctx->req.loop = uv_default_loop();
 	ctx->client = client;
     ctx->handler = this;
+    ctx->stream = nullptr;
+    ctx->entry = nullptr;
+    ctx->busy = true;
+    ctx->closed = false;
     client->setClientCloseCallback(on_client_closed, ctx);
-    uv_fs_stat(ctx->req.loop, &ctx->req, ctx->file.c_str(), handle_on_stat);
+    FileCache::get(ctx->req.loop).stat(ctx->file, handle_on_stat, ctx);
 }
-void handle_on_stat(uv_fs_t *req) {
-    RequestContext *ctx = static_cast<RequestContext *>(req->data);
+void handle_on_stat(FileEntry *entry, void *arg) {
+    RequestContext *ctx = static_cast<RequestContext *>(arg);
+    ctx->entry = entry;
+    if (request_done(ctx)) {
+        return;
+    }
 
-    if (req->result != 0) {
+    if (entry->status != 0) {
         // The file does not exist or does not have read permissions
         ctx->client->send(HEADER(DOES_NOT_EXIST));
         ctx->client->close();
-        uv_fs_req_cleanup(req);
         return;
     }
     string path = ctx->client->getRequest().path;
+    bool is_dir = entry->isDir();
+    bool is_file = entry->isFile();
+    uv_timespec_t mtime = entry->stat.st_mtim;
+    release_entry(ctx);
 
-    if (S_IFDIR & req->statbuf.st_mode) {
+    if (is_dir) {
         // The path is a directory
-        uv_fs_req_cleanup(req);
 
         if (path.empty() || path.back() != '/') {
             // Make sure that the path ends with a forward slash for directories
@@ -194,12 +415,11 @@ void handle_on_stat(uv_fs_t *req) {
             return;
         }
 
-        read_dir(ctx);
+        read_dir(ctx, mtime);
         return;
     }
-    if (S_IFREG & req->statbuf.st_mode) {
+    if (is_file) {
         // The path is a file
-        uv_fs_req_cleanup(req);
 
         if (!path.empty() && path.back() == '/') {
             // Make sure that the path ends with a forward slash for directories
@@ -215,7 +435,6 @@ void handle_on_stat(uv_fs_t *req) {
 
     ctx->client->send(HEADER(DOES_NOT_EXIST));
     ctx->client->close();
-    uv_fs_req_cleanup(req);
 }
 
 
@@ -228,55 +447,184 @@ void handle_on_stat(uv_fs_t *req) {
 ////////////////////////////////////////////////////////////////////////////////
 
 
-void file_on_close(uv_fs_t *req);
-void file_on_read(uv_fs_t *req);
-void file_on_open(uv_fs_t *req);
+void file_on_read(ssize_t result, void *arg);
+void file_on_open(FileEntry *entry, void *arg);
+void file_on_drain(ClientConnection *client, void *arg);
 void read_file(RequestContext *ctx) {
     if (ctx->handler->isExecutable(ctx->file)) {
         // Run the file if it is a cgi script
         run_cgi(ctx);
         return;
     }
+    if (ctx->client->getRequest().is_upload) {
+        // Only scripts can accept uploads
+        ctx->client->send(HEADER(UPLOAD_NOT_ALLOWED));
+        ctx->client->close();
+        return;
+    }
 
-    uv_fs_open(ctx->req.loop, &ctx->req, ctx->file.c_str(), 0, UV_FS_O_RDONLY, file_on_open);
+    ctx->busy = true;
+    FileCache::get(ctx->req.loop).open(ctx->file, file_on_open, ctx);
 }
-void file_on_open(uv_fs_t *req) {
-    RequestContext *ctx = static_cast<RequestContext *>(req->data);
 
-    if (req->result < 0) {
-        // The file couldn't be opened
-        ctx->client->send(HEADER(FILE_NOT_OPEN));
-        ctx->client->close();
-        uv_fs_req_cleanup(req);
+/**
+ * Start reading the next blocks of the file, as long as the client keeps up
+ */
+void stream_fill(RequestContext *ctx) {
+    FileStream *stream = ctx->stream;
+    if (ctx->client->getPending() >= stream->block_size * READ_AHEAD) {
+        // Wait for the client to drain before reading any more
         return;
     }
-    ctx->fd = req->result;
-    ctx->buf = buffer_allocate();
-    ctx->offset = 0;
+    for (ReadBlock &block : stream->blocks) {
+        if (stream->next_read >= stream->size) {
+            break;
+        }
+        if (block.reading || block.ready) {
+            continue;
+        }
+        if (block.buf.base == nullptr) {
+            block.buf = block_allocate(stream->block_size);
+        }
+        uint64_t remaining = stream->size - stream->next_read;
+        size_t space = block.buf.len - block.prefix;
+        block.offset = stream->next_read;
+        block.length = remaining < space ? remaining : space;
+        block.reading = true;
+        stream->next_read += block.length;
+        ++stream->reading;
+        ctx->busy = true;
+
+        // The descriptor is shared through the file cache, so always read at an offset
+        FileIO::get(ctx->req.loop).read(ctx->entry->fd, block.buf.base + block.prefix, block.length, block.offset, file_on_read, &block);
+    }
+}
 
-    const auto header = responseHeader(RES_SUCCESS, mimeTypes.getType(ctx->file.c_str()));
-    ctx->client->send(HEADER(header));
+/**
+ * Send the blocks that are ready in order, then read ahead again
+ */
+void stream_pump(RequestContext *ctx) {
+    FileStream *stream = ctx->stream;
+    bool found = true;
+    while (found) {
+        found = false;
+        for (ReadBlock &block : stream->blocks) {
+            if (!block.ready || block.offset != stream->next_send) {
+                continue;
+            }
+            block.ready = false;
+            if (block.result < 0) {
+                // The file couldn't be read
+                if (block.prefix > 0) {
+                    ctx->client->send(HEADER(FILE_NOT_OPEN));
+                }
+                stream->done = true;
+                ctx->client->close();
+                return;
+            }
+            if (block.result > 0 || block.prefix > 0) {
+                ctx->client->send(block.buf.base, block.prefix + block.result);
+                stream->next_send += block.result;
+                found = block.result > 0;
+            }
+            block.prefix = 0;
+        }
+    }
 
-    uv_fs_read(req->loop, req, ctx->fd, &ctx->buf, 1, ctx->offset, file_on_read);
+    if (stream->next_send >= stream->size) {
+        stream->done = true;
+        ctx->client->close();
+        return;
+    }
+    stream_fill(ctx);
 }
-void file_on_read(uv_fs_t *req) {
-    RequestContext *ctx = static_cast<RequestContext *>(req->data);
 
-    if (req->result <= 0) {
+void file_on_open(FileEntry *entry, void *arg) {
+    RequestContext *ctx = static_cast<RequestContext *>(arg);
+    ctx->entry = entry;
+    if (request_done(ctx)) {
+        return;
+    }
+
+    if (entry->status != 0) {
+        ctx->client->send(HEADER(DOES_NOT_EXIST));
         ctx->client->close();
-        uv_fs_req_cleanup(req);
-        uv_fs_close(req->loop, req, ctx->fd, file_on_close);
         return;
     }
+    if (entry->fd < 0) {
+        // The file couldn't be opened
+        ctx->client->send(HEADER(FILE_NOT_OPEN));
+        ctx->client->close();
+        return;
+    }
+
+    // The header is built once for as long as the file is cached
+    if (entry->header_owner != ctx->handler->getId()) {
+        entry->header = ctx->handler->buildHeader(ctx->file);
+        entry->header_owner = ctx->handler->getId();
+    }
 
-    ctx->client->send(ctx->buf.base, req->result);
-    ctx->offset += req->result;
+    FileStream *stream = new FileStream;
+    for (ReadBlock &block : stream->blocks) {
+        block.ctx = ctx;
+        block.buf.base = nullptr;
+        block.prefix = 0;
+        block.reading = false;
+        block.ready = false;
+    }
+    stream->block_size = ctx->handler->getReadBlockSize();
+    stream->size = entry->stat.st_size;
+    ctx->stream = stream;
+    ctx->client->setClientDrainCallback(file_on_drain, ctx);
+
+    if (stream->size == 0 || entry->header.length() >= stream->block_size) {
+        ctx->client->send(entry->header.c_str(), entry->header.length());
+    } else {
+        // Send the header in the same write (and TLS record) as the start of the file
+        ReadBlock &first = stream->blocks[0];
+        first.buf = block_allocate(stream->block_size);
+        first.prefix = entry->header.length();
+        memcpy(first.buf.base, entry->header.c_str(), first.prefix);
+    }
+    if (stream->size == 0) {
+        stream->done = true;
+        ctx->client->close();
+        return;
+    }
+    stream_fill(ctx);
+}
+void file_on_read(ssize_t result, void *arg) {
+    ReadBlock *block = static_cast<ReadBlock *>(arg);
+    RequestContext *ctx = block->ctx;
+    FileStream *stream = ctx->stream;
+    block->result = result;
+    block->reading = false;
+    --stream->reading;
+    ctx->busy = stream->reading > 0;
+    if (ctx->closed) {
+        if (!ctx->busy) {
+            request_free(ctx);
+        }
+        return;
+    }
+    if (stream->done) {
+        return;
+    }
 
-    uv_fs_req_cleanup(req);
-    uv_fs_read(req->loop, req, ctx->fd, &ctx->buf, 1, ctx->offset, file_on_read);
+    if (block->result >= 0 && (size_t)block->result < block->length) {
+        // The file got shorter since it was opened, so stop at the short read
+        // Blocks finish out of order, so a later one must not raise it again
+        stream->size = std::min(stream->size, block->offset + block->result);
+    }
+    block->ready = true;
+    stream_pump(ctx);
 }
-void file_on_close(uv_fs_t *req) {
-    uv_fs_req_cleanup(req);
+void file_on_drain(ClientConnection *client, void *arg) {
+    RequestContext *ctx = static_cast<RequestContext *>(arg);
+    if (ctx->closed || ctx->stream == nullptr || ctx->stream->done) {
+        return;
+    }
+    stream_fill(ctx);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -291,12 +639,19 @@ class CGIRunner;
 
 typedef void (*onCGIRunnerClose)(CGIRunner *runner);
 
+struct UploadWrite {
+    uv_write_t req;
+    uv_buf_t buf;
+};
+ReusableAllocator<UploadWrite> upload_allocator;
+
 class CGIRunner : public ExecutorContext {
 private:
     RequestContext *ctx;
     uv_pipe_t *response;
     Executor executor;
     bool closing = false;
+    bool client_closed = false;
     const onCGIRunnerClose close_cb;
 
     static void __on_pipe_closed(uv_handle_t *handle) {
@@ -320,6 +675,11 @@ private:
             buffer_deallocate(*buf);
             return;
         }
+        if (nread == UV_EOF) {
+            buffer_deallocate(*buf);
+            runner->close();
+            return;
+        }
         if (nread < 0) {
             LOG_ERROR("Could not read data from pipe: '" << uv_strerror(nread) << "'");
             buffer_deallocate(*buf);
@@ -327,6 +687,10 @@ private:
             return;
         }
 
+        if (!runner->received && nread > 0) {
+            runner->received = true;
+            runner->armTimeout();
+        }
         runner->ctx->client->send(buf->base, nread);
 
         buffer_deallocate(*buf);
@@ -341,24 +705,263 @@ private:
     static void __on_client_closed(ClientConnection *client, void *ctx) {
         LOG_DEBUG("Client Closed");
         CGIRunner *runner = static_cast<CGIRunner *>(ctx);
+        runner->client_closed = true;
         runner->close_cb(runner);
     }
 
+    uv_pipe_t *input = nullptr;
+    size_t upload_queued = 0;
+    bool upload_paused = false;
+    bool upload_done = false;
+
+    static void __on_input_closed(uv_handle_t *handle) {
+        if (handle->data != nullptr) {
+            CGIRunner *runner = static_cast<CGIRunner *>(handle->data);
+            runner->input = nullptr;
+        }
+        pipe_allocator.deallocate((uv_pipe_t *)handle);
+    }
+
+    static void __on_upload_written(uv_write_t *req, int status) noexcept {
+        UploadWrite *write = reinterpret_cast<UploadWrite *>(req);
+        CGIRunner *runner = static_cast<CGIRunner *>(req->handle->data);
+        size_t length = write->buf.len;
+        buffer_deallocate(write->buf);
+        upload_allocator.deallocate(write);
+        if (runner == nullptr) {
+            return;
+        }
+        runner->upload_queued -= length;
+
+        if (status < 0) {
+            if (status != UV_ECANCELED) {
+                LOG_WARN("Could not send the upload to '" << runner->ctx->file << "': " << uv_strerror(status));
+            }
+            runner->stopUpload();
+            return;
+        }
+        if (runner->upload_queued == 0 && runner->upload_done) {
+            runner->stopUpload();
+        } else if (runner->upload_paused && runner->upload_queued < UPLOAD_LOW_WATER && !runner->client_closed) {
+            runner->upload_paused = false;
+            runner->ctx->client->resumeData();
+        }
+    }
+
+    static void __on_client_data(ClientConnection *client, const char *data, size_t length, void *ctx) noexcept {
+        CGIRunner *runner = static_cast<CGIRunner *>(ctx);
+        if (runner->input == nullptr || runner->upload_done) {
+            return;
+        }
+        if (length == 0) {
+            runner->upload_done = true;
+            if (runner->upload_queued == 0) {
+                runner->stopUpload();
+            }
+            return;
+        }
+
+        // The data is only valid during the callback, so copy it into the write buffers
+        size_t pos = 0;
+        while (pos < length) {
+            UploadWrite *write = upload_allocator.allocate();
+            write->buf = buffer_allocate();
+            size_t len = length - pos < write->buf.len ? length - pos : write->buf.len;
+            memcpy(write->buf.base, data + pos, len);
+            write->buf.len = len;
+            pos += len;
+
+            int res = uv_write(&write->req, (uv_stream_t *)runner->input, &write->buf, 1, __on_upload_written);
+            if (res < 0) {
+                buffer_deallocate(write->buf);
+                upload_allocator.deallocate(write);
+                LOG_WARN("Could not send the upload to '" << runner->ctx->file << "': " << uv_strerror(res));
+                runner->stopUpload();
+                return;
+            }
+            runner->upload_queued += len;
+        }
+
+        if (runner->upload_queued > UPLOAD_HIGH_WATER && !runner->upload_paused) {
+            // Let the script catch up before reading any more of the upload
+            runner->upload_paused = true;
+            client->pauseData();
+        }
+    }
+
+    /**
+     * Stop sending the upload and close the script's stdin
+     */
+    void stopUpload() noexcept {
+        if (input == nullptr || uv_is_closing((uv_handle_t *)input)) {
+            return;
+        }
+        upload_done = true;
+        if (!client_closed) {
+            ctx->client->setClientDataCallback(nullptr);
+            ctx->client->pauseData();
+        }
+        uv_close((uv_handle_t *)input, __on_input_closed);
+    }
+
+    uv_timer_t *timer;
+    uint64_t started = 0;
+    bool received = false;
+    bool terminating = false;
+
+    Limiter *local;
+    Limiter *waiting = nullptr;
+    uint64_t ticket = 0;
+    uint64_t deadline = 0;
+    bool holding_local = false;
+    bool holding_global = false;
+
+    static void __on_local_acquire(bool acquired, void *ctx) noexcept {
+        CGIRunner *runner = static_cast<CGIRunner *>(ctx);
+        runner->waiting = nullptr;
+        if (!acquired) {
+            runner->reject(Limiter::QUEUED);
+            return;
+        }
+        runner->holding_local = true;
+        runner->acquireGlobal();
+    }
+
+    static void __on_global_acquire(bool acquired, void *ctx) noexcept {
+        CGIRunner *runner = static_cast<CGIRunner *>(ctx);
+        runner->waiting = nullptr;
+        if (!acquired) {
+            runner->reject(Limiter::QUEUED);
+            return;
+        }
+        runner->holding_global = true;
+        runner->run();
+    }
+
+    static void __on_timeout(uv_timer_t *timer) noexcept {
+        CGIRunner *runner = static_cast<CGIRunner *>(timer->data);
+        if (runner == nullptr) {
+            return;
+        }
+        runner->timeout();
+    }
+
+    /**
+     * Start the timer for whichever timeout comes first
+     */
+    void armTimeout() noexcept {
+        const CGITimeouts &timeouts = ctx->handler->getCgiTimeouts();
+        uint64_t due = UINT64_MAX;
+        if (timeouts.timeout > 0) {
+            due = started + timeouts.timeout;
+        }
+        if (!received && timeouts.first_byte_timeout > 0 && started + timeouts.first_byte_timeout < due) {
+            due = started + timeouts.first_byte_timeout;
+        }
+        uv_timer_stop(timer);
+        if (due == UINT64_MAX) {
+            return;
+        }
+        uint64_t now = uv_now(ctx->req.loop);
+        uv_timer_start(timer, __on_timeout, due > now ? due - now : 0, 0);
+    }
+
+    /**
+     * Ask the script to terminate, and kill it if it doesn't in time
+     */
+    void timeout() noexcept {
+        if (terminating) {
+            LOG_WARN("CGI Script '" << ctx->file << "' did not terminate, killing it");
+            metrics::counter("gemcaps_cgi_killed_total", "Number of cgi scripts killed after not terminating").inc();
+            executor.signal(SIGKILL);
+            close();
+            return;
+        }
+        terminating = true;
+        LOG_WARN("CGI Script '" << ctx->file << "' timed out");
+        if (received) {
+            metrics::counter("gemcaps_cgi_timeouts_total{timeout=\"wall\"}", "Number of cgi scripts that ran too long").inc();
+        } else {
+            metrics::counter("gemcaps_cgi_timeouts_total{timeout=\"first_byte\"}").inc();
+            ctx->client->send(CGI_TIMED_OUT.buf, CGI_TIMED_OUT.length());
+        }
+        if (!closing && response != nullptr) {
+            uv_read_stop((uv_stream_t *)response);
+        }
+        if (!executor.is_alive()) {
+            close();
+            return;
+        }
+        executor.signal(SIGTERM);
+        uv_timer_start(timer, __on_timeout, ctx->handler->getCgiTimeouts().kill_timeout, 0);
+    }
+
+    void acquireGlobal() noexcept {
+        Limiter &global = Executor::limiter();
+        if (!global.enabled()) {
+            run();
+            return;
+        }
+        Limiter::Result result = global.acquire(ctx->req.loop, __on_global_acquire, this, &ticket, deadline);
+        if (result == Limiter::ACQUIRED) {
+            holding_global = true;
+            run();
+        } else if (result == Limiter::QUEUED) {
+            waiting = &global;
+        } else {
+            reject(result);
+        }
+    }
+
+    /**
+     * Tell the client that the script can't be run right now
+     * 
+     * @param result FULL if the queue was full, otherwise the request timed out
+     */
+    void reject(Limiter::Result result) noexcept {
+        if (result == Limiter::FULL) {
+            // Ask the client to wait about as long as a request would wait in the queue
+            Limiter *limiter = local != nullptr && local->enabled() ? local : &Executor::limiter();
+            uint64_t seconds = limiter->getTimeout() / 1000;
+            const auto header = responseHeader<32>(RES_SLOW_DOWN, std::to_string(seconds > 0 ? seconds : 1).c_str());
+            ctx->client->send(header.buf, header.length());
+        } else {
+            ctx->client->send(CGI_BUSY.buf, CGI_BUSY.length());
+        }
+        close();
+    }
 public:
-    CGIRunner(RequestContext *ctx, phmap::flat_hash_map<string, string> env, vector<string> args, onCGIRunnerClose on_close)
+    CGIRunner(RequestContext *ctx, vector<string> args, onCGIRunnerClose on_close)
             : ctx(ctx),
-              executor(ctx->file, env, args),
+              executor(ctx->file, ctx->handler->getEnvironment(), args, &ctx->handler->getScriptRunners()),
               response(pipe_allocator.allocate()),
-              close_cb(on_close) {
+              close_cb(on_close),
+              local(ctx->handler->getCgiLimiter()) {
         ctx->client->setClientCloseCallback(__on_client_closed, this);
         executor.setContext(this);
+        executor.setLimits(ctx->handler->getCgiTimeouts().resources);
+        ctx->handler->generateEnvironment(ctx->file, ctx->client, executor.environment());
+
+        timer = timer_allocator.allocate();
+        uv_timer_init(ctx->req.loop, timer);
+        timer->data = this;
 
         uv_pipe_init(ctx->req.loop, response, false);
         response->data = this;
     }
     
     ~CGIRunner() {
-        request_allocator.deallocate(ctx);
+        request_free(ctx);
+
+        timer->data = nullptr;
+        uv_close((uv_handle_t *)timer, on_timer_close);
+
+        if (input != nullptr) {
+            input->data = nullptr;
+            if (!uv_is_closing((uv_handle_t *)input)) {
+                uv_close((uv_handle_t *)input, __on_input_closed);
+            }
+        }
 
         if (response != nullptr) {
             response->data = nullptr;
@@ -366,6 +969,40 @@ public:
                 close();
             }
         }
+
+        // Releasing a slot may start the next waiting script, so do it last
+        if (waiting != nullptr) {
+            waiting->cancel(ticket);
+        }
+        if (holding_global) {
+            Executor::limiter().release();
+        }
+        if (holding_local) {
+            local->release();
+        }
+    }
+
+    /**
+     * Wait for a free slot and then run the cgi script
+     */
+    void start() noexcept {
+        if (local == nullptr || !local->enabled()) {
+            acquireGlobal();
+            return;
+        }
+        if (local->getTimeout() > 0) {
+            // The deadline covers the time spent waiting in both queues
+            deadline = uv_now(ctx->req.loop) + local->getTimeout();
+        }
+        Limiter::Result result = local->acquire(ctx->req.loop, __on_local_acquire, this, &ticket, deadline);
+        if (result == Limiter::ACQUIRED) {
+            holding_local = true;
+            acquireGlobal();
+        } else if (result == Limiter::QUEUED) {
+            waiting = local;
+        } else {
+            reject(result);
+        }
     }
 
     /**
@@ -373,30 +1010,79 @@ public:
      */
     void run() noexcept {
         uv_file pipe[2];
-        uv_pipe(pipe, UV_NONBLOCK_PIPE, 0);
+        int error = uv_pipe(pipe, UV_NONBLOCK_PIPE, 0);
+        if (error != 0) {
+            LOG_ERROR("Could not create a pipe for CGI Script '" << ctx->file << "': " << uv_strerror(error));
+            ctx->client->send(CGI_ERROR.buf, CGI_ERROR.length());
+            close();
+            return;
+        }
 
         uv_pipe_open(response, pipe[0]);
         uv_read_start((uv_stream_t *)response, __on_alloc, __on_read);
 
-        int error = executor.spawn(ctx->req.loop, -1, pipe[1]);
+        // Titan uploads are streamed to the script's stdin
+        uv_file upload[2] = {-1, -1};
+        uv_fs_t close_req;
+        if (ctx->client->getRequest().is_upload) {
+            error = uv_pipe(upload, 0, UV_NONBLOCK_PIPE);
+            if (error != 0) {
+                LOG_ERROR("Could not create a pipe for CGI Script '" << ctx->file << "': " << uv_strerror(error));
+                uv_fs_close(ctx->req.loop, &close_req, pipe[1], nullptr);
+                uv_fs_req_cleanup(&close_req);
+                ctx->client->send(CGI_ERROR.buf, CGI_ERROR.length());
+                close();
+                return;
+            }
+            input = pipe_allocator.allocate();
+            uv_pipe_init(ctx->req.loop, input, false);
+            input->data = this;
+            uv_pipe_open(input, upload[1]);
+        }
+
+        error = executor.spawn(ctx->req.loop, upload[0], pipe[1]);
+
+        // The child has its own copy of the write end, closing ours lets the
+        // pipe reach EOF once the script is finished writing
+        uv_fs_close(ctx->req.loop, &close_req, pipe[1], nullptr);
+        uv_fs_req_cleanup(&close_req);
+        if (upload[0] >= 0) {
+            uv_fs_close(ctx->req.loop, &close_req, upload[0], nullptr);
+            uv_fs_req_cleanup(&close_req);
+        }
+
         if (error != 0) {
             LOG_ERROR("Could not start CGI Script '" << ctx->file << "': " << uv_strerror(error));
             ctx->client->send(CGI_ERROR.buf, CGI_ERROR.length());
             close();
             return;
         }
-        return;
+        started = uv_now(ctx->req.loop);
+        armTimeout();
+
+        if (input != nullptr) {
+            ctx->client->setClientDataCallback(__on_client_data, this);
+            ctx->client->resumeData();
+        }
     }
 
     /**
      * Close the client connection and make sure the cgi script stops
      */
     void close() {
-        closing = true;
         if (executor.is_alive()) {
             executor.signal(SIGINT);
         }
-        ctx->client->close();
+        if (closing || response == nullptr) {
+            // The pipe can reach EOF before the script exits
+            return;
+        }
+        closing = true;
+        uv_timer_stop(timer);
+        stopUpload();
+        if (!client_closed) {
+            ctx->client->close();
+        }
         uv_close((uv_handle_t *)response, __on_pipe_closed);
     }
 
@@ -410,11 +1096,10 @@ public:
 
 void on_cgi_close(CGIRunner *runner);
 void run_cgi(RequestContext *ctx) {
-    phmap::flat_hash_map<string, string> env = ctx->handler->generateEnvironment(ctx->file, ctx->client);
     vector<string> args;
 
-    CGIRunner *runner = new CGIRunner(ctx, env, args, on_cgi_close);
-    runner->run();
+    CGIRunner *runner = new CGIRunner(ctx, args, on_cgi_close);
+    runner->start();
 }
 void on_cgi_close(CGIRunner *runner) {
     delete runner;
@@ -432,38 +1117,29 @@ void on_cgi_close(CGIRunner *runner) {
 // If there is no index.* file, and ctx->handler->canReadDirs() is true, then
 // the contents of the directory will be read to the client.
 //
+// Listings come from the DirCache, so the directory is only read again once
+// it has changed.
+//
 ////////////////////////////////////////////////////////////////////////////////
 
-void dir_on_scan(uv_fs_t *req);
-void read_dir(RequestContext *ctx) {
-    uv_fs_scandir(ctx->req.loop, &ctx->req, ctx->file.c_str(), 0, dir_on_scan);
+void dir_on_listing(DirListing *listing, void *arg);
+void read_dir(RequestContext *ctx, const uv_timespec_t &mtime) {
+    ctx->busy = true;
+    DirCache::get(ctx->req.loop).list(ctx->file, mtime, dir_on_listing, ctx);
 }
-void dir_on_scan(uv_fs_t *req) {
-    RequestContext *ctx = static_cast<RequestContext *>(req->data);
+void dir_on_listing(DirListing *listing, void *arg) {
+    RequestContext *ctx = static_cast<RequestContext *>(arg);
+    if (request_done(ctx)) {
+        return;
+    }
 
-    if (req->result < 0) {
+    if (listing->status < 0) {
         ctx->client->send(HEADER(FILE_NOT_OPEN));
         ctx->client->close();
-        uv_fs_req_cleanup(req);
-        request_allocator.deallocate(ctx);
         return;
     }
 
-    vector<string> folders;
-    vector<string> children;
-
-    uv_dirent_t entry;
-    while (uv_fs_scandir_next(req, &entry) != UV_EOF) {
-        string name = entry.name;
-        if (entry.type == UV_DIRENT_DIR) {
-            folders.push_back(name);
-        } else {
-            children.push_back(name);
-        }
-        // Assert that the filename starts with index
-        if (name.rfind("index.", 0) == string::npos) {
-            continue;
-        }
+    for (const string &name : listing->indexes) {
         string new_file = path::join(ctx->file, name);
 
         // Assert that the file is allowed
@@ -471,45 +1147,26 @@ void dir_on_scan(uv_fs_t *req) {
             continue;
         }
         ctx->file = new_file;
-        uv_fs_req_cleanup(req);
         read_file(ctx);
         return;
     }
-    uv_fs_req_cleanup(req);
 
-    if (!ctx->handler->canReadDirs()) {
-        ctx->client->send(HEADER(DOES_NOT_EXIST));
+    if (ctx->client->getRequest().is_upload) {
+        ctx->client->send(HEADER(UPLOAD_NOT_ALLOWED));
         ctx->client->close();
-        request_allocator.deallocate(ctx);
         return;
     }
 
-    // Read the contents of the directory
-
-    constexpr const auto header = responseHeader(RES_SUCCESS, "text/gemini");
-    ctx->client->send(HEADER(header));
-	
-	const Request &request = ctx->client->getRequest();
-
-    ostringstream oss;
-    oss << "# DirectoryContents\n\n## " << request.path << "\n\n";
-
-    oss << "=> " << path::dirname(request.path) << " back\n\n";
-
-    for (string folder : folders) {
-        oss << "=> " << path::join(request.path, folder) << "/ " << folder << "/\n";
-    }
-
-    oss << "\n";
-
-    for (string file : children) {
-        oss << "=> " << path::join(request.path, file) << " " << file << "\n";
+    if (!ctx->handler->canReadDirs()) {
+        ctx->client->send(HEADER(DOES_NOT_EXIST));
+        ctx->client->close();
+        return;
     }
 
-    string response = oss.str();
+    // The listing is rendered once for as long as the directory doesn't change
+    const string &response = listing->render(ctx->client->getRequest().path, ctx->handler->getListingOptions());
     ctx->client->send(response.c_str(), response.length());
     ctx->client->close();
-    request_allocator.deallocate(ctx);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -525,20 +1182,28 @@ shared_ptr<Handler> FileHandlerFactory::createHandler(YAML::Node settings, strin
     bool read_dirs = getProperty<bool>(settings, READ_DIRS, true);
     string cgi_lang = getProperty<string>(settings, CGI_LANG, "en_US.UTF-8");
 
-    vector<regex> rules;
+    vector<string> rule_patterns;
     if (settings[RULES].IsDefined()) {
         if (!settings[RULES].IsSequence()) {
             throw InvalidSettingsException(settings[RULES].Mark(), "'" + RULES + "' must be a sequence");
         }
         try {
             for (auto rule : settings[RULES]) {
-                string rule_value = rule.as<string>();
-                rules.push_back(regex(rule_value, re_consts::ECMAScript | re_consts::icase | re_consts::optimize));
+                rule_patterns.push_back(rule.as<string>());
             }
         } catch (YAML::RepresentationException e) {
             throw InvalidSettingsException(e.mark, e.msg);
         }
     }
+    RuleSet rules;
+    try {
+        rules = RuleSet(rule_patterns);
+    } catch (std::regex_error &e) {
+        throw InvalidSettingsException(settings[RULES].Mark(), "Invalid rule: " + string(e.what()));
+    }
+    if (rules.getFallbackCount() > 0) {
+        LOG_DEBUG(rules.getFallbackCount() << " rules in '" << folder << "' need std::regex");
+    }
 
     std::vector<string> cgi_types;
     if (settings[CGI_TYPES].IsDefined()) {
@@ -573,7 +1238,71 @@ shared_ptr<Handler> FileHandlerFactory::createHandler(YAML::Node settings, strin
     }
     folder = path::delUps(folder);
 
-    return make_shared<FileHandler>(
+    size_t max_concurrent_cgi = getProperty<size_t>(settings, MAX_CONCURRENT_CGI, 0);
+    size_t cgi_queue_size = getProperty<size_t>(settings, CGI_QUEUE_SIZE, 0);
+    uint64_t cgi_queue_timeout = getProperty<uint64_t>(settings, CGI_QUEUE_TIMEOUT, 0);
+    // Handlers may share a folder, but not the requests they serve
+    string limiter_name = (host.empty() ? "*" : host) + (base.empty() || base.front() != '/' ? "/" : "") + base;
+    auto cgi_limiter = make_shared<Limiter>(limiter_name, max_concurrent_cgi, cgi_queue_size, cgi_queue_timeout);
+
+    CGITimeouts cgi_timeouts;
+    cgi_timeouts.timeout = getProperty<uint64_t>(settings, CGI_TIMEOUT, 0);
+    cgi_timeouts.first_byte_timeout = getProperty<uint64_t>(settings, CGI_FIRST_BYTE_TIMEOUT, 0);
+    cgi_timeouts.kill_timeout = getProperty<uint64_t>(settings, CGI_KILL_TIMEOUT, 5000);
+    if (settings[CGI_LIMITS].IsDefined()) {
+        YAML::Node limits = settings[CGI_LIMITS];
+        if (!limits.IsMap()) {
+            throw InvalidSettingsException(limits.Mark(), "'" + CGI_LIMITS + "' must be a map");
+        }
+        cgi_timeouts.resources.cpu = getProperty<uint64_t>(limits, LIMIT_CPU, 0);
+        cgi_timeouts.resources.memory = getProperty<uint64_t>(limits, LIMIT_MEMORY, 0);
+        cgi_timeouts.resources.files = getProperty<uint64_t>(limits, LIMIT_FILES, 0);
+    }
+
+    size_t max_upload_size = getProperty<size_t>(settings, MAX_UPLOAD_SIZE, 0);
+
+    ListingOptions listing;
+    if (settings[LISTING].IsDefined()) {
+        YAML::Node options = settings[LISTING];
+        if (!options.IsMap()) {
+            throw InvalidSettingsException(options.Mark(), "'" + LISTING + "' must be a map");
+        }
+        string sort = getProperty<string>(options, LISTING_SORT, "name");
+        if (sort == "name") {
+            listing.sort = ListingSort::NAME;
+        } else if (sort == "size") {
+            listing.sort = ListingSort::SIZE;
+        } else if (sort == "mtime") {
+            listing.sort = ListingSort::MTIME;
+        } else if (sort == "none") {
+            listing.sort = ListingSort::NONE;
+        } else {
+            throw InvalidSettingsException(options[LISTING_SORT].Mark(), "'" + LISTING_SORT + "' must be one of name, size, mtime, or none");
+        }
+        listing.size = getProperty<bool>(options, LISTING_SIZE, false);
+        listing.mtime = getProperty<bool>(options, LISTING_MTIME, false);
+    }
+
+    size_t read_block_size = getProperty<size_t>(settings, READ_BLOCK_SIZE, 64 * 1024);
+    if (read_block_size == 0) {
+        throw InvalidSettingsException(settings[READ_BLOCK_SIZE].Mark(), "'" + READ_BLOCK_SIZE + "' must be greater than 0");
+    }
+    string lang = getProperty<string>(settings, LANG, "");
+    string charset = getProperty<string>(settings, CHARSET, "");
+    if (lang.find_first_of(";\r\n") != string::npos) {
+        throw InvalidSettingsException(settings[LANG].Mark(), "'" + LANG + "' may not contain ';' or newlines");
+    }
+    if (charset.find_first_of(";\r\n") != string::npos) {
+        throw InvalidSettingsException(settings[CHARSET].Mark(), "'" + CHARSET + "' may not contain ';' or newlines");
+    }
+
+    // Interpreters are resolved now so that requests never have to search the path
+    ScriptRunners cgi_runners;
+    if (settings[SCRIPT_RUNNERS].IsDefined()) {
+        cgi_runners = Executor::loadRunners(settings[SCRIPT_RUNNERS]);
+    }
+
+    auto handler = make_shared<FileHandler>(
         host,
         folder,
         base,
@@ -581,6 +1310,20 @@ shared_ptr<Handler> FileHandlerFactory::createHandler(YAML::Node settings, strin
         rules,
         cgi_types,
         cgi_lang,
-        cgi_vars
+        cgi_vars,
+        cgi_limiter,
+        cgi_runners,
+        cgi_timeouts,
+        max_upload_size,
+        listing,
+        read_block_size,
+        lang,
+        charset
     );
+    if (getProperty<bool>(settings, WATCH, true)) {
+        // Changes to the folder invalidate the file cache as soon as they happen
+        FileCache::get(uv_default_loop());
+        handler->watch(uv_default_loop());
+    }
+    return handler;
 }
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include "gemcaps/fileio.hpp"
+
+#include <memory>
+
+#include <parallel_hashmap/phmap.h>
+
+#include "gemcaps/settings.hpp"
+#include "gemcaps/log.hpp"
+#include "gemcaps/threadpool.hpp"
+#include "uringio.hpp"
+
+using std::string;
+using std::unique_ptr;
+
+
+FileIO::FileIO(uv_loop_t *loop)
+        : loop(loop) {
+    inflight = &metrics::gauge("gemcaps_file_io_inflight", "Number of file operations that have been started but not finished");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ThreadpoolFileIO
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * File operations that run in libuv's threadpool
+ *
+ * Reads use the pool's read lane, and everything else the metadata lane, so
+ * that large downloads and bursts of small requests don't hold each other up.
+ */
+class ThreadpoolFileIO : public FileIO {
+private:
+    enum OpType {
+        STAT,
+        STAT_OPEN,
+        OPEN,
+        READ,
+        CLOSE,
+    };
+
+    struct Request {
+        uv_work_t work;
+        ThreadpoolFileIO *io;
+        OpType type;
+        string path;
+        uv_file fd = -1;
+        char *buf = nullptr;
+        size_t length = 0;
+        uint64_t offset = 0;
+        int status = 0;
+        ssize_t result = 0;
+        uv_stat_t stat;
+        onFileResult result_cb = nullptr;
+        onFileStat stat_cb = nullptr;
+        onFileOpened opened_cb = nullptr;
+        void *ctx = nullptr;
+    };
+
+    void start(Request *req) noexcept {
+        req->work.data = req;
+        req->io = this;
+        inflight->inc();
+        ThreadPool::Lane lane = req->type == READ ? ThreadPool::READ : ThreadPool::METADATA;
+        ThreadPool::get(loop).queue(lane, &req->work, __work, __after_work);
+    }
+
+    static void __work(uv_work_t *work) noexcept {
+        // Runs in the threadpool, so only synchronous requests may be used
+        Request *request = static_cast<Request *>(work->data);
+        uv_fs_t req;
+        uv_buf_t buf;
+        switch (request->type) {
+        case STAT:
+        case STAT_OPEN:
+            request->status = uv_fs_stat(nullptr, &req, request->path.c_str(), nullptr);
+            if (request->status == 0) {
+                request->stat = req.statbuf;
+            }
+            uv_fs_req_cleanup(&req);
+            if (request->type == STAT) {
+                break;
+            }
+            if (request->status < 0) {
+                request->result = request->status;
+            } else if (!S_ISREG(request->stat.st_mode)) {
+                request->result = UV_EINVAL;
+            } else {
+                request->result = uv_fs_open(nullptr, &req, request->path.c_str(), UV_FS_O_RDONLY, 0, nullptr);
+                uv_fs_req_cleanup(&req);
+            }
+            break;
+        case OPEN:
+            request->result = uv_fs_open(nullptr, &req, request->path.c_str(), UV_FS_O_RDONLY, 0, nullptr);
+            uv_fs_req_cleanup(&req);
+            break;
+        case READ:
+            buf = uv_buf_init(request->buf, request->length);
+            request->result = uv_fs_read(nullptr, &req, request->fd, &buf, 1, request->offset, nullptr);
+            uv_fs_req_cleanup(&req);
+            break;
+        case CLOSE:
+            request->result = uv_fs_close(nullptr, &req, request->fd, nullptr);
+            uv_fs_req_cleanup(&req);
+            break;
+        }
+    }
+    static void __after_work(uv_work_t *work, int status) noexcept {
+        Request *request = static_cast<Request *>(work->data);
+        if (status < 0) {
+            request->status = status;
+            request->result = status;
+        }
+        switch (request->type) {
+        case STAT:
+            request->stat_cb(request->status, request->status == 0 ? &request->stat : nullptr, request->ctx);
+            break;
+        case STAT_OPEN:
+            request->opened_cb(request->status, request->status == 0 ? &request->stat : nullptr, request->result, request->ctx);
+            break;
+        default:
+            if (request->result_cb) {
+                request->result_cb(request->result, request->ctx);
+            }
+            break;
+        }
+        request->io->inflight->dec();
+        delete request;
+    }
+public:
+    ThreadpoolFileIO(uv_loop_t *loop)
+        : FileIO(loop) {}
+
+    const char *getName() const noexcept { return "threadpool"; }
+
+    void stat(const string &path, onFileStat cb, void *ctx) noexcept {
+        Request *req = new Request;
+        req->type = STAT;
+        req->path = path;
+        req->stat_cb = cb;
+        req->ctx = ctx;
+        start(req);
+    }
+    void statOpen(const string &path, onFileOpened cb, void *ctx) noexcept {
+        Request *req = new Request;
+        req->type = STAT_OPEN;
+        req->path = path;
+        req->opened_cb = cb;
+        req->ctx = ctx;
+        start(req);
+    }
+    void open(const string &path, onFileResult cb, void *ctx) noexcept {
+        Request *req = new Request;
+        req->type = OPEN;
+        req->path = path;
+        req->result_cb = cb;
+        req->ctx = ctx;
+        start(req);
+    }
+    void read(uv_file fd, char *buf, size_t length, uint64_t offset, onFileResult cb, void *ctx) noexcept {
+        Request *req = new Request;
+        req->type = READ;
+        req->fd = fd;
+        req->buf = buf;
+        req->length = length;
+        req->offset = offset;
+        req->result_cb = cb;
+        req->ctx = ctx;
+        start(req);
+    }
+    void close(uv_file fd, onFileResult cb, void *ctx) noexcept {
+        Request *req = new Request;
+        req->type = CLOSE;
+        req->fd = fd;
+        req->result_cb = cb;
+        req->ctx = ctx;
+        start(req);
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// FileIO
+//
+////////////////////////////////////////////////////////////////////////////////
+
+FileIO &FileIO::get(uv_loop_t *loop) {
+    static phmap::flat_hash_map<uv_loop_t *, unique_ptr<FileIO>> ios;
+    auto &io = ios[loop];
+    if (io) {
+        return *io;
+    }
+#ifdef GEMCAPS_IO_URING
+    if (backend != THREADPOOL) {
+        io.reset(UringFileIO::create(loop, entries));
+        if (!io && backend == URING) {
+            LOG_WARN("io_uring is not available, file operations will use the threadpool");
+        }
+    }
+#else
+    if (backend == URING) {
+        LOG_WARN("io_uring is not supported on this platform, file operations will use the threadpool");
+    }
+#endif
+    if (!io) {
+        io.reset(new ThreadpoolFileIO(loop));
+    }
+    LOG_DEBUG("Using " << io->getName() << " for file operations");
+    return *io;
+}
+
+void FileIO::load(YAML::Node settings) {
+    if (!settings[FILE_IO].IsDefined()) {
+        return;
+    }
+    YAML::Node io = settings[FILE_IO];
+    if (!io.IsMap()) {
+        throw InvalidSettingsException(io.Mark(), "'" + FILE_IO + "' must be a map");
+    }
+    string name = getProperty<string>(io, BACKEND, "auto");
+    Backend backend;
+    if (name == "auto") {
+        backend = AUTO;
+    } else if (name == "threadpool") {
+        backend = THREADPOOL;
+    } else if (name == "io_uring") {
+        backend = URING;
+    } else {
+        throw InvalidSettingsException(io[BACKEND].Mark(), "'" + BACKEND + "' must be one of auto, threadpool, or io_uring");
+    }
+    unsigned entries = getProperty<unsigned>(io, ENTRIES, FileIO::entries);
+    if (entries == 0) {
+        throw InvalidSettingsException(io[ENTRIES].Mark(), "'" + ENTRIES + "' must be greater than 0");
+    }
+    configure(backend, entries);
+}
+
+void FileIO::configure(Backend backend, unsigned entries) noexcept {
+    FileIO::backend = backend;
+    FileIO::entries = entries > 0 ? entries : 1;
+}
@@ -0,0 +1,158 @@
+#include "gemcaps/limiter.hpp"
+
+#include "gemcaps/uvutils.hpp"
+
+using std::string;
+
+
+void on_limiter_timer_close(uv_handle_t *handle) {
+    timer_allocator.deallocate((uv_timer_t *)handle);
+}
+
+void Limiter::__on_timer(uv_timer_t *timer) noexcept {
+    Limiter *limiter = static_cast<Limiter *>(timer->data);
+    if (limiter == nullptr) {
+        return;
+    }
+    limiter->expire(uv_now(timer->loop));
+}
+
+Limiter::Limiter(string name, size_t max_active, size_t max_queue, uint64_t timeout)
+        : max_active(max_active),
+          max_queue(max_queue),
+          timeout(timeout) {
+    string label = "{limiter=\"" + name + "\"}";
+    active_gauge = &metrics::gauge("gemcaps_cgi_active" + label, "Number of running cgi scripts");
+    depth_gauge = &metrics::gauge("gemcaps_cgi_queue_depth" + label, "Number of cgi requests waiting to run");
+    wait_hist = &metrics::histogram("gemcaps_cgi_queue_wait_ms" + label, "Time cgi requests spent waiting to run");
+    rejected = &metrics::counter("gemcaps_cgi_rejected_total" + label, "Number of cgi requests rejected because the queue was full");
+    timeouts = &metrics::counter("gemcaps_cgi_queue_timeouts_total" + label, "Number of cgi requests that waited too long to run");
+}
+
+Limiter::~Limiter() {
+    closeTimer();
+}
+
+void Limiter::closeTimer() noexcept {
+    if (timer != nullptr) {
+        timer->data = nullptr;
+        uv_close((uv_handle_t *)timer, on_limiter_timer_close);
+        timer = nullptr;
+        loop = nullptr;
+    }
+}
+
+void Limiter::configure(size_t max_active, size_t max_queue, uint64_t timeout) noexcept {
+    this->max_active = max_active;
+    this->max_queue = max_queue;
+    this->timeout = timeout;
+}
+
+void Limiter::arm() noexcept {
+    if (timer == nullptr) {
+        return;
+    }
+    if (queue.empty()) {
+        // Nothing is waiting, so nothing holds on to the loop. This also
+        // keeps a limiter that outlives its loop from touching it.
+        closeTimer();
+        return;
+    }
+    uint64_t earliest = UINT64_MAX;
+    for (const Waiter &waiter : queue) {
+        if (waiter.deadline < earliest) {
+            earliest = waiter.deadline;
+        }
+    }
+    uv_timer_stop(timer);
+    if (earliest == UINT64_MAX) {
+        return;
+    }
+    uint64_t now = uv_now(loop);
+    uv_timer_start(timer, __on_timer, earliest > now ? earliest - now : 0, 0);
+}
+
+Limiter::Result Limiter::acquire(uv_loop_t *loop, onLimiterAcquire cb, void *ctx, uint64_t *ticket, uint64_t deadline) noexcept {
+    if (max_active == 0 || active < max_active) {
+        ++active;
+        active_gauge->set(active);
+        wait_hist->observe(0);
+        return ACQUIRED;
+    }
+    if (queue.size() >= max_queue) {
+        rejected->inc();
+        return FULL;
+    }
+
+    uint64_t now = uv_now(loop);
+    if (timeout > 0 && (deadline == 0 || now + timeout < deadline)) {
+        deadline = now + timeout;
+    } else if (deadline == 0) {
+        deadline = UINT64_MAX;
+    }
+
+    if (timer == nullptr) {
+        this->loop = loop;
+        timer = timer_allocator.allocate();
+        uv_timer_init(loop, timer);
+        timer->data = this;
+    }
+
+    *ticket = next_ticket++;
+    queue.push_back({*ticket, now, deadline, cb, ctx});
+    depth_gauge->set(queue.size());
+    arm();
+    return QUEUED;
+}
+
+void Limiter::cancel(uint64_t ticket) noexcept {
+    for (auto it = queue.begin(); it != queue.end(); ++it) {
+        if (it->ticket == ticket) {
+            queue.erase(it);
+            depth_gauge->set(queue.size());
+            arm();
+            return;
+        }
+    }
+}
+
+void Limiter::release() noexcept {
+    if (active == 0) {
+        return;
+    }
+    if (!queue.empty() && (max_active == 0 || active <= max_active)) {
+        // Hand the slot directly to the next waiting request
+        Waiter waiter = queue.front();
+        queue.pop_front();
+        depth_gauge->set(queue.size());
+        if (loop != nullptr) {
+            wait_hist->observe(uv_now(loop) - waiter.queued);
+        }
+        arm();
+        waiter.cb(true, waiter.ctx);
+        return;
+    }
+    --active;
+    active_gauge->set(active);
+}
+
+void Limiter::expire(uint64_t now) noexcept {
+    // Collect the expired waiters first since the callbacks may modify the queue
+    std::deque<Waiter> expired;
+    for (auto it = queue.begin(); it != queue.end();) {
+        if (it->deadline <= now) {
+            expired.push_back(*it);
+            it = queue.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    depth_gauge->set(queue.size());
+    arm();
+
+    for (const Waiter &waiter : expired) {
+        timeouts->inc();
+        wait_hist->observe(now - waiter.queued);
+        waiter.cb(false, waiter.ctx);
+    }
+}
@@ -3,24 +3,53 @@
 #include "gemcaps/settings.hpp"
 #include "gemcaps/pathutils.hpp"
 #include "filehandler.hpp"
+#include "metricshandler.hpp"
+#include "archivehandler.hpp"
 
 using std::shared_ptr;
 using std::make_shared;
 using std::string;
+using std::vector;
 
 
-shared_ptr<SSLServer> loadServer(YAML::Node settings, string dir, uv_loop_t *loop) {
-    shared_ptr<SSLServer> server = make_shared<SSLServer>();
-
-    if (loop == nullptr) {
-        loop = uv_default_loop();
-    }
-
-
+ServerSettings loadServerSettings(YAML::Node settings, string dir) {
     string host = getProperty<string>(settings, HOST, "0.0.0.0");
     int port = getProperty<int>(settings, PORT, 1965);
     string cert = getProperty<string>(settings, CERT);
     string key = getProperty<string>(settings, KEY);
+    string ecdsa_cert = getProperty<string>(settings, ECDSA_CERT, "");
+    string ecdsa_key = getProperty<string>(settings, ECDSA_KEY, "");
+    if (ecdsa_cert.empty() != ecdsa_key.empty()) {
+        YAML::Mark mark = ecdsa_cert.empty() ? settings[ECDSA_KEY].Mark() : settings[ECDSA_CERT].Mark();
+        throw InvalidSettingsException(mark, "'" + ECDSA_CERT + "' and '" + ECDSA_KEY + "' must be set together");
+    }
+    int backlog = getProperty<int>(settings, BACKLOG, SSLServer::DEFAULT_BACKLOG);
+    if (backlog <= 0) {
+        throw InvalidSettingsException(settings[BACKLOG].Mark(), "'" + BACKLOG + "' must be greater than 0");
+    }
+    size_t max_connections = getProperty<size_t>(settings, SSLServer::MAX_CONNECTIONS, 0);
+    bool reuse_port = getProperty<bool>(settings, REUSE_PORT, false);
+
+    vector<ListenAddress> addresses;
+    if (settings[LISTEN].IsDefined()) {
+        YAML::Node listen = settings[LISTEN];
+        if (!listen.IsSequence() || listen.size() == 0) {
+            throw InvalidSettingsException(listen.Mark(), "'" + LISTEN + "' must be a list of addresses");
+        }
+        for (auto node : listen) {
+            ListenAddress address;
+            if (!ListenAddress::parse(node.as<string>(), port, address)) {
+                throw InvalidSettingsException(node.Mark(), "'" + node.as<string>() + "' is not a valid address");
+            }
+            addresses.push_back(address);
+        }
+    } else {
+        ListenAddress address;
+        if (!ListenAddress::parse(host, port, address) || address.port != port) {
+            throw InvalidSettingsException(settings[HOST].Mark(), "'" + host + "' is not a valid address");
+        }
+        addresses.push_back(address);
+    }
 
     if (path::isrel(cert)) {
         cert = path::join(dir, cert);
@@ -28,14 +57,20 @@ shared_ptr<SSLServer> loadServer(YAML::Node settings, string dir, uv_loop_t *loo
     if (path::isrel(key)) {
         key = path::join(dir, key);
     }
+    if (!ecdsa_cert.empty() && path::isrel(ecdsa_cert)) {
+        ecdsa_cert = path::join(dir, ecdsa_cert);
+    }
+    if (!ecdsa_key.empty() && path::isrel(ecdsa_key)) {
+        ecdsa_key = path::join(dir, ecdsa_key);
+    }
 
-    server->load(loop, host, port, cert, key);
-
-    return server;
+    return {addresses, cert, key, ecdsa_cert, ecdsa_key, backlog, max_connections, reuse_port};
 }
 
 void HandlerLoader::loadFactories() noexcept {
     factories.insert({"filehandler", make_shared<FileHandlerFactory>()});
+    factories.insert({"metrics", make_shared<MetricsHandlerFactory>()});
+    factories.insert({"archive", make_shared<ArchiveHandlerFactory>()});
 }
 
 shared_ptr<Handler> HandlerLoader::loadHandler(YAML::Node settings, string dir) {
@@ -17,6 +17,12 @@
 #include "params.hpp"
 #include "gemcaps/pathutils.hpp"
 #include "gemcaps/executor.hpp"
+#include "gemcaps/threadpool.hpp"
+#include "gemcaps/fileio.hpp"
+#include "gemcaps/filecache.hpp"
+#include "gemcaps/dircache.hpp"
+#include "gemcaps/MimeTypes.h"
+#include "gemcaps/ratelimiter.hpp"
 
 namespace fs = std::filesystem;
 
@@ -103,23 +109,46 @@ int main(int argc, const char **argv) {
     string conf_file = path::join(config, "conf.yml");
     try {
         YAML::Node config = YAML::LoadFile(conf_file);
+        ThreadPool::load(config);
         constexpr const char *ScriptRunners = "scriptRunners";
         if (config[ScriptRunners].IsDefined()) {
             Executor::load(config[ScriptRunners]);
         }
+        Executor::loadLimits(config);
+        FileIO::load(config);
+        FileCache::load(config);
+        DirCache::load(config);
+        MimeTypes::load(config);
+        RateLimiter::load(config);
+        SSLServer::loadLimits(config);
+        Manager::loadTimeouts(config);
     } catch (InvalidSettingsException &e) {
         LOG_ERROR(e.getMessage(conf_file));
     } catch (exception &e) {
         LOG_ERROR("Could not load '" << conf_file << "': " << e.what());
     }
+    // Even without a valid conf.yml, the lanes are sized from the same number
+    // of threads that libuv starts
+    ThreadPool::exportSize();
 
+    // Sockets handed over by an upgrade are used instead of binding new ones
+    SSLServer::loadInherited();
     Manager manager;
-    manager.loadServers(path::join(config, "servers"));
-    manager.loadHandlers(path::join(config, "handlers"));
+    manager.loadUpgrade();
+    manager.load(config);
+    SSLServer::closeInherited();
     manager.startServers();
+    // The old process keeps serving until this one is ready to take over
+    if (!manager.finishUpgrade()) {
+        return 1;
+    }
+    manager.reloadOnSignal();
+    manager.shutdownOnSignal();
+    manager.upgradeOnSignal(std::vector<string>(argv, argv + argc));
 
     int ret = uv_run(uv_default_loop(), UV_RUN_DEFAULT);
     uv_loop_close(uv_default_loop());
     wolfSSL_Cleanup();
-    return ret;
+    // The loop is stopped with handles still open once a shutdown finishes
+    return manager.isShuttingDown() ? 0 : ret;
 }
\ No newline at end of file
@@ -1,12 +1,23 @@
 #include "manager.hpp"
 
+#include <algorithm>
 #include <iostream>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <yaml-cpp/yaml.h>
 
 #include "loader.hpp"
+#include "request.hpp"
 
 #include "gemcaps/log.hpp"
+#include "gemcaps/ratelimiter.hpp"
+#include "gemcaps/threadpool.hpp"
+#include "gemcaps/pathutils.hpp"
+#include "gemcaps/executor.hpp"
 
 using std::string;
 using std::make_unique;
@@ -43,26 +54,26 @@ bool is_yaml(uv_dirent_t *entry) {
 
 
 void GeminiConnection::send(const void *data, size_t length) noexcept {
-	buffer.write((const char *)data, length);
-	char buf[1024];
-	size_t read = buffer.read(1024, buf);
-
     if (!sentHeader) {
-        string header = buf;
-        size_t found = header.find("\r\n");
-        if (found != string::npos) {
-            header = header.substr(0, found);
-        } else {
-            found = header.find('\n');
-            if (found != string::npos) {
-                header = header.substr(0, found);
-            }
+        const char *begin = static_cast<const char *>(data);
+        const char *end = begin + (length < 1024 ? length : 1024);
+        const char *found = std::find(begin, end, '\n');
+        if (found != begin && found[-1] == '\r') {
+            --found;
         }
-        LOG_INFO(request.host << request.path << ": " << header.substr(0, found));
+        LOG_INFO(request.host << request.path << ": " << string(begin, found));
         sentHeader = true;
     }
 
-	client->write(buf, read);
+	client->write(data, length);
+}
+
+uint64_t GeminiConnection::setPhase(Phase phase) noexcept {
+    uint64_t now = uv_now(client->getLoop());
+    uint64_t spent = now - phase_start;
+    this->phase = phase;
+    phase_start = now;
+    return spent;
 }
 
 void GeminiConnection::close() noexcept {
@@ -70,238 +81,868 @@ void GeminiConnection::close() noexcept {
 }
 
 void GeminiConnection::on_close(SSLClient *client) noexcept {
-	manager->on_close(client);
     if (cb) {
         cb(this, ctx);
     }
+    // The manager owns this connection, so it must be the last thing to be notified
+	manager->on_close(client);
 }
 
-void GeminiConnection::on_write(SSLClient *client) noexcept {
-	if (buffer.ready() > 0) {
-		char buf[1024];
-		size_t read = buffer.read(1024, buf);
-		client->write(buf, read);
-	}
+void GeminiConnection::dispatch(string body) noexcept {
+    dispatched = true;
+    if (!request.is_upload) {
+        return;
+    }
+    remaining = request.upload.size;
+    if (body.length() > remaining) {
+        body = body.substr(0, remaining);
+    }
+    pending_data = body;
 }
 
+void GeminiConnection::pauseData() noexcept {
+    paused = true;
+    client->stop_listening();
+}
 
-void Manager::loadServers(string config_dir) noexcept {
-    servers.clear();
+void GeminiConnection::resumeData() noexcept {
+    if (!request.is_upload || !paused) {
+        return;
+    }
+    paused = false;
+    if (remaining > pending_data.length()) {
+        client->listen();
+    }
+    pump();
+}
 
-    uv_loop_t *loop = uv_default_loop();
-    uv_fs_t scan_req;
+void GeminiConnection::pump() noexcept {
+    if (data_cb == nullptr || !request.is_upload || ended) {
+        return;
+    }
+    if (!pending_data.empty()) {
+        string data;
+        data.swap(pending_data);
+        remaining -= data.length();
+        data_cb(this, data.c_str(), data.length(), data_ctx);
+    }
+    char buf[1024];
+    while (!paused && remaining > 0 && client->is_open()) {
+        int read = client->read(remaining < sizeof(buf) ? remaining : sizeof(buf), buf);
+        if (read <= 0) {
+            if (read < 0) {
+                int err = client->getSSLErrorNumber(read);
+                if (err != WOLFSSL_ERROR_WANT_READ && err != WOLFSSL_ERROR_WANT_WRITE) {
+                    LOG_ERROR("Could not read the upload: " << client->getSSLErrorString(read));
+                    client->crash();
+                }
+            }
+            return;
+        }
+        remaining -= read;
+        data_cb(this, buf, read, data_ctx);
+    }
+    // An empty upload ends as soon as the handler asks for it
+    if (remaining == 0 && data_cb != nullptr) {
+        ended = true;
+        client->stop_listening();
+        data_cb(this, nullptr, 0, data_ctx);
+    }
+}
 
-    uv_fs_scandir(loop, &scan_req, config_dir.c_str(), 0, nullptr);
-    
-    if (scan_req.result < 0) {
-        LOG_ERROR("[Manager::loadServers] Could not read from '" << config_dir << "': " << uv_strerror(scan_req.result));
+void GeminiConnection::on_read(SSLClient *client) noexcept {
+    if (paused) {
         return;
     }
+    pump();
+}
+
+void GeminiConnection::on_write(SSLClient *client) noexcept {
+    if (drain_cb) {
+        drain_cb(this, drain_ctx);
+    }
+}
+
 
+void Manager::loadTimeouts(YAML::Node settings) {
+    if (!settings[TIMEOUTS].IsDefined()) {
+        return;
+    }
+    YAML::Node timeouts = settings[TIMEOUTS];
+    if (!timeouts.IsMap()) {
+        throw InvalidSettingsException(timeouts.Mark(), "'" + TIMEOUTS + "' must be a map");
+    }
+    configureTimeouts(
+        getProperty<uint64_t>(timeouts, HANDSHAKE_TIMEOUT, handshake_timeout),
+        getProperty<uint64_t>(timeouts, HEADER_TIMEOUT, header_timeout),
+        getProperty<uint64_t>(timeouts, IDLE_TIMEOUT, idle_timeout),
+        getProperty<uint64_t>(timeouts, REQUEST_DEADLINE, request_deadline),
+        getProperty<uint64_t>(timeouts, SHUTDOWN_TIMEOUT, shutdown_timeout)
+    );
+}
+
+void Manager::configureTimeouts(uint64_t handshake, uint64_t header, uint64_t idle, uint64_t request, uint64_t shutdown) noexcept {
+    handshake_timeout = handshake;
+    header_timeout = header;
+    idle_timeout = idle;
+    request_deadline = request;
+    shutdown_timeout = shutdown;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Phase metrics
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static const char *PHASE_NAMES[] = {"handshake", "header", "handling"};
+
+/**
+ * Get the histogram of how long connections spend in a phase
+ */
+static metrics::Histogram &phase_duration(GeminiConnection::Phase phase) {
+    static metrics::Histogram *durations[] = {
+        &metrics::histogram("gemcaps_phase_duration_ms{phase=\"handshake\"}", "Time connections spent in each phase before the request was handled"),
+        &metrics::histogram("gemcaps_phase_duration_ms{phase=\"header\"}", "Time connections spent in each phase before the request was handled"),
+    };
+    return *durations[phase];
+}
+
+/**
+ * Get the counter of connections dropped in a phase
+ */
+static metrics::Counter &phase_timeouts(GeminiConnection::Phase phase, bool deadline) {
+    static metrics::Counter *timeouts[2][3];
+    metrics::Counter *&counter = timeouts[deadline][phase];
+    if (counter == nullptr) {
+        counter = &metrics::counter(string("gemcaps_timeouts_total{phase=\"") + PHASE_NAMES[phase]
+            + "\",kind=\"" + (deadline ? "deadline" : "idle") + "\"}",
+            "Number of connections dropped for timing out, by the phase they were in");
+    }
+    return *counter;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Generations
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static void on_signal_close(uv_handle_t *handle) {
+    delete (uv_signal_t *)handle;
+}
+
+static void on_sweep_close(uv_handle_t *handle) {
+    delete (uv_timer_t *)handle;
+}
+
+bool Manager::Generation::drained() const noexcept {
+    for (auto &server : servers) {
+        if (server.second->getConnections() > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Manager::Manager(uv_loop_t *loop)
+        : loop(loop != nullptr ? loop : uv_default_loop()) {
+    reloads = &metrics::counter("gemcaps_reloads_total", "Number of times the servers and handlers were reloaded");
+    reload_errors = &metrics::counter("gemcaps_reload_errors_total", "Number of reloads that were abandoned because of an error");
+    generation_gauge = &metrics::gauge("gemcaps_config_generation", "Number of times the servers and handlers have been loaded");
+    draining_gauge = &metrics::gauge("gemcaps_draining_generations", "Number of old generations of servers that still have open connections");
+
+    sweep_timer = new uv_timer_t;
+    uv_timer_init(this->loop, sweep_timer);
+    sweep_timer->data = this;
+    drain_timer = new uv_timer_t;
+    uv_timer_init(this->loop, drain_timer);
+    drain_timer->data = this;
+}
+
+Manager::~Manager() {
+    if (reloading != nullptr) {
+        reloading->manager = nullptr;
+    }
+    if (reload_signal != nullptr) {
+        uv_signal_stop(reload_signal);
+        uv_close((uv_handle_t *)reload_signal, on_signal_close);
+    }
+    for (uv_signal_t *signal : shutdown_signals) {
+        if (signal != nullptr) {
+            uv_signal_stop(signal);
+            uv_close((uv_handle_t *)signal, on_signal_close);
+        }
+    }
+    if (upgrade_signal != nullptr) {
+        uv_signal_stop(upgrade_signal);
+        uv_close((uv_handle_t *)upgrade_signal, on_signal_close);
+    }
+    if (upgrading != nullptr) {
+        endUpgrade(false);
+    }
+    uv_timer_stop(sweep_timer);
+    uv_close((uv_handle_t *)sweep_timer, on_sweep_close);
+    uv_timer_stop(drain_timer);
+    uv_close((uv_handle_t *)drain_timer, on_sweep_close);
+}
+
+void Manager::scan(Reload *reload) noexcept {
+    uv_fs_t scan_req;
     uv_dirent_t entry;
-    while (uv_fs_scandir_next(&scan_req, &entry) != UV_EOF) {
+
+    uv_fs_scandir(reload->loop, &scan_req, reload->servers_dir.c_str(), 0, nullptr);
+    if (scan_req.result < 0) {
+        reload->errors.push_back("Could not read from '" + reload->servers_dir + "': " + uv_strerror(scan_req.result));
+    }
+    while (scan_req.result >= 0 && uv_fs_scandir_next(&scan_req, &entry) != UV_EOF) {
         if (!is_yaml(&entry)) {
             continue;
         }
-        string filename = join(config_dir, entry.name);
-
-        YAML::Node node = YAML::LoadFile(filename);
+        string filename = join(reload->servers_dir, entry.name);
         try {
-            auto server = loadServer(node, config_dir, loop);
-            server->setContext(this);
-			string name = getProperty<string>(node, NAME);
-            servers.insert({name, server});
-			LOG_INFO("Loaded server '" << filename << "'");
-        } catch (InvalidSettingsException e) {
-            LOG_ERROR("[Manager::loadServers] while loading " << e.getMessage(filename));
+            YAML::Node node = YAML::LoadFile(filename);
+            Reload::ServerFile server;
+            server.filename = filename;
+            server.settings = loadServerSettings(node, reload->servers_dir);
+            server.name = getProperty<string>(node, NAME);
+            // Reading the certificates is the slow part of a reload, so only
+            // the ones that changed are read again
+            server.certificates = SSLServer::loadCertificate(server.settings.cert, server.settings.key,
+                server.settings.ecdsa_cert, server.settings.ecdsa_key);
+            if (!server.certificates.primary) {
+                reload->errors.push_back("Could not load the certificate of '" + filename + "'");
+                continue;
+            }
+            reload->servers.push_back(server);
+        } catch (InvalidSettingsException &e) {
+            reload->errors.push_back("while loading " + e.getMessage(filename));
+        } catch (YAML::Exception &e) {
+            reload->errors.push_back("Could not load '" + filename + "': " + e.what());
         }
     }
+    uv_fs_req_cleanup(&scan_req);
 
-    if (servers.empty()) {
-        LOG_WARN("[Manager::loadServers] No servers were loaded");
+    uv_fs_scandir(reload->loop, &scan_req, reload->handlers_dir.c_str(), 0, nullptr);
+    if (scan_req.result < 0) {
+        reload->errors.push_back("Could not read from '" + reload->handlers_dir + "': " + uv_strerror(scan_req.result));
     }
+    while (scan_req.result >= 0 && uv_fs_scandir_next(&scan_req, &entry) != UV_EOF) {
+        if (!is_yaml(&entry)) {
+            continue;
+        }
+        string filename = join(reload->handlers_dir, entry.name);
+        try {
+            reload->handlers.push_back({filename, YAML::LoadFile(filename)});
+        } catch (YAML::Exception &e) {
+            reload->errors.push_back("Could not load '" + filename + "': " + e.what());
+        }
+    }
+    uv_fs_req_cleanup(&scan_req);
 }
 
-void Manager::loadHandlers(string config_dir) noexcept {
-    handlers.clear();
-
-    HandlerLoader loader;
-    loader.loadFactories();
+bool Manager::apply(Reload *reload, bool strict) noexcept {
+    for (const string &error : reload->errors) {
+        LOG_ERROR("[Manager::load] " << error);
+    }
+    if (strict && !reload->errors.empty()) {
+        return false;
+    }
 
-    uv_loop_t *loop = uv_default_loop();
-    uv_fs_t scan_req;
+    auto generation = std::make_shared<Generation>();
+    vector<SSLServer *> previous;
+    if (current) {
+        for (auto &server : current->servers) {
+            previous.push_back(server.second.get());
+        }
+    }
 
-    uv_fs_scandir(loop, &scan_req, config_dir.c_str(), 0, nullptr);
-    
-    if (scan_req.result < 0) {
-        LOG_ERROR("[Manager::loadHandlers] Could not read from '" << config_dir << "': " << uv_strerror(scan_req.result));
-        return;
+    // Whether an IPv6 listener is dual stack depends on every server's addresses
+    vector<ListenAddress> addresses;
+    for (const Reload::ServerFile &file : reload->servers) {
+        addresses.insert(addresses.end(), file.settings.addresses.begin(), file.settings.addresses.end());
     }
 
-    uv_dirent_t entry;
-    while (uv_fs_scandir_next(&scan_req, &entry) != UV_EOF) {
-        if (!is_yaml(&entry)) {
+    size_t errors = 0;
+    for (Reload::ServerFile &file : reload->servers) {
+        auto server = std::make_shared<SSLServer>();
+        server->setContext(this);
+        const ServerSettings &settings = file.settings;
+        server->load(loop, settings.addresses, file.certificates, settings.backlog, settings.max_connections, settings.reuse_port,
+            previous, addresses);
+        if (!server->isLoaded()) {
+            LOG_ERROR("[Manager::load] Could not start the server of '" << file.filename << "'");
+            ++errors;
             continue;
         }
-        string filename = join(config_dir, entry.name);
+        generation->servers.insert({file.name, server});
+        LOG_INFO("Loaded server '" << file.filename << "'");
+    }
 
-        YAML::Node node = YAML::LoadFile(filename);
+    HandlerLoader loader;
+    loader.loadFactories();
+    for (Reload::HandlerFile &file : reload->handlers) {
         try {
-            auto handler = loader.loadHandler(node, config_dir);
-            string server = getProperty<string>(node, SERVER);
-            auto found = servers.find(server);
-            if (found == servers.end()) {
-                throw InvalidSettingsException(node[SERVER].Mark(), "The server '" + server + "' does not exist");
-            }
-            auto serverHandlers = handlers.find(found->second.get());
-            if (serverHandlers == handlers.end()) {
-                // Create an empty vector if it didn't already exist
-                serverHandlers = handlers.insert({found->second.get(), vector<shared_ptr<Handler>>()}).first;
+            auto handler = loader.loadHandler(file.node, reload->handlers_dir);
+            string server = getProperty<string>(file.node, SERVER);
+            auto found = generation->servers.find(server);
+            if (found == generation->servers.end()) {
+                throw InvalidSettingsException(file.node[SERVER].Mark(), "The server '" + server + "' does not exist");
             }
-            serverHandlers->second.push_back(handler);
-            LOG_INFO("Loaded handler '" << filename << "'");
-        } catch (InvalidSettingsException e) {
-            LOG_ERROR("[Manager::loadHandlers] while loading " << e.getMessage(filename));
+            generation->handlers[found->second.get()].push_back(handler);
+            LOG_INFO("Loaded handler '" << file.filename << "'");
+        } catch (InvalidSettingsException &e) {
+            LOG_ERROR("[Manager::load] while loading " << e.getMessage(file.filename));
+            ++errors;
         }
     }
 
-    if (handlers.empty()) {
-        LOG_WARN("[Manager::loadHandlers] No handlers were loaded");
+    if (generation->servers.empty()) {
+        LOG_WARN("[Manager::load] No servers were loaded");
+    }
+    if (generation->handlers.empty()) {
+        LOG_WARN("[Manager::load] No handlers were loaded");
+    }
+    if (strict && (errors > 0 || generation->servers.empty())) {
+        // Nothing has been taken from the current generation yet, so dropping
+        // the new one only closes the sockets that it bound
+        return false;
+    }
+
+    // Switch over
+    for (auto &server : generation->servers) {
+        server.second->adopt(previous);
+    }
+    for (SSLServer *server : previous) {
+        server->stopListening();
+    }
+    if (current) {
+        draining.push_back(current);
+    }
+    generation->id = ++generations;
+    current = generation;
+    if (started) {
+        for (auto &server : current->servers) {
+            server.second->listen();
+        }
+    }
+    generation_gauge->set(generations);
+    sweep();
+    return true;
+}
+
+void Manager::load(string config_dir) noexcept {
+    this->config_dir = config_dir;
+    Reload reload;
+    reload.manager = this;
+    reload.loop = loop;
+    reload.servers_dir = path::join(config_dir, "servers");
+    reload.handlers_dir = path::join(config_dir, "handlers");
+    scan(&reload);
+    // An upgrade only takes over if the whole config loads, like a reload
+    apply(&reload, upgraded_from >= 0);
+}
+
+void Manager::getSockets(vector<std::pair<ListenAddress, uv_os_fd_t>> &sockets) const noexcept {
+    if (current) {
+        for (auto &server : current->servers) {
+            server.second->getSockets(sockets);
+        }
     }
 }
 
 void Manager::startServers() noexcept {
-    for (auto server : servers) {
-        server.second->listen();
+    started = true;
+    if (current) {
+        for (auto &server : current->servers) {
+            server.second->listen();
+        }
     }
     LOG_INFO("Started servers");
 }
 
-void Manager::on_accept(SSLServer *server, SSLClient *client) noexcept {
-    requests.insert({client, make_unique<GeminiConnection>(this, client)});
-    client->setContext(this);
-#ifndef NO_TIMEOUTS
-    client->setTimeout(1000);
-#endif
-    client->listen();
+void Manager::reload() noexcept {
+    if (shutting_down) {
+        return;
+    }
+    if (reloading != nullptr) {
+        // Pick up any change made while the files were being read
+        reload_again = true;
+        return;
+    }
+    LOG_INFO("Reloading the servers and handlers");
+    reloading = new Reload;
+    reloading->work.data = reloading;
+    reloading->manager = this;
+    reloading->loop = loop;
+    reloading->servers_dir = path::join(config_dir, "servers");
+    reloading->handlers_dir = path::join(config_dir, "handlers");
+    ThreadPool::get(loop).queue(ThreadPool::SCAN, &reloading->work, __reload, __on_reloaded);
 }
 
-// These next functions for parsing a host is gross, but I guess it works
-bool parseQuery(Request *request, size_t start);
-bool parsePath(Request *request, size_t start);
-bool parsePort(Request *request, size_t start);
-bool parseHost(Request *request) {
-    size_t start = request->header.find("://");
-    if (start == string::npos) {
-        return false;
+void Manager::reloadOnSignal() noexcept {
+    if (reload_signal != nullptr) {
+        return;
     }
-    start += 3;
+    reload_signal = new uv_signal_t;
+    uv_signal_init(loop, reload_signal);
+    reload_signal->data = this;
+    uv_signal_start(reload_signal, __on_signal, SIGHUP);
+}
+
+void Manager::__reload(uv_work_t *work) noexcept {
+    scan(static_cast<Reload *>(work->data));
+}
 
-    bool result = true;
-    size_t end = request->header.find(':', start);
-    if (end != string::npos) {
-        result = parsePort(request, end + 1);
+void Manager::__on_reloaded(uv_work_t *work, int status) noexcept {
+    Reload *reload = static_cast<Reload *>(work->data);
+    Manager *manager = reload->manager;
+    if (manager == nullptr) {
+        delete reload;
+        return;
+    }
+    manager->reloading = nullptr;
+
+    if (manager->shutting_down) {
+        delete reload;
+        return;
+    }
+    if (manager->apply(reload, true)) {
+        manager->reloads->inc();
+        LOG_INFO("Switched to generation " << manager->current->id << ", "
+            << manager->draining.size() << " older generations are finishing their connections");
     } else {
-        request->port = 1965;
-        end = request->header.find('/', start);
-        if (end != string::npos) {
-            result = parsePath(request, end);
-        } else {
-            request->path.clear();
-            end = request->header.find('?', start);
-            if (end != string::npos) {
-                result = parseQuery(request, end);
-            } else {
-                request->query.clear();
-                end = request->header.find('\r', start);
-                if (end == string::npos) {
-                    end = request->header.find('\n', start);
-                    if (end == string::npos) {
-                        return false;
-                    }
-                }
-            }
+        manager->reload_errors->inc();
+        LOG_WARN("Could not reload, still using generation " << (manager->current ? manager->current->id : 0));
+    }
+    delete reload;
+
+    if (manager->reload_again) {
+        manager->reload_again = false;
+        manager->reload();
+    }
+}
+
+void Manager::__on_signal(uv_signal_t *handle, int signum) noexcept {
+    Manager *manager = static_cast<Manager *>(handle->data);
+    if (manager != nullptr) {
+        manager->reload();
+    }
+}
+
+const vector<shared_ptr<Handler>> *Manager::findHandlers(SSLServer *server) const noexcept {
+    if (current) {
+        auto found = current->handlers.find(server);
+        if (found != current->handlers.end()) {
+            return &found->second;
         }
     }
-    if (!result) {
-        return false;
+    for (auto &generation : draining) {
+        auto found = generation->handlers.find(server);
+        if (found != generation->handlers.end()) {
+            return &found->second;
+        }
     }
-    request->host = request->header.substr(start, end - start);
-    return true;
+    return nullptr;
 }
-bool parsePort(Request *request, size_t start) {
-    bool result = true;
-    size_t end = request->header.find('/', start);
-    if (end != string::npos) {
-        result = parsePath(request, end);
-    } else {
-        request->path.clear();
-        end = request->header.find('?', start);
-        if (end != string::npos) {
-            result = parseQuery(request, end);
+
+void Manager::sweep() noexcept {
+    for (auto it = draining.begin(); it != draining.end();) {
+        if ((*it)->drained()) {
+            LOG_DEBUG("Generation " << (*it)->id << " has finished its connections");
+            it = draining.erase(it);
+            continue;
+        }
+        ++it;
+    }
+    draining_gauge->set(draining.size());
+}
+
+void Manager::__on_sweep(uv_timer_t *handle) noexcept {
+    static_cast<Manager *>(handle->data)->sweep();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Shutdown
+//
+////////////////////////////////////////////////////////////////////////////////
+
+void Manager::shutdown(bool close_idle) noexcept {
+    if (shutting_down) {
+        return;
+    }
+    shutting_down = true;
+    shutdown_deadline = uv_now(loop) + shutdown_timeout;
+    LOG_INFO("Shutting down, waiting up to " << shutdown_timeout << "ms for " << requests.size() << " connections to finish");
+
+    vector<shared_ptr<Generation>> generations = draining;
+    if (current) {
+        generations.push_back(current);
+    }
+    for (auto &generation : generations) {
+        for (auto &server : generation->servers) {
+            server.second->stopListening();
+        }
+    }
+    if (reload_signal != nullptr) {
+        uv_signal_stop(reload_signal);
+    }
+
+    // Only connections with a response in progress are worth waiting for
+    vector<SSLClient *> waiting;
+    for (auto &request : requests) {
+        if (close_idle && request.second->getPhase() != GeminiConnection::HANDLING) {
+            waiting.push_back(request.first);
+        }
+    }
+    for (SSLClient *client : waiting) {
+        client->close();
+    }
+
+    uv_timer_start(drain_timer, __on_drain, 0, 1000);
+}
+
+void Manager::shutdownOnSignal() noexcept {
+    if (shutdown_signals[0] != nullptr) {
+        return;
+    }
+    const int signums[] = {SIGTERM, SIGINT};
+    for (int i = 0; i < 2; ++i) {
+        shutdown_signals[i] = new uv_signal_t;
+        uv_signal_init(loop, shutdown_signals[i]);
+        shutdown_signals[i]->data = this;
+        uv_signal_start(shutdown_signals[i], __on_shutdown_signal, signums[i]);
+    }
+}
+
+void Manager::drain() noexcept {
+    uint64_t now = uv_now(loop);
+    if (!requests.empty() && now >= shutdown_deadline) {
+        LOG_WARN("Dropping " << requests.size() << " connections that did not finish in time");
+        vector<SSLClient *> clients;
+        for (auto &request : requests) {
+            clients.push_back(request.first);
+        }
+        for (SSLClient *client : clients) {
+            client->crash();
+        }
+        size_t scripts = Executor::signalAll(SIGKILL);
+        if (scripts > 0) {
+            LOG_WARN("Killed " << scripts << " scripts that were still running");
+        }
+        // The connections are gone once their handles finish closing
+        shutdown_deadline = now + shutdown_timeout;
+        return;
+    }
+    if (!requests.empty()) {
+        LOG_INFO("Waiting for " << requests.size() << " connections to finish, "
+            << (shutdown_deadline - now) / 1000 << "s until they are dropped");
+        return;
+    }
+    // Scripts can outlive their connection, and must not outlive the server
+    size_t scripts = Executor::getRunning();
+    if (scripts > 0) {
+        if (now >= shutdown_deadline) {
+            LOG_WARN("Killing " << scripts << " scripts that did not exit in time");
+            Executor::signalAll(SIGKILL);
+        } else if (!scripts_terminated) {
+            LOG_INFO("Terminating " << scripts << " scripts that are still running");
+            Executor::signalAll(SIGTERM);
+            scripts_terminated = true;
         } else {
-            request->query.clear();
-            end = request->header.find('\r', start);
-            if (end == string::npos) {
-                end = request->header.find('\n', start);
-                if (end == string::npos) {
-                    return false;
-                }
-            }
+            LOG_INFO("Waiting for " << scripts << " scripts to exit, "
+                << (shutdown_deadline - now) / 1000 << "s until they are killed");
         }
+        return;
     }
-    if (result == false) {
-        return false;
+
+    LOG_INFO("Every connection has finished, stopping");
+    uv_timer_stop(drain_timer);
+    for (uv_signal_t *signal : shutdown_signals) {
+        if (signal != nullptr) {
+            uv_signal_stop(signal);
+        }
     }
-    int port = atoi(request->header.substr(start, end - start).c_str());
-    if (port <= 0 || port > 65535) {
-        return false;
+    if (upgrade_signal != nullptr) {
+        uv_signal_stop(upgrade_signal);
     }
-    request->port = port;
-    return true;
+    uv_stop(loop);
 }
-bool parsePath(Request *request, size_t start) {
-    bool result = true;
-    size_t end = request->header.find('?', start);
-    if (end != string::npos) {
-        result = parseQuery(request, end);
+
+void Manager::__on_shutdown_signal(uv_signal_t *handle, int signum) noexcept {
+    Manager *manager = static_cast<Manager *>(handle->data);
+    if (manager == nullptr) {
+        return;
+    }
+    if (manager->shutting_down) {
+        LOG_WARN("Got signal " << signum << " again, dropping every connection");
+        manager->shutdown_deadline = 0;
+        manager->drain();
+        return;
+    }
+    LOG_INFO("Got signal " << signum);
+    manager->shutdown();
+}
+
+void Manager::__on_drain(uv_timer_t *handle) noexcept {
+    static_cast<Manager *>(handle->data)->drain();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Upgrade
+//
+////////////////////////////////////////////////////////////////////////////////
+
+void Manager::Upgrade::__on_close(uv_handle_t *handle) noexcept {
+    Upgrade *upgrade = static_cast<Upgrade *>(handle->data);
+    if (--upgrade->handles == 0) {
+        delete upgrade;
+    }
+}
+
+void Manager::upgrade(const vector<string> &args) noexcept {
+#ifndef WIN32
+    if (shutting_down || !current || args.empty()) {
+        return;
+    }
+    if (upgrading != nullptr) {
+        LOG_WARN("[Manager::upgrade] An upgrade is already starting");
+        return;
+    }
+    vector<std::pair<ListenAddress, uv_os_fd_t>> sockets;
+    getSockets(sockets);
+
+    char exepath[1024];
+    size_t exepath_size = sizeof(exepath);
+    if (uv_exepath(exepath, &exepath_size) != 0) {
+        LOG_ERROR("[Manager::upgrade] Could not find the gemcaps binary");
+        return;
+    }
+    uv_file ready[2];
+    int error = uv_pipe(ready, 0, 0);
+    if (error != 0) {
+        LOG_ERROR("[Manager::upgrade] Could not create a pipe: " << uv_strerror(error));
+        return;
+    }
+
+    // The sockets are passed on as the fds right after stderr, followed by the
+    // pipe that the new process reports it is ready on
+    vector<uv_stdio_container_t> stdio(4 + sockets.size());
+    string inherited;
+    for (int i = 0; i < 3; ++i) {
+        stdio[i].flags = UV_INHERIT_FD;
+        stdio[i].data.fd = i;
+    }
+    for (size_t i = 0; i < sockets.size(); ++i) {
+        stdio[3 + i].flags = UV_INHERIT_FD;
+        stdio[3 + i].data.fd = sockets[i].second;
+        inherited += (inherited.empty() ? "" : ";") + sockets[i].first.toString() + "=" + std::to_string(3 + i);
+    }
+    stdio.back().flags = UV_INHERIT_FD;
+    stdio.back().data.fd = ready[1];
+
+    vector<char *> argv;
+    for (const string &arg : args) {
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    Upgrade *upgrade = new Upgrade;
+    upgrade->manager = this;
+    uv_process_options_t options = {};
+    options.file = exepath;
+    options.args = argv.data();
+    options.exit_cb = __on_upgrade_exit;
+    // The new process outlives this one
+    options.flags = UV_PROCESS_DETACHED;
+    options.stdio_count = stdio.size();
+    options.stdio = stdio.data();
+
+    // The new process gets this one's environment, along with the sockets
+    uv_os_setenv(SSLServer::INHERITED_ENV, inherited.c_str());
+    uv_os_setenv(READY_ENV, std::to_string(stdio.size() - 1).c_str());
+    error = uv_spawn(loop, &upgrade->process, &options);
+    uv_os_unsetenv(SSLServer::INHERITED_ENV);
+    uv_os_unsetenv(READY_ENV);
+    upgrade->process.data = upgrade;
+    uv_fs_t close_req;
+    uv_fs_close(nullptr, &close_req, ready[1], nullptr);
+    uv_fs_req_cleanup(&close_req);
+    if (error != 0) {
+        LOG_ERROR("[Manager::upgrade] Could not start '" << exepath << "': " << uv_strerror(error));
+        uv_fs_close(nullptr, &close_req, ready[0], nullptr);
+        uv_fs_req_cleanup(&close_req);
+        upgrade->handles = 1;
+        uv_close((uv_handle_t *)&upgrade->process, Upgrade::__on_close);
+        return;
+    }
+
+    uv_pipe_init(loop, &upgrade->ready, false);
+    upgrade->ready.data = upgrade;
+    uv_pipe_open(&upgrade->ready, ready[0]);
+    uv_read_start((uv_stream_t *)&upgrade->ready, [](uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf) {
+        static char byte;
+        buf->base = &byte;
+        buf->len = 1;
+    }, __on_upgrade_read);
+    uv_timer_init(loop, &upgrade->timer);
+    upgrade->timer.data = upgrade;
+    uv_timer_start(&upgrade->timer, __on_upgrade_timeout, UPGRADE_TIMEOUT, 0);
+    upgrading = upgrade;
+    LOG_INFO("Started gemcaps " << upgrade->process.pid << " with " << sockets.size() << " listening sockets, waiting for it to be ready");
+#else
+    LOG_WARN("[Manager::upgrade] Upgrading is not supported on this platform");
+#endif
+}
+
+void Manager::endUpgrade(bool ready) noexcept {
+    Upgrade *upgrade = upgrading;
+    if (upgrade == nullptr) {
+        return;
+    }
+    upgrading = nullptr;
+    if (!ready && !upgrade->exited) {
+        // It may still be holding the sockets open. The process handle stays
+        // open until it exits, since closing it would leave the pid unreaped
+        uv_process_kill(&upgrade->process, SIGTERM);
     } else {
-        request->query.clear();
-        end = request->header.find('\r', start);
-        if (end == string::npos) {
-            end = request->header.find('\n', start);
-            if (end == string::npos) {
-                return false;
-            }
-        }
+        uv_close((uv_handle_t *)&upgrade->process, Upgrade::__on_close);
     }
-    if (result == false) {
-        return false;
+    uv_close((uv_handle_t *)&upgrade->ready, Upgrade::__on_close);
+    uv_close((uv_handle_t *)&upgrade->timer, Upgrade::__on_close);
+    upgrade->manager = nullptr;
+    if (!ready) {
+        LOG_ERROR("[Manager::upgrade] The new process did not start its servers, carrying on");
+        return;
     }
-    request->path = request->header.substr(start, end - start);
-    return true;
+
+    // The new process has its own copy of the sockets, so this one can close
+    // them without refusing anyone
+    LOG_INFO("The new process is ready, shutting down");
+    shutdown(false);
 }
-bool parseQuery(Request *request, size_t start) {
-    bool result = true;
-    size_t end = request->header.find('\r', start);
-    if (end == string::npos) {
-        end = request->header.find('\n', start);
-        if (end == string::npos) {
-            return false;
+
+void Manager::__on_upgrade_exit(uv_process_t *process, int64_t exit_status, int term_signal) noexcept {
+    Upgrade *upgrade = static_cast<Upgrade *>(process->data);
+    upgrade->exited = true;
+    if (upgrade->manager != nullptr) {
+        LOG_ERROR("[Manager::upgrade] The new process exited with status " << exit_status << " and signal " << term_signal);
+        upgrade->manager->endUpgrade(false);
+    } else if (!uv_is_closing((uv_handle_t *)process)) {
+        // The upgrade already failed, and was waiting for it to be reaped
+        uv_close((uv_handle_t *)process, Upgrade::__on_close);
+    }
+}
+
+void Manager::__on_upgrade_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) noexcept {
+    Upgrade *upgrade = static_cast<Upgrade *>(stream->data);
+    if (upgrade->manager == nullptr || nread == 0) {
+        return;
+    }
+    // The pipe closes without a byte if the new process gives up or crashes
+    upgrade->manager->endUpgrade(nread > 0);
+}
+
+void Manager::__on_upgrade_timeout(uv_timer_t *handle) noexcept {
+    Upgrade *upgrade = static_cast<Upgrade *>(handle->data);
+    if (upgrade->manager != nullptr) {
+        LOG_ERROR("[Manager::upgrade] The new process took longer than " << UPGRADE_TIMEOUT << "ms to start");
+        upgrade->manager->endUpgrade(false);
+    }
+}
+
+void Manager::loadUpgrade() noexcept {
+#ifndef WIN32
+    const char *env = getenv(READY_ENV);
+    if (env == nullptr) {
+        return;
+    }
+    string value = env;
+    uv_os_unsetenv(READY_ENV);
+    if (value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+        LOG_WARN("[Manager::loadUpgrade] '" << value << "' is not a valid pipe");
+        return;
+    }
+    upgraded_from = std::stoi(value);
+    // Scripts must not keep the old process waiting
+    fcntl(upgraded_from, F_SETFD, FD_CLOEXEC);
+#endif
+}
+
+bool Manager::finishUpgrade() noexcept {
+#ifndef WIN32
+    if (upgraded_from < 0) {
+        return true;
+    }
+    bool ready = current && !current->servers.empty();
+    if (ready) {
+        for (auto &server : current->servers) {
+            ready &= server.second->isLoaded();
         }
     }
-    if (result == false) {
-        return false;
+    if (ready) {
+        char byte = 1;
+        ssize_t written;
+        do {
+            written = write(upgraded_from, &byte, 1);
+        } while (written < 0 && errno == EINTR);
+        LOG_INFO("Took over from the old process");
+    } else {
+        LOG_ERROR("[Manager::finishUpgrade] Not every server could start, leaving the old process running");
     }
-    request->query = request->header.substr(start, end - start);
+    ::close(upgraded_from);
+    upgraded_from = -1;
+    return ready;
+#else
     return true;
+#endif
+}
+
+void Manager::upgradeOnSignal(vector<string> args) noexcept {
+#ifndef WIN32
+    if (upgrade_signal != nullptr) {
+        return;
+    }
+    upgrade_args = std::move(args);
+    upgrade_signal = new uv_signal_t;
+    uv_signal_init(loop, upgrade_signal);
+    upgrade_signal->data = this;
+    uv_signal_start(upgrade_signal, __on_upgrade_signal, SIGUSR2);
+#endif
+}
+
+void Manager::__on_upgrade_signal(uv_signal_t *handle, int signum) noexcept {
+    Manager *manager = static_cast<Manager *>(handle->data);
+    if (manager != nullptr) {
+        manager->upgrade(manager->upgrade_args);
+    }
+}
+
+void Manager::on_accept(SSLServer *server, SSLClient *client) noexcept {
+    requests.insert({client, make_unique<GeminiConnection>(this, client)});
+    client->setContext(this);
+    client->setTimeout(handshake_timeout);
+    // Trickling data restarts the timeout, but not the deadline
+    client->setDeadline(request_deadline);
+    client->listen();
 }
 
 void Manager::on_read(SSLClient *client) noexcept {
     char buf[1024];
     GeminiConnection *gemini = requests[client].get();
+    if (gemini->isDispatched()) {
+        // Anything after the request belongs to the handler
+        gemini->on_read(client);
+        return;
+    }
     Request &request = gemini->getRequest();
     int read = client->read(1024, buf);
+    if (gemini->getPhase() == GeminiConnection::HANDSHAKE && client->isHandshakeDone()) {
+        phase_duration(GeminiConnection::HANDSHAKE).observe(gemini->setPhase(GeminiConnection::HEADER));
+        client->setTimeout(header_timeout);
+    }
     if (read < 0) {
         int err = client->getSSLErrorNumber(read);
         if (err == WOLFSSL_ERROR_WANT_READ || err == WOLFSSL_ERROR_WANT_WRITE) {
@@ -316,41 +957,51 @@ void Manager::on_read(SSLClient *client) noexcept {
         request.header += string(buf, read);
     }
 
-    if (request.header.length() > 1024) {
-        // The header is invalid, and will be discarded
-        client->crash();
-        return;
-    }
-
     size_t pos = request.header.find('\n');
-    if (pos == string::npos) {
+    if (pos == string::npos || pos > 1025) {
+        if (pos != string::npos || request.header.length() > 1025) {
+            // The header is invalid, and will be discarded
+            client->crash();
+        }
         // The header isn't finished yet, wait for more data
         return;
     }
 
     // The request is finished
     client->stop_listening();
+    client->setDeadline(0);
+    string body = request.header.substr(pos + 1);
     request.header = request.header.substr(0, pos + 1);
 
     // Parse the header
-    if (!parseHost(&request)) {
+    if (!parseRequest(&request)) {
         client->crash();
         return;
     }
 
-    // Figure out which handler should process the manager
-    auto foundHandlers = handlers.find(client->getServer());
-    if (foundHandlers == handlers.end()) {
+    // Clients that make too many requests are asked to slow down
+    unsigned retry_after = 0;
+    if (!RateLimiter::get(client->getLoop()).take(client->getAddress(), &retry_after)) {
+        const auto slow_down = responseHeader<32>(RES_SLOW_DOWN, std::to_string(retry_after).c_str());
+        gemini->send(slow_down.buf, slow_down.length());
+        gemini->close();
+        return;
+    }
+
+    // Figure out which handler should process the manager, from the
+    // generation that accepted the connection
+    auto foundHandlers = findHandlers(client->getServer());
+    if (foundHandlers == nullptr) {
         LOG_ERROR("Could not find handlers for the requested server!");
         client->crash();
         return;
     }
 
-    for (auto handler : foundHandlers->second) {
+    for (auto handler : *foundHandlers) {
         if (handler->shouldHandle(request.host, request.path)) {
-#ifndef NO_TIMEOUTS
-            client->setTimeout(30000);
-#endif
+            phase_duration(GeminiConnection::HEADER).observe(gemini->setPhase(GeminiConnection::HANDLING));
+            client->setTimeout(idle_timeout);
+            gemini->dispatch(body);
             handler->handle(gemini);
             return;
         }
@@ -362,10 +1013,26 @@ void Manager::on_read(SSLClient *client) noexcept {
 	gemini->close();
 }
 
+void Manager::on_timeout(SSLClient *client, bool deadline) noexcept {
+    auto found = requests.find(client);
+    if (found == requests.end()) {
+        return;
+    }
+    phase_timeouts(found->second->getPhase(), deadline).inc();
+}
+
 void Manager::on_close(SSLClient *client) noexcept {
     auto found = requests.find(client);
     if (found == requests.end()) {
         return;
     }
     requests.erase(found);
+    if (shutting_down && requests.empty()) {
+        uv_timer_start(drain_timer, __on_drain, 0, 1000);
+    }
+    if (!draining.empty()) {
+        // The server still counts the client until this returns, so its
+        // generation can only be freed afterwards
+        uv_timer_start(sweep_timer, __on_sweep, 0, 0);
+    }
 }
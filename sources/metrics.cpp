@@ -0,0 +1,146 @@
+#include "gemcaps/metrics.hpp"
+
+#include <map>
+#include <memory>
+#include <sstream>
+
+using std::string;
+using std::vector;
+using std::map;
+using std::unique_ptr;
+using std::make_unique;
+using std::ostringstream;
+
+using namespace metrics;
+
+struct Family {
+    string help;
+    const char *type;
+    map<string, unique_ptr<Counter>> counters;
+    map<string, unique_ptr<Gauge>> gauges;
+    map<string, unique_ptr<Histogram>> histograms;
+};
+
+// A sorted map keeps the output stable between renders
+map<string, Family> &families() {
+    static map<string, Family> f;
+    return f;
+}
+
+/**
+ * Split a metric name into its base name and labels (without the braces)
+ */
+void split_name(const string &name, string &base, string &labels) {
+    size_t pos = name.find('{');
+    if (pos == string::npos) {
+        base = name;
+        labels.clear();
+        return;
+    }
+    base = name.substr(0, pos);
+    labels = name.substr(pos + 1, name.length() - pos - 2);
+}
+
+Family &family(const string &base, const string &help, const char *type) {
+    Family &f = families()[base];
+    if (f.type == nullptr) {
+        f.type = type;
+    }
+    if (f.help.empty()) {
+        f.help = help;
+    }
+    return f;
+}
+
+void Histogram::observe(double value) noexcept {
+    size_t i = 0;
+    while (i < bounds.size() && value > bounds[i]) {
+        ++i;
+    }
+    ++buckets[i];
+    sum += value;
+    ++count;
+}
+
+Counter &metrics::counter(const string &name, const string &help) {
+    string base, labels;
+    split_name(name, base, labels);
+    auto &counters = family(base, help, "counter").counters;
+    auto &c = counters[labels];
+    if (!c) {
+        c = make_unique<Counter>();
+    }
+    return *c;
+}
+
+Gauge &metrics::gauge(const string &name, const string &help) {
+    string base, labels;
+    split_name(name, base, labels);
+    auto &gauges = family(base, help, "gauge").gauges;
+    auto &g = gauges[labels];
+    if (!g) {
+        g = make_unique<Gauge>();
+    }
+    return *g;
+}
+
+Histogram &metrics::histogram(const string &name, const string &help, const vector<double> &bounds) {
+    string base, labels;
+    split_name(name, base, labels);
+    auto &histograms = family(base, help, "histogram").histograms;
+    auto &h = histograms[labels];
+    if (!h) {
+        h = make_unique<Histogram>(bounds);
+    }
+    return *h;
+}
+
+string with_labels(const string &name, const string &labels, const string &extra = "") {
+    if (labels.empty() && extra.empty()) {
+        return name;
+    }
+    if (labels.empty()) {
+        return name + "{" + extra + "}";
+    }
+    if (extra.empty()) {
+        return name + "{" + labels + "}";
+    }
+    return name + "{" + labels + "," + extra + "}";
+}
+
+string metrics::render() {
+    ostringstream oss;
+    for (auto &pair : families()) {
+        const string &name = pair.first;
+        const Family &f = pair.second;
+        if (!f.help.empty()) {
+            oss << "# HELP " << name << " " << f.help << "\n";
+        }
+        oss << "# TYPE " << name << " " << f.type << "\n";
+        for (auto &c : f.counters) {
+            oss << with_labels(name, c.first) << " " << c.second->get() << "\n";
+        }
+        for (auto &g : f.gauges) {
+            oss << with_labels(name, g.first) << " " << g.second->get() << "\n";
+        }
+        for (auto &h : f.histograms) {
+            const Histogram &hist = *h.second;
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i < hist.getBuckets().size(); ++i) {
+                cumulative += hist.getBuckets()[i];
+                ostringstream le;
+                le << "le=\"";
+                if (i < hist.getBounds().size()) {
+                    le << hist.getBounds()[i];
+                } else {
+                    le << "+Inf";
+                }
+                le << "\"";
+                oss << with_labels(name + "_bucket", h.first, le.str()) << " " << cumulative << "\n";
+            }
+            oss << with_labels(name + "_sum", h.first) << " " << hist.getSum() << "\n";
+            oss << with_labels(name + "_count", h.first) << " " << hist.getCount() << "\n";
+        }
+    }
+    return oss.str();
+}
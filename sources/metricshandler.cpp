@@ -0,0 +1,31 @@
+#include "metricshandler.hpp"
+
+#include "gemcaps/metrics.hpp"
+
+using std::shared_ptr;
+using std::make_shared;
+using std::string;
+
+constexpr const auto METRICS_HEADER = responseHeader<32>(RES_SUCCESS, "text/plain");
+
+
+bool MetricsHandler::shouldHandle(string host, string path) noexcept {
+    if (!this->host.empty() && this->host != host) {
+        return false;
+    }
+    return this->path == path;
+}
+
+void MetricsHandler::handle(ClientConnection *client) noexcept {
+    string body = metrics::render();
+    client->send(METRICS_HEADER.buf, METRICS_HEADER.length());
+    client->send(body.c_str(), body.length());
+    client->close();
+}
+
+shared_ptr<Handler> MetricsHandlerFactory::createHandler(YAML::Node settings, string dir) {
+    string host = getProperty<string>(settings, HOST, "");
+    string path = getProperty<string>(settings, PATH, "/metrics");
+
+    return make_shared<MetricsHandler>(host, path);
+}
@@ -0,0 +1,186 @@
+#include "gemcaps/ratelimiter.hpp"
+
+#include <cmath>
+#include <cstring>
+#include <memory>
+
+#include <parallel_hashmap/phmap.h>
+
+#include "gemcaps/settings.hpp"
+#include "gemcaps/log.hpp"
+
+using std::string;
+using std::unique_ptr;
+using std::make_unique;
+
+
+RateLimiter::RateLimiter(uv_loop_t *loop)
+        : loop(loop) {
+    limited_accepts = &metrics::counter("gemcaps_rate_limited_total{stage=\"accept\"}", "Number of connections and requests turned away by the rate limit");
+    limited_requests = &metrics::counter("gemcaps_rate_limited_total{stage=\"request\"}", "Number of connections and requests turned away by the rate limit");
+}
+
+RateLimiter &RateLimiter::get(uv_loop_t *loop) noexcept {
+    static phmap::flat_hash_map<uv_loop_t *, unique_ptr<RateLimiter>> limiters;
+    auto &limiter = limiters[loop];
+    if (!limiter) {
+        limiter = make_unique<RateLimiter>(loop);
+    }
+    return *limiter;
+}
+
+void RateLimiter::load(YAML::Node settings) {
+    if (!settings[RATE_LIMIT].IsDefined()) {
+        return;
+    }
+    YAML::Node limit = settings[RATE_LIMIT];
+    if (!limit.IsMap()) {
+        throw InvalidSettingsException(limit.Mark(), "'" + RATE_LIMIT + "' must be a map");
+    }
+    double rate = getProperty<double>(limit, RATE, 0);
+    if (rate < 0) {
+        throw InvalidSettingsException(limit[RATE].Mark(), "'" + RATE + "' may not be negative");
+    }
+    double burst = getProperty<double>(limit, BURST, 10);
+    if (burst < 1) {
+        throw InvalidSettingsException(limit[BURST].Mark(), "'" + BURST + "' must be at least 1");
+    }
+    unsigned ipv6_prefix = getProperty<unsigned>(limit, IPV6_PREFIX, 64);
+    if (ipv6_prefix == 0 || ipv6_prefix > 128) {
+        throw InvalidSettingsException(limit[IPV6_PREFIX].Mark(), "'" + IPV6_PREFIX + "' must be between 1 and 128");
+    }
+    size_t width = getProperty<size_t>(limit, SIZE, 4096);
+    if (width == 0) {
+        throw InvalidSettingsException(limit[SIZE].Mark(), "'" + SIZE + "' must be greater than 0");
+    }
+    configure(rate, burst, ipv6_prefix, width);
+    if (enabled()) {
+        LOG_DEBUG("Limiting each address to " << rate << " requests per second, with bursts of " << burst);
+    }
+}
+
+void RateLimiter::configure(double rate, double burst, unsigned ipv6_prefix, size_t width) noexcept {
+    RateLimiter::rate = rate;
+    RateLimiter::burst = burst;
+    RateLimiter::ipv6_prefix = ipv6_prefix < 128 ? ipv6_prefix : 128;
+    RateLimiter::width = width > 0 ? width : 1;
+    ++settings_version;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Buckets
+//
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * FNV-1a, then the splitmix64 finalizer
+ */
+static uint64_t hash_key(const unsigned char *key, size_t length) noexcept {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= key[i];
+        h *= 1099511628211ull;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebull;
+    h ^= h >> 31;
+    return h;
+}
+
+bool RateLimiter::find(const sockaddr *addr, size_t (&rows)[ROWS]) noexcept {
+    // The first byte keeps IPv4 and IPv6 keys apart
+    unsigned char key[17] = {};
+    size_t length;
+    if (addr->sa_family == AF_INET) {
+        key[0] = 4;
+        memcpy(key + 1, &reinterpret_cast<const sockaddr_in *>(addr)->sin_addr, 4);
+        length = 5;
+    } else if (addr->sa_family == AF_INET6) {
+        const unsigned char *ip = reinterpret_cast<const sockaddr_in6 *>(addr)->sin6_addr.s6_addr;
+        static const unsigned char MAPPED[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        if (memcmp(ip, MAPPED, sizeof(MAPPED)) == 0) {
+            // An IPv4 client of a dual stack socket
+            key[0] = 4;
+            memcpy(key + 1, ip + 12, 4);
+            length = 5;
+        } else {
+            key[0] = 6;
+            size_t bytes = ipv6_prefix / 8;
+            memcpy(key + 1, ip, bytes);
+            if (ipv6_prefix % 8 != 0) {
+                key[1 + bytes] = ip[bytes] & (0xff << (8 - ipv6_prefix % 8));
+            }
+            length = 17;
+        }
+    } else {
+        return false;
+    }
+
+    if (buckets.empty() || buckets_version != settings_version) {
+        buckets.assign(ROWS * width, {burst, 0});
+        buckets_version = settings_version;
+    }
+    uint64_t h = hash_key(key, length);
+    uint64_t h1 = h & 0xffffffff;
+    uint64_t h2 = (h >> 32) | 1;
+    for (size_t i = 0; i < ROWS; ++i) {
+        rows[i] = i * width + (h1 + i * h2) % width;
+    }
+    return true;
+}
+
+void RateLimiter::refill(Bucket &bucket, uint64_t now) const noexcept {
+    if (now > bucket.updated) {
+        bucket.tokens += (now - bucket.updated) * rate / 1000;
+        bucket.updated = now;
+    }
+    if (bucket.tokens > burst) {
+        bucket.tokens = burst;
+    }
+}
+
+bool RateLimiter::limited(const sockaddr *addr) noexcept {
+    size_t rows[ROWS];
+    if (!enabled() || !find(addr, rows)) {
+        return false;
+    }
+    uint64_t now = uv_now(loop);
+    double tokens = 0;
+    for (size_t row : rows) {
+        refill(buckets[row], now);
+        tokens = buckets[row].tokens > tokens ? buckets[row].tokens : tokens;
+    }
+    if (tokens < 1) {
+        limited_accepts->inc();
+        return true;
+    }
+    return false;
+}
+
+bool RateLimiter::take(const sockaddr *addr, unsigned *retry_after) noexcept {
+    size_t rows[ROWS];
+    if (!enabled() || !find(addr, rows)) {
+        return true;
+    }
+    uint64_t now = uv_now(loop);
+    double tokens = 0;
+    for (size_t row : rows) {
+        refill(buckets[row], now);
+        tokens = buckets[row].tokens > tokens ? buckets[row].tokens : tokens;
+    }
+    if (tokens < 1) {
+        limited_requests->inc();
+        if (retry_after != nullptr) {
+            *retry_after = static_cast<unsigned>(std::ceil((1 - tokens) / rate));
+        }
+        return false;
+    }
+    for (size_t row : rows) {
+        Bucket &bucket = buckets[row];
+        bucket.tokens = bucket.tokens > 1 ? bucket.tokens - 1 : 0;
+    }
+    return true;
+}
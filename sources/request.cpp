@@ -0,0 +1,173 @@
+#include "request.hpp"
+
+#include <cstdlib>
+
+using std::string;
+
+
+// These next functions for parsing a host is gross, but I guess it works
+bool parseQuery(Request *request, size_t start);
+bool parsePath(Request *request, size_t start);
+bool parsePort(Request *request, size_t start);
+bool parseHost(Request *request) {
+    size_t start = request->header.find("://");
+    if (start == string::npos) {
+        return false;
+    }
+    start += 3;
+
+    bool result = true;
+    size_t end = request->header.find(':', start);
+    if (end != string::npos) {
+        result = parsePort(request, end + 1);
+    } else {
+        request->port = 1965;
+        end = request->header.find('/', start);
+        if (end != string::npos) {
+            result = parsePath(request, end);
+        } else {
+            request->path.clear();
+            end = request->header.find('?', start);
+            if (end != string::npos) {
+                result = parseQuery(request, end);
+            } else {
+                request->query.clear();
+                end = request->header.find('\r', start);
+                if (end == string::npos) {
+                    end = request->header.find('\n', start);
+                    if (end == string::npos) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    if (!result) {
+        return false;
+    }
+    request->host = request->header.substr(start, end - start);
+    return true;
+}
+bool parsePort(Request *request, size_t start) {
+    bool result = true;
+    size_t end = request->header.find('/', start);
+    if (end != string::npos) {
+        result = parsePath(request, end);
+    } else {
+        request->path.clear();
+        end = request->header.find('?', start);
+        if (end != string::npos) {
+            result = parseQuery(request, end);
+        } else {
+            request->query.clear();
+            end = request->header.find('\r', start);
+            if (end == string::npos) {
+                end = request->header.find('\n', start);
+                if (end == string::npos) {
+                    return false;
+                }
+            }
+        }
+    }
+    if (result == false) {
+        return false;
+    }
+    int port = atoi(request->header.substr(start, end - start).c_str());
+    if (port <= 0 || port > 65535) {
+        return false;
+    }
+    request->port = port;
+    return true;
+}
+bool parsePath(Request *request, size_t start) {
+    bool result = true;
+    size_t end = request->header.find('?', start);
+    if (end != string::npos) {
+        result = parseQuery(request, end);
+    } else {
+        request->query.clear();
+        end = request->header.find('\r', start);
+        if (end == string::npos) {
+            end = request->header.find('\n', start);
+            if (end == string::npos) {
+                return false;
+            }
+        }
+    }
+    if (result == false) {
+        return false;
+    }
+    request->path = request->header.substr(start, end - start);
+    return true;
+}
+bool parseQuery(Request *request, size_t start) {
+    bool result = true;
+    size_t end = request->header.find('\r', start);
+    if (end == string::npos) {
+        end = request->header.find('\n', start);
+        if (end == string::npos) {
+            return false;
+        }
+    }
+    if (result == false) {
+        return false;
+    }
+    request->query = request->header.substr(start, end - start);
+    return true;
+}
+
+/**
+ * Parse the titan parameters from the end of the path
+ */
+bool parseTitan(Request *request) {
+    size_t pos = request->path.find(';');
+    if (pos == string::npos) {
+        return false;
+    }
+    string params = request->path.substr(pos + 1);
+    request->path = request->path.substr(0, pos);
+
+    bool has_size = false;
+    request->upload = Upload();
+    request->upload.mime = "text/gemini";
+    while (!params.empty()) {
+        pos = params.find(';');
+        string param = params.substr(0, pos);
+        params = pos == string::npos ? "" : params.substr(pos + 1);
+
+        size_t eq = param.find('=');
+        if (eq == string::npos) {
+            return false;
+        }
+        string key = param.substr(0, eq);
+        string value = param.substr(eq + 1);
+        if (key == "size") {
+            if (value.empty() || value.find_first_not_of("0123456789") != string::npos) {
+                return false;
+            }
+            request->upload.size = strtoull(value.c_str(), nullptr, 10);
+            has_size = true;
+        } else if (key == "mime") {
+            request->upload.mime = value;
+        } else if (key == "token") {
+            request->upload.token = value;
+        }
+    }
+    return has_size;
+}
+
+bool parseRequest(Request *request) {
+    size_t pos = request->header.find("://");
+    if (pos == string::npos) {
+        return false;
+    }
+    request->scheme = request->header.substr(0, pos);
+    if (!parseHost(request)) {
+        return false;
+    }
+    request->is_upload = request->scheme == "titan";
+    if (request->is_upload) {
+        return parseTitan(request);
+    }
+    return true;
+}
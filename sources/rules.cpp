@@ -0,0 +1,653 @@
+#include "rules.hpp"
+
+#include <algorithm>
+
+using std::string;
+using std::vector;
+using std::bitset;
+using std::regex;
+
+namespace re_consts = std::regex_constants;
+
+// Limits how far bounded repeats may be expanded before a rule falls back to std::regex
+const size_t MAX_NFA_STATES = 5000;
+// Each compiled rule takes a bit in the DFA's matched mask
+const size_t MAX_COMPILED_RULES = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Parser
+//
+// Parses the subset of ECMAScript regexes that can be matched by an automaton.
+// Anything else throws Unsupported, and the rule is left to std::regex.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+struct Unsupported {};
+
+struct RuleSet::Node {
+    enum Type {SET, CAT, ALT, REPEAT, BOL, EOL};
+    Type type;
+    bitset<256> set;
+    vector<Node> children;
+    int min = 0;
+    // -1 repeats forever
+    int max = 0;
+};
+
+typedef RuleSet::Node Node;
+
+unsigned char first_char(const bitset<256> &set) {
+    for (int i = 0; i < 256; ++i) {
+        if (set[i]) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+class Parser {
+private:
+    const string &p;
+    size_t pos = 0;
+    bool icase;
+
+    bool more() const { return pos < p.length(); }
+    char peek() const { return p[pos]; }
+
+    void addChar(bitset<256> &set, unsigned char c) const {
+        set.set(c);
+        if (icase && c < 128 && isalpha(c)) {
+            set.set(tolower(c));
+            set.set(toupper(c));
+        }
+    }
+
+    Node makeSet(bitset<256> set) const {
+        Node node;
+        node.type = Node::SET;
+        node.set = set;
+        return node;
+    }
+
+    int parseNumber() {
+        if (!more() || !isdigit(peek())) {
+            throw Unsupported();
+        }
+        int n = 0;
+        while (more() && isdigit(peek())) {
+            n = n * 10 + (p[pos++] - '0');
+            if (n > 1000) {
+                throw Unsupported();
+            }
+        }
+        return n;
+    }
+
+    int parseHex(int digits) {
+        int n = 0;
+        for (int i = 0; i < digits; ++i) {
+            if (!more() || !isxdigit(peek())) {
+                throw Unsupported();
+            }
+            char c = p[pos++];
+            n = n * 16 + (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+        }
+        return n;
+    }
+
+    /**
+     * Parse an escape after the backslash
+     *
+     * @param set set to add the escaped characters to
+     * @param in_class whether the escape is in a character class
+     *
+     * @return whether the escape is a single character
+     */
+    bool parseEscape(bitset<256> &set, bool in_class) {
+        if (!more()) {
+            throw Unsupported();
+        }
+        char c = p[pos++];
+        bitset<256> cls;
+        switch (c) {
+        case 'd':
+        case 'D':
+            for (int i = '0'; i <= '9'; ++i) {
+                cls.set(i);
+            }
+            set |= c == 'd' ? cls : ~cls;
+            return false;
+        case 'w':
+        case 'W':
+            for (int i = 0; i < 128; ++i) {
+                if (isalnum(i) || i == '_') {
+                    cls.set(i);
+                }
+            }
+            set |= c == 'w' ? cls : ~cls;
+            return false;
+        case 's':
+        case 'S':
+            for (char w : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+                cls.set(w);
+            }
+            set |= c == 's' ? cls : ~cls;
+            return false;
+        case 'n': set.set('\n'); return true;
+        case 't': set.set('\t'); return true;
+        case 'r': set.set('\r'); return true;
+        case 'v': set.set('\v'); return true;
+        case 'f': set.set('\f'); return true;
+        case 'x': addChar(set, parseHex(2)); return true;
+        case '0':
+            if (more() && isdigit(peek())) {
+                throw Unsupported();
+            }
+            set.set(0);
+            return true;
+        case 'b':
+            if (!in_class) {
+                // word boundary
+                throw Unsupported();
+            }
+            set.set('\b');
+            return true;
+        }
+        if (isalnum((unsigned char)c)) {
+            // back references, \B, \c, \u and friends
+            throw Unsupported();
+        }
+        addChar(set, c);
+        return true;
+    }
+
+    Node parseClass() {
+        bool negate = false;
+        if (more() && peek() == '^') {
+            negate = true;
+            ++pos;
+        }
+        bitset<256> set;
+        while (true) {
+            if (!more()) {
+                throw Unsupported();
+            }
+            if (peek() == ']') {
+                ++pos;
+                break;
+            }
+            bitset<256> item;
+            bool single;
+            unsigned char lo;
+            if (peek() == '\\') {
+                ++pos;
+                single = parseEscape(item, true);
+                lo = single ? first_char(item) : 0;
+            } else {
+                lo = p[pos++];
+                item.set(lo);
+                single = true;
+            }
+            if (single && pos + 1 < p.length() && peek() == '-' && p[pos + 1] != ']') {
+                ++pos;
+                bitset<256> hi_set;
+                unsigned char hi;
+                if (peek() == '\\') {
+                    ++pos;
+                    if (!parseEscape(hi_set, true)) {
+                        throw Unsupported();
+                    }
+                    hi = first_char(hi_set);
+                } else {
+                    hi = p[pos++];
+                }
+                if (hi < lo) {
+                    throw Unsupported();
+                }
+                for (int i = lo; i <= hi; ++i) {
+                    addChar(set, i);
+                }
+                continue;
+            }
+            if (single) {
+                addChar(set, lo);
+            } else {
+                set |= item;
+            }
+        }
+        return makeSet(negate ? ~set : set);
+    }
+
+    Node parseAtom() {
+        char c = p[pos++];
+        switch (c) {
+        case '(': {
+            if (more() && peek() == '?') {
+                if (pos + 1 < p.length() && p[pos + 1] == ':') {
+                    pos += 2;
+                } else {
+                    // lookaheads
+                    throw Unsupported();
+                }
+            }
+            Node node = parseAlt();
+            if (!more() || peek() != ')') {
+                throw Unsupported();
+            }
+            ++pos;
+            return node;
+        }
+        case '[':
+            return parseClass();
+        case '.': {
+            bitset<256> set;
+            set.set();
+            set.reset('\n');
+            set.reset('\r');
+            return makeSet(set);
+        }
+        case '^': {
+            Node node;
+            node.type = Node::BOL;
+            return node;
+        }
+        case '$': {
+            Node node;
+            node.type = Node::EOL;
+            return node;
+        }
+        case '\\': {
+            bitset<256> set;
+            parseEscape(set, false);
+            return makeSet(set);
+        }
+        case ')':
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            throw Unsupported();
+        }
+        bitset<256> set;
+        addChar(set, c);
+        return makeSet(set);
+    }
+
+    Node parseRepeat() {
+        Node atom = parseAtom();
+        while (more()) {
+            int min, max;
+            char c = peek();
+            if (c == '*') {
+                min = 0;
+                max = -1;
+                ++pos;
+            } else if (c == '+') {
+                min = 1;
+                max = -1;
+                ++pos;
+            } else if (c == '?') {
+                min = 0;
+                max = 1;
+                ++pos;
+            } else if (c == '{') {
+                ++pos;
+                min = max = parseNumber();
+                if (more() && peek() == ',') {
+                    ++pos;
+                    max = more() && peek() == '}' ? -1 : parseNumber();
+                }
+                if (!more() || peek() != '}' || (max != -1 && max < min)) {
+                    throw Unsupported();
+                }
+                ++pos;
+            } else {
+                break;
+            }
+            // Lazy quantifiers don't change whether there is a match
+            if (more() && peek() == '?') {
+                ++pos;
+            }
+            if (atom.type == Node::BOL || atom.type == Node::EOL) {
+                throw Unsupported();
+            }
+            Node repeat;
+            repeat.type = Node::REPEAT;
+            repeat.min = min;
+            repeat.max = max;
+            repeat.children.push_back(atom);
+            atom = repeat;
+        }
+        return atom;
+    }
+
+    Node parseCat() {
+        Node node;
+        node.type = Node::CAT;
+        while (more() && peek() != '|' && peek() != ')') {
+            node.children.push_back(parseRepeat());
+        }
+        return node;
+    }
+public:
+    Parser(const string &pattern, bool icase)
+        : p(pattern),
+          icase(icase) {}
+
+    Node parseAlt() {
+        Node node;
+        node.type = Node::ALT;
+        node.children.push_back(parseCat());
+        while (more() && peek() == '|') {
+            ++pos;
+            node.children.push_back(parseCat());
+        }
+        return node;
+    }
+
+    Node parse() {
+        Node node = parseAlt();
+        if (more()) {
+            throw Unsupported();
+        }
+        return node;
+    }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Compiler
+//
+// Builds a Thompson NFA out of the parsed rules
+//
+////////////////////////////////////////////////////////////////////////////////
+
+int RuleSet::newState(NState::Type type, int rule) {
+    if (nfa.size() >= MAX_NFA_STATES) {
+        throw Unsupported();
+    }
+    NState state;
+    state.type = type;
+    state.rule = rule;
+    nfa.push_back(state);
+    return nfa.size() - 1;
+}
+
+void RuleSet::patch(const Frag &frag, int target) {
+    for (auto &out : frag.outs) {
+        if (out.second) {
+            nfa[out.first].out1 = target;
+        } else {
+            nfa[out.first].out = target;
+        }
+    }
+}
+
+RuleSet::Frag RuleSet::compile(const Node &node, int rule) {
+    switch (node.type) {
+    case Node::SET: {
+        int s = newState(NState::CHAR, rule);
+        nfa[s].chars = node.set;
+        return {s, {{s, false}}};
+    }
+    case Node::BOL:
+    case Node::EOL: {
+        int s = newState(node.type == Node::BOL ? NState::BOL : NState::EOL, rule);
+        return {s, {{s, false}}};
+    }
+    case Node::CAT: {
+        if (node.children.empty()) {
+            // An empty expression is a split whose branches go to the same place
+            int s = newState(NState::SPLIT, rule);
+            return {s, {{s, false}, {s, true}}};
+        }
+        Frag frag = compile(node.children.front(), rule);
+        for (size_t i = 1; i < node.children.size(); ++i) {
+            Frag next = compile(node.children[i], rule);
+            patch(frag, next.start);
+            frag.outs = next.outs;
+        }
+        return frag;
+    }
+    case Node::ALT: {
+        Frag frag = compile(node.children.front(), rule);
+        for (size_t i = 1; i < node.children.size(); ++i) {
+            Frag next = compile(node.children[i], rule);
+            int s = newState(NState::SPLIT, rule);
+            nfa[s].out = frag.start;
+            nfa[s].out1 = next.start;
+            frag.start = s;
+            frag.outs.insert(frag.outs.end(), next.outs.begin(), next.outs.end());
+        }
+        return frag;
+    }
+    case Node::REPEAT: {
+        const Node &child = node.children.front();
+        // Start with an empty fragment, and append each copy of the child
+        int s = newState(NState::SPLIT, rule);
+        Frag frag = {s, {{s, false}, {s, true}}};
+        for (int i = 0; i < node.min; ++i) {
+            Frag next = compile(child, rule);
+            patch(frag, next.start);
+            frag.outs = next.outs;
+        }
+        if (node.max == -1) {
+            Frag loop = compile(child, rule);
+            int split = newState(NState::SPLIT, rule);
+            nfa[split].out = loop.start;
+            patch(loop, split);
+            patch(frag, split);
+            frag.outs = {{split, true}};
+        } else {
+            for (int i = node.min; i < node.max; ++i) {
+                Frag optional = compile(child, rule);
+                int split = newState(NState::SPLIT, rule);
+                nfa[split].out = optional.start;
+                patch(frag, split);
+                frag.outs = optional.outs;
+                frag.outs.push_back({split, true});
+            }
+        }
+        return frag;
+    }
+    }
+    throw Unsupported();
+}
+
+RuleSet::RuleSet(const vector<string> &patterns, bool icase)
+        : patterns(patterns) {
+    auto flags = re_consts::ECMAScript | re_consts::optimize;
+    if (icase) {
+        flags |= re_consts::icase;
+    }
+    for (const string &pattern : patterns) {
+        // std::regex decides which patterns are valid
+        regex re(pattern, flags);
+
+        size_t rollback = nfa.size();
+        try {
+            if (starts.size() >= MAX_COMPILED_RULES) {
+                throw Unsupported();
+            }
+            int rule = starts.size();
+            Node node = Parser(pattern, icase).parse();
+            Frag frag = compile(node, rule);
+            int match = newState(NState::MATCH, rule);
+            patch(frag, match);
+            starts.push_back(frag.start);
+            all_rules |= uint64_t(1) << rule;
+        } catch (Unsupported) {
+            nfa.resize(rollback);
+            fallback.push_back(re);
+        }
+    }
+    reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Matching
+//
+// The DFA is built lazily from the NFA. Each DFA state is the set of NFA
+// states that are active, and the rules that have already matched. Since the
+// rules are searched for anywhere in the path, every rule that hasn't matched
+// yet is restarted at each character.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+void RuleSet::closure(vector<int> &states, vector<char> &seen, int state, bool consumed, bool at_start, bool at_end) const {
+    if (state < 0) {
+        return;
+    }
+    int key = state * 2 + consumed;
+    if (seen[key]) {
+        return;
+    }
+    seen[key] = true;
+    const NState &s = nfa[state];
+    switch (s.type) {
+    case NState::SPLIT:
+        closure(states, seen, s.out, consumed, at_start, at_end);
+        closure(states, seen, s.out1, consumed, at_start, at_end);
+        return;
+    case NState::BOL:
+        if (at_start) {
+            closure(states, seen, s.out, consumed, at_start, at_end);
+        }
+        return;
+    case NState::EOL:
+        if (at_end) {
+            closure(states, seen, s.out, consumed, at_start, at_end);
+            return;
+        }
+        states.push_back(key);
+        return;
+    default:
+        states.push_back(key);
+    }
+}
+
+int RuleSet::addState(vector<int> &states, uint64_t matched) const {
+    std::sort(states.begin(), states.end());
+    string key(reinterpret_cast<const char *>(&matched), sizeof(matched));
+    key.append(reinterpret_cast<const char *>(states.data()), states.size() * sizeof(int));
+
+    auto found = dfa_index.find(key);
+    if (found != dfa_index.end()) {
+        return found->second;
+    }
+    DState state;
+    state.states = states;
+    state.matched = matched;
+    state.next.resize(256, -1);
+    dfa.push_back(state);
+    dfa_index.insert({key, dfa.size() - 1});
+    return dfa.size() - 1;
+}
+
+void RuleSet::reset() const {
+    dfa.clear();
+    dfa_index.clear();
+    if (starts.empty()) {
+        return;
+    }
+    vector<int> states;
+    vector<char> seen(nfa.size() * 2, false);
+    for (int start : starts) {
+        closure(states, seen, start, false, true);
+    }
+    addState(states, 0);
+}
+
+int RuleSet::step(int dstate, unsigned char c) const {
+    int next = dfa[dstate].next[c];
+    if (next >= 0) {
+        return next;
+    }
+
+    uint64_t matched = dfa[dstate].matched;
+    vector<int> states;
+    vector<char> seen(nfa.size() * 2, false);
+    for (int key : dfa[dstate].states) {
+        const NState &s = nfa[key / 2];
+        if (s.type == NState::CHAR && s.chars[c] && !(matched >> s.rule & 1)) {
+            closure(states, seen, s.out, true, false);
+        }
+    }
+    for (const int key : states) {
+        const NState &s = nfa[key / 2];
+        // Empty matches don't count, like std::regex_constants::match_not_null
+        if (s.type == NState::MATCH && (key & 1)) {
+            matched |= uint64_t(1) << s.rule;
+        }
+    }
+    for (size_t rule = 0; rule < starts.size(); ++rule) {
+        if (!(matched >> rule & 1)) {
+            closure(states, seen, starts[rule], false, false);
+        }
+    }
+
+    // States of rules that already matched don't matter anymore
+    states.erase(std::remove_if(states.begin(), states.end(), [&](int key) {
+        return matched >> nfa[key / 2].rule & 1;
+    }), states.end());
+
+    next = addState(states, matched);
+    dfa[dstate].next[c] = next;
+    return next;
+}
+
+bool RuleSet::finish(int dstate) const {
+    uint64_t matched = dfa[dstate].matched;
+    vector<int> states;
+    vector<char> seen(nfa.size() * 2, false);
+    for (int key : dfa[dstate].states) {
+        const NState &s = nfa[key / 2];
+        if (s.type == NState::EOL) {
+            closure(states, seen, s.out, key & 1, false, true);
+        }
+    }
+    for (int key : states) {
+        const NState &s = nfa[key / 2];
+        if (s.type == NState::MATCH && (key & 1)) {
+            matched |= uint64_t(1) << s.rule;
+        }
+    }
+    return matched == all_rules;
+}
+
+bool RuleSet::search(const string &path) const {
+    if (dfa.size() > MAX_DFA_STATES) {
+        reset();
+    }
+    int state = 0;
+    for (char c : path) {
+        state = step(state, c);
+        if (dfa[state].matched == all_rules) {
+            return true;
+        }
+    }
+    return finish(state);
+}
+
+bool RuleSet::matches(const string &path) const noexcept {
+    auto found = verdicts.find(path);
+    if (found != verdicts.end()) {
+        return found->second;
+    }
+
+    bool result = starts.empty() || search(path);
+    for (const regex &re : fallback) {
+        if (!result) {
+            break;
+        }
+        result = std::regex_search(path, re, re_consts::match_not_null | re_consts::match_any);
+    }
+
+    if (verdicts.size() >= MAX_VERDICTS) {
+        verdicts.clear();
+    }
+    verdicts.insert({path, result});
+    return result;
+}
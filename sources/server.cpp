@@ -1,9 +1,20 @@
 #include "server.hpp"
 
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "certstore.hpp"
+#include "clienthello.hpp"
 #include "gemcaps/uvutils.hpp"
 #include "gemcaps/log.hpp"
+#include "gemcaps/ratelimiter.hpp"
+#include "gemcaps/settings.hpp"
+#include "gemcaps/threadpool.hpp"
 
 using std::vector;
 
@@ -11,10 +22,6 @@ using std::endl;
 
 ReusableAllocator<uv_tcp_t> tcp_allocator;
 
-void on_timeout_close(uv_handle_t *handle) {
-    timer_allocator.deallocate((uv_timer_t *)handle);
-}
-
 void on_tcp_close(uv_handle_t *handle) {
     tcp_allocator.deallocate((uv_tcp_t *)handle);
 }
@@ -28,9 +35,22 @@ void on_tcp_close(uv_handle_t *handle) {
 int SSLClient::_send(const char *buf, int size) noexcept {
     resetTimeout();
 
-    vector<uv_buf_t> buffers;
     int pos = 0;
+    if (queued_writes == 0) {
+        // Nothing is waiting, so try writing straight to the socket
+        uv_buf_t direct = uv_buf_init(const_cast<char *>(buf), size);
+        int written = uv_try_write((uv_stream_t *)client, &direct, 1);
+        if (written == size) {
+            return size;
+        }
+        if (written > 0) {
+            pos = written;
+        }
+    }
 
+    // Queue whatever the socket didn't take
+    vector<uv_buf_t> buffers;
+    size_t queued = size - pos;
     while (pos < size) {
         uv_buf_t buffer = buffer_allocate();
         int len = (size - pos) > buffer.len ? buffer.len : size - pos;
@@ -46,19 +66,18 @@ int SSLClient::_send(const char *buf, int size) noexcept {
     }
 
     uv_write_t *req = write_req_allocator.allocate();
-    write_requests.insert_or_assign(req, buffers);
-    ++queued_writes;
-
-    int written = uv_try_write((uv_stream_t *)client, data, buffers.size());
-    if (written > 0) {
-        delete[] data;
-        req->handle = (uv_stream_t *)client;
-        req->cb = __on_send;
-        __on_send(req, written);
-        return written;
-    }
     int res = uv_write(req, (uv_stream_t *)client, data, buffers.size(), __on_send);
     delete[] data;
+    if (res < 0) {
+        for (uv_buf_t buffer : buffers) {
+            buffer_deallocate(buffer);
+        }
+        write_req_allocator.deallocate(req);
+        return WOLFSSL_CBIO_ERR_CONN_CLOSE;
+    }
+    write_requests.insert_or_assign(req, buffers);
+    ++queued_writes;
+    pending_bytes += queued;
     return size;
 }
 
@@ -91,16 +110,93 @@ void SSLClient::__on_recv(uv_stream_t *stream, ssize_t nread, const uv_buf_t *bu
 
     client->resetTimeout();
 
+    if (client->handshake != nullptr) {
+        // The handshake has the buffer until it is back on the loop
+        client->deferred.append(buf->base, nread);
+        buffer_deallocate(*buf);
+        return;
+    }
     if (nread > 0) {
+        if (!client->hello_checked) {
+            client->hello_checked = true;
+            client->server->chooseCertificate(client, buf->base, nread);
+        }
         client->buffer.write(buf->base, nread);
     }
     buffer_deallocate(*buf);
 
-    if (client->context) {
+    if (!wolfSSL_is_init_finished(client->ssl) && ThreadPool::getShare(ThreadPool::HANDSHAKE) > 0) {
+        client->offloadHandshake();
+        return;
+    }
+    client->notifyRead();
+}
+
+void SSLClient::notifyRead() noexcept {
+    if (context) {
         do {
-            client->context->on_read(client);
-        } while (client->is_open() && client->hasData() && !wolfSSL_want_read(client->ssl));
+            context->on_read(this);
+        } while (reading && is_open() && hasData() && !wolfSSL_want_read(ssl));
+    }
+}
+
+void SSLClient::offloadHandshake() noexcept {
+    handshake = new Handshake;
+    handshake->work.data = handshake;
+    handshake->client = this;
+    ThreadPool::get(client->loop).queue(ThreadPool::HANDSHAKE, &handshake->work, __handshake, __on_handshake);
+}
+
+void SSLClient::__handshake(uv_work_t *work) noexcept {
+    Handshake *handshake = static_cast<Handshake *>(work->data);
+    WOLFSSL *ssl = handshake->client->ssl;
+    handshake->result = wolfSSL_accept(ssl);
+    if (handshake->result != WOLFSSL_SUCCESS) {
+        handshake->error = wolfSSL_get_error(ssl, handshake->result);
+    }
+}
+
+void SSLClient::__on_handshake(uv_work_t *work, int status) noexcept {
+    Handshake *handshake = static_cast<Handshake *>(work->data);
+    SSLClient *client = handshake->client;
+    client->handshake = nullptr;
+    if (handshake->orphaned) {
+        delete client;
+        delete handshake;
+        return;
+    }
+    if (!client->is_open()) {
+        delete handshake;
+        return;
+    }
+
+    if (!handshake->output.empty()) {
+        client->_send(handshake->output.data(), handshake->output.size());
+    }
+    if (!client->deferred.empty()) {
+        client->buffer.write(client->deferred.data(), client->deferred.size());
+        client->deferred.clear();
+    }
+    int result = handshake->result;
+    int error = handshake->error;
+    delete handshake;
+
+    if (result != WOLFSSL_SUCCESS) {
+        if (error != WOLFSSL_ERROR_WANT_READ && error != WOLFSSL_ERROR_WANT_WRITE) {
+            char message[80];
+            wolfSSL_ERR_error_string(error, message);
+            LOG_ERROR("There was an error during the TLS handshake: " << message);
+            client->crash();
+            return;
+        }
+        // More of the handshake arrived while this step ran
+        if (client->hasData()) {
+            client->offloadHandshake();
+        }
+        return;
     }
+    // The context takes over, along with anything sent after the handshake
+    client->notifyRead();
 }
 
 void SSLClient::__on_send(uv_write_t *req, int status) noexcept {
@@ -114,6 +210,7 @@ void SSLClient::__on_send(uv_write_t *req, int status) noexcept {
     auto found = client->write_requests.find(req);
     if (found != client->write_requests.end()) {
         for (uv_buf_t buf : found->second) {
+            client->pending_bytes -= client->pending_bytes < buf.len ? client->pending_bytes : buf.len;
             buffer_deallocate(buf);
         }
         client->write_requests.erase(found);
@@ -122,13 +219,11 @@ void SSLClient::__on_send(uv_write_t *req, int status) noexcept {
     if (--client->queued_writes < 0) {
         client->queued_writes = 0;
     }
-    if (client->queued_writes == 0) {
-        if (client->context) {
-            client->context->on_write(client);
-        }
-        if (client->queued_close) {
-            client->close();
-        }
+    if (client->context) {
+        client->context->on_write(client);
+    }
+    if (client->queued_writes == 0 && client->queued_close) {
+        client->close();
     }
 
     write_req_allocator.deallocate(req);
@@ -152,24 +247,32 @@ void SSLClient::__on_close(uv_handle_t *handle) noexcept {
     client->server->_on_client_close(client);
 }
 
-void SSLClient::__on_timeout(uv_timer_t *timeout) noexcept {
-    SSLClient *client = static_cast<SSLClient *>(timeout->data);
-    if (!client) {
-        timer_allocator.deallocate(timeout);
-        return;
+void SSLClient::__on_timeout(void *ctx) noexcept {
+    SSLClient *client = static_cast<SSLClient *>(ctx);
+    LOG_DEBUG("The client timed out");
+    if (client->context) {
+        client->context->on_timeout(client, false);
     }
+    client->crash();
+}
 
+void SSLClient::__on_deadline(void *ctx) noexcept {
+    SSLClient *client = static_cast<SSLClient *>(ctx);
+    LOG_DEBUG("The client missed its deadline");
+    if (client->context) {
+        client->context->on_timeout(client, true);
+    }
     client->crash();
 }
 
 SSLClient::SSLClient(SSLServer *server, uv_tcp_t *client, WOLFSSL *ssl)
         : server(server),
           client(client),
-          ssl(ssl),
-          timeout(timer_allocator.allocate()) {
-    uv_timer_init(client->loop, timeout);
+          wheel(&TimerWheel::get(client->loop)),
+          timeout(__on_timeout, this),
+          deadline(__on_deadline, this),
+          ssl(ssl) {
     client->data = this;
-    timeout->data = this;
 }
 
 SSLClient::~SSLClient() noexcept {
@@ -177,7 +280,6 @@ SSLClient::~SSLClient() noexcept {
     if (!closing) {
         crash();
     }
-    uv_close((uv_handle_t *)timeout, on_timeout_close);
     // Doing this may cause an error in the event that the client is deleted while in the middle of a write
     for (auto pair : write_requests) {
         for (uv_buf_t buf : pair.second) {
@@ -195,28 +297,47 @@ uv_loop_t *SSLClient::getLoop() const noexcept {
 }
 
 void SSLClient::listen() noexcept {
+    if (reading || client == nullptr) {
+        return;
+    }
+    reading = true;
     uv_read_start((uv_stream_t *)client, alloc_recv_buf, __on_recv);
 }
 
 void SSLClient::stop_listening() noexcept {
+    if (!reading || client == nullptr) {
+        return;
+    }
+    reading = false;
     uv_read_stop((uv_stream_t *)client);
 }
 
 void SSLClient::setTimeout(unsigned long time) noexcept {
     timeout_time = time;
-    uv_timer_stop(timeout);
-    if (time == 0) {
+    if (time == 0 || closing) {
+        timeout.stop();
         return;
     }
-    uv_timer_start(timeout, __on_timeout, time, 0);
+    wheel->start(timeout, time);
 }
 
 void SSLClient::resetTimeout() noexcept {
-    if (timeout_time == 0) {
+    if (timeout_time == 0 || closing) {
         return;
     }
-    uv_timer_stop(timeout);
-    uv_timer_start(timeout, __on_timeout, timeout_time, 0);
+    wheel->start(timeout, timeout_time);
+}
+
+void SSLClient::setDeadline(unsigned long time) noexcept {
+    if (time == 0 || closing) {
+        deadline.stop();
+        return;
+    }
+    wheel->start(deadline, time);
+}
+
+bool SSLClient::isHandshakeDone() const noexcept {
+    return handshake == nullptr && wolfSSL_is_init_finished(ssl);
 }
 
 int SSLClient::read(size_t size, void *buffer) noexcept {
@@ -241,9 +362,19 @@ void SSLClient::close() noexcept {
         queued_close = true;
         return;
     }
+    if (!sent_close_notify && !closing && client != nullptr && isHandshakeDone()) {
+        sent_close_notify = true;
+        // There is no need to wait for the client's close_notify
+        wolfSSL_shutdown(ssl);
+        if (queued_writes > 0) {
+            queued_close = true;
+            return;
+        }
+    }
     closing = true;
     queued_close = false;
-    uv_timer_stop(timeout);
+    timeout.stop();
+    deadline.stop();
     if (client) {
         uv_close((uv_handle_t *)client, __on_close);
     }
@@ -253,7 +384,8 @@ void SSLClient::crash() noexcept {
     LOG_DEBUG("The client has crashed");
     queued_close = false;
     closing = true;
-    uv_timer_stop(timeout);
+    timeout.stop();
+    deadline.stop();
     if (client) {
         uv_tcp_close_reset(client, __on_close);
     }
@@ -280,7 +412,26 @@ void SSLServer::__on_accept(uv_stream_t *stream, int status) noexcept {
     if (!server) {
         return;
     }
+    if (status < 0) {
+        LOG_ERROR("[SSLServer::__on_accept] Could not accept a connection: " << uv_strerror(status));
+        return;
+    }
+
+    if (server->atCapacity()) {
+        // Leaving the connection unaccepted stops libuv from polling the
+        // listener, so the rest wait in the backlog until a client closes
+        LOG_DEBUG("The connection limit was reached, waiting for a client to close");
+        static metrics::Counter &waits = metrics::counter("gemcaps_accept_waits_total", "Number of times a server stopped accepting because of a connection limit");
+        waits.inc();
+        server->waiting.push_back(stream);
+        waiting_servers.insert(server);
+        updateMetrics();
+        return;
+    }
+    server->accept(stream);
+}
 
+void SSLServer::accept(uv_stream_t *stream) noexcept {
     LOG_DEBUG("A new connection has been accepted");
 
     uv_tcp_t *conn = tcp_allocator.allocate();
@@ -290,12 +441,26 @@ void SSLServer::__on_accept(uv_stream_t *stream, int status) noexcept {
         return;
     }
 
-    WOLFSSL *ssl = wolfSSL_new(server->wolfssl);
-    SSLClient *client = *server->clients.insert(new SSLClient(server, conn, ssl)).first;
+    sockaddr_storage address = {};
+    int address_len = sizeof(address);
+    uv_tcp_getpeername(conn, (sockaddr *)&address, &address_len);
+    if (RateLimiter::get(stream->loop).limited((const sockaddr *)&address)) {
+        // Don't spend a handshake on a client that has used up its requests
+        LOG_DEBUG("A connection was turned away by the rate limit");
+        uv_tcp_close_reset(conn, on_tcp_close);
+        return;
+    }
+
+    WOLFSSL *ssl = wolfSSL_new(certificates.primary.get());
+    SSLClient *client = *clients.insert(new SSLClient(this, conn, ssl)).first;
+    client->address = address;
+    ++total;
+    connections_gauge->set(clients.size());
+    updateMetrics();
     wolfSSL_SetIOReadCtx(ssl, client);
     wolfSSL_SetIOWriteCtx(ssl, client);
-    if (server->context) {
-        server->context->on_accept(server, client);
+    if (context) {
+        context->on_accept(this, client);
     } else {
         LOG_ERROR("No context has been set for the server");
         client->crash();
@@ -308,6 +473,12 @@ int SSLServer::__send(WOLFSSL *ssl, char *buf, int size, void *ctx) noexcept {
         return WOLFSSL_CBIO_ERR_GENERAL;
     }
 
+    if (client->handshake != nullptr) {
+        // Off of the loop, the records can only be held on to
+        client->handshake->output.append(buf, size);
+        return size;
+    }
+
     if (!client->is_open()) {
         return WOLFSSL_CBIO_ERR_CONN_CLOSE;
     }
@@ -322,6 +493,9 @@ int SSLServer::__recv(WOLFSSL *ssl, char *buf, int size, void *ctx) noexcept {
     }
 
     if (client->_ready() == 0) {
+        if (client->handshake != nullptr) {
+            return WOLFSSL_CBIO_ERR_WANT_READ;
+        }
         if (!client->is_open()) {
             return WOLFSSL_CBIO_ERR_CONN_CLOSE;
         }
@@ -337,77 +511,429 @@ void SSLServer::_on_client_close(SSLClient *client) noexcept {
         return;
     }
     clients.erase(found);
-    delete client;
+    if (client->handshake != nullptr) {
+        // The threadpool is still using the client, so it is deleted once the
+        // handshake is back
+        client->handshake->orphaned = true;
+    } else {
+        delete client;
+    }
+    --total;
+    connections_gauge->set(clients.size());
+    updateMetrics();
+    resumeWaiting();
 }
 
+bool SSLServer::atCapacity() const noexcept {
+    return (max_connections > 0 && clients.size() >= max_connections)
+        || (max_total > 0 && total >= max_total);
+}
 
-SSLServer::~SSLServer() noexcept {
-    if (wolfssl != nullptr) {
-        wolfSSL_CTX_free(wolfssl);
+void SSLServer::resumeWaiting() noexcept {
+    if (waiting_servers.empty()) {
+        return;
     }
-    if (server != nullptr) {
-        uv_close((uv_handle_t *)server, on_tcp_close);
+    vector<SSLServer *> ready;
+    for (SSLServer *server : waiting_servers) {
+        if (!server->atCapacity()) {
+            ready.push_back(server);
+        }
+    }
+    for (SSLServer *server : ready) {
+        while (!server->waiting.empty() && !server->atCapacity()) {
+            uv_stream_t *listener = server->waiting.back();
+            server->waiting.pop_back();
+            server->accept(listener);
+        }
+        if (server->waiting.empty()) {
+            waiting_servers.erase(server);
+        }
+    }
+    updateMetrics();
+}
+
+void SSLServer::updateMetrics() noexcept {
+    static metrics::Gauge &connections = metrics::gauge("gemcaps_connections", "Number of open client connections");
+    static metrics::Gauge &limit = metrics::gauge("gemcaps_connection_limit", "Most client connections that may be open at once, 0 if there is no limit");
+    static metrics::Gauge &utilization = metrics::gauge("gemcaps_connection_utilization_percent", "Open client connections as a percent of the limit, 0 if there is no limit");
+    static metrics::Gauge &waiting = metrics::gauge("gemcaps_accept_waiting", "Number of servers that stopped accepting until a client closes");
+    connections.set(total);
+    limit.set(max_total);
+    utilization.set(max_total > 0 ? total * 100 / max_total : 0);
+    waiting.set(waiting_servers.size());
+}
+
+void SSLServer::loadLimits(YAML::Node settings) {
+    configureLimits(getProperty<size_t>(settings, MAX_CONNECTIONS, 0));
+    if (max_total > 0) {
+        LOG_DEBUG("Limiting all servers to " << max_total << " connections");
+    }
+}
+
+void SSLServer::configureLimits(size_t max_connections) noexcept {
+    max_total = max_connections;
+    updateMetrics();
+    resumeWaiting();
+}
+
+
+SSLServer::~SSLServer() noexcept {
+    waiting_servers.erase(this);
+    total -= clients.size();
+    updateMetrics();
+    for (Listener &listener : listeners) {
+        listener.handle->data = nullptr;
+        uv_close((uv_handle_t *)listener.handle, on_tcp_close);
     }
     for (SSLClient *client : clients) {
-        delete client;
+        if (client->handshake != nullptr) {
+            client->handshake->orphaned = true;
+        } else {
+            delete client;
+        }
     }
 }
 
-void SSLServer::load(uv_loop_t *loop, const std::string &host, int port, const std::string &cert, const std::string &key) noexcept {
-    if (wolfssl != nullptr) {
-        wolfSSL_CTX_free(wolfssl);
+ServerCertificates SSLServer::loadCertificate(const std::string &cert, const std::string &key,
+        const std::string &ecdsa_cert, const std::string &ecdsa_key) noexcept {
+    // Read and write through the client, rather than the socket
+    setupContext setup_context = [](WOLFSSL_CTX *ctx) {
+        wolfSSL_CTX_SetIORecv(ctx, __recv);
+        wolfSSL_CTX_SetIOSend(ctx, __send);
+    };
+    ServerCertificates certificates;
+    certificates.primary = CertificateStore::get(cert, key, setup_context);
+    if (!ecdsa_cert.empty() && certificates.primary) {
+        certificates.ecdsa = CertificateStore::get(ecdsa_cert, ecdsa_key, setup_context);
+        if (!certificates.ecdsa) {
+            return {};
+        }
     }
+    return certificates;
+}
 
-    wolfssl = wolfSSL_CTX_new(wolfTLSv1_2_server_method());
-    if (wolfssl == nullptr) {
+void SSLServer::chooseCertificate(SSLClient *client, const char *data, size_t size) noexcept {
+    if (!certificates.ecdsa) {
         return;
     }
-
-    // Load the certificates
-    if (wolfSSL_CTX_use_certificate_file(wolfssl, cert.c_str(), SSL_FILETYPE_PEM) != SSL_SUCCESS) {
-        LOG_ERROR("[SSLServer::load] Could not load certificate file '" << cert << "'");
-        wolfSSL_CTX_free(wolfssl);
-        wolfssl = nullptr;
+    ClientHello hello;
+    if (!ClientHello::parse(data, size, hello) || !hello.offersECDSA()) {
         return;
     }
-    if (wolfSSL_CTX_use_PrivateKey_file(wolfssl, key.c_str(), SSL_FILETYPE_PEM) != SSL_SUCCESS) {
-        LOG_ERROR("[SSLServer::load] Could not load key file '" << key << "'");
-        wolfSSL_CTX_free(wolfssl);
-        wolfssl = nullptr;
+    WOLFSSL *ssl = wolfSSL_new(certificates.ecdsa.get());
+    if (ssl == nullptr) {
         return;
     }
+    wolfSSL_SetIOReadCtx(ssl, client);
+    wolfSSL_SetIOWriteCtx(ssl, client);
+    wolfSSL_free(client->ssl);
+    client->ssl = ssl;
+}
 
-    wolfSSL_CTX_SetIORecv(wolfssl, __recv);
-    wolfSSL_CTX_SetIOSend(wolfssl, __send);
+void SSLServer::load(uv_loop_t *loop, const vector<ListenAddress> &addresses, const ServerCertificates &certificates,
+        int backlog, size_t max_connections, bool reuse_port, const vector<SSLServer *> &previous,
+        const vector<ListenAddress> &others) noexcept {
+    this->backlog = backlog > 0 ? backlog : DEFAULT_BACKLOG;
+    this->max_connections = max_connections;
+    std::string label;
+    for (const ListenAddress &address : addresses) {
+        label += (label.empty() ? "" : ",") + address.toString();
+    }
+    connections_gauge = &metrics::gauge("gemcaps_server_connections{listen=\"" + label + "\"}",
+        "Number of open client connections of each server");
 
-    if (server != nullptr) {
-        uv_close((uv_handle_t *)server, on_tcp_close);
+    this->certificates = certificates;
+    if (!isLoaded()) {
+        return;
     }
-    server = tcp_allocator.allocate();
-    uv_tcp_init(loop, server);
-    server->data = this;
 
-    sockaddr_in addr;
-    uv_ip4_addr(host.c_str(), port, &addr);
-    int error = uv_tcp_bind(server, (const sockaddr *)&addr, 0);
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        closeListener(i);
+    }
+    listeners.clear();
+    adoptable.clear();
+
+    for (const ListenAddress &address : addresses) {
+        // A dual stack socket would take the port from the IPv4 listener,
+        // even if another server owns it
+        bool ipv6_only = false;
+        if (address.isIPv6()) {
+            for (const vector<ListenAddress> *list : {&addresses, &others}) {
+                for (const ListenAddress &other : *list) {
+                    ipv6_only |= !other.isIPv6() && other.port == address.port;
+                }
+            }
+        }
+        bool held = false;
+        for (SSLServer *server : previous) {
+            held |= server != this && server->findListener(address, ipv6_only) >= 0;
+        }
+        if (held) {
+            adoptable.push_back({address, ipv6_only});
+            continue;
+        }
+        bind(loop, address, ipv6_only, reuse_port);
+    }
+    if (listeners.empty() && adoptable.empty()) {
+        this->certificates = {};
+    }
+}
+
+void SSLServer::adopt(const vector<SSLServer *> &previous) noexcept {
+    for (auto &address : adoptable) {
+        for (SSLServer *server : previous) {
+            int index = server->findListener(address.first, address.second);
+            if (index < 0) {
+                continue;
+            }
+            Listener listener = server->listeners[index];
+            server->listeners.erase(server->listeners.begin() + index);
+            listener.handle->data = this;
+            listeners.push_back(listener);
+
+            // A connection the old server had no room for is now this one's
+            uv_stream_t *stream = (uv_stream_t *)listener.handle;
+            auto found = std::find(server->waiting.begin(), server->waiting.end(), stream);
+            if (found != server->waiting.end()) {
+                server->waiting.erase(found);
+                if (server->waiting.empty()) {
+                    waiting_servers.erase(server);
+                }
+                waiting.push_back(stream);
+                waiting_servers.insert(this);
+            }
+            break;
+        }
+    }
+    adoptable.clear();
+    resumeWaiting();
+}
+
+int SSLServer::findListener(const ListenAddress &address, bool ipv6_only) const noexcept {
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        if (listeners[i].address == address && listeners[i].ipv6_only == ipv6_only) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void SSLServer::closeListener(size_t index) noexcept {
+    uv_tcp_t *handle = listeners[index].handle;
+    auto found = std::find(waiting.begin(), waiting.end(), (uv_stream_t *)handle);
+    if (found != waiting.end()) {
+        waiting.erase(found);
+        if (waiting.empty()) {
+            waiting_servers.erase(this);
+        }
+        // libuv has already accepted the connection that is waiting, and
+        // closing the listener would drop it
+        accept((uv_stream_t *)handle);
+    }
+    handle->data = nullptr;
+    uv_close((uv_handle_t *)handle, on_tcp_close);
+}
+
+bool SSLServer::bind(uv_loop_t *loop, const ListenAddress &address, bool ipv6_only, bool reuse_port) noexcept {
+    sockaddr_storage addr = {};
+    int error;
+    if (address.isIPv6()) {
+        error = uv_ip6_addr(address.host.c_str(), address.port, (sockaddr_in6 *)&addr);
+    } else {
+        error = uv_ip4_addr(address.host.c_str(), address.port, (sockaddr_in *)&addr);
+    }
     if (error != 0) {
-        LOG_ERROR("[SSLServer::load] Could not bind to '" << host << ":" << port << "': " << uv_strerror(error));
-        wolfSSL_CTX_free(wolfssl);
-        wolfssl = nullptr;
-        uv_close((uv_handle_t *)server, on_tcp_close);
-        server = nullptr;
-        return;
+        LOG_ERROR("[SSLServer::load] '" << address.toString() << "' is not a valid address: " << uv_strerror(error));
+        return false;
+    }
+
+    uv_tcp_t *listener = tcp_allocator.allocate();
+    auto found = inherited.find(address.toString());
+    if (found != inherited.end()) {
+        // The socket is already bound, and likely has connections waiting
+        uv_tcp_init(loop, listener);
+        error = uv_tcp_open(listener, found->second);
+        inherited.erase(found);
+        if (error == 0) {
+            listener->data = this;
+            listeners.push_back({listener, address, ipv6_only});
+            LOG_DEBUG("Took over the socket of '" << address.toString() << "'");
+            return true;
+        }
+        LOG_WARN("[SSLServer::load] Could not use the inherited socket of '" << address.toString() << "': " << uv_strerror(error));
+        uv_close((uv_handle_t *)listener, on_tcp_close);
+        listener = tcp_allocator.allocate();
+    }
+    // Create the socket now so that options can be set before it is bound
+    uv_tcp_init_ex(loop, listener, addr.ss_family);
+    listener->data = this;
+
+    if (reuse_port) {
+#ifdef SO_REUSEPORT
+        uv_os_fd_t fd;
+        int on = 1;
+        if (uv_fileno((uv_handle_t *)listener, &fd) == 0) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (const char *)&on, sizeof(on));
+        }
+#else
+        LOG_WARN("[SSLServer::load] reusePort is not supported on this platform");
+#endif
+    }
+
+    error = uv_tcp_bind(listener, (const sockaddr *)&addr, ipv6_only ? UV_TCP_IPV6ONLY : 0);
+    if (error != 0) {
+        LOG_ERROR("[SSLServer::load] Could not bind to '" << address.toString() << "': " << uv_strerror(error));
+        listener->data = nullptr;
+        uv_close((uv_handle_t *)listener, on_tcp_close);
+        return false;
     }
+    listeners.push_back({listener, address, ipv6_only});
+    return true;
 }
 
 void SSLServer::listen() noexcept {
-    int error = uv_listen((uv_stream_t *)server, 5, __on_accept);
-    if (error != 0) {
-        LOG_ERROR("[SSLServer::load] Could not start listening: " << uv_strerror(error));
-        wolfSSL_CTX_free(wolfssl);
-        wolfssl = nullptr;
-        uv_close((uv_handle_t *)server, on_tcp_close);
-        server = nullptr;
+    for (size_t i = 0; i < listeners.size();) {
+        uv_tcp_t *listener = listeners[i].handle;
+        if (uv_is_active((uv_handle_t *)listener)) {
+            // Adopted listeners are already listening
+            ++i;
+            continue;
+        }
+        int error = uv_listen((uv_stream_t *)listener, backlog, __on_accept);
+        if (error != 0) {
+            LOG_ERROR("[SSLServer::listen] Could not start listening: " << uv_strerror(error));
+            closeListener(i);
+            listeners.erase(listeners.begin() + i);
+            continue;
+        }
+        ++i;
+    }
+    if (listeners.empty()) {
+        certificates = {};
+    }
+}
+
+void SSLServer::stopListening() noexcept {
+    for (size_t i = 0; i < listeners.size(); ++i) {
+        closeListener(i);
+    }
+    listeners.clear();
+    updateMetrics();
+}
+
+void SSLServer::getSockets(vector<std::pair<ListenAddress, uv_os_fd_t>> &sockets) const noexcept {
+    for (const Listener &listener : listeners) {
+        uv_os_fd_t fd;
+        if (uv_fileno((const uv_handle_t *)listener.handle, &fd) == 0) {
+            sockets.push_back({listener.address, fd});
+        }
+    }
+}
+
+void SSLServer::loadInherited() noexcept {
+#ifndef WIN32
+    const char *env = getenv(INHERITED_ENV);
+    if (env == nullptr) {
         return;
     }
+    std::string value = env;
+    uv_os_unsetenv(INHERITED_ENV);
+    parseInherited(value, inherited);
+    LOG_DEBUG("Inherited " << inherited.size() << " listening sockets");
+#endif
+}
+
+size_t SSLServer::parseInherited(const std::string &value, phmap::flat_hash_map<std::string, uv_os_sock_t> &sockets) noexcept {
+    size_t skipped = 0;
+    size_t pos = 0;
+    while (pos < value.length()) {
+        size_t end = value.find(';', pos);
+        if (end == std::string::npos) {
+            end = value.length();
+        }
+        std::string pair = value.substr(pos, end - pos);
+        pos = end + 1;
+        if (pair.empty()) {
+            continue;
+        }
+
+        size_t equals = pair.rfind('=');
+        if (equals == std::string::npos || equals == 0 || equals + 1 == pair.length() || pair.length() - equals > 10
+                || pair.find_first_not_of("0123456789", equals + 1) != std::string::npos) {
+            LOG_WARN("[SSLServer::loadInherited] '" << pair << "' is not a valid socket");
+            ++skipped;
+            continue;
+        }
+        sockets[pair.substr(0, equals)] = std::stoi(pair.substr(equals + 1));
+    }
+    return skipped;
+}
+
+void SSLServer::closeInherited() noexcept {
+#ifndef WIN32
+    for (auto &socket : inherited) {
+        LOG_DEBUG("No server listens on '" << socket.first << "' anymore, closing it");
+        ::close(socket.second);
+    }
+#endif
+    inherited.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// ListenAddress
+//
+////////////////////////////////////////////////////////////////////////////////
+
+bool ListenAddress::parse(const std::string &address, int default_port, ListenAddress &result) noexcept {
+    std::string host = address;
+    std::string port;
+    bool has_port = false;
+    if (!address.empty() && address.front() == '[') {
+        size_t end = address.find(']');
+        if (end == std::string::npos) {
+            return false;
+        }
+        host = address.substr(1, end - 1);
+        if (end + 1 < address.length()) {
+            if (address[end + 1] != ':') {
+                return false;
+            }
+            has_port = true;
+            port = address.substr(end + 2);
+        }
+    } else {
+        size_t colon = address.find(':');
+        // More than one colon is a bare IPv6 address
+        if (colon != std::string::npos && address.find(':', colon + 1) == std::string::npos) {
+            has_port = true;
+            host = address.substr(0, colon);
+            port = address.substr(colon + 1);
+        }
+    }
+
+    result.host = host;
+    result.port = default_port;
+    if (has_port) {
+        if (port.empty() || port.length() > 5 || port.find_first_not_of("0123456789") != std::string::npos) {
+            return false;
+        }
+        result.port = std::stoi(port);
+    }
+    if (result.port <= 0 || result.port > 65535) {
+        return false;
+    }
+
+    sockaddr_storage addr;
+    if (result.isIPv6()) {
+        return uv_ip6_addr(result.host.c_str(), result.port, (sockaddr_in6 *)&addr) == 0;
+    }
+    return uv_ip4_addr(result.host.c_str(), result.port, (sockaddr_in *)&addr) == 0;
+}
+
+std::string ListenAddress::toString() const noexcept {
+    if (isIPv6()) {
+        return "[" + host + "]:" + std::to_string(port);
+    }
+    return host + ":" + std::to_string(port);
 }
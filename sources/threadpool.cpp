@@ -0,0 +1,186 @@
+#include "gemcaps/threadpool.hpp"
+
+#include <cstdlib>
+#include <memory>
+#include <thread>
+
+#include <parallel_hashmap/phmap.h>
+
+#include "gemcaps/settings.hpp"
+#include "gemcaps/log.hpp"
+
+using std::string;
+using std::unique_ptr;
+using std::make_unique;
+
+
+static const char *LANE_NAMES[ThreadPool::LANE_COUNT] = {"metadata", "read", "scan", "handshake"};
+
+ThreadPool::ThreadPool(uv_loop_t *loop)
+        : loop(loop) {
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        string label = string("{lane=\"") + LANE_NAMES[i] + "\"}";
+        lanes[i].active_gauge = &metrics::gauge("gemcaps_threadpool_active" + label, "Number of jobs each lane has running in the threadpool");
+        lanes[i].depth_gauge = &metrics::gauge("gemcaps_threadpool_queue_depth" + label, "Number of jobs waiting for a thread in each lane");
+        lanes[i].wait_hist = &metrics::histogram("gemcaps_threadpool_queue_wait_ms" + label, "Time jobs waited for a thread in each lane");
+    }
+    metrics::gauge("gemcaps_threadpool_size", "Number of threads in the threadpool").set(getSize());
+}
+
+ThreadPool &ThreadPool::get(uv_loop_t *loop) noexcept {
+    static phmap::flat_hash_map<uv_loop_t *, unique_ptr<ThreadPool>> pools;
+    auto &pool = pools[loop];
+    if (!pool) {
+        pool = make_unique<ThreadPool>(loop);
+    }
+    return *pool;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sizing
+//
+////////////////////////////////////////////////////////////////////////////////
+
+void ThreadPool::load(YAML::Node settings) {
+    unsigned size = 0;
+    unsigned metadata = 0;
+    unsigned read = 0;
+    unsigned scan = 0;
+    unsigned handshake = 0;
+    if (settings[THREADPOOL].IsDefined()) {
+        YAML::Node pool = settings[THREADPOOL];
+        if (!pool.IsMap()) {
+            throw InvalidSettingsException(pool.Mark(), "'" + THREADPOOL + "' must be a map");
+        }
+        size = getProperty<unsigned>(pool, SIZE, 0);
+        if (size > MAX_SIZE) {
+            throw InvalidSettingsException(pool[SIZE].Mark(), "'" + SIZE + "' may be at most " + std::to_string(MAX_SIZE));
+        }
+        if (pool[LANES].IsDefined()) {
+            YAML::Node lanes = pool[LANES];
+            if (!lanes.IsMap()) {
+                throw InvalidSettingsException(lanes.Mark(), "'" + LANES + "' must be a map");
+            }
+            metadata = getProperty<unsigned>(lanes, LANE_METADATA, 0);
+            read = getProperty<unsigned>(lanes, LANE_READ, 0);
+            scan = getProperty<unsigned>(lanes, LANE_SCAN, 0);
+            handshake = getProperty<unsigned>(lanes, LANE_HANDSHAKE, 0);
+        }
+    }
+    configure(size, metadata, read, scan, handshake);
+
+    unsigned total = 0;
+    for (int i = 0; i < LANE_COUNT; ++i) {
+        total += getShare(static_cast<Lane>(i));
+    }
+    if (total > getSize()) {
+        LOG_WARN("The threadpool lanes can use " << total << " threads, but there are only " << getSize()
+            << ", so a busy lane may hold up the others");
+    }
+}
+
+void ThreadPool::exportSize() noexcept {
+    // libuv reads the size when it starts its threads, which it does the
+    // first time work is queued
+    string value = std::to_string(getSize());
+#ifdef WIN32
+    _putenv_s("UV_THREADPOOL_SIZE", value.c_str());
+#else
+    setenv("UV_THREADPOOL_SIZE", value.c_str(), 1);
+#endif
+    LOG_DEBUG("Using " << getSize() << " threads for the threadpool");
+}
+
+void ThreadPool::configure(unsigned size, unsigned metadata, unsigned read, unsigned scan, unsigned handshake) noexcept {
+    ThreadPool::size = size < MAX_SIZE ? size : MAX_SIZE;
+    shares[METADATA] = metadata;
+    shares[READ] = read;
+    shares[SCAN] = scan;
+    shares[HANDSHAKE] = handshake;
+}
+
+unsigned ThreadPool::getSize() noexcept {
+    if (size > 0) {
+        return size;
+    }
+    const char *env = getenv("UV_THREADPOOL_SIZE");
+    if (env != nullptr) {
+        unsigned long value = strtoul(env, nullptr, 10);
+        if (value > 0) {
+            return value < MAX_SIZE ? value : MAX_SIZE;
+        }
+    }
+    unsigned cpus = std::thread::hardware_concurrency();
+    if (cpus < 4) {
+        return 4;
+    }
+    return cpus < MAX_SIZE ? cpus : MAX_SIZE;
+}
+
+unsigned ThreadPool::getShare(Lane lane) noexcept {
+    if (shares[lane] > 0 || lane == HANDSHAKE) {
+        return shares[lane];
+    }
+    unsigned share = lane == READ ? getSize() / 2 : getSize() / 4;
+    return share > 0 ? share : 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Lanes
+//
+////////////////////////////////////////////////////////////////////////////////
+
+void ThreadPool::queue(Lane lane, uv_work_t *req, uv_work_cb work_cb, uv_after_work_cb after_cb) noexcept {
+    Job *job = new Job;
+    job->work.data = job;
+    job->pool = this;
+    job->lane = lane;
+    job->queued = uv_now(loop);
+    job->req = req;
+    job->work_cb = work_cb;
+    job->after_cb = after_cb;
+    req->loop = loop;
+
+    LaneState &state = lanes[lane];
+    if (state.active < getShare(lane)) {
+        start(job);
+        return;
+    }
+    state.queue.push_back(job);
+    state.depth_gauge->set(state.queue.size());
+}
+
+void ThreadPool::start(Job *job) noexcept {
+    LaneState &state = lanes[job->lane];
+    ++state.active;
+    state.active_gauge->set(state.active);
+    state.wait_hist->observe(uv_now(loop) - job->queued);
+    uv_queue_work(loop, &job->work, __work, __after_work);
+}
+
+void ThreadPool::__work(uv_work_t *work) noexcept {
+    Job *job = static_cast<Job *>(work->data);
+    job->work_cb(job->req);
+}
+
+void ThreadPool::__after_work(uv_work_t *work, int status) noexcept {
+    Job *job = static_cast<Job *>(work->data);
+    ThreadPool *pool = job->pool;
+    LaneState &state = pool->lanes[job->lane];
+    --state.active;
+    state.active_gauge->set(state.active);
+
+    // Hand the thread to the next job in the lane before running the callback,
+    // which may queue more work
+    if (!state.queue.empty()) {
+        Job *next = state.queue.front();
+        state.queue.pop_front();
+        state.depth_gauge->set(state.queue.size());
+        pool->start(next);
+    }
+
+    job->after_cb(job->req, status);
+    delete job;
+}
@@ -0,0 +1,151 @@
+#include "gemcaps/timerwheel.hpp"
+
+#include <memory>
+
+#include <parallel_hashmap/phmap.h>
+
+#include "gemcaps/uvutils.hpp"
+
+using std::unique_ptr;
+using std::make_unique;
+
+
+static void on_wheel_timer_close(uv_handle_t *handle) {
+    timer_allocator.deallocate((uv_timer_t *)handle);
+}
+
+void WheelTimer::stop() noexcept {
+    if (wheel == nullptr) {
+        return;
+    }
+    TimerWheel::unlink(this);
+    --wheel->active;
+    wheel = nullptr;
+}
+
+TimerWheel::TimerWheel(uv_loop_t *loop, uint64_t tick, size_t slots)
+        : loop(loop),
+          timer(timer_allocator.allocate()),
+          tick(tick > 0 ? tick : 1),
+          slots(slots > 0 ? slots : 1) {
+    uv_timer_init(loop, timer);
+    timer->data = this;
+    current = uv_now(loop) / this->tick;
+}
+
+TimerWheel::~TimerWheel() {
+    for (WheelTimer &head : slots) {
+        while (head.next != &head) {
+            WheelTimer *timer = head.next;
+            unlink(timer);
+            timer->wheel = nullptr;
+        }
+    }
+    timer->data = nullptr;
+    uv_close((uv_handle_t *)timer, on_wheel_timer_close);
+}
+
+TimerWheel &TimerWheel::get(uv_loop_t *loop) noexcept {
+    static phmap::flat_hash_map<uv_loop_t *, unique_ptr<TimerWheel>> wheels;
+    auto &wheel = wheels[loop];
+    if (!wheel) {
+        wheel = make_unique<TimerWheel>(loop);
+    }
+    return *wheel;
+}
+
+void TimerWheel::unlink(WheelTimer *timer) noexcept {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer;
+    timer->next = timer;
+}
+
+void TimerWheel::link(WheelTimer *head, WheelTimer *timer) noexcept {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void TimerWheel::start(WheelTimer &timer, uint64_t timeout) noexcept {
+    if (!running) {
+        // Nothing was waiting, so there are no ticks to catch up on
+        current = uv_now(loop) / tick;
+    }
+    // Round up, so that a timer never expires early
+    uint64_t deadline = (uv_now(loop) + timeout + tick - 1) / tick;
+    if (deadline <= current) {
+        deadline = current + 1;
+    }
+
+    if (timer.wheel == this) {
+        if (timer.deadline == deadline) {
+            // Resetting within the same tick is free
+            return;
+        }
+        unlink(&timer);
+    } else {
+        timer.stop();
+        timer.wheel = this;
+        ++active;
+    }
+    timer.deadline = deadline;
+    link(&slots[deadline % slots.size()], &timer);
+
+    if (!running) {
+        running = true;
+        uv_timer_start(this->timer, __on_tick, tick, tick);
+    }
+}
+
+void TimerWheel::advance() noexcept {
+    uint64_t now = uv_now(loop) / tick;
+    if (now <= current) {
+        return;
+    }
+    // After a long stall every slot is visited once
+    uint64_t steps = now - current;
+    if (steps > slots.size()) {
+        steps = slots.size();
+    }
+
+    WheelTimer expired;
+    for (uint64_t i = 1; i <= steps; ++i) {
+        WheelTimer &head = slots[(current + i) % slots.size()];
+        WheelTimer *timer = head.next;
+        while (timer != &head) {
+            WheelTimer *next = timer->next;
+            if (timer->deadline <= now) {
+                unlink(timer);
+                link(&expired, timer);
+            }
+            timer = next;
+        }
+    }
+    current = now;
+
+    // Callbacks may stop or restart any timer, including ones that have yet to
+    // be called, which takes them off of the expired list
+    while (expired.next != &expired) {
+        WheelTimer *timer = expired.next;
+        unlink(timer);
+        timer->wheel = nullptr;
+        --active;
+        if (timer->cb != nullptr) {
+            timer->cb(timer->ctx);
+        }
+    }
+}
+
+void TimerWheel::__on_tick(uv_timer_t *handle) noexcept {
+    TimerWheel *wheel = static_cast<TimerWheel *>(handle->data);
+    if (wheel == nullptr) {
+        return;
+    }
+    wheel->advance();
+    if (wheel->active == 0) {
+        wheel->running = false;
+        uv_timer_stop(handle);
+    }
+}
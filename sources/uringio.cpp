@@ -0,0 +1,496 @@
+#include "uringio.hpp"
+
+#ifdef GEMCAPS_IO_URING
+
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/sysmacros.h>
+
+#include "gemcaps/log.hpp"
+
+using std::string;
+
+
+static int uring_setup(unsigned entries, io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void on_handle_close(uv_handle_t *handle) {
+    if (handle->type == UV_POLL) {
+        delete (uv_poll_t *)handle;
+    } else if (handle->type == UV_TIMER) {
+        delete (uv_timer_t *)handle;
+    } else {
+        delete (uv_prepare_t *)handle;
+    }
+}
+
+/**
+ * Convert the result of a statx into a uv_stat_t, the way libuv does
+ */
+static void statx_to_uv(const struct statx &statxbuf, uv_stat_t *buf) {
+    buf->st_dev = makedev(statxbuf.stx_dev_major, statxbuf.stx_dev_minor);
+    buf->st_mode = statxbuf.stx_mode;
+    buf->st_nlink = statxbuf.stx_nlink;
+    buf->st_uid = statxbuf.stx_uid;
+    buf->st_gid = statxbuf.stx_gid;
+    buf->st_rdev = makedev(statxbuf.stx_rdev_major, statxbuf.stx_rdev_minor);
+    buf->st_ino = statxbuf.stx_ino;
+    buf->st_size = statxbuf.stx_size;
+    buf->st_blksize = statxbuf.stx_blksize;
+    buf->st_blocks = statxbuf.stx_blocks;
+    buf->st_atim.tv_sec = statxbuf.stx_atime.tv_sec;
+    buf->st_atim.tv_nsec = statxbuf.stx_atime.tv_nsec;
+    buf->st_mtim.tv_sec = statxbuf.stx_mtime.tv_sec;
+    buf->st_mtim.tv_nsec = statxbuf.stx_mtime.tv_nsec;
+    buf->st_ctim.tv_sec = statxbuf.stx_ctime.tv_sec;
+    buf->st_ctim.tv_nsec = statxbuf.stx_ctime.tv_nsec;
+    buf->st_birthtim.tv_sec = statxbuf.stx_btime.tv_sec;
+    buf->st_birthtim.tv_nsec = statxbuf.stx_btime.tv_nsec;
+    buf->st_flags = 0;
+    buf->st_gen = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Setup
+//
+////////////////////////////////////////////////////////////////////////////////
+
+UringFileIO *UringFileIO::create(uv_loop_t *loop, unsigned entries) noexcept {
+    UringFileIO *io = new UringFileIO(loop);
+    if (!io->setup(entries)) {
+        delete io;
+        return nullptr;
+    }
+    return io;
+}
+
+bool UringFileIO::setup(unsigned entries) noexcept {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = uring_setup(entries, &params);
+    if (ring_fd < 0) {
+        LOG_DEBUG("Could not set up io_uring: " << strerror(errno));
+        return false;
+    }
+
+    // Make sure that every operation the file handler needs is supported
+    size_t probe_size = sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+    io_uring_probe *probe = (io_uring_probe *)calloc(1, probe_size);
+    bool supported = uring_register(ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) >= 0;
+    for (int op : {IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE}) {
+        supported = supported && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    if (!supported) {
+        LOG_DEBUG("io_uring does not support the needed file operations");
+        return false;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = sq_ring_size > cq_ring_size ? sq_ring_size : cq_ring_size;
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        sq_ring = nullptr;
+        return false;
+    }
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            cq_ring = nullptr;
+            return false;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    void *mapped = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    sqes = static_cast<io_uring_sqe *>(mapped);
+
+    char *sq = static_cast<char *>(sq_ring);
+    sq_head = (unsigned *)(sq + params.sq_off.head);
+    sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    sq_array = (unsigned *)(sq + params.sq_off.array);
+    sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_local_tail = *sq_tail;
+    char *cq = static_cast<char *>(cq_ring);
+    cq_head = (unsigned *)(cq + params.cq_off.head);
+    cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    cq_entries = params.cq_entries;
+
+    // Completions wake the loop through an eventfd
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0 || uring_register(ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+        LOG_DEBUG("Could not register an eventfd with io_uring: " << strerror(errno));
+        return false;
+    }
+
+    poll = new uv_poll_t;
+    if (uv_poll_init(loop, poll, event_fd) < 0) {
+        delete poll;
+        poll = nullptr;
+        return false;
+    }
+    poll->data = this;
+    uv_poll_start(poll, UV_READABLE, __on_poll);
+    uv_unref((uv_handle_t *)poll);
+
+    prepare = new uv_prepare_t;
+    uv_prepare_init(loop, prepare);
+    prepare->data = this;
+    uv_prepare_start(prepare, __on_prepare);
+    uv_unref((uv_handle_t *)prepare);
+
+    retry = new uv_timer_t;
+    uv_timer_init(loop, retry);
+    retry->data = this;
+    return true;
+}
+
+UringFileIO::~UringFileIO() {
+    if (poll != nullptr) {
+        poll->data = nullptr;
+        uv_poll_stop(poll);
+        uv_close((uv_handle_t *)poll, on_handle_close);
+    }
+    if (prepare != nullptr) {
+        prepare->data = nullptr;
+        uv_prepare_stop(prepare);
+        uv_close((uv_handle_t *)prepare, on_handle_close);
+    }
+    if (retry != nullptr) {
+        retry->data = nullptr;
+        uv_timer_stop(retry);
+        uv_close((uv_handle_t *)retry, on_handle_close);
+    }
+    for (Op *op : backlog) {
+        delete op;
+    }
+    if (sqes != nullptr) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ring != nullptr && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != nullptr) {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (event_fd >= 0) {
+        ::close(event_fd);
+    }
+    if (ring_fd >= 0) {
+        ::close(ring_fd);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Submissions
+//
+////////////////////////////////////////////////////////////////////////////////
+
+io_uring_sqe *UringFileIO::nextSqe() noexcept {
+    unsigned index = sq_local_tail & sq_mask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    ++sq_local_tail;
+    ++unsubmitted;
+    return sqe;
+}
+
+bool UringFileIO::push(Op *op) noexcept {
+    unsigned needed = op->type == STAT_OPEN ? 2 : 1;
+    if (expected + needed > cq_entries) {
+        // Never have more in flight than the completion queue can hold
+        return false;
+    }
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sq_entries - (sq_local_tail - head) < needed) {
+        submit();
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sq_entries - (sq_local_tail - head) < needed) {
+            return false;
+        }
+    }
+
+    uint64_t data = reinterpret_cast<uint64_t>(op);
+    io_uring_sqe *sqe = nextSqe();
+    switch (op->type) {
+    case STAT:
+    case STAT_OPEN:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(op->path.c_str());
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = reinterpret_cast<uint64_t>(&op->statxbuf);
+        sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+        sqe->user_data = data;
+        if (op->type == STAT_OPEN) {
+            // The open only runs if the stat succeeds. It doesn't block on
+            // fifos, since the file type isn't known yet.
+            sqe->flags = IOSQE_IO_LINK;
+            sqe = nextSqe();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(op->path.c_str());
+            sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+            sqe->user_data = data | 1;
+        }
+        break;
+    case OPEN:
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(op->path.c_str());
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = data;
+        break;
+    case READ:
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = op->fd;
+        sqe->addr = reinterpret_cast<uint64_t>(op->buf);
+        sqe->len = op->length;
+        sqe->off = op->offset;
+        sqe->user_data = data;
+        break;
+    case CLOSE:
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = op->fd;
+        sqe->user_data = data;
+        break;
+    }
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    expected += needed;
+    return true;
+}
+
+void UringFileIO::start(Op *op) noexcept {
+    inflight->inc();
+    if (!backlog.empty() || !push(op)) {
+        backlog.push_back(op);
+    }
+    updateRef();
+}
+
+void UringFileIO::submit() noexcept {
+    while (unsubmitted > 0) {
+        int res = uring_enter(ring_fd, unsubmitted, 0, 0);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EBUSY) {
+                LOG_ERROR("Could not submit to io_uring: " << strerror(errno));
+                return;
+            }
+            // The kernel is short of resources or has completions to hand
+            // back first. Nothing may wake the loop, so try again shortly.
+            if (!uv_is_active((uv_handle_t *)retry)) {
+                uv_timer_start(retry, __on_retry, 1, 0);
+            }
+            return;
+        }
+        if (res == 0) {
+            return;
+        }
+        unsubmitted -= res < unsubmitted ? res : unsubmitted;
+    }
+}
+
+void UringFileIO::updateRef() noexcept {
+    // The loop is only kept alive while there is something in flight
+    bool busy = expected > 0 || !backlog.empty();
+    if (busy && !referenced) {
+        uv_ref((uv_handle_t *)poll);
+    } else if (!busy && referenced) {
+        uv_unref((uv_handle_t *)poll);
+    }
+    referenced = busy;
+}
+
+void UringFileIO::__on_prepare(uv_prepare_t *handle) noexcept {
+    UringFileIO *io = static_cast<UringFileIO *>(handle->data);
+    if (io != nullptr && io->unsubmitted > 0) {
+        io->submit();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Completions
+//
+////////////////////////////////////////////////////////////////////////////////
+
+void UringFileIO::__on_poll(uv_poll_t *handle, int status, int events) noexcept {
+    UringFileIO *io = static_cast<UringFileIO *>(handle->data);
+    if (io == nullptr) {
+        return;
+    }
+    uint64_t count;
+    while (::read(io->event_fd, &count, sizeof(count)) > 0) {}
+    io->reap();
+}
+
+void UringFileIO::__on_retry(uv_timer_t *handle) noexcept {
+    UringFileIO *io = static_cast<UringFileIO *>(handle->data);
+    if (io != nullptr) {
+        io->reap();
+    }
+}
+
+void UringFileIO::reap() noexcept {
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        io_uring_cqe cqe = cqes[head & cq_mask];
+        ++head;
+        // Give the entry back before the callback can start anything else
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        --expected;
+
+        Op *op = reinterpret_cast<Op *>(cqe.user_data & ~uint64_t(1));
+        complete(op, cqe.user_data & 1, cqe.res);
+        head = *cq_head;
+    }
+
+    while (!backlog.empty() && push(backlog.front())) {
+        backlog.pop_front();
+    }
+    if (unsubmitted > 0) {
+        submit();
+    }
+    updateRef();
+}
+
+void UringFileIO::complete(Op *op, unsigned part, int result) noexcept {
+    uv_stat_t stat;
+    switch (op->type) {
+    case STAT:
+        if (result >= 0) {
+            statx_to_uv(op->statxbuf, &stat);
+        }
+        op->stat_cb(result < 0 ? result : 0, result < 0 ? nullptr : &stat, op->ctx);
+        break;
+    case STAT_OPEN:
+        if (part == 0) {
+            op->stat_result = result;
+        } else {
+            op->open_result = result;
+        }
+        if (--op->remaining > 0) {
+            return;
+        }
+        if (op->stat_result < 0) {
+            if (op->open_result >= 0) {
+                ::close(op->open_result);
+            }
+            op->opened_cb(op->stat_result, nullptr, op->stat_result, op->ctx);
+            break;
+        }
+        statx_to_uv(op->statxbuf, &stat);
+        if (!S_ISREG(stat.st_mode)) {
+            if (op->open_result >= 0) {
+                ::close(op->open_result);
+            }
+            op->opened_cb(0, &stat, UV_EINVAL, op->ctx);
+            break;
+        }
+        if (op->open_result >= 0) {
+            // Reads of regular files should wait for the disk, not fail with EAGAIN
+            int flags = fcntl(op->open_result, F_GETFL);
+            fcntl(op->open_result, F_SETFL, flags & ~O_NONBLOCK);
+        }
+        op->opened_cb(0, &stat, op->open_result, op->ctx);
+        break;
+    case OPEN:
+    case READ:
+    case CLOSE:
+        if (op->result_cb) {
+            op->result_cb(result, op->ctx);
+        }
+        break;
+    }
+    inflight->dec();
+    delete op;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Operations
+//
+////////////////////////////////////////////////////////////////////////////////
+
+void UringFileIO::stat(const string &path, onFileStat cb, void *ctx) noexcept {
+    Op *op = new Op;
+    op->type = STAT;
+    op->path = path;
+    op->stat_cb = cb;
+    op->ctx = ctx;
+    start(op);
+}
+
+void UringFileIO::statOpen(const string &path, onFileOpened cb, void *ctx) noexcept {
+    Op *op = new Op;
+    op->type = STAT_OPEN;
+    op->path = path;
+    op->opened_cb = cb;
+    op->ctx = ctx;
+    op->remaining = 2;
+    start(op);
+}
+
+void UringFileIO::open(const string &path, onFileResult cb, void *ctx) noexcept {
+    Op *op = new Op;
+    op->type = OPEN;
+    op->path = path;
+    op->result_cb = cb;
+    op->ctx = ctx;
+    start(op);
+}
+
+void UringFileIO::read(uv_file fd, char *buf, size_t length, uint64_t offset, onFileResult cb, void *ctx) noexcept {
+    Op *op = new Op;
+    op->type = READ;
+    op->fd = fd;
+    op->buf = buf;
+    op->length = length;
+    op->offset = offset;
+    op->result_cb = cb;
+    op->ctx = ctx;
+    start(op);
+}
+
+void UringFileIO::close(uv_file fd, onFileResult cb, void *ctx) noexcept {
+    Op *op = new Op;
+    op->type = CLOSE;
+    op->fd = fd;
+    op->result_cb = cb;
+    op->ctx = ctx;
+    start(op);
+}
+
+#endif
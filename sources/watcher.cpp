@@ -0,0 +1,264 @@
+#include "gemcaps/watcher.hpp"
+
+#include <memory>
+
+#include "gemcaps/pathutils.hpp"
+#include "gemcaps/threadpool.hpp"
+#include "gemcaps/log.hpp"
+
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::make_unique;
+
+// inotify can only watch a single directory, other platforms can watch a whole tree
+#ifdef __linux__
+#define WATCH_FLAGS 0
+#else
+#define WATCH_FLAGS UV_FS_EVENT_RECURSIVE
+#endif
+
+
+/**
+ * Remove any trailing slashes from a path
+ */
+static string strip_path(string path) {
+    while (path.length() > 1 && (path.back() == '/' || path.back() == '\\')) {
+        path.pop_back();
+    }
+    return path;
+}
+
+FileWatcher::FileWatcher(uv_loop_t *loop)
+        : loop(loop) {
+    watched = &metrics::gauge("gemcaps_watched_dirs", "Number of directories watched for changes");
+    events = &metrics::counter("gemcaps_watch_events_total", "Number of file changes noticed by the watcher");
+}
+
+FileWatcher::~FileWatcher() {
+    for (Scan *scan : scans) {
+        scan->watcher = nullptr;
+    }
+    for (Check *check : checks) {
+        check->watcher = nullptr;
+    }
+    for (auto &pair : watches) {
+        uv_fs_event_stop(&pair.second->handle);
+        uv_close((uv_handle_t *)&pair.second->handle, __on_close);
+    }
+}
+
+FileWatcher &FileWatcher::get(uv_loop_t *loop) noexcept {
+    static phmap::flat_hash_map<uv_loop_t *, unique_ptr<FileWatcher>> watchers;
+    auto &watcher = watchers[loop];
+    if (!watcher) {
+        watcher = make_unique<FileWatcher>(loop);
+    }
+    return *watcher;
+}
+
+void FileWatcher::watch(const string &folder) noexcept {
+    string dir = strip_path(folder);
+    if (roots[dir]++ > 0) {
+        return;
+    }
+    watchTree(dir);
+}
+
+void FileWatcher::unwatch(const string &folder) noexcept {
+    string dir = strip_path(folder);
+    auto found = roots.find(dir);
+    if (found == roots.end() || --found->second > 0) {
+        return;
+    }
+    roots.erase(found);
+    unwatchTree(dir);
+    LOG_DEBUG("Stopped watching '" << dir << "'");
+}
+
+bool FileWatcher::isCovered(const string &dir) const noexcept {
+    for (auto &root : roots) {
+        const string &folder = root.first;
+        if (dir == folder || dir.rfind(folder.back() == '/' ? folder : folder + "/", 0) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FileWatcher::watchDir(const string &dir) noexcept {
+    if (watches.count(dir)) {
+        return;
+    }
+    Watch *watch = new Watch;
+    watch->dir = dir;
+    watch->watcher = this;
+    uv_fs_event_init(loop, &watch->handle);
+    watch->handle.data = watch;
+    int res = uv_fs_event_start(&watch->handle, __on_event, dir.c_str(), WATCH_FLAGS);
+    if (res < 0) {
+        LOG_WARN("Could not watch '" << dir << "' for changes: " << uv_strerror(res));
+        uv_close((uv_handle_t *)&watch->handle, __on_close);
+        return;
+    }
+    watches.insert({dir, watch});
+    watched->set(watches.size());
+}
+
+void FileWatcher::watchTree(const string &dir) noexcept {
+    watchDir(dir);
+#ifdef __linux__
+    // A large folder takes a while to scan, so its directories are found in
+    // the threadpool
+    Scan *scan = new Scan;
+    scan->work.data = scan;
+    scan->dir = dir;
+    scan->watcher = this;
+    scans.insert(scan);
+    ThreadPool::get(loop).queue(ThreadPool::SCAN, &scan->work, __scan, __on_scanned);
+#endif
+}
+
+void FileWatcher::unwatchTree(const string &dir) noexcept {
+    string prefix = dir + "/";
+    vector<string> removed;
+    for (auto &pair : watches) {
+        if ((pair.first == dir || pair.first.rfind(prefix, 0) == 0) && !isCovered(pair.first)) {
+            removed.push_back(pair.first);
+        }
+    }
+    for (const string &name : removed) {
+        Watch *watch = watches.at(name);
+        uv_fs_event_stop(&watch->handle);
+        uv_close((uv_handle_t *)&watch->handle, __on_close);
+        watches.erase(name);
+    }
+    watched->set(watches.size());
+}
+
+void FileWatcher::__scan(uv_work_t *work) noexcept {
+    // Runs in the threadpool, so only synchronous requests may be used
+    Scan *scan = static_cast<Scan *>(work->data);
+    vector<string> pending = {scan->dir};
+    while (!pending.empty()) {
+        string dir = pending.back();
+        pending.pop_back();
+        uv_fs_t req;
+        if (uv_fs_scandir(nullptr, &req, dir.c_str(), 0, nullptr) < 0) {
+            uv_fs_req_cleanup(&req);
+            continue;
+        }
+        uv_dirent_t entry;
+        while (uv_fs_scandir_next(&req, &entry) != UV_EOF) {
+            if (entry.type == UV_DIRENT_DIR) {
+                string child = path::join(dir, entry.name);
+                scan->dirs.push_back(child);
+                pending.push_back(child);
+            }
+        }
+        uv_fs_req_cleanup(&req);
+    }
+}
+
+void FileWatcher::__on_scanned(uv_work_t *work, int status) noexcept {
+    Scan *scan = static_cast<Scan *>(work->data);
+    FileWatcher *watcher = scan->watcher;
+    if (watcher == nullptr) {
+        delete scan;
+        return;
+    }
+    watcher->scans.erase(scan);
+    // The folder may have stopped being watched during the scan
+    for (const string &dir : scan->dirs) {
+        if (watcher->isCovered(dir)) {
+            watcher->watchDir(dir);
+        }
+    }
+    LOG_DEBUG("Watching " << watcher->watches.size() << " directories after scanning '" << scan->dir << "'");
+    delete scan;
+}
+
+bool FileWatcher::isWatched(const string &path) const noexcept {
+    string stripped = strip_path(path);
+#ifdef __linux__
+    return watches.count(stripped) || watches.count(strip_path(path::dirname(stripped)));
+#else
+    for (auto &root : roots) {
+        if (watches.count(root.first) && (stripped == root.first || path::isSubpath(root.first, stripped))) {
+            return true;
+        }
+    }
+    return false;
+#endif
+}
+
+void FileWatcher::addListener(onFileChanged cb, void *ctx) noexcept {
+    listeners.push_back({cb, ctx});
+}
+
+void FileWatcher::removeListener(onFileChanged cb, void *ctx) noexcept {
+    for (auto it = listeners.begin(); it != listeners.end(); ++it) {
+        if (it->first == cb && it->second == ctx) {
+            listeners.erase(it);
+            return;
+        }
+    }
+}
+
+void FileWatcher::notify(const string &path) noexcept {
+    events->inc();
+    LOG_DEBUG("'" << path << "' changed");
+    for (auto &listener : listeners) {
+        listener.first(path, listener.second);
+    }
+}
+
+void FileWatcher::__on_event(uv_fs_event_t *handle, const char *filename, int events, int status) noexcept {
+    Watch *watch = static_cast<Watch *>(handle->data);
+    FileWatcher *watcher = watch->watcher;
+    if (status < 0 || filename == nullptr) {
+        if (status < 0) {
+            LOG_WARN("Error while watching '" << watch->dir << "': " << uv_strerror(status));
+        }
+        // We don't know what changed, so everything in the directory is suspect
+        watcher->notify(watch->dir);
+        return;
+    }
+
+    string path = path::join(watch->dir, filename);
+    watcher->notify(path);
+
+#ifdef __linux__
+    if (events & UV_RENAME) {
+        // Something was created, moved or deleted; keep the watched directories up to date
+        Check *check = new Check;
+        check->path = path;
+        check->watcher = watcher;
+        check->req.data = check;
+        watcher->checks.insert(check);
+        uv_fs_stat(watcher->loop, &check->req, check->path.c_str(), __on_check);
+    }
+#endif
+}
+
+void FileWatcher::__on_check(uv_fs_t *req) noexcept {
+    Check *check = static_cast<Check *>(req->data);
+    FileWatcher *watcher = check->watcher;
+    if (watcher == nullptr) {
+        uv_fs_req_cleanup(req);
+        delete check;
+        return;
+    }
+    watcher->checks.erase(check);
+    if (req->result == 0 && (req->statbuf.st_mode & S_IFMT) == S_IFDIR && watcher->isCovered(check->path)) {
+        watcher->watchTree(check->path);
+    } else if (req->result < 0) {
+        watcher->unwatchTree(check->path);
+    }
+    uv_fs_req_cleanup(req);
+    delete check;
+}
+
+void FileWatcher::__on_close(uv_handle_t *handle) noexcept {
+    delete static_cast<Watch *>(handle->data);
+}
@@ -0,0 +1,204 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#include "archive.hpp"
+#include "archivehandler.hpp"
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+
+namespace fs = std::filesystem;
+
+
+fs::path make_capsule() {
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_archive";
+    fs::remove_all(dir);
+    fs::create_directories(dir / "docs");
+    fs::create_directories(dir / "gemlog");
+    std::ofstream(dir / "index.gmi") << "# Home";
+    std::ofstream(dir / "docs" / "notes.txt") << "notes";
+    std::ofstream(dir / "gemlog" / "index.gmi") << "# Gemlog";
+    std::ofstream(dir / "gemlog" / "index.txt") << "not the index";
+    std::ofstream(dir / ".hidden") << "secret";
+    return dir;
+}
+
+string response(const Archive &archive, const string &path) {
+    const Archive::Entry *entry = archive.find(path);
+    if (entry == nullptr) {
+        return "";
+    }
+    return string(archive.getResponse(*entry), entry->response_length);
+}
+
+/**
+ * A client that holds everything sent to it until it is drained
+ */
+class ArchiveClient : public ClientConnection {
+public:
+    Request request;
+    string sent;
+    size_t writes = 0;
+    size_t pending = 0;
+    bool closed = false;
+
+    onClientClose close_cb = nullptr;
+    void *close_ctx = nullptr;
+    onClientDrain drain_cb = nullptr;
+    void *drain_ctx = nullptr;
+
+    const Request &getRequest() const { return request; }
+    void send(const void *data, size_t length) {
+        sent.append(static_cast<const char *>(data), length);
+        pending += length;
+        ++writes;
+    }
+    void close() { closed = true; }
+    void setClientCloseCallback(onClientClose cb, void *ctx = nullptr) { close_cb = cb; close_ctx = ctx; }
+    void setClientDataCallback(onClientData cb, void *ctx = nullptr) {}
+    void pauseData() {}
+    void resumeData() {}
+    size_t getPending() const { return pending; }
+    void setClientDrainCallback(onClientDrain cb, void *ctx = nullptr) { drain_cb = cb; drain_ctx = ctx; }
+
+    /**
+     * Write everything that is pending, like the server does once the socket is writable
+     */
+    void drain() {
+        pending = 0;
+        if (drain_cb) {
+            drain_cb(this, drain_ctx);
+        }
+    }
+};
+
+TEST(archive, pack) {
+    fs::path dir = make_capsule();
+    string file = (fs::temp_directory_path() / "gemcaps_test_archive.gca").string();
+    ASSERT_EQ(Archive::pack(dir.string(), file), 7);
+
+    auto archive = Archive::open(file);
+    ASSERT_EQ(archive->getCount(), 7);
+
+    ASSERT_EQ(response(*archive, "docs/notes.txt"), "20 text/plain\r\nnotes");
+    ASSERT_EQ(archive->find("docs/notes.txt")->kind, Archive::FILE);
+    ASSERT_EQ(archive->find("docs/notes.txt")->header_length, 15);
+
+    // Directories share the response of their index file
+    ASSERT_EQ(archive->find("")->kind, Archive::DIRECTORY);
+    ASSERT_EQ(response(*archive, ""), response(*archive, "index.gmi"));
+    ASSERT_EQ(response(*archive, "gemlog"), "20 text/gemini\r\n# Gemlog");
+
+    // Directories without an index get a listing
+    ASSERT_EQ(response(*archive, "docs"),
+        "20 text/gemini\r\n"
+        "# DirectoryContents\n\n## /docs/\n\n=> / back\n\n"
+        "\n"
+        "=> /docs/notes.txt notes.txt\n"
+    );
+
+    ASSERT_EQ(archive->find(".hidden"), nullptr);
+    ASSERT_EQ(archive->find("missing.gmi"), nullptr);
+    ASSERT_EQ(archive->find("docs/"), nullptr);
+}
+
+TEST(archive, options) {
+    fs::path dir = make_capsule();
+    string file = (fs::temp_directory_path() / "gemcaps_test_archive.gca").string();
+    PackOptions options;
+    options.listings = false;
+    options.hidden = true;
+    Archive::pack(dir.string(), file, options);
+
+    auto archive = Archive::open(file);
+    ASSERT_EQ(response(*archive, ".hidden"), "20 application/octet-stream\r\nsecret");
+    ASSERT_EQ(archive->find("docs")->response_length, 0);
+}
+
+TEST(archive, many) {
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_archive_many";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    for (int i = 0; i < 1000; ++i) {
+        std::ofstream(dir / ("page" + std::to_string(i) + ".gmi")) << i;
+    }
+    string file = (fs::temp_directory_path() / "gemcaps_test_archive_many.gca").string();
+    ASSERT_EQ(Archive::pack(dir.string(), file), 1001);
+
+    auto archive = Archive::open(file);
+    for (int i = 0; i < 1000; ++i) {
+        string name = "page" + std::to_string(i) + ".gmi";
+        ASSERT_EQ(response(*archive, name), "20 text/gemini\r\n" + std::to_string(i));
+        ASSERT_EQ(archive->find("page" + std::to_string(i)), nullptr);
+    }
+}
+
+TEST(archive, swap) {
+    fs::path dir = make_capsule();
+    string file = (fs::temp_directory_path() / "gemcaps_test_archive.gca").string();
+    Archive::pack(dir.string(), file);
+    auto old_archive = Archive::open(file);
+
+    std::ofstream(dir / "docs" / "notes.txt") << "new notes";
+    Archive::pack(dir.string(), file);
+    auto new_archive = Archive::open(file);
+
+    // The old mapping is still usable after the archive was replaced
+    ASSERT_EQ(response(*old_archive, "docs/notes.txt"), "20 text/plain\r\nnotes");
+    ASSERT_EQ(response(*new_archive, "docs/notes.txt"), "20 text/plain\r\nnew notes");
+}
+
+TEST(archive, invalid) {
+    fs::path file = fs::temp_directory_path() / "gemcaps_test_archive_invalid.gca";
+    std::ofstream(file) << "this is not an archive, it is just some text";
+    ASSERT_THROW(Archive::open(file.string()), std::runtime_error);
+    ASSERT_THROW(Archive::open((fs::temp_directory_path() / "gemcaps_missing.gca").string()), std::runtime_error);
+
+    // Truncated archives are rejected
+    fs::path dir = make_capsule();
+    Archive::pack(dir.string(), file.string());
+    fs::resize_file(file, fs::file_size(file) - 1);
+    ASSERT_THROW(Archive::open(file.string()), std::runtime_error);
+}
+
+TEST(archive, streams_large_responses) {
+    fs::path dir = make_capsule();
+    string contents(10000, 'x');
+    std::ofstream(dir / "large.txt") << contents;
+    string file = (fs::temp_directory_path() / "gemcaps_test_archive.gca").string();
+    Archive::pack(dir.string(), file);
+    ArchiveHandler handler("", "", file, Archive::open(file), nullptr, 4096);
+
+    // Only one block is sent until the client catches up
+    ArchiveClient client;
+    client.request.path = "/large.txt";
+    handler.handle(&client);
+    ASSERT_EQ(client.writes, 1);
+    ASSERT_FALSE(client.closed);
+    while (!client.closed && client.writes < 10) {
+        client.drain();
+    }
+    ASSERT_TRUE(client.closed);
+    ASSERT_EQ(client.writes, 3);
+    ASSERT_EQ(client.sent, "20 text/plain\r\n" + contents);
+
+    // A client that goes away stops the response
+    ArchiveClient gone;
+    gone.request.path = "/large.txt";
+    handler.handle(&gone);
+    ASSERT_EQ(gone.writes, 1);
+    gone.close_cb(&gone, gone.close_ctx);
+    ASSERT_EQ(gone.writes, 1);
+
+    // Small responses are still sent at once
+    ArchiveClient small;
+    small.request.path = "/docs/notes.txt";
+    handler.handle(&small);
+    ASSERT_TRUE(small.closed);
+    ASSERT_EQ(small.sent, "20 text/plain\r\nnotes");
+}
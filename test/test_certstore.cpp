@@ -0,0 +1,77 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <filesystem>
+
+#include "certstore.hpp"
+
+using std::string;
+using std::shared_ptr;
+
+namespace fs = std::filesystem;
+
+
+/**
+ * Copy the example certificate somewhere its modification time can change
+ */
+fs::path make_certificate() {
+    fs::path example = fs::path(__FILE__).parent_path().parent_path() / "example";
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_certstore";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    fs::copy_file(example / "cert.pem", dir / "cert.pem");
+    fs::copy_file(example / "key.pem", dir / "key.pem");
+    return dir;
+}
+
+TEST(certstore, reuses_contexts) {
+    fs::path dir = make_certificate();
+    string cert = (dir / "cert.pem").string();
+    string key = (dir / "key.pem").string();
+    size_t before = CertificateStore::size();
+
+    shared_ptr<WOLFSSL_CTX> first = CertificateStore::get(cert, key);
+    ASSERT_NE(first, nullptr);
+    shared_ptr<WOLFSSL_CTX> second = CertificateStore::get(cert, key);
+    ASSERT_EQ(first, second);
+    ASSERT_EQ(CertificateStore::size(), before + 1);
+}
+
+TEST(certstore, reloads_changed_files) {
+    fs::path dir = make_certificate();
+    string cert = (dir / "cert.pem").string();
+    string key = (dir / "key.pem").string();
+
+    shared_ptr<WOLFSSL_CTX> old_ctx = CertificateStore::get(cert, key);
+    ASSERT_NE(old_ctx, nullptr);
+    fs::last_write_time(dir / "cert.pem", fs::last_write_time(dir / "cert.pem") + std::chrono::seconds(10));
+    shared_ptr<WOLFSSL_CTX> new_ctx = CertificateStore::get(cert, key);
+    ASSERT_NE(new_ctx, nullptr);
+    ASSERT_NE(old_ctx, new_ctx);
+    ASSERT_EQ(CertificateStore::get(cert, key), new_ctx);
+}
+
+TEST(certstore, frees_unused_contexts) {
+    fs::path dir = make_certificate();
+    string cert = (dir / "cert.pem").string();
+    string key = (dir / "key.pem").string();
+    size_t before = CertificateStore::size();
+
+    shared_ptr<WOLFSSL_CTX> ctx = CertificateStore::get(cert, key);
+    ASSERT_EQ(CertificateStore::size(), before + 1);
+    std::weak_ptr<WOLFSSL_CTX> weak = ctx;
+    ctx.reset();
+    ASSERT_TRUE(weak.expired());
+    ASSERT_EQ(CertificateStore::size(), before);
+
+    // Once freed, the certificate is read again
+    ASSERT_NE(CertificateStore::get(cert, key), nullptr);
+}
+
+TEST(certstore, missing_files) {
+    fs::path dir = make_certificate();
+    ASSERT_EQ(CertificateStore::get((dir / "missing.pem").string(), (dir / "key.pem").string()), nullptr);
+    ASSERT_EQ(CertificateStore::get((dir / "cert.pem").string(), (dir / "missing.pem").string()), nullptr);
+}
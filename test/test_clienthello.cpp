@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include <clienthello.hpp>
+
+using std::string;
+using std::vector;
+
+
+/**
+ * Build the start of a ClientHello record
+ */
+string make_hello(const vector<uint16_t> &ciphers, size_t session_id = 32) {
+    string body;
+    body += string("\x03\x03", 2);
+    body += string(32, 'r');
+    body += static_cast<char>(session_id);
+    body += string(session_id, 's');
+    body += static_cast<char>(ciphers.size() * 2 >> 8);
+    body += static_cast<char>(ciphers.size() * 2 & 0xff);
+    for (uint16_t cipher : ciphers) {
+        body += static_cast<char>(cipher >> 8);
+        body += static_cast<char>(cipher & 0xff);
+    }
+    // Compression methods
+    body += string("\x01\x00", 2);
+
+    string handshake = string("\x01\x00", 2);
+    handshake += static_cast<char>(body.length() >> 8);
+    handshake += static_cast<char>(body.length() & 0xff);
+    handshake += body;
+
+    string record = string("\x16\x03\x01", 3);
+    record += static_cast<char>(handshake.length() >> 8);
+    record += static_cast<char>(handshake.length() & 0xff);
+    return record + handshake;
+}
+
+TEST(clienthello, parse) {
+    string hello = make_hello({0xC02F, 0xC02B, 0x009C});
+    ClientHello parsed;
+    ASSERT_TRUE(ClientHello::parse(hello.data(), hello.length(), parsed));
+    ASSERT_EQ(parsed.ciphers, vector<uint16_t>({0xC02F, 0xC02B, 0x009C}));
+    ASSERT_TRUE(parsed.offersECDSA());
+
+    hello = make_hello({0xC02F, 0x009C}, 0);
+    ASSERT_TRUE(ClientHello::parse(hello.data(), hello.length(), parsed));
+    ASSERT_EQ(parsed.ciphers.size(), 2);
+    ASSERT_FALSE(parsed.offersECDSA());
+}
+
+TEST(clienthello, rejects_partial_hellos) {
+    string hello = make_hello({0xC02B, 0xC02C});
+    ClientHello parsed;
+    // Cut off in the middle of the cipher suites
+    ASSERT_FALSE(ClientHello::parse(hello.data(), hello.length() - 5, parsed));
+    ASSERT_FALSE(ClientHello::parse(hello.data(), 4, parsed));
+
+    string alert = hello;
+    alert[0] = 0x15;
+    ASSERT_FALSE(ClientHello::parse(alert.data(), alert.length(), parsed));
+
+    string get = "GET / HTTP/1.1\r\n\r\n";
+    ASSERT_FALSE(ClientHello::parse(get.data(), get.length(), parsed));
+}
@@ -0,0 +1,140 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#include <gemcaps/dircache.hpp>
+
+using std::string;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+
+struct Listed {
+    vector<DirListing *> listings;
+    vector<string> rendered;
+    vector<int> status;
+    ListingOptions options;
+};
+
+void on_listing(DirListing *listing, void *ctx) {
+    Listed *listed = static_cast<Listed *>(ctx);
+    listed->listings.push_back(listing);
+    listed->status.push_back(listing->status);
+    listed->rendered.push_back(listing->render("/docs/", listed->options));
+}
+
+fs::path make_dir() {
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_dircache";
+    fs::remove_all(dir);
+    fs::create_directories(dir / "sub");
+    std::ofstream(dir / "b.gmi") << "hello";
+    std::ofstream(dir / "a.txt") << "hello world";
+    std::ofstream(dir / "index.txt") << "index";
+    std::ofstream(dir / "index.gmi") << "index";
+    return dir;
+}
+
+uv_timespec_t dir_mtime(uv_loop_t *loop, const fs::path &dir) {
+    uv_fs_t req;
+    uv_fs_stat(loop, &req, dir.string().c_str(), nullptr);
+    uv_timespec_t mtime = req.statbuf.st_mtim;
+    uv_fs_req_cleanup(&req);
+    return mtime;
+}
+
+TEST(dircache, list) {
+    uv_loop_t *loop = uv_default_loop();
+    DirCache cache(loop);
+    fs::path dir = make_dir();
+    uv_timespec_t mtime = dir_mtime(loop, dir);
+
+    // Concurrent listings share a single scan
+    Listed listed;
+    cache.list(dir.string() + "/", mtime, on_listing, &listed);
+    cache.list(dir.string(), mtime, on_listing, &listed);
+    ASSERT_TRUE(listed.listings.empty());
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(listed.listings.size(), 2);
+    ASSERT_EQ(listed.rendered[0], listed.rendered[1]);
+
+    ASSERT_EQ(listed.rendered[0],
+        "20 text/gemini\r\n"
+        "# DirectoryContents\n\n## /docs/\n\n=> / back\n\n"
+        "=> /docs/sub/ sub/\n"
+        "\n"
+        "=> /docs/a.txt a.txt\n"
+        "=> /docs/b.gmi b.gmi\n"
+        "=> /docs/index.gmi index.gmi\n"
+        "=> /docs/index.txt index.txt\n"
+    );
+
+    // Cached listings are answered right away
+    listed = Listed();
+    cache.list(dir.string(), mtime, on_listing, &listed);
+    ASSERT_EQ(listed.listings.size(), 1);
+    ASSERT_EQ(listed.listings[0]->indexes, vector<string>({"index.gmi", "index.txt"}));
+    ASSERT_EQ(cache.getSize(), 1);
+}
+
+TEST(dircache, options) {
+    uv_loop_t *loop = uv_default_loop();
+    DirCache cache(loop);
+    fs::path dir = make_dir();
+
+    Listed listed;
+    listed.options.sort = ListingSort::SIZE;
+    listed.options.size = true;
+    cache.list(dir.string(), dir_mtime(loop, dir), on_listing, &listed);
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(listed.rendered.size(), 1);
+    string rendered = listed.rendered[0];
+    ASSERT_LT(rendered.find("=> /docs/a.txt a.txt (11 B)"), rendered.find("=> /docs/b.gmi b.gmi (5 B)"));
+
+    listed.options.size = false;
+    listed.options.mtime = true;
+    rendered = listed.listings[0]->render("/docs/", listed.options);
+    ASSERT_NE(rendered.find("=> /docs/sub/ sub/ ("), string::npos);
+}
+
+TEST(dircache, modified) {
+    uv_loop_t *loop = uv_default_loop();
+    DirCache cache(loop);
+    fs::path dir = make_dir();
+
+    Listed listed;
+    cache.list(dir.string(), dir_mtime(loop, dir), on_listing, &listed);
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(listed.listings[0]->items.size(), 5);
+
+    // A new modification time reads the directory again
+    std::ofstream(dir / "c.gmi") << "new";
+    uv_timespec_t changed = dir_mtime(loop, dir);
+    changed.tv_nsec += 1;
+    listed = Listed();
+    cache.list(dir.string(), changed, on_listing, &listed);
+    ASSERT_TRUE(listed.listings.empty());
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(listed.listings.size(), 1);
+    ASSERT_EQ(listed.listings[0]->items.size(), 6);
+
+    cache.invalidateTree(dir.string());
+    ASSERT_EQ(cache.getSize(), 0);
+}
+
+TEST(dircache, missing) {
+    uv_loop_t *loop = uv_default_loop();
+    DirCache cache(loop);
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_dircache_missing";
+    fs::remove_all(dir);
+
+    Listed listed;
+    cache.list(dir.string(), {0, 0}, on_listing, &listed);
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(listed.status, vector<int>({UV_ENOENT}));
+    // Errors aren't remembered
+    ASSERT_EQ(cache.getSize(), 0);
+}
@@ -0,0 +1,135 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#include <gemcaps/executor.hpp>
+
+using std::string;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+
+TEST(executor, environment) {
+    Environment env;
+    env.set("FOO", "bar");
+    env.set("EMPTY", "");
+    env.set("PARTIAL", "abcdef", 3);
+    ASSERT_EQ(env.size(), 3);
+
+    vector<char *> pointers;
+    env.pointers(pointers);
+    ASSERT_EQ(pointers.size(), 3);
+    ASSERT_STREQ(pointers[0], "FOO=bar");
+    ASSERT_STREQ(pointers[1], "EMPTY=");
+    ASSERT_STREQ(pointers[2], "PARTIAL=abc");
+}
+
+TEST(executor, environment_reuse) {
+    Environment env;
+    env.set("FOO", "bar");
+    env.clear();
+    ASSERT_EQ(env.size(), 0);
+
+    env.set("BAR", "foo");
+    vector<char *> pointers;
+    env.pointers(pointers);
+    ASSERT_EQ(pointers.size(), 1);
+    ASSERT_STREQ(pointers[0], "BAR=foo");
+}
+
+TEST(executor, resolve) {
+    ExecutableResolver resolver("/nonexistent:/bin:/usr/bin");
+    string sh = resolver.resolve("sh");
+    ASSERT_TRUE(sh == "/bin/sh" || sh == "/usr/bin/sh");
+    ASSERT_EQ(resolver.resolve("gemcaps-not-a-program"), "gemcaps-not-a-program");
+}
+
+TEST(executor, resolve_invalidate) {
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_resolve";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    ExecutableResolver resolver(dir.string());
+    ASSERT_EQ(resolver.resolve("prog"), "prog");
+
+    // Installing the program is noticed without clearing the cache
+    fs::path prog = dir / "prog";
+    std::ofstream(prog) << "#!/bin/sh\n";
+    fs::permissions(prog, fs::perms::owner_all);
+    ASSERT_EQ(resolver.resolve("prog"), prog.string());
+
+    // So is removing it
+    fs::remove(prog);
+    ASSERT_EQ(resolver.resolve("prog"), "prog");
+
+    fs::remove_all(dir);
+}
+
+struct ExitRecorder : public ExecutorContext {
+    int term_signal = -1;
+    void onExit(Executor *executor, int64_t exit_status, int term_signal) { this->term_signal = term_signal; }
+};
+
+TEST(executor, signal_all) {
+    Environment env;
+    ExitRecorder recorder;
+    Executor executor("/bin/sh", env, {"-c", "sleep 10"});
+    executor.setContext(&recorder);
+    ASSERT_EQ(executor.spawn(uv_default_loop()), 0);
+    ASSERT_EQ(Executor::getRunning(), 1);
+
+    ASSERT_EQ(Executor::signalAll(SIGTERM), 1);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_EQ(recorder.term_signal, SIGTERM);
+    ASSERT_EQ(Executor::getRunning(), 0);
+}
+
+TEST(executor, reaps_children_that_exit_at_once) {
+    Environment env;
+    for (int i = 0; i < 10; ++i) {
+        ExitRecorder recorder;
+        Executor executor("/bin/sh", env, {"-c", "exit 0"});
+        executor.setContext(&recorder);
+        ASSERT_EQ(executor.spawn(uv_default_loop()), 0);
+        uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+        ASSERT_EQ(recorder.term_signal, 0);
+        ASSERT_FALSE(executor.is_alive());
+    }
+}
+
+TEST(executor, limits) {
+    fs::path output = fs::temp_directory_path() / "gemcaps_test_limits";
+    uv_fs_t req;
+    uv_file fd = uv_fs_open(nullptr, &req, output.string().c_str(), UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0644, nullptr);
+    uv_fs_req_cleanup(&req);
+    ASSERT_GE(fd, 0);
+
+    Environment env;
+    ExitRecorder recorder;
+    Executor executor("/bin/sh", env, {"-c", "ulimit -n"});
+    ResourceLimits limits;
+    limits.files = 64;
+    executor.setLimits(limits);
+    executor.setContext(&recorder);
+    ASSERT_EQ(executor.spawn(uv_default_loop(), -1, fd), 0);
+    uv_fs_close(nullptr, &req, fd, nullptr);
+    uv_fs_req_cleanup(&req);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    // The limit was already set when the script started
+    std::ifstream file(output);
+    string limit;
+    std::getline(file, limit);
+    ASSERT_EQ(limit, "64");
+    ASSERT_EQ(recorder.term_signal, 0);
+    fs::remove(output);
+
+    // Failing to start the script is reported by spawn
+    Executor missing("/nonexistent/gemcaps-script", env, {});
+    missing.setLimits(limits);
+    ASSERT_EQ(missing.spawn(uv_default_loop()), UV_ENOENT);
+}
@@ -0,0 +1,151 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#include <gemcaps/filecache.hpp>
+
+using std::string;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+
+struct Lookup {
+    FileCache *cache;
+    vector<FileEntry *> entries;
+};
+
+void on_file(FileEntry *entry, void *ctx) {
+    Lookup *lookup = static_cast<Lookup *>(ctx);
+    lookup->entries.push_back(entry);
+}
+
+void release_all(Lookup &lookup) {
+    for (FileEntry *entry : lookup.entries) {
+        lookup.cache->release(entry);
+    }
+    lookup.entries.clear();
+}
+
+fs::path make_file(string name, string contents) {
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_filecache";
+    fs::create_directories(dir);
+    fs::path file = dir / name;
+    std::ofstream out(file);
+    out << contents;
+    return file;
+}
+
+TEST(filecache, stat) {
+    uv_loop_t *loop = uv_default_loop();
+    FileCache cache(loop);
+    Lookup lookup{&cache};
+    string file = make_file("stat", "hello").string();
+
+    // Concurrent lookups share a single stat
+    cache.stat(file, on_file, &lookup);
+    cache.stat(file, on_file, &lookup);
+    ASSERT_TRUE(lookup.entries.empty());
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(lookup.entries.size(), 2);
+    ASSERT_EQ(lookup.entries[0], lookup.entries[1]);
+    ASSERT_TRUE(lookup.entries[0]->isFile());
+    ASSERT_EQ(lookup.entries[0]->stat.st_size, 5);
+    release_all(lookup);
+
+    // Cached lookups are answered right away
+    cache.stat(file, on_file, &lookup);
+    ASSERT_EQ(lookup.entries.size(), 1);
+    release_all(lookup);
+    ASSERT_EQ(cache.getSize(), 1);
+}
+
+TEST(filecache, missing) {
+    uv_loop_t *loop = uv_default_loop();
+    FileCache cache(loop);
+    Lookup lookup{&cache};
+    string file = (fs::temp_directory_path() / "gemcaps_test_filecache" / "missing").string();
+    fs::remove(file);
+
+    cache.open(file, on_file, &lookup);
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(lookup.entries.size(), 1);
+    ASSERT_EQ(lookup.entries[0]->status, UV_ENOENT);
+    ASSERT_EQ(lookup.entries[0]->fd, -1);
+    release_all(lookup);
+
+    // Missing files are remembered too
+    cache.stat(file, on_file, &lookup);
+    ASSERT_EQ(lookup.entries.size(), 1);
+    ASSERT_EQ(lookup.entries[0]->status, UV_ENOENT);
+    release_all(lookup);
+}
+
+TEST(filecache, open) {
+    uv_loop_t *loop = uv_default_loop();
+    FileCache cache(loop);
+    Lookup lookup{&cache};
+    string file = make_file("open", "hello").string();
+
+    cache.open(file, on_file, &lookup);
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(lookup.entries.size(), 1);
+    FileEntry *entry = lookup.entries[0];
+    ASSERT_GE(entry->fd, 0);
+
+    char buf[16];
+    uv_buf_t uvbuf = uv_buf_init(buf, sizeof(buf));
+    uv_fs_t req;
+    ASSERT_EQ(uv_fs_read(loop, &req, entry->fd, &uvbuf, 1, 0, nullptr), 5);
+    uv_fs_req_cleanup(&req);
+
+    // The descriptor is shared with the next reader
+    cache.open(file, on_file, &lookup);
+    ASSERT_EQ(lookup.entries.size(), 2);
+    ASSERT_EQ(lookup.entries[1]->fd, entry->fd);
+    release_all(lookup);
+}
+
+TEST(filecache, invalidate) {
+    uv_loop_t *loop = uv_default_loop();
+    FileCache cache(loop);
+    Lookup lookup{&cache};
+    string file = make_file("invalidate", "hello").string();
+
+    cache.stat(file, on_file, &lookup);
+    uv_run(loop, UV_RUN_DEFAULT);
+    release_all(lookup);
+
+    make_file("invalidate", "hello world");
+    cache.invalidate(file);
+    ASSERT_EQ(cache.getSize(), 0);
+
+    cache.stat(file, on_file, &lookup);
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(lookup.entries.size(), 1);
+    ASSERT_EQ(lookup.entries[0]->stat.st_size, 11);
+    release_all(lookup);
+}
+
+TEST(filecache, evict) {
+    uv_loop_t *loop = uv_default_loop();
+    FileCache::configure(1000, 1000, 2);
+    FileCache cache(loop);
+    Lookup lookup{&cache};
+
+    for (string name : {"a", "b", "c"}) {
+        cache.open(make_file(name, name).string(), on_file, &lookup);
+    }
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(lookup.entries.size(), 3);
+    ASSERT_EQ(cache.getSize(), 2);
+
+    // The evicted entry stays usable until it is released
+    FileEntry *evicted = lookup.entries[0];
+    ASSERT_GE(evicted->fd, 0);
+    release_all(lookup);
+    FileCache::configure(1000, 60000, 1024);
+}
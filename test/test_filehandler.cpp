@@ -0,0 +1,282 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <memory>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+
+#include <uv.h>
+
+#include "filehandler.hpp"
+#include <gemcaps/filecache.hpp>
+#include <gemcaps/metrics.hpp>
+
+using std::string;
+using std::shared_ptr;
+using std::make_shared;
+
+namespace fs = std::filesystem;
+
+
+/**
+ * A client that records everything sent to it
+ */
+class TestClient : public ClientConnection {
+public:
+    Request request;
+    string sent;
+    std::vector<string> writes;
+    size_t pending = 0;
+    bool closed = false;
+
+    onClientClose close_cb = nullptr;
+    void *close_ctx = nullptr;
+    onClientDrain drain_cb = nullptr;
+    void *drain_ctx = nullptr;
+
+    const Request &getRequest() const { return request; }
+    void send(const void *data, size_t length) {
+        sent.append(static_cast<const char *>(data), length);
+        writes.emplace_back(static_cast<const char *>(data), length);
+    }
+    void close() { closed = true; }
+    void setClientCloseCallback(onClientClose cb, void *ctx = nullptr) { close_cb = cb; close_ctx = ctx; }
+    void setClientDataCallback(onClientData cb, void *ctx = nullptr) {}
+    void pauseData() {}
+    void resumeData() {}
+    size_t getPending() const { return pending; }
+    void setClientDrainCallback(onClientDrain cb, void *ctx = nullptr) { drain_cb = cb; drain_ctx = ctx; }
+
+    /**
+     * Finish closing the client, like the server does once the socket is closed
+     */
+    void finish() {
+        if (close_cb) {
+            close_cb(this, close_ctx);
+            close_cb = nullptr;
+        }
+    }
+};
+
+fs::path make_folder(const string &contents, const string &name = "file.txt") {
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_filehandler";
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+    std::ofstream(dir / name, std::ios::binary) << contents;
+    return dir;
+}
+
+shared_ptr<FileHandler> make_handler(const fs::path &dir, size_t block_size, const string &lang = "", const string &charset = "") {
+    return make_shared<FileHandler>(
+        "", dir.string(), "", false, RuleSet(), std::vector<string>(), "", phmap::flat_hash_map<string, string>(),
+        make_shared<Limiter>("test"), ScriptRunners(), CGITimeouts(), 0, ListingOptions(), block_size, lang, charset);
+}
+
+shared_ptr<FileHandler> make_cgi_handler(const fs::path &dir, const CGITimeouts &timeouts) {
+    return make_shared<FileHandler>(
+        "", dir.string(), "", false, RuleSet(), std::vector<string>({".cgi"}), "", phmap::flat_hash_map<string, string>(),
+        make_shared<Limiter>("test"), ScriptRunners(), timeouts, 0, ListingOptions(), 4096, "", "");
+}
+
+fs::path make_script(const string &script) {
+    fs::path dir = make_folder("#!/bin/sh\n" + script + "\n", "script.cgi");
+    fs::permissions(dir / "script.cgi", fs::perms::owner_all);
+    return dir;
+}
+
+string make_contents(size_t length) {
+    string contents;
+    contents.reserve(length);
+    for (size_t i = 0; i < length; ++i) {
+        contents += static_cast<char>('a' + (i * 7 + i / 13) % 26);
+    }
+    return contents;
+}
+
+TEST(filehandler, streams_large_files_in_order) {
+    string contents = make_contents(100 * 1024 + 17);
+    fs::path dir = make_folder(contents);
+    auto handler = make_handler(dir, 4096);
+
+    TestClient client;
+    client.request.path = "/file.txt";
+    handler->handle(&client);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    ASSERT_TRUE(client.closed);
+    ASSERT_EQ(client.sent, "20 text/plain\r\n" + contents);
+    client.finish();
+    FileCache::get(uv_default_loop()).clear();
+}
+
+TEST(filehandler, waits_for_the_client_to_drain) {
+    string contents = make_contents(64 * 1024);
+    fs::path dir = make_folder(contents);
+    auto handler = make_handler(dir, 4096);
+
+    TestClient client;
+    client.request.path = "/file.txt";
+    client.pending = 1024 * 1024;
+    handler->handle(&client);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    // Nothing is read while the client is behind, and the header waits for the file
+    ASSERT_FALSE(client.closed);
+    ASSERT_EQ(client.sent, "");
+    ASSERT_NE(client.drain_cb, nullptr);
+
+    client.pending = 0;
+    client.drain_cb(&client, client.drain_ctx);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    ASSERT_TRUE(client.closed);
+    ASSERT_EQ(client.sent, "20 text/plain\r\n" + contents);
+    client.finish();
+    FileCache::get(uv_default_loop()).clear();
+}
+
+TEST(filehandler, closed_client_stops_the_stream) {
+    string contents = make_contents(64 * 1024);
+    fs::path dir = make_folder(contents);
+    auto handler = make_handler(dir, 4096);
+
+    TestClient client;
+    client.request.path = "/file.txt";
+    client.pending = 1024 * 1024;
+    handler->handle(&client);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    client.finish();
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_EQ(client.sent, "");
+    FileCache::get(uv_default_loop()).clear();
+}
+
+TEST(filehandler, sends_the_header_with_the_first_block) {
+    string contents = make_contents(10000);
+    fs::path dir = make_folder(contents);
+    auto handler = make_handler(dir, 4096);
+
+    TestClient client;
+    client.request.path = "/file.txt";
+    handler->handle(&client);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    string header = "20 text/plain\r\n";
+    ASSERT_EQ(client.sent, header + contents);
+    ASSERT_EQ(client.writes.size(), 3);
+    ASSERT_EQ(client.writes[0], header + contents.substr(0, 4096 - header.length()));
+    client.finish();
+    FileCache::get(uv_default_loop()).clear();
+}
+
+TEST(filehandler, adds_lang_and_charset) {
+    fs::path dir = make_folder("# Hello", "index.gmi");
+    std::ofstream(dir / "file.txt") << "hello";
+    std::ofstream(dir / "image.png") << "png";
+    auto handler = make_handler(dir, 4096, "en", "utf-8");
+
+    TestClient gemini, text, image;
+    gemini.request.path = "/index.gmi";
+    text.request.path = "/file.txt";
+    image.request.path = "/image.png";
+    handler->handle(&gemini);
+    handler->handle(&text);
+    handler->handle(&image);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    ASSERT_EQ(gemini.sent, "20 text/gemini; charset=utf-8; lang=en\r\n# Hello");
+    ASSERT_EQ(text.sent, "20 text/plain; charset=utf-8\r\nhello");
+    ASSERT_EQ(image.sent, "20 image/png\r\npng");
+
+    // Another handler builds its own header for the same cached file
+    TestClient plain;
+    plain.request.path = "/index.gmi";
+    make_handler(dir, 4096)->handle(&plain);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+    ASSERT_EQ(plain.sent, "20 text/gemini\r\n# Hello");
+
+    gemini.finish();
+    text.finish();
+    image.finish();
+    plain.finish();
+
+    // A handler replaced by a reload may be allocated where the old one was,
+    // and still doesn't get the old one's header
+    for (int i = 0; i < 4; ++i) {
+        TestClient reloaded;
+        reloaded.request.path = "/index.gmi";
+        handler.reset();
+        handler = make_handler(dir, 4096, i % 2 == 0 ? "" : "en", "utf-8");
+        handler->handle(&reloaded);
+        uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+        ASSERT_EQ(reloaded.sent, i % 2 == 0 ? "20 text/gemini; charset=utf-8\r\n# Hello" : "20 text/gemini; charset=utf-8; lang=en\r\n# Hello");
+        reloaded.finish();
+    }
+    FileCache::get(uv_default_loop()).clear();
+}
+
+TEST(filehandler, cgi_timeout) {
+    fs::path dir = make_script("printf '20 text/plain\\r\\nhello'; exec /bin/sleep 10");
+    CGITimeouts timeouts;
+    timeouts.timeout = 100;
+    auto handler = make_cgi_handler(dir, timeouts);
+
+    TestClient client;
+    client.request.path = "/script.cgi";
+    uint64_t start = uv_now(uv_default_loop());
+    handler->handle(&client);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    // What the script sent before the timeout is kept
+    ASSERT_TRUE(client.closed);
+    ASSERT_EQ(client.sent, "20 text/plain\r\nhello");
+    ASSERT_LT(uv_now(uv_default_loop()) - start, 5000);
+    client.finish();
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+}
+
+TEST(filehandler, cgi_first_byte_timeout) {
+    fs::path dir = make_script("exec /bin/sleep 10");
+    CGITimeouts timeouts;
+    timeouts.timeout = 10000;
+    timeouts.first_byte_timeout = 100;
+    auto handler = make_cgi_handler(dir, timeouts);
+
+    TestClient client;
+    client.request.path = "/script.cgi";
+    uint64_t start = uv_now(uv_default_loop());
+    handler->handle(&client);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    ASSERT_TRUE(client.closed);
+    ASSERT_EQ(client.sent, "42 Script timed out\r\n");
+    ASSERT_LT(uv_now(uv_default_loop()) - start, 5000);
+    client.finish();
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+}
+
+TEST(filehandler, cgi_killed_after_ignoring_sigterm) {
+    fs::path dir = make_script("trap '' TERM; while :; do :; done");
+    CGITimeouts timeouts;
+    timeouts.first_byte_timeout = 100;
+    timeouts.kill_timeout = 100;
+    auto handler = make_cgi_handler(dir, timeouts);
+    metrics::Counter &killed = metrics::counter("gemcaps_cgi_killed_total");
+    uint64_t killed_before = killed.get();
+
+    TestClient client;
+    client.request.path = "/script.cgi";
+    uint64_t start = uv_now(uv_default_loop());
+    handler->handle(&client);
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+
+    ASSERT_TRUE(client.closed);
+    ASSERT_EQ(client.sent, "42 Script timed out\r\n");
+    ASSERT_EQ(killed.get(), killed_before + 1);
+    ASSERT_GE(uv_now(uv_default_loop()) - start, 200);
+    ASSERT_LT(uv_now(uv_default_loop()) - start, 5000);
+    client.finish();
+    uv_run(uv_default_loop(), UV_RUN_DEFAULT);
+}
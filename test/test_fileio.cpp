@@ -0,0 +1,154 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <fstream>
+#include <filesystem>
+
+#include <uv.h>
+
+#include <gemcaps/fileio.hpp>
+
+using std::string;
+
+namespace fs = std::filesystem;
+
+
+struct Result {
+    int status = 1;
+    uv_stat_t stat;
+    ssize_t result = 1;
+    int calls = 0;
+};
+
+void on_stat(int status, const uv_stat_t *stat, void *ctx) {
+    Result *result = static_cast<Result *>(ctx);
+    result->status = status;
+    if (stat != nullptr) {
+        result->stat = *stat;
+    }
+    ++result->calls;
+}
+
+void on_opened(int status, const uv_stat_t *stat, uv_file fd, void *ctx) {
+    Result *result = static_cast<Result *>(ctx);
+    result->status = status;
+    if (stat != nullptr) {
+        result->stat = *stat;
+    }
+    result->result = fd;
+    ++result->calls;
+}
+
+void on_result(ssize_t res, void *ctx) {
+    Result *result = static_cast<Result *>(ctx);
+    result->result = res;
+    ++result->calls;
+}
+
+fs::path make_files() {
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_fileio";
+    fs::remove_all(dir);
+    fs::create_directories(dir / "sub");
+    std::ofstream(dir / "file.txt") << "hello world";
+    return dir;
+}
+
+/**
+ * Make a loop whose file operations use the given backend
+ *
+ * Loops are never freed, so that no two tests share a loop's file operations.
+ */
+uv_loop_t *make_loop(FileIO::Backend backend) {
+    uv_loop_t *loop = new uv_loop_t;
+    uv_loop_init(loop);
+    FileIO::configure(backend, 4);
+    FileIO::get(loop);
+    FileIO::configure(FileIO::AUTO);
+    return loop;
+}
+
+class fileio : public testing::TestWithParam<FileIO::Backend> {};
+
+TEST_P(fileio, stats_files) {
+    fs::path dir = make_files();
+    uv_loop_t *loop = make_loop(GetParam());
+    FileIO &io = FileIO::get(loop);
+    if (GetParam() == FileIO::THREADPOOL) {
+        ASSERT_STREQ(io.getName(), "threadpool");
+    }
+
+    Result file, missing;
+    io.stat((dir / "file.txt").string(), on_stat, &file);
+    io.stat((dir / "missing").string(), on_stat, &missing);
+    ASSERT_EQ(file.calls, 0);
+    uv_run(loop, UV_RUN_DEFAULT);
+
+    ASSERT_EQ(file.calls, 1);
+    ASSERT_EQ(file.status, 0);
+    ASSERT_EQ(file.stat.st_size, 11);
+    ASSERT_TRUE(S_ISREG(file.stat.st_mode));
+    ASSERT_EQ(missing.calls, 1);
+    ASSERT_EQ(missing.status, UV_ENOENT);
+}
+
+TEST_P(fileio, opens_and_reads_files) {
+    fs::path dir = make_files();
+    uv_loop_t *loop = make_loop(GetParam());
+    FileIO &io = FileIO::get(loop);
+
+    Result file, sub, missing;
+    io.statOpen((dir / "file.txt").string(), on_opened, &file);
+    io.statOpen((dir / "sub").string(), on_opened, &sub);
+    io.statOpen((dir / "missing").string(), on_opened, &missing);
+    uv_run(loop, UV_RUN_DEFAULT);
+
+    ASSERT_EQ(file.status, 0);
+    ASSERT_GE(file.result, 0);
+    ASSERT_EQ(file.stat.st_size, 11);
+    // Only regular files are opened
+    ASSERT_EQ(sub.status, 0);
+    ASSERT_TRUE(S_ISDIR(sub.stat.st_mode));
+    ASSERT_LT(sub.result, 0);
+    ASSERT_EQ(missing.status, UV_ENOENT);
+    ASSERT_LT(missing.result, 0);
+
+    char buf[16];
+    Result read;
+    io.read(file.result, buf, 5, 6, on_result, &read);
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(read.result, 5);
+    ASSERT_EQ(string(buf, 5), "world");
+
+    Result closed;
+    io.close(file.result, on_result, &closed);
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(closed.result, 0);
+}
+
+TEST_P(fileio, queues_more_than_the_ring_holds) {
+    fs::path dir = make_files();
+    uv_loop_t *loop = make_loop(GetParam());
+    FileIO &io = FileIO::get(loop);
+
+    Result opened;
+    io.open((dir / "file.txt").string(), on_result, &opened);
+    uv_run(loop, UV_RUN_DEFAULT);
+    ASSERT_GE(opened.result, 0);
+
+    const int count = 64;
+    char bufs[count][4];
+    Result reads[count];
+    for (int i = 0; i < count; ++i) {
+        io.read(opened.result, bufs[i], 4, i % 8, on_result, &reads[i]);
+    }
+    uv_run(loop, UV_RUN_DEFAULT);
+    for (int i = 0; i < count; ++i) {
+        ASSERT_EQ(reads[i].calls, 1);
+        ASSERT_EQ(reads[i].result, 4);
+        ASSERT_EQ(string(bufs[i], 4), string("hello world").substr(i % 8, 4));
+    }
+    io.close(opened.result, nullptr, nullptr);
+    uv_run(loop, UV_RUN_DEFAULT);
+}
+
+INSTANTIATE_TEST_SUITE_P(backends, fileio, testing::Values(FileIO::THREADPOOL, FileIO::AUTO));
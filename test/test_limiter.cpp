@@ -0,0 +1,131 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <gemcaps/limiter.hpp>
+#include <gemcaps/metrics.hpp>
+
+using std::vector;
+
+
+struct Acquired {
+    vector<int> order;
+    vector<bool> results;
+};
+
+struct Waiting {
+    Acquired *acquired;
+    int id;
+};
+
+void on_acquire(bool acquired, void *ctx) {
+    Waiting *waiting = static_cast<Waiting *>(ctx);
+    waiting->acquired->order.push_back(waiting->id);
+    waiting->acquired->results.push_back(acquired);
+}
+
+TEST(limiter, unlimited) {
+    Limiter limiter("test_unlimited");
+    uint64_t ticket;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(limiter.acquire(uv_default_loop(), on_acquire, nullptr, &ticket), Limiter::ACQUIRED);
+    }
+    ASSERT_EQ(limiter.getActive(), 100);
+}
+
+TEST(limiter, queue_fifo) {
+    Limiter limiter("test_fifo", 1, 2);
+    Acquired acquired;
+    Waiting a{&acquired, 1};
+    Waiting b{&acquired, 2};
+    uint64_t ticket;
+
+    ASSERT_EQ(limiter.acquire(uv_default_loop(), on_acquire, nullptr, &ticket), Limiter::ACQUIRED);
+    ASSERT_EQ(limiter.acquire(uv_default_loop(), on_acquire, &a, &ticket), Limiter::QUEUED);
+    ASSERT_EQ(limiter.acquire(uv_default_loop(), on_acquire, &b, &ticket), Limiter::QUEUED);
+    ASSERT_EQ(limiter.acquire(uv_default_loop(), on_acquire, nullptr, &ticket), Limiter::FULL);
+    ASSERT_EQ(limiter.getQueued(), 2);
+
+    limiter.release();
+    ASSERT_EQ(acquired.order, vector<int>({1}));
+    ASSERT_EQ(limiter.getActive(), 1);
+
+    limiter.release();
+    ASSERT_EQ(acquired.order, vector<int>({1, 2}));
+    ASSERT_EQ(acquired.results, vector<bool>({true, true}));
+
+    limiter.release();
+    ASSERT_EQ(limiter.getActive(), 0);
+    ASSERT_EQ(limiter.getQueued(), 0);
+}
+
+TEST(limiter, cancel) {
+    Limiter limiter("test_cancel", 1, 2);
+    Acquired acquired;
+    Waiting a{&acquired, 1};
+    Waiting b{&acquired, 2};
+    uint64_t ticket_a, ticket_b, ticket;
+
+    limiter.acquire(uv_default_loop(), on_acquire, nullptr, &ticket);
+    limiter.acquire(uv_default_loop(), on_acquire, &a, &ticket_a);
+    limiter.acquire(uv_default_loop(), on_acquire, &b, &ticket_b);
+
+    limiter.cancel(ticket_a);
+    ASSERT_EQ(limiter.getQueued(), 1);
+
+    limiter.release();
+    ASSERT_EQ(acquired.order, vector<int>({2}));
+}
+
+TEST(limiter, expire) {
+    Limiter limiter("test_expire", 1, 2, 100);
+    Acquired acquired;
+    Waiting a{&acquired, 1};
+    uint64_t ticket;
+
+    uint64_t now = uv_now(uv_default_loop());
+    limiter.acquire(uv_default_loop(), on_acquire, nullptr, &ticket);
+    limiter.acquire(uv_default_loop(), on_acquire, &a, &ticket);
+
+    limiter.expire(now + 50);
+    ASSERT_TRUE(acquired.order.empty());
+
+    limiter.expire(now + 100);
+    ASSERT_EQ(acquired.order, vector<int>({1}));
+    ASSERT_EQ(acquired.results, vector<bool>({false}));
+    ASSERT_EQ(limiter.getQueued(), 0);
+    ASSERT_EQ(metrics::counter("gemcaps_cgi_queue_timeouts_total{limiter=\"test_expire\"}").get(), 1);
+}
+
+TEST(limiter, leaves_the_loop_once_empty) {
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    Limiter limiter("test_loop", 1, 2, 100);
+    Acquired acquired;
+    Waiting a{&acquired, 1};
+    uint64_t ticket;
+
+    limiter.acquire(&loop, on_acquire, nullptr, &ticket);
+    limiter.acquire(&loop, on_acquire, &a, &ticket);
+    ASSERT_TRUE(uv_loop_alive(&loop));
+
+    // Once nothing waits, the loop can close while the limiter lives on
+    limiter.release();
+    ASSERT_EQ(acquired.results, vector<bool>({true}));
+    uv_run(&loop, UV_RUN_NOWAIT);
+    ASSERT_FALSE(uv_loop_alive(&loop));
+    ASSERT_EQ(uv_loop_close(&loop), 0);
+}
+
+TEST(metrics, render) {
+    metrics::counter("test_render_total{a=\"b\"}", "A test counter").inc(3);
+    metrics::histogram("test_render_ms", "A test histogram", {10, 100}).observe(50);
+
+    std::string rendered = metrics::render();
+    ASSERT_NE(rendered.find("# TYPE test_render_total counter\n"), std::string::npos);
+    ASSERT_NE(rendered.find("test_render_total{a=\"b\"} 3\n"), std::string::npos);
+    ASSERT_NE(rendered.find("test_render_ms_bucket{le=\"10\"} 0\n"), std::string::npos);
+    ASSERT_NE(rendered.find("test_render_ms_bucket{le=\"100\"} 1\n"), std::string::npos);
+    ASSERT_NE(rendered.find("test_render_ms_bucket{le=\"+Inf\"} 1\n"), std::string::npos);
+    ASSERT_NE(rendered.find("test_render_ms_count 1\n"), std::string::npos);
+}
@@ -0,0 +1,510 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#include <uv.h>
+
+#include "manager.hpp"
+#include "gemcaps/executor.hpp"
+#include "gemcaps/metrics.hpp"
+
+using std::string;
+
+namespace fs = std::filesystem;
+
+
+TEST(manager, upgrade_waits_for_the_servers) {
+    uv_file ready[2];
+    ASSERT_EQ(uv_pipe(ready, 0, 0), 0);
+    uv_os_setenv(Manager::READY_ENV, std::to_string(ready[1]).c_str());
+
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    {
+        Manager manager(&loop);
+        manager.loadUpgrade();
+        // Scripts don't see the pipe
+        ASSERT_EQ(getenv(Manager::READY_ENV), nullptr);
+
+        // Without any servers, the old process is left running
+        ASSERT_FALSE(manager.finishUpgrade());
+        char byte;
+        uv_fs_t req;
+        uv_buf_t buf = uv_buf_init(&byte, 1);
+        ASSERT_EQ(uv_fs_read(nullptr, &req, ready[0], &buf, 1, -1, nullptr), 0);
+        uv_fs_req_cleanup(&req);
+        uv_fs_close(nullptr, &req, ready[0], nullptr);
+        uv_fs_req_cleanup(&req);
+
+        // A process that wasn't started by an upgrade has nothing to report
+        ASSERT_TRUE(manager.finishUpgrade());
+    }
+    uv_run(&loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(uv_loop_close(&loop), 0);
+}
+
+/**
+ * A client that connects and then sends a byte at a time, or nothing at all
+ */
+struct SlowClient {
+    uv_tcp_t tcp;
+    uv_connect_t connect;
+    uv_timer_t timer;
+    bool trickle;
+    bool connected = false;
+    uint64_t started = 0;
+    // Time in ms until the server dropped the connection
+    uint64_t dropped_after = 0;
+    int *open;
+};
+
+void slow_alloc(uv_handle_t *handle, size_t suggested, uv_buf_t *buf) {
+    static char data[256];
+    *buf = uv_buf_init(data, sizeof(data));
+}
+
+void slow_on_close(uv_handle_t *handle) {}
+
+void slow_on_read(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf) {
+    SlowClient *client = static_cast<SlowClient *>(stream->data);
+    if (nread >= 0) {
+        return;
+    }
+    client->dropped_after = uv_now(stream->loop) - client->started;
+    uv_close((uv_handle_t *)&client->tcp, slow_on_close);
+    uv_close((uv_handle_t *)&client->timer, slow_on_close);
+    if (--*client->open == 0) {
+        uv_stop(stream->loop);
+    }
+}
+
+void slow_on_tick(uv_timer_t *timer) {
+    SlowClient *client = static_cast<SlowClient *>(timer->data);
+    // Part of a ClientHello, which is never finished
+    char byte = 'h';
+    uv_buf_t buf = uv_buf_init(&byte, 1);
+    uv_try_write((uv_stream_t *)&client->tcp, &buf, 1);
+}
+
+void slow_on_connect(uv_connect_t *req, int status) {
+    SlowClient *client = static_cast<SlowClient *>(req->data);
+    ASSERT_EQ(status, 0);
+    client->connected = true;
+    client->started = uv_now(req->handle->loop);
+    uv_read_start((uv_stream_t *)&client->tcp, slow_alloc, slow_on_read);
+    if (client->trickle) {
+        uv_buf_t header = uv_buf_init(const_cast<char *>("\x16\x03\x01\x02\x00"), 5);
+        uv_try_write((uv_stream_t *)&client->tcp, &header, 1);
+        uv_timer_start(&client->timer, slow_on_tick, 50, 50);
+    }
+}
+
+/**
+ * Start connecting a client that never sends anything
+ */
+void connect_idle_client(uv_loop_t *loop, SlowClient &client, const sockaddr *addr, int *open) {
+    client.trickle = false;
+    client.open = open;
+    ++*open;
+    uv_tcp_init(loop, &client.tcp);
+    uv_timer_init(loop, &client.timer);
+    client.tcp.data = client.timer.data = client.connect.data = &client;
+    uv_tcp_connect(&client.connect, &client.tcp, addr, slow_on_connect);
+}
+
+/**
+ * Hang up a client, unless the server already did
+ */
+void hang_up(SlowClient &client) {
+    if (!uv_is_closing((uv_handle_t *)&client.tcp)) {
+        uv_close((uv_handle_t *)&client.tcp, slow_on_close);
+        uv_close((uv_handle_t *)&client.timer, slow_on_close);
+        --*client.open;
+    }
+}
+
+void on_run_timeout(uv_timer_t *timer) {
+    *static_cast<bool *>(timer->data) = true;
+}
+
+/**
+ * Run the loop until a condition holds, or five seconds have passed
+ * 
+ * @return whether the condition holds
+ */
+template <typename Condition>
+bool run_until(uv_loop_t *loop, Condition done) {
+    bool timed_out = false;
+    uv_timer_t timer;
+    uv_timer_init(loop, &timer);
+    timer.data = &timed_out;
+    uv_timer_start(&timer, on_run_timeout, 5000, 0);
+    while (!done() && !timed_out) {
+        uv_run(loop, UV_RUN_ONCE);
+    }
+    uv_close((uv_handle_t *)&timer, nullptr);
+    uv_run(loop, UV_RUN_NOWAIT);
+    return done();
+}
+
+/**
+ * Load a server on any free port of 127.0.0.1
+ * 
+ * @return the address the server is listening on
+ */
+sockaddr_storage listen_locally(uv_loop_t *loop, SSLServer &server, size_t max_connections) {
+    fs::path example = fs::path(__FILE__).parent_path().parent_path() / "example";
+    ListenAddress address;
+    address.host = "127.0.0.1";
+    address.port = 0;
+    server.load(loop, {address}, SSLServer::loadCertificate((example / "cert.pem").string(), (example / "key.pem").string()),
+        SSLServer::DEFAULT_BACKLOG, max_connections);
+    server.listen();
+
+    std::vector<std::pair<ListenAddress, uv_os_fd_t>> sockets;
+    server.getSockets(sockets);
+    sockaddr_storage bound = {};
+    socklen_t bound_len = sizeof(bound);
+    if (!sockets.empty()) {
+        getsockname(sockets[0].second, (sockaddr *)&bound, &bound_len);
+    }
+    return bound;
+}
+
+TEST(manager, trickling_clients_are_dropped_at_the_deadline) {
+    metrics::Counter &idle = metrics::counter("gemcaps_timeouts_total{phase=\"handshake\",kind=\"idle\"}");
+    metrics::Counter &deadline = metrics::counter("gemcaps_timeouts_total{phase=\"handshake\",kind=\"deadline\"}");
+    uint64_t idle_before = idle.get();
+    uint64_t deadline_before = deadline.get();
+    Manager::configureTimeouts(300, 300, 300, 1000, 1000);
+
+    uv_loop_t *loop = uv_default_loop();
+    {
+        Manager manager(loop);
+        SSLServer server;
+        server.setContext(&manager);
+        sockaddr_storage bound = listen_locally(loop, server, 0);
+        ASSERT_NE(bound.ss_family, 0);
+
+        int open = 2;
+        SlowClient clients[2];
+        for (int i = 0; i < 2; ++i) {
+            SlowClient &client = clients[i];
+            client.trickle = i == 0;
+            client.open = &open;
+            uv_tcp_init(loop, &client.tcp);
+            uv_timer_init(loop, &client.timer);
+            client.tcp.data = client.timer.data = client.connect.data = &client;
+            uv_tcp_connect(&client.connect, &client.tcp, (const sockaddr *)&bound, slow_on_connect);
+        }
+        uv_run(loop, UV_RUN_DEFAULT);
+        uv_run(loop, UV_RUN_NOWAIT);
+
+        // The trickle kept restarting the idle timeout, but not the deadline
+        ASSERT_GE(clients[0].dropped_after, 900);
+        ASSERT_LT(clients[1].dropped_after, 900);
+        ASSERT_EQ(deadline.get(), deadline_before + 1);
+        ASSERT_EQ(idle.get(), idle_before + 1);
+        server.stopListening();
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+    Manager::configureTimeouts(1000, 1000, 30000, 10000, 30000);
+}
+
+struct ScriptExit : public ExecutorContext {
+    int term_signal = -1;
+    void onExit(Executor *executor, int64_t exit_status, int term_signal) { this->term_signal = term_signal; }
+};
+
+TEST(manager, shutdown_waits_for_scripts) {
+    Manager::configureTimeouts(1000, 1000, 30000, 10000, 500);
+
+    uv_loop_t *loop = uv_default_loop();
+    {
+        Manager manager(loop);
+        Environment env;
+        ScriptExit polite_exit, stubborn_exit;
+        Executor polite("/bin/sh", env, {"-c", "exec sleep 10"});
+        Executor stubborn("/bin/sh", env, {"-c", "trap '' TERM; while :; do sleep 0.1; done"});
+        polite.setContext(&polite_exit);
+        stubborn.setContext(&stubborn_exit);
+        ASSERT_EQ(polite.spawn(loop), 0);
+        ASSERT_EQ(stubborn.spawn(loop), 0);
+        // Give the shell time to ignore SIGTERM
+        uv_sleep(200);
+
+        // Nothing is connected, but the loop keeps going until both scripts exit
+        uint64_t start = uv_now(loop);
+        manager.shutdown();
+        uv_run(loop, UV_RUN_DEFAULT);
+        ASSERT_EQ(Executor::getRunning(), 0);
+        ASSERT_EQ(polite_exit.term_signal, SIGTERM);
+        ASSERT_EQ(stubborn_exit.term_signal, SIGKILL);
+        ASSERT_GE(uv_now(loop) - start, 500);
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+    Manager::configureTimeouts(1000, 1000, 30000, 10000, 30000);
+}
+
+/**
+ * Find a port that is free on 127.0.0.1
+ */
+int free_local_port(uv_loop_t *loop) {
+    uv_tcp_t tcp;
+    uv_tcp_init(loop, &tcp);
+    sockaddr_in addr;
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_tcp_bind(&tcp, (const sockaddr *)&addr, 0);
+    int length = sizeof(addr);
+    uv_tcp_getsockname(&tcp, (sockaddr *)&addr, &length);
+    uv_close((uv_handle_t *)&tcp, nullptr);
+    uv_run(loop, UV_RUN_NOWAIT);
+    return ntohs(addr.sin_port);
+}
+
+/**
+ * Write a config directory with a single server on a port of 127.0.0.1
+ */
+fs::path write_config(const string &name, int port) {
+    fs::path dir = fs::temp_directory_path() / name;
+    // The config is read from another directory
+    fs::path example = fs::absolute(fs::path(__FILE__).parent_path().parent_path() / "example");
+    fs::remove_all(dir);
+    fs::create_directories(dir / "servers");
+    fs::create_directories(dir / "handlers");
+    std::ofstream(dir / "servers" / "main.yml") << "name: main\n"
+        << "host: 127.0.0.1\n"
+        << "port: " << port << "\n"
+        << "cert: " << (example / "cert.pem").string() << "\n"
+        << "key: " << (example / "key.pem").string() << "\n";
+    return dir;
+}
+
+/**
+ * Reload, and run the loop until the new generation was switched to or given up on
+ */
+void reload_and_wait(uv_loop_t *loop, Manager &manager) {
+    metrics::Counter &reloads = metrics::counter("gemcaps_reloads_total");
+    metrics::Counter &errors = metrics::counter("gemcaps_reload_errors_total");
+    uint64_t before = reloads.get() + errors.get();
+    manager.reload();
+    ASSERT_TRUE(run_until(loop, [&]() { return reloads.get() + errors.get() > before; }));
+}
+
+TEST(manager, reload_keeps_unchanged_listeners) {
+    metrics::Counter &reloads = metrics::counter("gemcaps_reloads_total");
+    metrics::Gauge &generation = metrics::gauge("gemcaps_config_generation");
+    metrics::Gauge &connections = metrics::gauge("gemcaps_connections");
+    Manager::configureTimeouts(5000, 5000, 30000, 10000, 30000);
+    uv_loop_t *loop = uv_default_loop();
+    int port = free_local_port(loop);
+    fs::path dir = write_config("gemcaps_test_reload", port);
+    sockaddr_in addr;
+    uv_ip4_addr("127.0.0.1", port, &addr);
+    {
+        Manager manager(loop);
+        manager.load(dir.string());
+        manager.startServers();
+        std::vector<std::pair<ListenAddress, uv_os_fd_t>> before;
+        manager.getSockets(before);
+        ASSERT_EQ(before.size(), 1);
+        int64_t loaded = generation.get();
+        uint64_t reloaded = reloads.get();
+        int64_t connected = connections.get();
+
+        // A client that connects while the files are being read is accepted
+        int open = 0;
+        SlowClient clients[2];
+        connect_idle_client(loop, clients[0], (const sockaddr *)&addr, &open);
+        reload_and_wait(loop, manager);
+        ASSERT_EQ(reloads.get(), reloaded + 1);
+        ASSERT_EQ(generation.get(), loaded + 1);
+
+        // The new generation took over the socket, rather than binding again
+        std::vector<std::pair<ListenAddress, uv_os_fd_t>> after;
+        manager.getSockets(after);
+        ASSERT_EQ(after.size(), 1);
+        ASSERT_EQ(after[0].second, before[0].second);
+
+        connect_idle_client(loop, clients[1], (const sockaddr *)&addr, &open);
+        ASSERT_TRUE(run_until(loop, [&]() { return connections.get() == connected + 2; }));
+        ASSERT_TRUE(clients[0].connected);
+        ASSERT_TRUE(clients[1].connected);
+        hang_up(clients[0]);
+        hang_up(clients[1]);
+        ASSERT_TRUE(run_until(loop, [&]() { return connections.get() == connected; }));
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+    fs::remove_all(dir);
+    Manager::configureTimeouts(1000, 1000, 30000, 10000, 30000);
+}
+
+TEST(manager, broken_reload_keeps_the_generation) {
+    metrics::Counter &errors = metrics::counter("gemcaps_reload_errors_total");
+    metrics::Gauge &generation = metrics::gauge("gemcaps_config_generation");
+    metrics::Gauge &connections = metrics::gauge("gemcaps_connections");
+    Manager::configureTimeouts(5000, 5000, 30000, 10000, 30000);
+    uv_loop_t *loop = uv_default_loop();
+    int port = free_local_port(loop);
+    fs::path dir = write_config("gemcaps_test_broken_reload", port);
+    sockaddr_in addr;
+    uv_ip4_addr("127.0.0.1", port, &addr);
+    {
+        Manager manager(loop);
+        manager.load(dir.string());
+        manager.startServers();
+        std::vector<std::pair<ListenAddress, uv_os_fd_t>> before;
+        manager.getSockets(before);
+        ASSERT_EQ(before.size(), 1);
+        int64_t loaded = generation.get();
+        uint64_t failed = errors.get();
+        int64_t connected = connections.get();
+
+        // One bad file is enough to give up on the whole reload
+        std::ofstream(dir / "servers" / "broken.yml") << "name: [\n";
+        reload_and_wait(loop, manager);
+        ASSERT_EQ(errors.get(), failed + 1);
+        ASSERT_EQ(generation.get(), loaded);
+
+        std::vector<std::pair<ListenAddress, uv_os_fd_t>> after;
+        manager.getSockets(after);
+        ASSERT_EQ(after.size(), 1);
+        ASSERT_EQ(after[0].second, before[0].second);
+
+        // The old servers are still listening
+        int open = 0;
+        SlowClient client;
+        connect_idle_client(loop, client, (const sockaddr *)&addr, &open);
+        ASSERT_TRUE(run_until(loop, [&]() { return connections.get() == connected + 1; }));
+        hang_up(client);
+        ASSERT_TRUE(run_until(loop, [&]() { return connections.get() == connected; }));
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+    fs::remove_all(dir);
+    Manager::configureTimeouts(1000, 1000, 30000, 10000, 30000);
+}
+
+TEST(manager, old_connections_finish_after_a_reload) {
+    metrics::Gauge &draining = metrics::gauge("gemcaps_draining_generations");
+    metrics::Gauge &connections = metrics::gauge("gemcaps_connections");
+    Manager::configureTimeouts(5000, 5000, 30000, 10000, 30000);
+    uv_loop_t *loop = uv_default_loop();
+    int port = free_local_port(loop);
+    fs::path dir = write_config("gemcaps_test_drain_reload", port);
+    sockaddr_in addr;
+    uv_ip4_addr("127.0.0.1", port, &addr);
+    {
+        Manager manager(loop);
+        manager.load(dir.string());
+        manager.startServers();
+        int64_t connected = connections.get();
+
+        int open = 0;
+        SlowClient client;
+        connect_idle_client(loop, client, (const sockaddr *)&addr, &open);
+        ASSERT_TRUE(run_until(loop, [&]() { return connections.get() == connected + 1; }));
+
+        // The connection stays with the old generation, which waits for it
+        reload_and_wait(loop, manager);
+        ASSERT_EQ(draining.get(), 1);
+        uv_run(loop, UV_RUN_NOWAIT);
+        ASSERT_EQ(client.dropped_after, 0);
+        ASSERT_EQ(connections.get(), connected + 1);
+
+        // Then the old generation is freed once it closes
+        hang_up(client);
+        ASSERT_TRUE(run_until(loop, [&]() { return draining.get() == 0; }));
+        ASSERT_EQ(connections.get(), connected);
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+    fs::remove_all(dir);
+    Manager::configureTimeouts(1000, 1000, 30000, 10000, 30000);
+}
+
+TEST(manager, server_connection_limit_holds_clients_back) {
+    metrics::Counter &waits = metrics::counter("gemcaps_accept_waits_total");
+    metrics::Gauge &waiting = metrics::gauge("gemcaps_accept_waiting");
+    Manager::configureTimeouts(5000, 5000, 30000, 10000, 30000);
+    uv_loop_t *loop = uv_default_loop();
+    {
+        Manager manager(loop);
+        SSLServer server;
+        server.setContext(&manager);
+        sockaddr_storage bound = listen_locally(loop, server, 1);
+        ASSERT_NE(bound.ss_family, 0);
+        uint64_t waited = waits.get();
+
+        int open = 0;
+        SlowClient clients[2];
+        connect_idle_client(loop, clients[0], (const sockaddr *)&bound, &open);
+        ASSERT_TRUE(run_until(loop, [&]() { return server.getConnections() == 1; }));
+
+        // The second client waits in the backlog, rather than being refused
+        connect_idle_client(loop, clients[1], (const sockaddr *)&bound, &open);
+        ASSERT_TRUE(run_until(loop, [&]() { return waits.get() == waited + 1; }));
+        ASSERT_TRUE(clients[1].connected);
+        ASSERT_EQ(server.getConnections(), 1);
+        ASSERT_TRUE(server.isWaiting());
+        ASSERT_EQ(waiting.get(), 1);
+
+        // and is only accepted once the first one closes
+        hang_up(clients[0]);
+        ASSERT_TRUE(run_until(loop, [&]() { return !server.isWaiting(); }));
+        ASSERT_EQ(server.getConnections(), 1);
+        ASSERT_EQ(waiting.get(), 0);
+        ASSERT_EQ(clients[1].dropped_after, 0);
+
+        hang_up(clients[1]);
+        ASSERT_TRUE(run_until(loop, [&]() { return server.getConnections() == 0; }));
+        server.stopListening();
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+    Manager::configureTimeouts(1000, 1000, 30000, 10000, 30000);
+}
+
+TEST(manager, global_connection_limit_holds_clients_back) {
+    metrics::Counter &waits = metrics::counter("gemcaps_accept_waits_total");
+    metrics::Gauge &utilization = metrics::gauge("gemcaps_connection_utilization_percent");
+    metrics::Gauge &limit = metrics::gauge("gemcaps_connection_limit");
+    Manager::configureTimeouts(5000, 5000, 30000, 10000, 30000);
+    SSLServer::configureLimits(1);
+    ASSERT_EQ(limit.get(), 1);
+    uv_loop_t *loop = uv_default_loop();
+    {
+        Manager manager(loop);
+        SSLServer server;
+        server.setContext(&manager);
+        sockaddr_storage bound = listen_locally(loop, server, 0);
+        ASSERT_NE(bound.ss_family, 0);
+        uint64_t waited = waits.get();
+        ASSERT_EQ(utilization.get(), 0);
+
+        int open = 0;
+        SlowClient clients[2];
+        connect_idle_client(loop, clients[0], (const sockaddr *)&bound, &open);
+        ASSERT_TRUE(run_until(loop, [&]() { return server.getConnections() == 1; }));
+        ASSERT_EQ(utilization.get(), 100);
+
+        connect_idle_client(loop, clients[1], (const sockaddr *)&bound, &open);
+        ASSERT_TRUE(run_until(loop, [&]() { return waits.get() == waited + 1; }));
+        ASSERT_EQ(server.getConnections(), 1);
+        ASSERT_TRUE(server.isWaiting());
+
+        // Closing the listener doesn't drop the connection that was waiting on it
+        server.stopListening();
+        ASSERT_FALSE(server.isWaiting());
+        ASSERT_EQ(server.getConnections(), 2);
+
+        hang_up(clients[0]);
+        hang_up(clients[1]);
+        ASSERT_TRUE(run_until(loop, [&]() { return server.getConnections() == 0; }));
+        ASSERT_EQ(utilization.get(), 0);
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+    SSLServer::configureLimits(0);
+    Manager::configureTimeouts(1000, 1000, 30000, 10000, 30000);
+}
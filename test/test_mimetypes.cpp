@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <yaml-cpp/yaml.h>
+
+#include <gemcaps/MimeTypes.h>
+#include <gemcaps/settings.hpp>
+
+using std::string;
+
+
+TEST(mimetypes, finds_types) {
+    ASSERT_STREQ(MimeTypes::getType("index.gmi"), "text/gemini");
+    ASSERT_STREQ(MimeTypes::getType("/a.b/file.tar.gz"), "application/gzip");
+    ASSERT_STREQ(MimeTypes::getType("png"), "image/png");
+    ASSERT_STREQ(MimeTypes::getType("IMAGE.PNG"), "image/png");
+    ASSERT_EQ(MimeTypes::getType("file.unknown"), nullptr);
+    ASSERT_EQ(MimeTypes::getType("file."), nullptr);
+    ASSERT_EQ(MimeTypes::getType("file.pngx"), nullptr);
+    ASSERT_EQ(MimeTypes::getType("file.pn"), nullptr);
+}
+
+TEST(mimetypes, precomputes_headers) {
+    const MimeTypes::Type *type = MimeTypes::find("index.gmi");
+    ASSERT_NE(type, nullptr);
+    ASSERT_EQ(string(type->header, type->header_length), "20 text/gemini\r\n");
+    ASSERT_EQ(strlen(type->header), type->header_length);
+}
+
+TEST(mimetypes, finds_extensions) {
+    ASSERT_STREQ(MimeTypes::getExtension("text/gemini"), "gemini");
+    ASSERT_STREQ(MimeTypes::getExtension("image/jpeg"), "jpe");
+    ASSERT_STREQ(MimeTypes::getExtension("image/jpeg", 1), "jpeg");
+    ASSERT_STREQ(MimeTypes::getExtension("image/jpeg", 2), "jpg");
+    ASSERT_EQ(MimeTypes::getExtension("image/jpeg", 3), nullptr);
+    ASSERT_EQ(MimeTypes::getExtension("text/unknown"), nullptr);
+}
+
+TEST(mimetypes, overrides_types) {
+    YAML::Node config = YAML::Load(
+        "mimeTypes:\n"
+        "  gmi: text/gemini; lang=en\n"
+        "  .Gemlog: text/gemini\n"
+    );
+    MimeTypes::load(config);
+
+    const MimeTypes::Type *type = MimeTypes::find("index.GMI");
+    ASSERT_NE(type, nullptr);
+    ASSERT_STREQ(type->mime, "text/gemini; lang=en");
+    ASSERT_EQ(string(type->header, type->header_length), "20 text/gemini; lang=en\r\n");
+    ASSERT_STREQ(MimeTypes::getType("post.gemlog"), "text/gemini");
+    ASSERT_STREQ(MimeTypes::getType("image.png"), "image/png");
+
+    MimeTypes::clearOverrides();
+    ASSERT_STREQ(MimeTypes::getType("index.gmi"), "text/gemini");
+    ASSERT_EQ(MimeTypes::getType("post.gemlog"), nullptr);
+
+    ASSERT_THROW(MimeTypes::load(YAML::Load("mimeTypes: [gmi]")), InvalidSettingsException);
+    ASSERT_THROW(MimeTypes::load(YAML::Load("mimeTypes: {gmi: ''}")), InvalidSettingsException);
+}
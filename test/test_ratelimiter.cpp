@@ -0,0 +1,118 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <thread>
+
+#include <uv.h>
+
+#include <gemcaps/ratelimiter.hpp>
+#include <gemcaps/settings.hpp>
+
+
+sockaddr_storage make_addr(const char *ip) {
+    sockaddr_storage addr = {};
+    if (uv_ip4_addr(ip, 1965, (sockaddr_in *)&addr) != 0) {
+        uv_ip6_addr(ip, 1965, (sockaddr_in6 *)&addr);
+    }
+    return addr;
+}
+
+/**
+ * Make a loop whose limiter starts empty
+ *
+ * Loops are never freed, so that no two tests share a limiter.
+ */
+uv_loop_t *make_limited_loop() {
+    uv_loop_t *loop = new uv_loop_t;
+    uv_loop_init(loop);
+    return loop;
+}
+
+TEST(ratelimiter, disabled_by_default) {
+    RateLimiter::configure(0);
+    RateLimiter &limiter = RateLimiter::get(make_limited_loop());
+    sockaddr_storage addr = make_addr("10.0.0.1");
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    }
+    ASSERT_FALSE(limiter.limited((sockaddr *)&addr));
+}
+
+TEST(ratelimiter, limits_bursts) {
+    RateLimiter::configure(1, 3);
+    RateLimiter &limiter = RateLimiter::get(make_limited_loop());
+    sockaddr_storage addr = make_addr("10.0.0.1");
+    sockaddr_storage other = make_addr("10.0.0.2");
+
+    ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    ASSERT_FALSE(limiter.limited((sockaddr *)&addr));
+    ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    ASSERT_TRUE(limiter.limited((sockaddr *)&addr));
+
+    unsigned retry_after = 0;
+    ASSERT_FALSE(limiter.take((sockaddr *)&addr, &retry_after));
+    ASSERT_EQ(retry_after, 1);
+
+    // Other clients have their own tokens
+    ASSERT_TRUE(limiter.take((sockaddr *)&other));
+    RateLimiter::configure(0);
+}
+
+TEST(ratelimiter, refills_over_time) {
+    RateLimiter::configure(200, 1);
+    uv_loop_t *loop = make_limited_loop();
+    RateLimiter &limiter = RateLimiter::get(loop);
+    sockaddr_storage addr = make_addr("10.0.0.1");
+
+    ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    ASSERT_FALSE(limiter.take((sockaddr *)&addr));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uv_update_time(loop);
+    ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    RateLimiter::configure(0);
+}
+
+TEST(ratelimiter, groups_ipv6_prefixes) {
+    RateLimiter::configure(1, 1, 64);
+    RateLimiter &limiter = RateLimiter::get(make_limited_loop());
+    sockaddr_storage addr = make_addr("2001:db8:0:1::1");
+    sockaddr_storage same = make_addr("2001:db8:0:1:ffff::2");
+    sockaddr_storage other = make_addr("2001:db8:0:2::1");
+    sockaddr_storage mapped = make_addr("::ffff:10.0.0.1");
+    sockaddr_storage ipv4 = make_addr("10.0.0.1");
+
+    ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    ASSERT_FALSE(limiter.take((sockaddr *)&same));
+    ASSERT_TRUE(limiter.take((sockaddr *)&other));
+
+    // IPv4 clients of a dual stack socket are limited as IPv4 addresses
+    ASSERT_TRUE(limiter.take((sockaddr *)&mapped));
+    ASSERT_FALSE(limiter.take((sockaddr *)&ipv4));
+    RateLimiter::configure(0);
+}
+
+TEST(ratelimiter, configure_forgets_addresses) {
+    RateLimiter::configure(1, 1);
+    RateLimiter &limiter = RateLimiter::get(make_limited_loop());
+    sockaddr_storage addr = make_addr("10.0.0.1");
+
+    ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    ASSERT_FALSE(limiter.take((sockaddr *)&addr));
+    // The same number of buckets, but a new burst
+    RateLimiter::configure(1, 2);
+    ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    ASSERT_TRUE(limiter.take((sockaddr *)&addr));
+    ASSERT_FALSE(limiter.take((sockaddr *)&addr));
+    RateLimiter::configure(0);
+}
+
+TEST(ratelimiter, loads_settings) {
+    ASSERT_THROW(RateLimiter::load(YAML::Load("rateLimit: 5")), InvalidSettingsException);
+    ASSERT_THROW(RateLimiter::load(YAML::Load("rateLimit: {rate: 1, burst: 0}")), InvalidSettingsException);
+    ASSERT_THROW(RateLimiter::load(YAML::Load("rateLimit: {rate: 1, ipv6Prefix: 129}")), InvalidSettingsException);
+    RateLimiter::load(YAML::Load("rateLimit: {rate: 0.5, burst: 20}"));
+    ASSERT_TRUE(RateLimiter::enabled());
+    RateLimiter::configure(0);
+    ASSERT_FALSE(RateLimiter::enabled());
+}
@@ -0,0 +1,120 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <uv.h>
+
+#include "manager.hpp"
+#include "request.hpp"
+
+using std::string;
+
+
+Request make_request(string header) {
+    Request request;
+    request.header = header;
+    return request;
+}
+
+TEST(request, gemini) {
+    Request request = make_request("gemini://example.com/foo/bar\r\n");
+    ASSERT_TRUE(parseRequest(&request));
+    ASSERT_EQ(request.scheme, "gemini");
+    ASSERT_EQ(request.host, "example.com");
+    ASSERT_EQ(request.port, 1965);
+    ASSERT_EQ(request.path, "/foo/bar");
+    ASSERT_FALSE(request.is_upload);
+}
+
+TEST(request, port) {
+    Request request = make_request("gemini://example.com:1966/foo\r\n");
+    ASSERT_TRUE(parseRequest(&request));
+    ASSERT_EQ(request.host, "example.com");
+    ASSERT_EQ(request.port, 1966);
+    ASSERT_EQ(request.path, "/foo");
+}
+
+TEST(request, invalid) {
+    Request request = make_request("example.com/foo\r\n");
+    ASSERT_FALSE(parseRequest(&request));
+}
+
+TEST(request, titan) {
+    Request request = make_request("titan://example.com/upload.cgi;size=128;mime=text/plain;token=secret\r\n");
+    ASSERT_TRUE(parseRequest(&request));
+    ASSERT_EQ(request.scheme, "titan");
+    ASSERT_TRUE(request.is_upload);
+    ASSERT_EQ(request.path, "/upload.cgi");
+    ASSERT_EQ(request.upload.size, 128);
+    ASSERT_EQ(request.upload.mime, "text/plain");
+    ASSERT_EQ(request.upload.token, "secret");
+}
+
+TEST(request, titan_defaults) {
+    Request request = make_request("titan://example.com/upload.cgi;size=0\r\n");
+    ASSERT_TRUE(parseRequest(&request));
+    ASSERT_EQ(request.upload.size, 0);
+    ASSERT_EQ(request.upload.mime, "text/gemini");
+    ASSERT_EQ(request.upload.token, "");
+}
+
+TEST(request, titan_invalid) {
+    Request missing_params = make_request("titan://example.com/upload.cgi\r\n");
+    ASSERT_FALSE(parseRequest(&missing_params));
+
+    Request missing_size = make_request("titan://example.com/upload.cgi;mime=text/plain\r\n");
+    ASSERT_FALSE(parseRequest(&missing_size));
+
+    Request bad_size = make_request("titan://example.com/upload.cgi;size=-12\r\n");
+    ASSERT_FALSE(parseRequest(&bad_size));
+}
+
+struct ReceivedBody {
+    string body;
+    bool ended = false;
+};
+
+void on_upload_data(ClientConnection *connection, const char *data, size_t length, void *ctx) {
+    ReceivedBody *upload = static_cast<ReceivedBody *>(ctx);
+    if (data == nullptr) {
+        upload->ended = true;
+        return;
+    }
+    upload->body.append(data, length);
+}
+
+/**
+ * Make a connection whose client never connects
+ * 
+ * Neither is freed, since a client is only freed by its server.
+ */
+GeminiConnection *make_connection(string header) {
+    uv_loop_t *loop = new uv_loop_t;
+    uv_loop_init(loop);
+    uv_tcp_t *tcp = new uv_tcp_t;
+    uv_tcp_init(loop, tcp);
+    GeminiConnection *connection = new GeminiConnection(nullptr, new SSLClient(nullptr, tcp, nullptr));
+    connection->getRequest() = make_request(header);
+    parseRequest(&connection->getRequest());
+    return connection;
+}
+
+TEST(request, titan_body_ends) {
+    GeminiConnection *connection = make_connection("titan://example.com/upload.cgi;size=5\r\n");
+    ReceivedBody upload;
+    connection->dispatch("hello, and more");
+    connection->setClientDataCallback(on_upload_data, &upload);
+    connection->resumeData();
+    ASSERT_EQ(upload.body, "hello");
+    ASSERT_TRUE(upload.ended);
+}
+
+TEST(request, empty_titan_body_ends) {
+    GeminiConnection *connection = make_connection("titan://example.com/upload.cgi;size=0\r\n");
+    ReceivedBody upload;
+    connection->dispatch("");
+    connection->setClientDataCallback(on_upload_data, &upload);
+    connection->resumeData();
+    ASSERT_EQ(upload.body, "");
+    ASSERT_TRUE(upload.ended);
+}
@@ -0,0 +1,105 @@
+#include <gtest/gtest.h>
+
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "rules.hpp"
+
+using std::string;
+using std::vector;
+using std::regex;
+
+namespace re_consts = std::regex_constants;
+
+
+/**
+ * Check the rules the way the file handler used to, with std::regex
+ */
+bool regex_matches(const vector<string> &patterns, const string &path) {
+    for (const string &pattern : patterns) {
+        regex re(pattern, re_consts::ECMAScript | re_consts::icase | re_consts::optimize);
+        if (!std::regex_search(path, re, re_consts::match_not_null | re_consts::match_any)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+const vector<string> PATHS = {
+    "/srv/gemini/index.gmi",
+    "/srv/gemini/INDEX.GMI",
+    "/srv/gemini/.git/config",
+    "/srv/gemini/.hidden",
+    "/srv/gemini/secret/keys.txt",
+    "/srv/gemini/cgi/hello.py",
+    "/srv/gemini/cgi/hello.py~",
+    "/srv/gemini/docs/2021-01-05.gmi",
+    "/srv/gemini/docs/notes.md",
+    "/srv/gemini/",
+    "",
+    "a",
+    "aaa",
+    "abab",
+    "x.gmi\n",
+};
+
+TEST(rules, matches_regex) {
+    const vector<vector<string>> rule_sets = {
+        {},
+        {"\\.gmi$"},
+        {"^[^.]*$|\\.gmi$|\\.txt$"},
+        {"^/srv/gemini/", "\\.(gmi|md|py)$"},
+        {"^(?:(?!/\\.).)*$"},
+        {"/\\.", "gmi"},
+        {"^(/[a-z0-9_-]+)*/?[^/]*$"},
+        {"\\d{4}-\\d{2}-\\d{2}"},
+        {"a*"},
+        {"^a{2,3}$"},
+        {"(ab)+$"},
+        {"[^~]$", "\\w+\\.\\w+"},
+        {"$"},
+        {"^"},
+        {"x\\.gmi$"},
+        {"index\\.gmi", "^/SRV"},
+        {"[.-]"},
+        {"\\bhello"},
+        {"b?$$"},
+    };
+
+    for (const vector<string> &patterns : rule_sets) {
+        RuleSet rules(patterns);
+        for (const string &path : PATHS) {
+            ASSERT_EQ(rules.matches(path), regex_matches(patterns, path))
+                << "patterns: " << testing::PrintToString(patterns) << " path: '" << path << "'";
+            // Memoized verdicts agree too
+            ASSERT_EQ(rules.matches(path), regex_matches(patterns, path));
+        }
+    }
+}
+
+TEST(rules, fallback) {
+    RuleSet compiled({"\\.gmi$", "^/srv/"});
+    ASSERT_EQ(compiled.getFallbackCount(), 0);
+
+    RuleSet lookahead({"\\.gmi$", "^(?!.*secret)/"});
+    ASSERT_EQ(lookahead.getFallbackCount(), 1);
+    ASSERT_TRUE(lookahead.matches("/srv/index.gmi"));
+    ASSERT_FALSE(lookahead.matches("/srv/secret/index.gmi"));
+}
+
+TEST(rules, invalid) {
+    ASSERT_THROW(RuleSet({"(unclosed"}), std::regex_error);
+    ASSERT_THROW(RuleSet({"[z-a]"}), std::regex_error);
+}
+
+TEST(rules, many_rules) {
+    vector<string> patterns;
+    for (int i = 0; i < 70; ++i) {
+        patterns.push_back("/");
+    }
+    RuleSet rules(patterns);
+    ASSERT_EQ(rules.getFallbackCount(), 6);
+    ASSERT_TRUE(rules.matches("/srv"));
+    ASSERT_FALSE(rules.matches("srv"));
+}
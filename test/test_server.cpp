@@ -0,0 +1,116 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include <filesystem>
+
+#include <uv.h>
+
+#include "server.hpp"
+
+using std::string;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+
+TEST(server, parse_address) {
+    ListenAddress address;
+    ASSERT_TRUE(ListenAddress::parse("[::1]:1966", 1965, address));
+    ASSERT_EQ(address.host, "::1");
+    ASSERT_EQ(address.port, 1966);
+    ASSERT_TRUE(address.isIPv6());
+    ASSERT_EQ(address.toString(), "[::1]:1966");
+
+    // Bare IPv6 addresses have no port
+    ASSERT_TRUE(ListenAddress::parse("::1", 1965, address));
+    ASSERT_EQ(address.host, "::1");
+    ASSERT_EQ(address.port, 1965);
+
+    ASSERT_TRUE(ListenAddress::parse("127.0.0.1:1966", 1965, address));
+    ASSERT_EQ(address.host, "127.0.0.1");
+    ASSERT_EQ(address.port, 1966);
+    ASSERT_FALSE(address.isIPv6());
+
+    ASSERT_TRUE(ListenAddress::parse("0.0.0.0", 1965, address));
+    ASSERT_EQ(address.port, 1965);
+}
+
+TEST(server, parse_invalid_address) {
+    ListenAddress address;
+    for (const char *invalid : {"127.0.0.1:", "127.0.0.1:0", "127.0.0.1:65536", "127.0.0.1:123456", "127.0.0.1:-1",
+            "127.0.0.1:http", "[::1]:", "[::1]:x", "[::1", "[::1]1966", "localhost:1965", "300.0.0.1:1965"}) {
+        ASSERT_FALSE(ListenAddress::parse(invalid, 1965, address)) << invalid;
+    }
+    ASSERT_FALSE(ListenAddress::parse("::1", 0, address));
+}
+
+/**
+ * Find a port that both IPv4 and IPv6 have free
+ */
+int free_port(uv_loop_t *loop) {
+    uv_tcp_t tcp;
+    uv_tcp_init(loop, &tcp);
+    sockaddr_in6 addr;
+    uv_ip6_addr("::", 0, &addr);
+    int port = 0;
+    if (uv_tcp_bind(&tcp, (const sockaddr *)&addr, 0) == 0) {
+        int length = sizeof(addr);
+        uv_tcp_getsockname(&tcp, (sockaddr *)&addr, &length);
+        port = ntohs(addr.sin6_port);
+    }
+    uv_close((uv_handle_t *)&tcp, nullptr);
+    uv_run(loop, UV_RUN_NOWAIT);
+    return port;
+}
+
+TEST(server, ipv6_leaves_ipv4_ports_of_other_servers) {
+    uv_loop_t *loop = uv_default_loop();
+    int port = free_port(loop);
+    if (port == 0) {
+        GTEST_SKIP() << "IPv6 is not available";
+    }
+    fs::path example = fs::path(__FILE__).parent_path().parent_path() / "example";
+    ServerCertificates certificates = SSLServer::loadCertificate((example / "cert.pem").string(), (example / "key.pem").string());
+
+    ListenAddress ipv4;
+    ListenAddress ipv6;
+    ASSERT_TRUE(ListenAddress::parse("0.0.0.0:" + std::to_string(port), 0, ipv4));
+    ASSERT_TRUE(ListenAddress::parse("[::]:" + std::to_string(port), 0, ipv6));
+    vector<ListenAddress> addresses = {ipv4, ipv6};
+    {
+        // Both servers get the port, whichever of them binds first
+        SSLServer second;
+        SSLServer first;
+        second.load(loop, {ipv6}, certificates, SSLServer::DEFAULT_BACKLOG, 0, false, {}, addresses);
+        second.listen();
+        first.load(loop, {ipv4}, certificates, SSLServer::DEFAULT_BACKLOG, 0, false, {}, addresses);
+        first.listen();
+        vector<std::pair<ListenAddress, uv_os_fd_t>> sockets;
+        second.getSockets(sockets);
+        first.getSockets(sockets);
+        ASSERT_EQ(sockets.size(), 2);
+        second.stopListening();
+        first.stopListening();
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+}
+
+TEST(server, parse_inherited) {
+    phmap::flat_hash_map<string, uv_os_sock_t> sockets;
+    ASSERT_EQ(SSLServer::parseInherited("0.0.0.0:1965=3;[::]:1965=4", sockets), 0);
+    ASSERT_EQ(sockets.size(), 2);
+    ASSERT_EQ(sockets["0.0.0.0:1965"], 3);
+    ASSERT_EQ(sockets["[::]:1965"], 4);
+}
+
+TEST(server, parse_inherited_skips_invalid_pairs) {
+    phmap::flat_hash_map<string, uv_os_sock_t> sockets;
+    ASSERT_EQ(SSLServer::parseInherited("0.0.0.0:1965;=3;[::1]:1966=;127.0.0.1:1965=x;127.0.0.1:1966=99999999999;;[::1]:1965=5", sockets), 5);
+    ASSERT_EQ(sockets.size(), 1);
+    ASSERT_EQ(sockets["[::1]:1965"], 5);
+
+    sockets.clear();
+    ASSERT_EQ(SSLServer::parseInherited("", sockets), 0);
+    ASSERT_TRUE(sockets.empty());
+}
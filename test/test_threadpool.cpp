@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+
+#include <uv.h>
+
+#include <gemcaps/threadpool.hpp>
+
+using std::vector;
+
+
+struct Job {
+    uv_work_t work;
+    int id;
+    vector<int> *done;
+};
+
+std::atomic<int> running(0);
+std::atomic<int> most_running(0);
+
+void slow_work(uv_work_t *work) {
+    int now = ++running;
+    int most = most_running;
+    while (now > most && !most_running.compare_exchange_weak(most, now)) {}
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    --running;
+}
+
+void after_work(uv_work_t *work, int status) {
+    Job *job = static_cast<Job *>(work->data);
+    job->done->push_back(job->id);
+}
+
+TEST(threadpool, shares) {
+    ThreadPool::configure(8);
+    ASSERT_EQ(ThreadPool::getSize(), 8);
+    ASSERT_EQ(ThreadPool::getShare(ThreadPool::METADATA), 2);
+    ASSERT_EQ(ThreadPool::getShare(ThreadPool::READ), 4);
+    ASSERT_EQ(ThreadPool::getShare(ThreadPool::SCAN), 2);
+    // Handshakes stay on the loop unless the lane is given threads
+    ASSERT_EQ(ThreadPool::getShare(ThreadPool::HANDSHAKE), 0);
+
+    ThreadPool::configure(2, 0, 0, 3, 2);
+    ASSERT_EQ(ThreadPool::getShare(ThreadPool::METADATA), 1);
+    ASSERT_EQ(ThreadPool::getShare(ThreadPool::READ), 1);
+    ASSERT_EQ(ThreadPool::getShare(ThreadPool::SCAN), 3);
+    ASSERT_EQ(ThreadPool::getShare(ThreadPool::HANDSHAKE), 2);
+
+    ThreadPool::configure(4096);
+    ASSERT_EQ(ThreadPool::getSize(), ThreadPool::MAX_SIZE);
+    ThreadPool::configure();
+}
+
+TEST(threadpool, exports_size) {
+    const char *env = getenv("UV_THREADPOOL_SIZE");
+    std::string old = env != nullptr ? env : "";
+
+    ThreadPool::configure(6);
+    ThreadPool::exportSize();
+    ASSERT_STREQ(getenv("UV_THREADPOOL_SIZE"), "6");
+
+    // Without a size, the one libuv would use is kept
+    ThreadPool::configure();
+    ASSERT_EQ(ThreadPool::getSize(), 6);
+    ThreadPool::exportSize();
+    ASSERT_STREQ(getenv("UV_THREADPOOL_SIZE"), "6");
+
+    if (env == nullptr) {
+        unsetenv("UV_THREADPOOL_SIZE");
+    } else {
+        setenv("UV_THREADPOOL_SIZE", old.c_str(), 1);
+    }
+}
+
+TEST(threadpool, lanes_are_limited) {
+    ThreadPool::configure(4, 1, 2, 1);
+    uv_loop_t *loop = uv_default_loop();
+    ThreadPool &pool = ThreadPool::get(loop);
+
+    // The first job may start as soon as it is queued
+    running = 0;
+    most_running = 0;
+    vector<int> done;
+    Job jobs[6];
+    for (int i = 0; i < 6; ++i) {
+        jobs[i].work.data = &jobs[i];
+        jobs[i].id = i;
+        jobs[i].done = &done;
+        pool.queue(ThreadPool::SCAN, &jobs[i].work, slow_work, after_work);
+    }
+    ASSERT_EQ(pool.getActive(ThreadPool::SCAN), 1);
+    ASSERT_EQ(pool.getQueued(ThreadPool::SCAN), 5);
+    ASSERT_EQ(pool.getActive(ThreadPool::READ), 0);
+
+    uv_run(loop, UV_RUN_DEFAULT);
+
+    // The jobs ran one at a time, in order
+    ASSERT_EQ(most_running, 1);
+    ASSERT_EQ(done, vector<int>({0, 1, 2, 3, 4, 5}));
+    ASSERT_EQ(pool.getActive(ThreadPool::SCAN), 0);
+    ASSERT_EQ(pool.getQueued(ThreadPool::SCAN), 0);
+    ThreadPool::configure();
+}
@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+
+#include <vector>
+
+#include <uv.h>
+
+#include <gemcaps/timerwheel.hpp>
+
+using std::vector;
+
+
+struct Expiry {
+    uv_loop_t *loop;
+    vector<int> *order;
+    int id;
+    uint64_t expired = 0;
+    WheelTimer *stop = nullptr;
+};
+
+void on_expire(void *ctx) {
+    Expiry *expiry = static_cast<Expiry *>(ctx);
+    expiry->expired = uv_now(expiry->loop);
+    expiry->order->push_back(expiry->id);
+    if (expiry->stop != nullptr) {
+        expiry->stop->stop();
+    }
+}
+
+TEST(timerwheel, expires_in_order) {
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    vector<int> order;
+    {
+        TimerWheel wheel(&loop, 10, 8);
+        Expiry a{&loop, &order, 1}, b{&loop, &order, 2}, c{&loop, &order, 3};
+        WheelTimer ta(on_expire, &a), tb(on_expire, &b), tc(on_expire, &c);
+
+        uint64_t start = uv_now(&loop);
+        // Further out than one turn of the wheel
+        wheel.start(ta, 150);
+        wheel.start(tb, 20);
+        wheel.start(tc, 60);
+        ASSERT_EQ(wheel.getActive(), 3);
+        uv_run(&loop, UV_RUN_DEFAULT);
+
+        ASSERT_EQ(order, vector<int>({2, 3, 1}));
+        ASSERT_GE(b.expired - start, 20);
+        ASSERT_GE(c.expired - start, 60);
+        ASSERT_GE(a.expired - start, 150);
+        ASSERT_EQ(wheel.getActive(), 0);
+        ASSERT_FALSE(ta.isActive());
+    }
+    uv_run(&loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(uv_loop_close(&loop), 0);
+}
+
+TEST(timerwheel, resets_and_stops) {
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    vector<int> order;
+    {
+        TimerWheel wheel(&loop, 10, 8);
+        Expiry a{&loop, &order, 1}, b{&loop, &order, 2};
+        WheelTimer ta(on_expire, &a), tb(on_expire, &b);
+
+        wheel.start(ta, 20);
+        wheel.start(tb, 30);
+        // Pushing a timer back moves it behind the other
+        wheel.start(ta, 50);
+        uv_run(&loop, UV_RUN_DEFAULT);
+        ASSERT_EQ(order, vector<int>({2, 1}));
+
+        order.clear();
+        wheel.start(ta, 20);
+        wheel.start(tb, 20);
+        tb.stop();
+        ASSERT_EQ(wheel.getActive(), 1);
+        uv_run(&loop, UV_RUN_DEFAULT);
+        ASSERT_EQ(order, vector<int>({1}));
+    }
+    uv_run(&loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(uv_loop_close(&loop), 0);
+}
+
+TEST(timerwheel, callbacks_can_stop_other_expired_timers) {
+    uv_loop_t loop;
+    uv_loop_init(&loop);
+    vector<int> order;
+    {
+        TimerWheel wheel(&loop, 10, 8);
+        Expiry a{&loop, &order, 1}, b{&loop, &order, 2};
+        WheelTimer ta(on_expire, &a), tb(on_expire, &b);
+        a.stop = &tb;
+
+        wheel.start(ta, 20);
+        wheel.start(tb, 20);
+        uv_run(&loop, UV_RUN_DEFAULT);
+        ASSERT_EQ(order, vector<int>({1}));
+        ASSERT_EQ(wheel.getActive(), 0);
+    }
+    uv_run(&loop, UV_RUN_DEFAULT);
+    ASSERT_EQ(uv_loop_close(&loop), 0);
+}
@@ -0,0 +1,134 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+
+#include <gemcaps/watcher.hpp>
+
+using std::string;
+using std::vector;
+
+namespace fs = std::filesystem;
+
+
+void on_changed(const string &path, void *ctx) {
+    vector<string> *changed = static_cast<vector<string> *>(ctx);
+    changed->push_back(path);
+}
+
+void on_wait_timeout(uv_timer_t *timer) {
+    *static_cast<bool *>(timer->data) = true;
+}
+
+/**
+ * Run the loop until the watcher noticed a change or a second has passed
+ */
+void wait_for_change(uv_loop_t *loop, vector<string> &changed) {
+    bool timed_out = false;
+    uv_timer_t timer;
+    uv_timer_init(loop, &timer);
+    timer.data = &timed_out;
+    uv_timer_start(&timer, on_wait_timeout, 1000, 0);
+    while (changed.empty() && !timed_out) {
+        uv_run(loop, UV_RUN_ONCE);
+    }
+    uv_close((uv_handle_t *)&timer, nullptr);
+    uv_run(loop, UV_RUN_NOWAIT);
+}
+
+bool contains(const vector<string> &changed, const string &path) {
+    for (const string &p : changed) {
+        if (p == path) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Run the loop until the watcher has found every directory
+ */
+void wait_for_scans(uv_loop_t *loop, FileWatcher &watcher) {
+    while (watcher.isScanning()) {
+        uv_run(loop, UV_RUN_ONCE);
+    }
+}
+
+TEST(watcher, changes) {
+    uv_loop_t *loop = uv_default_loop();
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_watcher";
+    fs::remove_all(dir);
+    fs::create_directories(dir / "sub");
+
+    vector<string> changed;
+    {
+        FileWatcher watcher(loop);
+        watcher.addListener(on_changed, &changed);
+        watcher.watch(dir.string());
+        wait_for_scans(loop, watcher);
+        ASSERT_EQ(watcher.getWatched(), 2);
+        ASSERT_TRUE(watcher.isWatched((dir / "sub" / "file.gmi").string()));
+        ASSERT_TRUE(watcher.isWatched((dir / "sub").string() + "/"));
+
+        std::ofstream((dir / "sub" / "file.gmi").string()) << "hello";
+        wait_for_change(loop, changed);
+        ASSERT_TRUE(contains(changed, (dir / "sub" / "file.gmi").string()));
+
+        // New directories are watched as well
+        changed.clear();
+        fs::create_directories(dir / "new");
+        wait_for_change(loop, changed);
+        ASSERT_TRUE(contains(changed, (dir / "new").string()));
+        // The new directory is watched once its stat finishes
+        while (!watcher.isWatched((dir / "new" / "file.gmi").string())) {
+            uv_run(loop, UV_RUN_ONCE);
+        }
+
+        changed.clear();
+        std::ofstream((dir / "new" / "file.gmi").string()) << "hello";
+        wait_for_change(loop, changed);
+        ASSERT_TRUE(contains(changed, (dir / "new" / "file.gmi").string()));
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+    fs::remove_all(dir);
+}
+
+TEST(watcher, unwatch) {
+    uv_loop_t *loop = uv_default_loop();
+    fs::path dir = fs::temp_directory_path() / "gemcaps_test_watcher";
+    fs::remove_all(dir);
+    fs::create_directories(dir / "sub" / "deeper");
+    fs::create_directories(dir / "other");
+
+    {
+        FileWatcher watcher(loop);
+        // A reload watches the folder again before the old handler lets go
+        watcher.watch(dir.string());
+        watcher.watch(dir.string() + "/");
+        wait_for_scans(loop, watcher);
+        ASSERT_EQ(watcher.getWatched(), 4);
+        watcher.unwatch(dir.string());
+        ASSERT_EQ(watcher.getWatched(), 4);
+
+        // Folders inside another watched folder keep their directories
+        watcher.watch((dir / "sub").string());
+        wait_for_scans(loop, watcher);
+        watcher.unwatch(dir.string());
+        ASSERT_EQ(watcher.getWatched(), 2);
+        ASSERT_TRUE(watcher.isWatched((dir / "sub" / "deeper" / "file.gmi").string()));
+        ASSERT_FALSE(watcher.isWatched((dir / "other" / "file.gmi").string()));
+
+        watcher.unwatch((dir / "sub").string());
+        ASSERT_EQ(watcher.getWatched(), 0);
+
+        // A folder that is let go during its scan isn't watched after it
+        watcher.watch(dir.string());
+        watcher.unwatch(dir.string());
+        wait_for_scans(loop, watcher);
+        ASSERT_EQ(watcher.getWatched(), 0);
+    }
+    uv_run(loop, UV_RUN_NOWAIT);
+    fs::remove_all(dir);
+}
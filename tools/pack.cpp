@@ -0,0 +1,72 @@
+#include <string>
+#include <exception>
+
+#include <uv.h>
+#include <parallel_hashmap/phmap.h>
+
+#include "archive.hpp"
+#include "params.hpp"
+#include "gemcaps/log.hpp"
+#include "gemcaps/pathutils.hpp"
+
+using std::string;
+
+/**
+ * Make a path absolute
+ */
+string absolute(string file) {
+    if (!path::isrel(file)) {
+        return path::delUps(file);
+    }
+    char cwd[1024];
+    size_t cwd_size = 1024;
+    uv_cwd(cwd, &cwd_size);
+    return path::delUps(path::join(cwd, file));
+}
+
+bool yes(const string &value) {
+    return !value.empty() && value.front() == 'y';
+}
+
+int main(int argc, const char **argv) {
+    ArgParse parser;
+    parser.addArg("folder");
+    parser.addArg("archive");
+    parser.addParam("base", "b");
+    parser.addParam("listings", "l");
+    parser.addParam("hidden");
+
+    phmap::flat_hash_map<string, string> args;
+    try {
+        args = parser.parseArgs(argv + 1, argc - 1);
+    } catch (std::exception &e) {
+        LOG_ERROR("Invalid arguments: " << e.what());
+        return 1;
+    }
+    if (!args.count("folder") || !args.count("archive")) {
+        LOG_ERROR("Usage: gemcaps-pack <folder> <archive> [--base /path] [--listings y/n] [--hidden y/n]");
+        return 1;
+    }
+
+    PackOptions options;
+    if (args.count("base")) {
+        options.base = args.at("base");
+    }
+    if (args.count("listings")) {
+        options.listings = yes(args.at("listings"));
+    }
+    if (args.count("hidden")) {
+        options.hidden = yes(args.at("hidden"));
+    }
+
+    string folder = absolute(args.at("folder"));
+    string archive = absolute(args.at("archive"));
+    try {
+        size_t count = Archive::pack(folder, archive, options);
+        LOG_INFO("Packed " << count << " entries from '" << folder << "' into '" << archive << "'");
+    } catch (std::exception &e) {
+        LOG_ERROR(e.what());
+        return 1;
+    }
+    return 0;
+}